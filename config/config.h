@@ -54,6 +54,15 @@
 #define CONST_CALLOUT_ONLY_BSP 0
 #define CONST_CALLOUT_PER_CPU  1
 
+// Timer modes
+#define CONST_TIMER_PERIODIC 0 /* Interrupt every ARCH_TIMER_NS on all CPUs */
+#define CONST_TIMER_TICKLESS 1 /* One-shot interrupt at the next deadline */
+
+// Spinlock types
+#define CONST_SPINLOCK_TAS    0 /* Test-and-set, unfair */
+#define CONST_SPINLOCK_TICKET 1 /* FIFO tickets, all waiters spin on the lock */
+#define CONST_SPINLOCK_MCS    2 /* FIFO queue, each waiter spins locally */
+
 /*******************************************************************************
  *                                CONFIGURATION
  * ****************************************************************************/
@@ -71,13 +80,15 @@
 #define CONFIG_ASSERT_ACTION    CONST_ASSERT_PANIC /* Action taken by KASSERT */
 
 // Max
-#define CONFIG_OPEN_MAX         96     /* Maximum number of FDs per process */
-#define CONFIG_PROC_MAX         250000 /* Maximum number of processes */
-#define CONFIG_SYSCALL_MAX      128    /* Maximum number of syscall handlers */
-#define CONFIG_SYMLINK_MAX      32
-#define CONFIG_PATH_MAX         256
-#define CONFIG_TTY_MAX          7
-#define CONFIG_VMM_PREFAULT_MAX 512 /* max n. pages faultable at once */
+#define CONFIG_OPEN_MAX          96     /* Maximum number of FDs per process */
+#define CONFIG_PROC_MAX          250000 /* Maximum number of processes */
+#define CONFIG_SYSCALL_MAX       128    /* Maximum number of syscall handlers */
+#define CONFIG_SYMLINK_MAX       32
+#define CONFIG_PATH_MAX          256
+#define CONFIG_TTY_MAX           7
+#define CONFIG_VMM_PREFAULT_MAX  512 /* max n. pages faultable at once */
+#define CONFIG_VMM_PREFAULT_MIN  1   /* fault-around window on random faults */
+#define CONFIG_VMM_PREFAULT_INIT 16  /* fault-around window of new VMAs */
 
 // Misc
 #define CONFIG_TERM_FPS           60 /* FPS of buffered terminals */
@@ -85,14 +96,25 @@
 #define CONFIG_INIT_PATH          "/boot/init" /* Path to init executable */
 #define CONFIG_INIT_ARGV          NULL         /* Init program argv */
 #define CONFIG_INIT_ENV           NULL         /* Init program env */
-#define CONFIG_CALLOUT_MODE       CONST_CALLOUT_ONLY_BSP
-#define CONFIG_MUTEX_RETRIES      60
+#define CONFIG_CALLOUT_MODE       CONST_CALLOUT_PER_CPU
+#define CONFIG_TIMER_MODE         CONST_TIMER_PERIODIC
 #define CONFIG_UNIX_SOCK_RB_SIZE  (256 * 1024UL)
 #define CONFIG_VMM_ANON_START     0x100000000
 #define CONFIG_VMM_REAPER_NOTIFY  8
+#define CONFIG_VMM_LAZY_FORK      1 /* share page tables until written */
 #define CONFIG_DEFAULT_KBD_LAYOUT en_us
-#define CONFIG_PMM_NOTIFY_ZERO    200 /* % of memory to zero before notify */
+#define CONFIG_PMM_NOTIFY_ZERO    200 /* notify zeroing at 1/N of memory */
 #define CONFIG_PMM_NOTIFY_INSERT  200 /* % of memory to free before notify */
+#define CONFIG_PMM_MAGAZINE_SIZE  64  /* max free pages cached per CPU */
+#define CONFIG_PMM_MAGAZINE_BATCH 32  /* pages moved per refill/drain */
+#define CONFIG_SLAB_MAGAZINE_SIZE 32  /* max free objects cached per CPU */
+#define CONFIG_SLAB_MAX_EMPTY     1   /* empty slabs kept per size class */
+#define CONFIG_SLAB_MAX_CACHES    64  /* max named slab caches */
 #define CONFIG_TRACK_SLEEP_TIME   1
 #define CONFIG_USE_PROFILER       1
 #define CONFIG_SPINLOCK_DEBUG     0
+#define CONFIG_SPINLOCK_TYPE      CONST_SPINLOCK_TAS
+#define CONFIG_LOCK_PROFILER      0    /* per-site lock contention stats */
+#define CONFIG_LOCK_PROFILER_MAX  1024 /* max lock sites tracked */
+#define CONFIG_SCHED_BALANCE_NS   (32 * 1000 * 1000UL) /* balancing period */
+#define CONFIG_SCHED_MIGRATE_COST (500 * 1000UL)       /* cache-hot time (ns) */
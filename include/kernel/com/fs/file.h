@@ -38,7 +38,7 @@
             if (0 == n) {                                       \
                 KDEBUG("freeing file %p", (file));              \
                 COM_FS_VFS_VNODE_RELEASE(file->vnode);          \
-                com_mm_slab_free(file, sizeof(com_file_t));     \
+                com_fs_file_free(file);                         \
                 file = NULL;                                    \
             }                                                   \
         }                                                       \
@@ -58,3 +58,7 @@ typedef struct com_filedesc {
     com_file_t *file;
     uintmax_t   flags;
 } com_filedesc_t;
+
+void        com_fs_file_init(void);
+com_file_t *com_fs_file_new(com_vnode_t *vnode, uintmax_t flags);
+void        com_fs_file_free(com_file_t *file);
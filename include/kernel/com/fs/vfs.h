@@ -250,6 +250,9 @@ int com_fs_vfs_mmap(void             **out,
 
 // UTILITY FUNCTIONS
 
+void         com_fs_vfs_init(void);
+com_vnode_t *com_fs_vfs_new_vnode(void);
+void         com_fs_vfs_free_vnode(com_vnode_t *vnode);
 int com_fs_vfs_alloc_vnode(com_vnode_t    **out,
                            com_vfs_t       *vfs,
                            com_vnode_type_t type,
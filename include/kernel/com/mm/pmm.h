@@ -19,6 +19,8 @@
 #pragma once
 
 #include <arch/info.h>
+#include <lib/seqlock.h>
+#include <lib/spinlock.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -28,6 +30,9 @@
 #define COM_MM_PMM_FREE_BYTES(ptr, bytes) \
     com_mm_pmm_free_many(ptr, (bytes + (ARCH_PAGE_SIZE - 1)) / ARCH_PAGE_SIZE)
 
+// Freed pages are only zeroed later on by a background thread. Until then they
+// are accounted for in free and in to_zero. Pages that have been zeroed but not
+// yet returned to the allocator are in to_insert
 typedef struct com_pmm_stats {
     size_t total;
     size_t usable;
@@ -39,6 +44,28 @@ typedef struct com_pmm_stats {
     size_t to_insert;
 } com_pmm_stats_t;
 
+// Changes to the stats made by one CPU. Only that CPU writes them, with
+// interrupts disabled, so allocations and frees never write to shared stats.
+// Fields wrap around, only their sum over all CPUs is meaningful
+typedef struct com_pmm_cpu_stats {
+    kseqcount_t     seq;
+    com_pmm_stats_t delta;
+} com_pmm_cpu_stats_t;
+
+// Per-CPU stash of free pages sitting in front of the global allocator.
+// Single-page allocations and frees go here first, and only the refill/drain
+// batches take the global lock. Zeroed and dirty pages are kept apart so that
+// allocations that do not need zeroed memory can reuse dirty ones
+typedef struct com_pmm_magazine {
+    kspinlock_t lock;
+    struct {
+        void  *pages;
+        size_t num_pages;
+        void  *dirty_pages;
+        size_t num_dirty_pages;
+    } private;
+} com_pmm_magazine_t;
+
 void *com_mm_pmm_alloc(void);
 void *com_mm_pmm_alloc_many(size_t pages);
 void *com_mm_pmm_alloc_zero(void);
@@ -46,10 +73,12 @@ void *com_mm_pmm_alloc_many_zero(size_t pages);
 void *com_mm_pmm_alloc_max(size_t *out_alloc_size, size_t pages);
 void *com_mm_pmm_alloc_max_zero(size_t *out_alloc_size, size_t pages);
 void  com_mm_pmm_hold(void *page);
+bool  com_mm_pmm_unhold(void *page);
 bool  com_mm_pmm_is_shared(void *page);
 void  com_mm_pmm_free(void *page);
 void  com_mm_pmm_free_many(void *base, size_t pages);
 void  com_mm_pmm_unreserve_many(void *base, size_t pages);
 void  com_mm_pmm_get_stats(com_pmm_stats_t *out);
+void  com_mm_pmm_reclaim_magazines(void);
 void  com_mm_pmm_init_threads(void);
 void  com_mm_pmm_init(void);
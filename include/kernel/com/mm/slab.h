@@ -18,8 +18,57 @@
 
 #pragma once
 
+#include <lib/spinlock.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+// Zero objects when they are allocated
+#define COM_MM_SLAB_CACHE_FLAGS_ZERO 1
+
+typedef struct com_slab_cache com_slab_cache_t;
+// Constructors and destructors run with the cache lock held and must not block
+typedef void (*com_intf_slab_ctor_t)(void *obj);
+
+typedef struct com_slab_cache_stats {
+    const char *name;
+    size_t      obj_size;
+    size_t      num_allocs;
+    size_t      num_frees;
+    size_t      num_active; // objects currently handed out to users
+    size_t      num_slabs;
+    size_t      num_ctor_calls;
+} com_slab_cache_stats_t;
+
+// Per-CPU stash of free objects for one cache. Counters are only updated by
+// the owning CPU and are summed when statistics are requested
+typedef struct com_slab_magazine {
+    void  *objs;
+    size_t num_objs;
+    size_t num_allocs;
+    size_t num_frees;
+} com_slab_magazine_t;
+
+// Per-CPU magazines, one for each size class and named cache. The array is
+// only allocated the first time the CPU uses the slab allocator
+typedef struct com_slab_cpu {
+    kspinlock_t          lock;
+    com_slab_magazine_t *magazines;
+} com_slab_cpu_t;
+
 void *com_mm_slab_alloc(size_t size);
 void  com_mm_slab_free(void *ptr, size_t size);
+
+com_slab_cache_t *com_mm_slab_cache_new(const char          *name,
+                                        size_t               size,
+                                        size_t               align,
+                                        com_intf_slab_ctor_t ctor,
+                                        com_intf_slab_ctor_t dtor,
+                                        int                  flags);
+void              com_mm_slab_cache_destroy(com_slab_cache_t *cache);
+void             *com_mm_slab_cache_alloc(com_slab_cache_t *cache);
+void com_mm_slab_cache_free(com_slab_cache_t *cache, void *obj);
+void com_mm_slab_cache_get_stats(com_slab_cache_stats_t *out,
+                                 com_slab_cache_t       *cache);
+size_t com_mm_slab_get_num_slots(void);
+bool   com_mm_slab_get_slot(com_slab_cache_stats_t *out, size_t slot);
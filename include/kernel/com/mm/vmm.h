@@ -20,8 +20,11 @@
 
 #include <arch/context.h>
 #include <arch/mmu.h>
+#include <lib/avltree.h>
 #include <lib/spinlock.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <vendor/tailq.h>
 
 #define COM_MM_VMM_FLAGS_NONE      0
 #define COM_MM_VMM_FLAGS_ANONYMOUS 1
@@ -36,6 +39,10 @@
 
 #define COM_MM_VMM_FAULT_ATTR_COW 1 // COW enabled on the address
 #define COM_MM_VMM_FAULT_ATTR_MAP 2 // Map on page fault
+// The large page around the address has not been touched yet
+#define COM_MM_VMM_FAULT_ATTR_LARGE 4
+// The page table that maps the address is shared with another address space
+#define COM_MM_VMM_FAULT_ATTR_COW_TABLE 8
 
 #define COM_MM_VMM_PREFAULT_SUPPORTED_ATTR (COM_MM_VMM_FAULT_ATTR_MAP)
 
@@ -46,10 +53,45 @@ typedef enum com_vmm_range_type {
     E_COM_VMM_RANGE_TYPE_FILE
 } com_vmm_range_type_t;
 
+// A contiguous range of user virtual memory with uniform attributes. VMAs
+// never overlap and are indexed by their start address
+typedef struct com_vmm_vma {
+    kavltree_node_t   node;
+    uintptr_t         start;
+    uintptr_t         end; // exclusive
+    int               vmm_flags;
+    arch_mmu_flags_t  mmu_flags;
+    struct com_vnode *vnode; // backing file, NULL if anonymous
+    uintmax_t         off;   // offset of start within vnode
+    // Fault-around state: the window grows while faults move forward through
+    // the VMA and shrinks when they jump around
+    uintptr_t         fault_last;   // page of the last fault, 0 if none
+    uintptr_t         fault_next;   // end of the last fault-around window
+    size_t            fault_window; // pages to map around the next fault
+    TAILQ_ENTRY(com_vmm_vma) dead;
+} com_vmm_vma_t;
+
+// Counters are updated atomically and may be read without the context lock
+typedef struct com_vmm_fault_stats {
+    size_t num_faults;        // faults that mapped new memory
+    size_t num_sequential;    // faults that continued a forward scan
+    size_t num_prefaulted;    // pages mapped ahead of the faulting one
+    size_t num_prefault_hits; // prefaulted pages that were used without fault
+} com_vmm_fault_stats_t;
+
+// Results of com_mm_vmm_bench_shootdown, in ns
+typedef struct com_vmm_shootdown_bench {
+    uintmax_t user_ns;   // synchronous, user page of the caller
+    uintmax_t kernel_ns; // synchronous, kernel page (all CPUs)
+    uintmax_t async_ns;  // asynchronous, kernel page, until all are done
+} com_vmm_shootdown_bench_t;
+
 typedef struct com_vmm_context {
     arch_mmu_pagetable_t *pagetable;
-    size_t                anon_pages;
-    kspinlock_t           lock;
+    kavltree_t            vmas;
+    size_t                num_vmas;
+    kspinlock_t           lock; // protects the VMA tree
+    com_vmm_fault_stats_t fault_stats;
 } com_vmm_context_t;
 
 void               com_mm_vmm_init(void);
@@ -66,6 +108,8 @@ void              *com_mm_vmm_map(com_vmm_context_t *context,
 void *com_mm_vmm_get_physical(com_vmm_context_t *context, void *virt_addr);
 void  com_mm_vmm_switch(com_vmm_context_t *context);
 void  com_mm_vmm_unmap(com_vmm_context_t *context, void *virt, size_t len);
+void  com_mm_vmm_populate(com_vmm_context_t *context, void *virt, size_t len);
+void  com_mm_vmm_discard(com_vmm_context_t *context, void *virt, size_t len);
 void  com_mm_vmm_handle_fault(void            *fault_virt,
                               void            *fault_phys,
                               arch_context_t  *fault_ctx,
@@ -75,3 +119,16 @@ void  com_mm_vmm_handle_fault(void            *fault_virt,
 void *com_mm_vmm_prealloc_range(com_vmm_context_t   *context,
                                 com_vmm_range_type_t rangetype,
                                 size_t               len);
+void  com_mm_vmm_fault_window(uintptr_t *out_start,
+                              uintptr_t *out_end,
+                              void      *fault_virt);
+void  com_mm_vmm_get_fault_stats(com_vmm_fault_stats_t *out,
+                                 com_vmm_context_t     *context);
+void  com_mm_vmm_set_backing(com_vmm_context_t *context,
+                             void              *virt,
+                             size_t             len,
+                             struct com_vnode  *vnode,
+                             uintmax_t          off);
+com_vmm_vma_t *com_mm_vmm_find_vma_nolock(com_vmm_context_t *context,
+                                          void              *virt);
+void com_mm_vmm_bench_shootdown(com_vmm_shootdown_bench_t *out, size_t n);
@@ -21,9 +21,18 @@
 #include <kernel/com/sys/interrupt.h>
 #include <lib/spinlock.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <vendor/tailq.h>
 
+// Pending callouts are kept in a hierarchical timing wheel. Each level has
+// COM_SYS_CALLOUT_WHEEL_SLOTS slots, and each slot of a level spans a full turn
+// of the level below it. Callouts are moved (cascaded) to the level below when
+// their slot comes up
+#define COM_SYS_CALLOUT_WHEEL_BITS   6
+#define COM_SYS_CALLOUT_WHEEL_SLOTS  (1UL << COM_SYS_CALLOUT_WHEEL_BITS)
+#define COM_SYS_CALLOUT_WHEEL_LEVELS 4
+
 typedef struct com_callout com_callout_t;
 typedef void (*com_intf_callout_t)(com_callout_t *callout);
 
@@ -36,15 +45,35 @@ typedef struct com_callout {
 
     kspinlock_t               entry_lock;  // only protects the following fields
     struct com_callout_queue *cpu_callout; // NULL if not scheduled
-    TAILQ_ENTRY(com_callout) queue;
+    LIST_ENTRY(com_callout) queue;
 } com_callout_t;
 
-TAILQ_HEAD(com_callout_tailq, com_callout);
+LIST_HEAD(com_callout_list, com_callout);
+
+typedef struct com_callout_stats {
+    size_t    num_pending;  // callouts currently in the wheel
+    uintmax_t num_fired;    // handlers run by this queue
+    uintmax_t num_migrated; // callouts moved here from other queues
+} com_callout_stats_t;
+
+// Results of com_sys_callout_bench, in ns
+typedef struct com_callout_bench {
+    uintmax_t arm_ns;      // arming all callouts
+    uintmax_t cancel_ns;   // cancelling all of them before they fire
+    uintmax_t fire_ns;     // from arming the first to running the last
+    uintmax_t lateness_ns; // sum of how late each handler ran
+} com_callout_bench_t;
 
+// The time of all queues is the same system-wide clock, so deadlines keep
+// their meaning when callouts move between CPUs
 typedef struct com_callout_queue {
     uintmax_t                ns;
     uintmax_t                next_preempt;
-    struct com_callout_tailq queue;
+    uintmax_t                tick;       // next tick to be processed
+    struct com_callout_list *wheel;      // one array of slots per level
+    uintmax_t                next_event; // time the timer is armed for
+    bool                     idle;       // no preemption while idle
+    com_callout_stats_t      stats;
     kspinlock_t              lock;
 } com_callout_queue_t;
 
@@ -66,6 +95,12 @@ void      com_sys_callout_add_bsp(com_intf_callout_t handler,
                                   void              *arg,
                                   uintmax_t          delay);
 void      com_sys_callout_set_bsp_nolock(com_callout_queue_t *bsp_queue);
+void      com_sys_callout_init(void);
+void      com_sys_callout_init_queue(com_callout_queue_t *queue);
+void      com_sys_callout_migrate(com_callout_queue_t *src,
+                                  com_callout_queue_t *dst);
+bool com_sys_callout_get_stats(com_callout_stats_t *out, size_t cpu_id);
+void com_sys_callout_set_idle(bool idle);
 com_callout_t      *
 com_sys_callout_new(com_intf_callout_t handler, void *arg, uintmax_t ns);
 void com_sys_callout_destroy(com_callout_t *callout);
@@ -74,3 +109,6 @@ void com_sys_callout_set_and_enqueue(com_callout_t     *callout,
                                      com_intf_callout_t handler,
                                      uintmax_t          delay);
 void com_sys_callout_cancel(com_callout_t *callout);
+void com_sys_callout_bench(com_callout_bench_t *out,
+                           size_t               n,
+                           uintmax_t            spread_ns);
@@ -0,0 +1,88 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of spinlocks whose hold time is tracked at once on a CPU
+#define COM_SYS_LOCKPROF_MAX_HELD 16
+
+typedef enum com_lockprof_type {
+    E_COM_LOCKPROF_SPINLOCK = 0,
+    E_COM_LOCKPROF_MUTEX,
+    E_COM_LOCKPROF_RWLOCK_READ,
+    E_COM_LOCKPROF_RWLOCK_WRITE
+} com_lockprof_type_t;
+
+// Statistics of all acquisitions made from one call site
+typedef struct com_lockprof_site {
+    void               *ip; // NULL if the slot is free
+    com_lockprof_type_t type;
+    bool                ready; // set once type is valid
+    uintmax_t           num_acquired;
+    uintmax_t           num_contended; // acquisitions that had to wait
+    uintmax_t           wait_ns;       // total time spent waiting
+    uintmax_t           max_wait_ns;
+    uintmax_t           max_hold_ns; // not tracked for readers
+} com_lockprof_site_t;
+
+// Spinlocks held by a CPU, so that their hold time can be computed on release
+typedef struct com_lockprof_held {
+    void                *lock;
+    com_lockprof_site_t *site;
+    uintmax_t            start;
+} com_lockprof_held_t;
+
+typedef struct com_lockprof_cpu {
+    com_lockprof_held_t held[COM_SYS_LOCKPROF_MAX_HELD];
+    size_t              num_held;
+} com_lockprof_cpu_t;
+
+// Only available with CONFIG_LOCK_PROFILER. These never take locks themselves,
+// and all of them accept a NULL site, which is what com_sys_lockprof_get_site
+// returns once the table is full
+com_lockprof_site_t *com_sys_lockprof_get_site(void               *ip,
+                                               com_lockprof_type_t type);
+void                 com_sys_lockprof_acquired(com_lockprof_site_t *site,
+                                               bool                 contended,
+                                               uintmax_t            wait_ns);
+void com_sys_lockprof_released(com_lockprof_site_t *site, uintmax_t hold_ns);
+void com_sys_lockprof_push_spinlock(void *lock, com_lockprof_site_t *site);
+void com_sys_lockprof_pop_spinlock(void *lock);
+
+// Always available, the site table has no slots without CONFIG_LOCK_PROFILER.
+// com_sys_lockprof_get_slot returns false if the slot is free or being claimed
+size_t com_sys_lockprof_get_num_slots(void);
+bool   com_sys_lockprof_get_slot(com_lockprof_site_t *out, size_t slot);
+void   com_sys_lockprof_reset(void);
+
+// Results of com_sys_lockprof_bench_spinlock
+typedef struct com_lockprof_bench {
+    size_t    num_workers;
+    size_t    num_cpus; // distinct CPUs the workers finished on
+    uintmax_t num_acquired;
+    uintmax_t wait_ns; // total time spent in kspinlock_acquire
+    uintmax_t max_wait_ns;
+    uintmax_t elapsed_ns; // from the first worker starting to the last ending
+} com_lockprof_bench_t;
+
+void com_sys_lockprof_bench_spinlock(com_lockprof_bench_t *out,
+                                     size_t                num_iters);
@@ -30,6 +30,7 @@ TAILQ_HEAD(com_proc_group_tailq, com_proc_group);
 #include <kernel/com/ipc/signal.h>
 #include <kernel/com/mm/vmm.h>
 #include <kernel/com/sys/thread.h>
+#include <lib/rcu.h>
 #include <lib/spinlock.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -82,6 +83,7 @@ typedef struct com_proc {
     KCACHE_FRIENDLY kspinlock_t signal_lock;
     com_sigmask_t               pending_signals;
     bool                        exited;
+    bool                        reaped; // set by waitpid
     int                         stop_signal;
     bool                        stop_notified;
     int                         exit_status;
@@ -98,6 +100,11 @@ typedef struct com_proc {
     com_filedesc_t               fd[CONFIG_OPEN_MAX];
 
     char executable_path[CONFIG_PATH_MAX];
+
+    // Lookups by PID do not take locks, so the process is freed after an RCU
+    // grace period
+    krcu_head_t rcu;
+    TAILQ_ENTRY(com_proc) reaper; // queued for com_sys_proc_destroy
 } com_proc_t;
 
 com_proc_t *com_sys_proc_new(com_vmm_context_t *vmm_context,
@@ -125,6 +132,10 @@ int com_sys_proc_get_directory(com_file_t  **dir_file,
                                int           dir_fd);
 com_proc_t *com_sys_proc_get_by_pid(pid_t pid);
 com_proc_t *com_sys_proc_get_arbitrary_child(com_proc_t *proc);
+void        com_sys_proc_bench_lookup(uintmax_t *out_rcu_ns,
+                                      uintmax_t *out_rwlock_ns,
+                                      pid_t      pid,
+                                      size_t     n);
 
 // Threads
 void com_sys_proc_add_thread(com_proc_t *proc, struct com_thread *thread);
@@ -149,3 +160,4 @@ com_proc_group_t   *com_sys_proc_get_group_by_pgid(pid_t pgid);
 com_proc_session_t *com_sys_proc_new_session_nolock(com_proc_t  *leader,
                                                     com_vnode_t *tty);
 void                com_sys_proc_init(void);
+void                com_sys_proc_init_reaper(void);
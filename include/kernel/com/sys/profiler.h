@@ -35,16 +35,24 @@ typedef enum com_profile_func {
     E_COM_PROFILE_FUNC_SCHED_YIELD,
     E_COM_PROFILE_FUNC_ELF_LOAD,
     E_COM_PROFILE_FUNC_VMM_HANDLE_FAULT,
+    E_COM_PROFILE_FUNC_VMM_DUPLICATE,
 
     E_COM_PROFILE_FUNC__MAX
 } com_profile_func_t;
 
+// Bucket i of the latency histogram counts calls whose real time was in
+// [2^i, 2^(i+1)) ns. The last bucket also counts everything above it
+#define COM_SYS_PROFILER_HIST_BUCKETS 48
+
 typedef struct com_profile_func_data {
     uintmax_t real_time;
     uintmax_t cpu_time;
     size_t    num_calls;
+    uintmax_t hist[COM_SYS_PROFILER_HIST_BUCKETS];
 } com_profile_func_data_t;
 
+// One per CPU, see com_sys_profiler_get_function and
+// com_sys_profiler_get_syscall for system-wide totals
 typedef struct com_syswide_profile {
     com_profile_func_data_t functions[E_COM_PROFILE_FUNC__MAX];
     com_profile_func_data_t syscalls[CONFIG_SYSCALL_MAX];
@@ -59,8 +67,12 @@ typedef struct com_profiler_data {
     uintmax_t thread_slept_start;
 } com_profiler_data_t;
 
-void                   com_sys_profiler_init(void);
-com_syswide_profile_t *com_sys_profiler_get_syswide(void);
+void com_sys_profiler_init(void);
+void com_sys_profiler_get_function(com_profile_func_data_t *out,
+                                   com_profile_func_t       function_id);
+void com_sys_profiler_get_syscall(com_profile_func_data_t *out,
+                                  size_t                   syscall_number);
+void com_sys_profiler_reset(void);
 const char *com_sys_profiler_resolve_name(com_profile_func_t function_id);
 
 // This is quite unconventional but it helps reduce code clutter
@@ -24,8 +24,13 @@
 #include <lib/mutex.h>
 #include <lib/spinlock.h>
 
+// Range of priorities of SCHED_FIFO and SCHED_RR threads, higher runs first
+#define COM_SYS_SCHED_RT_PRIO_MIN 1
+#define COM_SYS_SCHED_RT_PRIO_MAX 99
+
 void com_sys_sched_yield_nolock(void);
 void com_sys_sched_yield(void);
+void com_sys_sched_preempt(void);
 void com_sys_sched_isr(com_isr_t *isr, arch_context_t *ctx);
 
 void com_sys_sched_wait_nodrop(com_waitlist_t *waitlist);
@@ -41,7 +46,8 @@ int com_sys_sched_wait_mutex_timeout(com_waitlist_t *waitlist,
                                      kmutex_t       *mutex,
                                      uintmax_t       timeout);
 
-void com_sys_sched_notify(com_waitlist_t *waitlist);
+// Returns the thread that was woken up, if any
+com_thread_t *com_sys_sched_notify(com_waitlist_t *waitlist);
 void com_sys_sched_notify_all(com_waitlist_t *waitlist);
 void com_sys_sched_notify_n(com_waitlist_t *waitlist, size_t num_waiters);
 void com_sys_sched_notify_thread_nolock(com_thread_t *thread);
@@ -50,4 +56,15 @@ void com_sys_sched_notify_thread(com_thread_t *thread);
 void com_sys_sched_prioritize(com_thread_t *thread);
 void com_sys_sched_prioritize_nolock(com_thread_t *thread);
 
+void com_sys_sched_init_thread(com_thread_t *thread, com_thread_t *parent);
+void com_sys_sched_set_nice(com_thread_t *thread, int nice);
+int  com_sys_sched_set_policy(com_thread_t *thread,
+                             int           policy,
+                             int           rt_priority);
+void com_sys_sched_wake(com_thread_t *thread);
+bool com_sys_sched_resched_pending(void);
+bool com_sys_sched_get_stats(com_sched_stats_t *out, size_t cpu_id);
+
+void com_sys_sched_init_runqueue(arch_cpu_t *cpu);
+
 void com_sys_sched_init(void);
@@ -186,6 +186,10 @@ COM_SYS_SYSCALL(com_sys_syscall_setitimer);
 COM_SYS_SYSCALL(com_sys_syscall_mkdirat);
 COM_SYS_SYSCALL(com_sys_syscall_getpeername);
 COM_SYS_SYSCALL(com_sys_syscall_munmap);
+COM_SYS_SYSCALL(com_sys_syscall_madvise);
+COM_SYS_SYSCALL(com_sys_syscall_setpriority);
+COM_SYS_SYSCALL(com_sys_syscall_getpriority);
+COM_SYS_SYSCALL(com_sys_syscall_sched_setscheduler);
 COM_SYS_SYSCALL(com_sys_syscall_sysprofile);
 
 // SYSCALL UTILITIES
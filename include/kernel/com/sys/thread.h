@@ -19,6 +19,8 @@
 #pragma once
 
 #include <lib/spinlock.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <vendor/tailq.h>
 
 struct com_thread;
@@ -35,6 +37,22 @@ typedef struct com_waitlist {
     kspinlock_t             lock;
 } com_waitlist_t;
 
+// Per-CPU runqueue statistics. Only updated with the runqueue lock held, but
+// may be read at any time
+typedef struct com_sched_stats {
+    size_t    queue_len;       // threads waiting in the runqueue
+    size_t    max_queue_len;   // highest queue_len so far
+    uintmax_t queue_len_sum;   // queue_len sampled at each balance check
+    uintmax_t num_samples;     // samples in queue_len_sum
+    uintmax_t num_pulled;      // threads moved here by periodic balancing
+    uintmax_t num_stolen;      // threads taken from other CPUs while idle
+    uintmax_t num_wakeups;     // threads woken up into the runqueue
+    uintmax_t num_wake_affine; // wakeups moved to the CPU of the waker
+    uintmax_t num_wake_idle;   // wakeups placed on an idle CPU
+    uintmax_t num_ipi_sent;    // reschedule IPIs sent for wakeups
+    uintmax_t num_ipi_avoided; // wakeups that did not need an IPI
+} com_sched_stats_t;
+
 typedef enum com_thread_state {
     E_COM_THREAD_STATE_NEW = 0,
     E_COM_THREAD_STATE_WAITING,
@@ -48,6 +66,8 @@ typedef enum com_thread_state {
 #include <kernel/com/ipc/signal.h>
 #include <kernel/com/sys/callout.h>
 #include <kernel/com/sys/proc.h>
+#include <lib/avltree.h>
+#include <lib/rcu.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <sys/time.h>
@@ -71,8 +91,19 @@ typedef struct com_thread {
     com_thread_state_t   state;
     TAILQ_ENTRY(com_thread) threads;
     TAILQ_ENTRY(com_thread) proc_threads;
-    int   lock_depth;
-    pid_t tid;
+    int       lock_depth;
+    pid_t     tid;
+    uintmax_t last_ran; // when the thread was last switched out
+
+    // Scheduling class and parameters, protected by sched_lock
+    int              sched_policy; // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int              rt_priority;  // only used by SCHED_FIFO and SCHED_RR
+    int              nice;         // -20 (highest) to 19 (lowest), SCHED_OTHER
+    uint32_t         weight;       // share of the CPU, derived from nice
+    uintmax_t        vruntime;     // ns run, scaled by weight (SCHED_OTHER)
+    uintmax_t        exec_start;   // when vruntime was last updated
+    struct arch_cpu *runqueue;     // CPU whose runqueue holds the thread
+    kavltree_node_t  fair_node;    // position in the fair runqueue
 
     com_waitlist_t     *waiting_on;
     uintmax_t           ctime;
@@ -87,6 +118,10 @@ typedef struct com_thread {
     // its things and all of a sudden we got a page fault in kernel or memory
     // corruption
     com_thread_timer_t real_timer;
+
+    // Drops the reference to proc once the thread has exited and been switched
+    // out for the last time
+    krcu_head_t rcu;
 } com_thread_t;
 
 com_thread_t *com_sys_thread_new(struct com_proc *proc,
@@ -103,3 +138,4 @@ void com_sys_thread_exit_nolock(com_thread_t *thread);
 void com_sys_thread_destroy(com_thread_t *thread);
 void com_sys_thread_ready_nolock(com_thread_t *thread);
 void com_sys_thread_ready(com_thread_t *thread);
+void com_sys_thread_init(void);
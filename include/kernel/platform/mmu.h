@@ -21,6 +21,10 @@
 #include <arch/mmu.h>
 #include <stddef.h>
 
+// Called once every CPU has dropped the translations of an asynchronous
+// invalidation. It may run in interrupt context on any CPU and must not block
+typedef void (*arch_intf_mmu_done_t)(void *arg);
+
 void                  arch_mmu_init(void);
 arch_mmu_pagetable_t *arch_mmu_new_table(void);
 void                  arch_mmu_destroy_table(arch_mmu_pagetable_t *pt);
@@ -33,7 +37,16 @@ bool                  arch_mmu_chflags(arch_mmu_pagetable_t *pt,
                                        void                 *virt,
                                        arch_mmu_flags_t      new_flags);
 bool  arch_mmu_unmap(void **out_old_phys, arch_mmu_pagetable_t *pt, void *virt);
+bool  arch_mmu_unmap_large(void                **out_old_phys,
+                           arch_mmu_pagetable_t *pt,
+                           void                 *virt);
+bool  arch_mmu_unshare_table(arch_mmu_pagetable_t *pt, void *virt);
 void  arch_mmu_invalidate(arch_mmu_pagetable_t *pt, void *virt, size_t pages);
+void  arch_mmu_invalidate_async(arch_mmu_pagetable_t *pt,
+                                void                 *virt,
+                                size_t                pages,
+                                arch_intf_mmu_done_t  done,
+                                void                 *arg);
 void  arch_mmu_switch(arch_mmu_pagetable_t *pt);
 void  arch_mmu_switch_default(void);
 void *arch_mmu_get_physical(arch_mmu_pagetable_t *pagetable, void *virt_addr);
@@ -18,14 +18,19 @@
 
 #pragma once
 
+#include <kernel/com/mm/pmm.h>
 #include <kernel/com/mm/pmmcache.h>
+#include <kernel/com/mm/slab.h>
 #include <kernel/com/sys/callout.h>
+#include <kernel/com/sys/lockprof.h>
+#include <kernel/com/sys/profiler.h>
 #include <kernel/com/sys/thread.h>
 #include <kernel/platform/x86-64/arch/mmu.h>
 #include <kernel/platform/x86-64/ist.h>
 #include <kernel/platform/x86-64/lapic.h>
 #include <kernel/platform/x86-64/msr.h>
 #include <kernel/platform/x86-64/tsc.h>
+#include <lib/avltree.h>
 #include <lib/spinlock.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -44,6 +49,7 @@
 #define ARCH_CPU_IPI_RESCHEDULE 0x31
 #define ARCH_CPU_IPI_SIGNAL     0x32
 #define ARCH_CPU_IPI_PANIC      0x33
+#define ARCH_CPU_IPI_TIMER      X86_64_LAPIC_TIMER_INTERRUPT
 
 #define ARCH_CPU_DISABLE_INTERRUPTS() asm volatile("cli")
 #define ARCH_CPU_ENABLE_INTERRUPTS()  asm volatile("sti")
@@ -59,6 +65,10 @@
     X86_64_TSC_VAL_TO_NS(ARCH_CPU_GET()->tsc_reverse_mult, ts)
 #define ARCH_CPU_GET_TIME() X86_64_TSC_GET_NS()
 
+// Fires the timer interrupt once at ns (as returned by ARCH_CPU_GET_TIME), or
+// never if ns is UINTMAX_MAX
+#define ARCH_CPU_SET_TIMER(ns) x86_64_lapic_set_deadline(ns)
+
 typedef struct arch_cpu {
     // Must be here
     struct com_thread *thread;
@@ -66,21 +76,35 @@ typedef struct arch_cpu {
     uint64_t           id;
     uint32_t           lapic_id;
 
-    uint64_t        gdt[7];
-    x86_64_ist_t    ist;
-    uint64_t        tsc_reverse_mult;
-    com_pmm_cache_t mmu_cache;
-    size_t         *mmu_shootdown_counter;
-    kspinlock_t     mmu_shootdown_lock;
-    void           *mmu_shootdown_virt;
-    size_t          mmu_shootdown_pages;
+    uint64_t            gdt[7];
+    x86_64_ist_t        ist;
+    uint64_t            tsc_reverse_mult;
+    com_pmm_cache_t     mmu_cache;
+    com_pmm_magazine_t  pmm_magazine;
+    com_pmm_cpu_stats_t pmm_stats;
+    com_slab_cpu_t      slab;
 
     arch_mmu_pagetable_t *root_page_table;
+    arch_mmu_pagetable_t *mmu_active_table;
+    x86_64_mmu_pcid_t     mmu_pcids[X86_64_MMU_NUM_PCIDS];
+    uint64_t              mmu_pcid_gen;
+
+    x86_64_mmu_shootdown_queue_t mmu_shootdown;
 
     kspinlock_t              runqueue_lock;
-    struct com_thread_tailq  sched_queue;
+    struct com_thread_tailq  sched_rt_queue; // by priority, FIFO among equals
+    kavltree_t               sched_fair;     // by vruntime
+    uintmax_t                sched_min_vruntime;
     struct com_callout_queue callout;
     struct com_thread       *idle_thread;
+    uintmax_t                sched_balance_next;
+    com_sched_stats_t        sched_stats;
+    bool                     sched_resched_pending;
+    uintmax_t                rcu_gp_seen; // last grace period seen quiescent
+    com_syswide_profile_t   *profile;     // this CPU's profiler counters
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_cpu_t lockprof; // spinlocks being timed on this CPU
+#endif
 } arch_cpu_t;
 
 #define ARCH_CPU_SET(cpuptr)                                 \
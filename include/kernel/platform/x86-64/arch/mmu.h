@@ -18,7 +18,9 @@
 
 #pragma once
 
+#include <lib/spinlock.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define ARCH_MMU_KERNELSPACE_START (void *)0xffff800000000000
@@ -46,6 +48,46 @@
 #define ARCH_MMU_EXTRA_FLAGS_SHARED  (1 << 10)
 #define ARCH_MMU_EXTRA_FLAGS_PRIVATE (1 << 9) // same as COW
 #define ARCH_MMU_EXTRA_FLAGS_NOCOPY  (1 << 11)
+// Only meaningful to arch_mmu_map and arch_mmu_chflags: requests a mapping of
+// ARCH_MMU_LARGE_PAGE_SIZE bytes at an address aligned to that size. It is
+// never stored in page table entries
+#define ARCH_MMU_EXTRA_FLAGS_LARGE ((uint64_t)1 << 52)
+
+#define ARCH_MMU_LARGE_PAGE_SIZE ((uintptr_t)2 * 1024 * 1024)
 
 typedef uint64_t arch_mmu_pagetable_t;
 typedef uint64_t arch_mmu_flags_t;
+
+// Number of address spaces each CPU keeps tagged in the TLB. PCID 0 is used by
+// the root table, so slot n holds PCID n + 1
+#define X86_64_MMU_NUM_PCIDS 8
+
+typedef struct x86_64_mmu_pcid {
+    arch_mmu_pagetable_t *table;    // NULL if the PCID is free
+    uint64_t              last_use; // per-CPU switch generation
+} x86_64_mmu_pcid_t;
+
+// Ranges each CPU can have queued before they are turned into a full flush
+#define X86_64_MMU_SHOOTDOWN_RANGES 8
+// Shootdowns each CPU can have left to acknowledge before senders must wait
+#define X86_64_MMU_SHOOTDOWN_ACKS 16
+
+struct x86_64_mmu_shootdown;
+
+typedef struct x86_64_mmu_shootdown_range {
+    arch_mmu_pagetable_t *table;
+    uintptr_t             start;
+    uintptr_t             end; // UINTPTR_MAX if the whole table is flushed
+} x86_64_mmu_shootdown_range_t;
+
+// Invalidations other CPUs have requested from this one. Overlapping and
+// adjacent ranges of the same table are merged as they are queued, and the
+// whole queue is drained by a single IPI
+typedef struct x86_64_mmu_shootdown_queue {
+    kspinlock_t                  lock;
+    bool                         flush_all; // ranges overflowed
+    size_t                       num_ranges;
+    x86_64_mmu_shootdown_range_t ranges[X86_64_MMU_SHOOTDOWN_RANGES];
+    size_t                       num_acks;
+    struct x86_64_mmu_shootdown *acks[X86_64_MMU_SHOOTDOWN_ACKS];
+} x86_64_mmu_shootdown_queue_t;
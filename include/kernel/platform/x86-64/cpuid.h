@@ -26,8 +26,13 @@
 #define X86_64_CPUID_EXT_MAX_LEAF()  __hdr_x86_64_cpuid_ext_max_leaf()
 #define X86_64_CPUID_BASE_MAX_LEAF() __hdr_x86_64_cpuid_base_max_leaf()
 
-#define X86_64_CPUID_LEAF_1_EDX_TSC (1 << 4)
-#define X86_64_CPUID_LEAF_1_EDX_HTT (1 << 28)
+#define X86_64_CPUID_LEAF_1_EDX_TSC     (1 << 4)
+#define X86_64_CPUID_LEAF_1_EDX_HTT     (1 << 28)
+#define X86_64_CPUID_LEAF_1_ECX_PCID    (1 << 17)
+#define X86_64_CPUID_LEAF_7_EBX_INVPCID (1 << 10)
+
+#define X86_64_CPUID_LEAF_EXT_1             0x80000001
+#define X86_64_CPUID_LEAF_EXT_1_EDX_PDPE1GB (1 << 26)
 
 typedef struct x86_64_cpuid {
     uint32_t eax;
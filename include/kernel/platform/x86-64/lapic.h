@@ -25,6 +25,7 @@
 void x86_64_lapic_eoi(com_isr_t *isr);
 void x86_64_lapic_bsp_init(void);
 void x86_64_lapic_init(void);
+void x86_64_lapic_set_deadline(uintmax_t ns);
 void x86_64_lapic_selfipi(uint8_t vector);
 void x86_64_lapic_send_ipi(uint8_t apic_id, uint8_t vector);
 void x86_64_lapic_broadcast_ipi(uint8_t vector);
@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 
+#define X86_64_MSR_TSC_DEADLINE 0x6E0
 #define X86_64_MSR_EFER         0xC0000080
 #define X86_64_MSR_STAR         0xC0000081
 #define X86_64_MSR_LSTAR        0xC0000082
@@ -25,6 +25,8 @@
     __hdr_x86_64_tsc_get_ns(ARCH_CPU_GET()->tsc_reverse_mult)
 #define X86_64_TSC_VAL_TO_NS(reverse_mult, val) \
     __hdr_x86_64_tsc_val_to_ns(reverse_mult, val)
+#define X86_64_TSC_TIME_TO_VAL(reverse_mult, ns) \
+    __hdr_x86_64_tsc_time_to_val(reverse_mult, ns)
 
 void x86_64_tsc_boot(void);
 void x86_64_tsc_bsp_init(void);
@@ -47,3 +49,20 @@ static inline uintmax_t __hdr_x86_64_tsc_get_ns(uint64_t tsc_reverse_mult) {
     return X86_64_TSC_VAL_TO_NS(tsc_reverse_mult, X86_64_TSC_READ()) -
            __x86_64_TSC_BootTime;
 }
+
+// Inverse of __hdr_x86_64_tsc_get_ns: TSC value at which ns is reached. The
+// 128-bit division is done by hand since there is no libgcc to do it
+static inline uint64_t __hdr_x86_64_tsc_time_to_val(uint64_t  tsc_reverse_mult,
+                                                    uintmax_t ns) {
+    extern uint64_t __x86_64_TSC_BootTime;
+    uint64_t        abs_ns = ns + __x86_64_TSC_BootTime;
+    uint64_t        high   = abs_ns >> 32;
+    uint64_t        low    = abs_ns << 32;
+    uint64_t        val;
+    uint64_t        rem;
+    asm("divq %4"
+        : "=a"(val), "=d"(rem)
+        : "a"(low), "d"(high), "rm"(tsc_reverse_mult));
+    (void)rem;
+    return val;
+}
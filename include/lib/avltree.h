@@ -0,0 +1,58 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Intrusive AVL tree. Nodes are embedded in the structures they index and are
+// ordered by the comparison function given at initialization time. Lookups
+// are done by the user by walking the node pointers, since the key type is not
+// known here
+
+#define KAVLTREE_INIT(tree_ptr, cmp_fn) \
+    (tree_ptr)->root = NULL;            \
+    (tree_ptr)->cmp  = cmp_fn
+
+#define KAVLTREE_ENTRY(node_ptr, type, field) \
+    ((NULL == (node_ptr))                     \
+         ? NULL                               \
+         : (type *)((uint8_t *)(node_ptr) - offsetof(type, field)))
+
+typedef struct kavltree_node {
+    struct kavltree_node *parent;
+    struct kavltree_node *left;
+    struct kavltree_node *right;
+    int                   height;
+} kavltree_node_t;
+
+// Returns < 0 if a comes before b, 0 if they are equal, > 0 otherwise
+typedef int (*kavltree_cmp_t)(kavltree_node_t *a, kavltree_node_t *b);
+
+typedef struct kavltree {
+    kavltree_node_t *root;
+    kavltree_cmp_t   cmp;
+} kavltree_t;
+
+void             kavltree_insert(kavltree_t *tree, kavltree_node_t *node);
+void             kavltree_remove(kavltree_t *tree, kavltree_node_t *node);
+kavltree_node_t *kavltree_first(kavltree_t *tree);
+kavltree_node_t *kavltree_last(kavltree_t *tree);
+kavltree_node_t *kavltree_next(kavltree_node_t *node);
+kavltree_node_t *kavltree_prev(kavltree_node_t *node);
@@ -18,23 +18,41 @@
 
 #pragma once
 
+#include <kernel/com/sys/lockprof.h>
 #include <kernel/com/sys/thread.h>
 #include <lib/spinlock.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <vendor/tailq.h>
 
-#define KMUTEX_INIT(mutexptr)             \
-    (mutexptr)->lock   = KSPINLOCK_NEW(); \
-    (mutexptr)->owner  = NULL;            \
-    (mutexptr)->locked = false;           \
+#define KMUTEX_INIT(mutexptr)                 \
+    (mutexptr)->lock   = KSPINLOCK_NEW();     \
+    (mutexptr)->owner  = NULL;                \
+    (mutexptr)->locked = false;               \
+    (mutexptr)->stats  = (kmutex_stats_t){0}; \
     COM_SYS_THREAD_WAITLIST_INIT(&(mutexptr)->waiters)
 
+// Contention statistics, updated with the mutex spinlock held
+typedef struct kmutex_stats {
+    uintmax_t num_acquired;  // successful acquisitions
+    uintmax_t num_contended; // acquisitions that found the mutex held
+    uintmax_t num_spun;      // contended acquisitions won by spinning
+    uintmax_t num_slept;     // times a thread went to sleep on the mutex
+    uintmax_t num_handoffs;  // releases that passed the mutex to a waiter
+    uintmax_t num_timeouts;  // acquisitions that gave up
+    uintmax_t wait_ns;       // total time spent in contended acquisitions
+} kmutex_stats_t;
+
 typedef struct kmutex {
     kspinlock_t        lock;
     bool               locked;
     struct com_thread *owner;
     com_waitlist_t     waiters;
+    kmutex_stats_t     stats;
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_site_t *prof_site;  // where the current owner acquired it
+    uintmax_t            prof_start; // when the current owner acquired it
+#endif
 } kmutex_t;
 
 bool kmutex_try_acquire(kmutex_t *mutex);
@@ -53,7 +53,9 @@ typedef union kradixtree_back {
 
 // This is needed to keep metadata as stated above
 // NOTE: This contains a lock, but _nolock operations may be used under other
-// locks, the important thing is to be consistent
+// locks, the important thing is to be consistent. Nodes are never freed and
+// entries are published atomically, so kradixtree_get_nolock may also be called
+// under krcu_read_lock alone
 typedef struct kradixtree {
     size_t             num_layers;
     kradixtree_back_t *back;
@@ -0,0 +1,48 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Quiescent-state-based RCU. Readers only disable preemption, so they never
+// write to shared memory. A CPU is in a quiescent state whenever it enters the
+// scheduler, since readers cannot sleep or be preempted. Once every CPU has
+// gone through one after an object was unpublished, no reader can still hold a
+// reference to it
+
+#define KRCU_DEREF(ptr)        __atomic_load_n(&(ptr), __ATOMIC_CONSUME)
+#define KRCU_PUBLISH(ptr, val) __atomic_store_n(&(ptr), val, __ATOMIC_RELEASE)
+#define KRCU_ENTRY(head_ptr, type, field) \
+    ((type *)((uint8_t *)(head_ptr) - offsetof(type, field)))
+
+typedef struct krcu_head krcu_head_t;
+typedef void (*krcu_callback_t)(krcu_head_t *head);
+
+typedef struct krcu_head {
+    struct krcu_head *next;
+    krcu_callback_t   callback;
+    uintmax_t         gp; // grace period that must end before the callback
+} krcu_head_t;
+
+void krcu_read_lock(void);
+void krcu_read_unlock(void);
+void krcu_call(krcu_head_t *head, krcu_callback_t callback);
+void krcu_synchronize(void);
+void krcu_quiescent(void);
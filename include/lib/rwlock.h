@@ -18,6 +18,7 @@
 
 #pragma once
 
+#include <kernel/com/sys/lockprof.h>
 #include <kernel/com/sys/thread.h>
 #include <lib/spinlock.h>
 #include <stdbool.h>
@@ -40,6 +41,11 @@ typedef struct krwlock {
 
     com_waitlist_t readers_waitlist;
     com_waitlist_t writers_waitlist;
+
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_site_t *prof_site;  // where the active writer acquired it
+    uintmax_t            prof_start; // when the active writer acquired it
+#endif
 } krwlock_t;
 
 void krwlock_acquire_read(krwlock_t *rwlock);
@@ -0,0 +1,38 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KSEQCOUNT_NEW() (kseqcount_t){.seq = 0}
+
+// Readers never write to the counter: they take a snapshot of the protected
+// data between kseqcount_read_begin and kseqcount_read_retry, and try again if
+// a writer was active in the meantime. There is no writer lock, so this is only
+// for data that has one writer at a time by construction (e.g., per-CPU data
+// written with interrupts disabled)
+typedef struct kseqcount {
+    uintmax_t seq; // odd while a writer is active
+} kseqcount_t;
+
+uintmax_t kseqcount_read_begin(kseqcount_t *seqcount);
+bool      kseqcount_read_retry(kseqcount_t *seqcount, uintmax_t seq);
+void      kseqcount_write_begin(kseqcount_t *seqcount);
+void      kseqcount_write_end(kseqcount_t *seqcount);
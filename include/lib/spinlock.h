@@ -21,21 +21,55 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#if CONFIG_SPINLOCK_TYPE == CONST_SPINLOCK_TICKET
+
+// Tickets are handed out from next and served in order through owner. The lock
+// is free when the two are equal, so a zeroed lock is a free lock
+typedef union kspinlock_word {
+    uint32_t raw;
+    struct {
+        uint16_t owner;
+        uint16_t next;
+    } ticket;
+} kspinlock_word_t;
+
+#define KSPINLOCK_WORD_FREE {.raw = 0}
+#define KSPINLOCK_WORD_IS_HELD(word) \
+    ((word).ticket.owner != (word).ticket.next)
+
+#elif CONFIG_SPINLOCK_TYPE == CONST_SPINLOCK_MCS
+
+// The low byte is set while the lock is held, the rest holds the ID + 1 of the
+// CPU at the tail of the waiter queue (0 if nobody is queued)
+typedef uint32_t kspinlock_word_t;
+
+#define KSPINLOCK_WORD_FREE          0
+#define KSPINLOCK_WORD_IS_HELD(word) (0 != ((word) & 0xFF))
+
+#else
+
+typedef int kspinlock_word_t;
+
+#define KSPINLOCK_WORD_FREE          KSPINLOCK_FREE_VALUE
+#define KSPINLOCK_WORD_IS_HELD(word) (KSPINLOCK_HELD_VALUE == (word))
+
+#endif
+
 #if CONFIG_SPINLOCK_DEBUG
 
 #define KSPINLOCK_HELD_VALUE 144
 #define KSPINLOCK_FREE_VALUE 0
 
-#define KSPINLOCK_NEW()                                  \
-    (kspinlock_t){.lock          = KSPINLOCK_FREE_VALUE, \
+#define KSPINLOCK_NEW()                                 \
+    (kspinlock_t){.lock          = KSPINLOCK_WORD_FREE, \
                   .holder_thread = (void *)0xAAAAAAA}
-#define KSPINLOCK_IS_HELD(lockptr) (KSPINLOCK_HELD_VALUE == (lockptr)->lock)
+#define KSPINLOCK_IS_HELD(lockptr) KSPINLOCK_WORD_IS_HELD((lockptr)->lock)
 
 typedef struct kspinlock {
-    int   lock;
-    void *holder_thread;
-    void *last_acquire_ip;
-    void *last_release_ip;
+    kspinlock_word_t lock;
+    void            *holder_thread;
+    void            *last_acquire_ip;
+    void            *last_release_ip;
 } kspinlock_t;
 
 #else
@@ -43,15 +77,16 @@ typedef struct kspinlock {
 #define KSPINLOCK_HELD_VALUE 1
 #define KSPINLOCK_FREE_VALUE 0
 
-#define KSPINLOCK_NEW()            (kspinlock_t) KSPINLOCK_FREE_VALUE
-#define KSPINLOCK_IS_HELD(lockptr) (KSPINLOCK_HELD_VALUE == *(lockptr))
+#define KSPINLOCK_NEW()            (kspinlock_t) KSPINLOCK_WORD_FREE
+#define KSPINLOCK_IS_HELD(lockptr) KSPINLOCK_WORD_IS_HELD(*(lockptr))
 
-typedef int kspinlock_t;
+typedef kspinlock_word_t kspinlock_t;
 
 #endif
 
 void kspinlock_acquire(kspinlock_t *lock);
 bool kspinlock_acquire_timeout(kspinlock_t *lock, uintmax_t timeout_ns);
 void kspinlock_release(kspinlock_t *lock);
+void kspinlock_release_raw(kspinlock_t *lock);
 void kspinlock_fake_acquire(void);
 void kspinlock_fake_release(void);
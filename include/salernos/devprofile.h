@@ -11,8 +11,63 @@
 #define DEVPROFILE_IOCTL_GET_FUNCTIONS _IOR('P', 0X02, struct devprofile_fn_res)
 #define DEVPROFILE_IOCTL_GET_SYSCALLS  _IOR('P', 0X03, struct devprofile_fn_res)
 
+#define DEVPROFILE_IOCTL_GET_FUNCTION_HISTS \
+    _IOR('P', 0X04, struct devprofile_hist_res)
+#define DEVPROFILE_IOCTL_GET_SYSCALL_HISTS \
+    _IOR('P', 0X05, struct devprofile_hist_res)
+#define DEVPROFILE_IOCTL_RESET _IO('P', 0X06)
+
+#define DEVPROFILE_IOCTL_GET_NUM_LOCKS _IOR('P', 0X07, size_t)
+#define DEVPROFILE_IOCTL_GET_LOCKS \
+    _IOR('P', 0X08, struct devprofile_lock_res)
+
+#define DEVPROFILE_IOCTL_GET_NUM_CACHES _IOR('P', 0X09, size_t)
+#define DEVPROFILE_IOCTL_GET_CACHES \
+    _IOR('P', 0X0A, struct devprofile_cache_res)
+
+#define DEVPROFILE_IOCTL_GET_NUM_CPUS _IOR('P', 0X0B, size_t)
+#define DEVPROFILE_IOCTL_GET_SCHED \
+    _IOR('P', 0X0C, struct devprofile_sched_res)
+
+#define DEVPROFILE_IOCTL_GET_FAULTS \
+    _IOR('P', 0X0D, struct devprofile_fault_res)
+
+#define DEVPROFILE_IOCTL_GET_CALLOUTS \
+    _IOR('P', 0X0E, struct devprofile_callout_res)
+
+#define DEVPROFILE_IOCTL_BENCH_PID_LOOKUP \
+    _IOWR('P', 0X0F, struct devprofile_bench_res)
+
+#define DEVPROFILE_IOCTL_BENCH_CALLOUTS \
+    _IOWR('P', 0X10, struct devprofile_callout_bench_res)
+
+#define DEVPROFILE_IOCTL_BENCH_SPINLOCK \
+    _IOWR('P', 0X11, struct devprofile_lock_bench_res)
+
+#define DEVPROFILE_IOCTL_BENCH_SHOOTDOWN \
+    _IOWR('P', 0X12, struct devprofile_shootdown_bench_res)
+
 #define DEVPROFILE_SIZEOF_FN_RES(n) \
     ((n) * sizeof(struct devprofile_fn_data) + sizeof(struct devprofile_fn_res))
+#define DEVPROFILE_SIZEOF_HIST_RES(n)            \
+    ((n) * sizeof(struct devprofile_hist_data) + \
+     sizeof(struct devprofile_hist_res))
+#define DEVPROFILE_SIZEOF_LOCK_RES(n)            \
+    ((n) * sizeof(struct devprofile_lock_data) + \
+     sizeof(struct devprofile_lock_res))
+#define DEVPROFILE_SIZEOF_CACHE_RES(n)            \
+    ((n) * sizeof(struct devprofile_cache_data) + \
+     sizeof(struct devprofile_cache_res))
+#define DEVPROFILE_SIZEOF_SCHED_RES(n)            \
+    ((n) * sizeof(struct devprofile_sched_data) + \
+     sizeof(struct devprofile_sched_res))
+#define DEVPROFILE_SIZEOF_CALLOUT_RES(n)            \
+    ((n) * sizeof(struct devprofile_callout_data) + \
+     sizeof(struct devprofile_callout_res))
+
+// Bucket i counts calls that took [2^i, 2^(i+1)) ns, bucket 0 also counts calls
+// that took 0 ns and the last bucket everything above it
+#define DEVPROFILE_HIST_BUCKETS 48
 
 struct devprofile_fn_data {
     char      name[64];
@@ -26,4 +81,213 @@ struct devprofile_fn_res {
     struct devprofile_fn_data data[];
 };
 
+struct devprofile_hist_data {
+    char     name[64];
+    size_t   num_calls;
+    uint64_t buckets[DEVPROFILE_HIST_BUCKETS];
+};
+
+struct devprofile_hist_res {
+    uint64_t                    _rsvd[16]; // reserved for future use
+    struct devprofile_hist_data data[];
+};
+
+#define DEVPROFILE_LOCK_SPINLOCK     0
+#define DEVPROFILE_LOCK_MUTEX        1
+#define DEVPROFILE_LOCK_RWLOCK_READ  2
+#define DEVPROFILE_LOCK_RWLOCK_WRITE 3
+
+// Lock statistics are kept per acquisition site, i.e., the kernel address the
+// lock was acquired from
+struct devprofile_lock_data {
+    uint64_t site;
+    uint64_t type; // one of DEVPROFILE_LOCK_*
+    uint64_t num_acquired;
+    uint64_t num_contended;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t max_hold_ns; // always 0 for readers
+};
+
+// max_locks is set by the caller to the capacity of data, num_locks is set by
+// the kernel to the number of entries filled in
+struct devprofile_lock_res {
+    uint64_t                    max_locks;
+    uint64_t                    num_locks;
+    uint64_t                    _rsvd[14]; // reserved for future use
+    struct devprofile_lock_data data[];
+};
+
+// Slab caches, both generic size classes (named "generic") and named caches
+struct devprofile_cache_data {
+    char     name[32];
+    uint64_t obj_size;
+    uint64_t num_allocs;
+    uint64_t num_frees;
+    uint64_t num_active; // objects currently allocated
+    uint64_t num_slabs;
+    uint64_t num_ctor_calls;
+};
+
+// max_caches is set by the caller to the capacity of data, num_caches is set by
+// the kernel to the number of entries filled in
+struct devprofile_cache_res {
+    uint64_t                     max_caches;
+    uint64_t                     num_caches;
+    uint64_t                     _rsvd[14]; // reserved for future use
+    struct devprofile_cache_data data[];
+};
+
+// Runqueue statistics of one CPU. The average runqueue length is
+// queue_len_sum / num_samples
+struct devprofile_sched_data {
+    uint64_t cpu;
+    uint64_t queue_len;
+    uint64_t max_queue_len;
+    uint64_t queue_len_sum;
+    uint64_t num_samples;
+    uint64_t num_pulled; // threads moved to this CPU by periodic balancing
+    uint64_t num_stolen; // threads taken from other CPUs while idle
+    uint64_t num_wakeups;
+    uint64_t num_wake_affine; // wakeups moved to the CPU of the waker
+    uint64_t num_wake_idle;   // wakeups placed on an idle CPU
+    uint64_t num_ipi_sent;    // reschedule IPIs sent for wakeups
+    uint64_t num_ipi_avoided; // wakeups that did not need an IPI
+};
+
+// max_cpus is set by the caller to the capacity of data, num_cpus is set by the
+// kernel to the number of entries filled in
+struct devprofile_sched_res {
+    uint64_t                     max_cpus;
+    uint64_t                     num_cpus;
+    uint64_t                     _rsvd[14]; // reserved for future use
+    struct devprofile_sched_data data[];
+};
+
+// Page fault statistics of the calling process. The prefault hit rate is
+// num_prefault_hits / num_prefaulted
+struct devprofile_fault_res {
+    uint64_t num_faults;        // faults that mapped new memory
+    uint64_t num_sequential;    // faults that continued a forward scan
+    uint64_t num_prefaulted;    // pages mapped ahead of the faulting one
+    uint64_t num_prefault_hits; // prefaulted pages used without faulting
+    uint64_t _rsvd[12];         // reserved for future use
+};
+
+// Callout queue statistics of one CPU
+struct devprofile_callout_data {
+    uint64_t cpu;
+    uint64_t num_pending;  // callouts currently queued
+    uint64_t num_fired;    // handlers run by this queue
+    uint64_t num_migrated; // callouts moved here from other queues
+};
+
+// max_cpus is set by the caller to the capacity of data, num_cpus is set by the
+// kernel to the number of entries filled in
+struct devprofile_callout_res {
+    uint64_t                       max_cpus;
+    uint64_t                       num_cpus;
+    uint64_t                       _rsvd[14]; // reserved for future use
+    struct devprofile_callout_data data[];
+};
+
+// pid and num_iters are set by the caller. The kernel looks pid up num_iters
+// times without locks (as done by the kernel) and as many times under a reader
+// lock shared by all callers, so running it on several CPUs at once shows the
+// cost of bouncing the lock
+struct devprofile_bench_res {
+    uint64_t pid;
+    uint64_t num_iters;
+    uint64_t rcu_ns;
+    uint64_t rwlock_ns;
+    uint64_t _rsvd[12]; // reserved for future use
+};
+
+// num_callouts and spread_ns are set by the caller. The kernel arms and cancels
+// num_callouts callouts on the queue of the calling CPU, then arms them again
+// with deadlines spread evenly over spread_ns and waits for all of them to
+// fire. Average handler lateness is lateness_ns / num_callouts
+struct devprofile_callout_bench_res {
+    uint64_t num_callouts;
+    uint64_t spread_ns;
+    uint64_t arm_ns;
+    uint64_t cancel_ns;
+    uint64_t fire_ns;
+    uint64_t lateness_ns;
+    uint64_t _rsvd[10]; // reserved for future use
+};
+
+// num_iters is set by the caller. The kernel has one worker per CPU acquire and
+// release the same spinlock num_iters times, which gives an average acquire
+// latency of wait_ns / num_acquired and a throughput of num_acquired /
+// elapsed_ns. spinlock_type is the CONST_SPINLOCK_* backing that was measured
+struct devprofile_lock_bench_res {
+    uint64_t num_iters;
+    uint64_t spinlock_type;
+    uint64_t num_workers;
+    uint64_t num_cpus; // distinct CPUs the workers ran on
+    uint64_t num_acquired;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t elapsed_ns;
+    uint64_t _rsvd[8]; // reserved for future use
+};
+
+// num_iters is set by the caller. The kernel times num_iters TLB invalidations
+// of one page of the caller's address space, which only interrupts CPUs running
+// other threads of the caller, and as many of a kernel page, which interrupts
+// every CPU, first waiting for each one and then sending them all before
+// waiting
+struct devprofile_shootdown_bench_res {
+    uint64_t num_iters;
+    uint64_t user_ns;
+    uint64_t kernel_ns;
+    uint64_t async_ns;
+    uint64_t _rsvd[12]; // reserved for future use
+};
+
+// Upper bound in ns of the latency below which the given fraction of calls
+// fall, with the fraction in parts per ten thousand (e.g., 9990 for p999).
+// Returns 0 if there are no calls
+static inline uint64_t
+devprofile_hist_percentile(const struct devprofile_hist_data *hist,
+                           uint64_t                           per_10k) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < DEVPROFILE_HIST_BUCKETS; i++) {
+        total += hist->buckets[i];
+    }
+
+    if (0 == total) {
+        return 0;
+    }
+
+    // Smallest number of calls that covers the fraction, rounding up
+    uint64_t target = (total * per_10k + 9999) / 10000;
+    uint64_t seen   = 0;
+    for (size_t i = 0; i < DEVPROFILE_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            return (uint64_t)1 << (i + 1);
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+// The percentiles that a reader of DEVPROFILE_IOCTL_GET_FUNCTION_HISTS and
+// DEVPROFILE_IOCTL_GET_SYSCALL_HISTS reports for each entry
+struct devprofile_hist_tail {
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+};
+
+static inline struct devprofile_hist_tail
+devprofile_hist_tail(const struct devprofile_hist_data *hist) {
+    return (struct devprofile_hist_tail){
+        .p50_ns  = devprofile_hist_percentile(hist, 5000),
+        .p99_ns  = devprofile_hist_percentile(hist, 9900),
+        .p999_ns = devprofile_hist_percentile(hist, 9990)};
+}
+
 #endif
@@ -19,12 +19,35 @@
 #include <arch/cpu.h>
 #include <errno.h>
 #include <kernel/com/fs/devfs.h>
+#include <kernel/com/mm/slab.h>
+#include <kernel/com/mm/vmm.h>
+#include <kernel/com/sys/callout.h>
+#include <kernel/com/sys/lockprof.h>
+#include <kernel/com/sys/proc.h>
 #include <kernel/com/sys/profiler.h>
+#include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/syscall.h>
+#include <kernel/platform/x86-64/smp.h>
 #include <lib/str.h>
 #include <lib/util.h>
 #include <salernos/devprofile.h>
 
+static void devprofile_fill_hist(struct devprofile_hist_data   *d,
+                                 const char                    *name,
+                                 const com_profile_func_data_t *data) {
+    kstrcpy(d->name, name);
+    d->num_calls = data->num_calls;
+
+    for (size_t i = 0; i < DEVPROFILE_HIST_BUCKETS; i++) {
+        d->buckets[i] = 0;
+    }
+
+    // Extra kernel buckets, if any, go into the last userspace one
+    for (size_t i = 0; i < COM_SYS_PROFILER_HIST_BUCKETS; i++) {
+        d->buckets[KMIN(i, DEVPROFILE_HIST_BUCKETS - 1)] += data->hist[i];
+    }
+}
+
 static int devprofile_ioctl(void *devdata, uintmax_t op, void *buf) {
     (void)devdata;
 
@@ -35,16 +58,16 @@ static int devprofile_ioctl(void *devdata, uintmax_t op, void *buf) {
         com_sys_syscall_get_tables(NULL, NULL, (size_t *)buf);
         return 0;
     } else if (DEVPROFILE_IOCTL_GET_FUNCTIONS == op) {
-        struct devprofile_fn_res *r        = buf;
-        com_syswide_profile_t    *profiler = com_sys_profiler_get_syswide();
+        struct devprofile_fn_res *r = buf;
 
         for (com_profile_func_t i = 0; i < E_COM_PROFILE_FUNC__MAX; i++) {
-            struct devprofile_fn_data *d    = &r->data[i];
-            com_profile_func_data_t   *data = &profiler->functions[i];
+            struct devprofile_fn_data *d = &r->data[i];
+            com_profile_func_data_t    data;
+            com_sys_profiler_get_function(&data, i);
             kstrcpy(d->name, com_sys_profiler_resolve_name(i));
-            d->real_time_ns = ARCH_CPU_TIMESTAMP_TO_NS(data->real_time);
-            d->cpu_time_ns  = ARCH_CPU_TIMESTAMP_TO_NS(data->cpu_time);
-            d->num_calls    = data->num_calls;
+            d->real_time_ns = ARCH_CPU_TIMESTAMP_TO_NS(data.real_time);
+            d->cpu_time_ns  = ARCH_CPU_TIMESTAMP_TO_NS(data.cpu_time);
+            d->num_calls    = data.num_calls;
         }
 
         return 0;
@@ -53,18 +76,211 @@ static int devprofile_ioctl(void *devdata, uintmax_t op, void *buf) {
         size_t                    num_syscalls = 0;
         com_syscall_aux_t        *aux_syscalls;
         com_sys_syscall_get_tables(NULL, &aux_syscalls, &num_syscalls);
-        com_syswide_profile_t *profiler = com_sys_profiler_get_syswide();
 
         for (size_t i = 0; i < num_syscalls; i++) {
-            struct devprofile_fn_data *d    = &r->data[i];
-            com_syscall_aux_t         *aux  = &aux_syscalls[i];
-            com_profile_func_data_t   *data = &profiler->syscalls[i];
+            struct devprofile_fn_data *d   = &r->data[i];
+            com_syscall_aux_t         *aux = &aux_syscalls[i];
+            com_profile_func_data_t    data;
+            com_sys_profiler_get_syscall(&data, i);
             kstrcpy(d->name, aux->name);
-            d->real_time_ns = ARCH_CPU_TIMESTAMP_TO_NS(data->real_time);
-            d->cpu_time_ns  = ARCH_CPU_TIMESTAMP_TO_NS(data->cpu_time);
-            d->num_calls    = data->num_calls;
+            d->real_time_ns = ARCH_CPU_TIMESTAMP_TO_NS(data.real_time);
+            d->cpu_time_ns  = ARCH_CPU_TIMESTAMP_TO_NS(data.cpu_time);
+            d->num_calls    = data.num_calls;
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_FUNCTION_HISTS == op) {
+        struct devprofile_hist_res *r = buf;
+
+        for (com_profile_func_t i = 0; i < E_COM_PROFILE_FUNC__MAX; i++) {
+            com_profile_func_data_t data;
+            com_sys_profiler_get_function(&data, i);
+            devprofile_fill_hist(&r->data[i],
+                                 com_sys_profiler_resolve_name(i),
+                                 &data);
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_SYSCALL_HISTS == op) {
+        struct devprofile_hist_res *r            = buf;
+        size_t                      num_syscalls = 0;
+        com_syscall_aux_t          *aux_syscalls;
+        com_sys_syscall_get_tables(NULL, &aux_syscalls, &num_syscalls);
+
+        for (size_t i = 0; i < num_syscalls; i++) {
+            com_profile_func_data_t data;
+            com_sys_profiler_get_syscall(&data, i);
+            devprofile_fill_hist(&r->data[i], aux_syscalls[i].name, &data);
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_RESET == op) {
+        com_sys_profiler_reset();
+        com_sys_lockprof_reset();
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_NUM_LOCKS == op) {
+        size_t              num_locks = 0;
+        com_lockprof_site_t site;
+
+        for (size_t i = 0; i < com_sys_lockprof_get_num_slots(); i++) {
+            if (com_sys_lockprof_get_slot(&site, i)) {
+                num_locks++;
+            }
+        }
+
+        *(size_t *)buf = num_locks;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_LOCKS == op) {
+        struct devprofile_lock_res *r = buf;
+        com_lockprof_site_t         site;
+        r->num_locks = 0;
+
+        // New sites may have appeared since DEVPROFILE_IOCTL_GET_NUM_LOCKS
+        for (size_t i = 0; i < com_sys_lockprof_get_num_slots() &&
+                           r->num_locks < r->max_locks;
+             i++) {
+            if (!com_sys_lockprof_get_slot(&site, i)) {
+                continue;
+            }
+
+            struct devprofile_lock_data *d = &r->data[r->num_locks++];
+            d->site                        = (uint64_t)site.ip;
+            d->type                        = site.type;
+            d->num_acquired                = site.num_acquired;
+            d->num_contended               = site.num_contended;
+            d->wait_ns                     = site.wait_ns;
+            d->max_wait_ns                 = site.max_wait_ns;
+            d->max_hold_ns                 = site.max_hold_ns;
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_NUM_CACHES == op) {
+        size_t                 num_caches = 0;
+        com_slab_cache_stats_t stats;
+
+        for (size_t i = 0; i < com_mm_slab_get_num_slots(); i++) {
+            if (com_mm_slab_get_slot(&stats, i)) {
+                num_caches++;
+            }
+        }
+
+        *(size_t *)buf = num_caches;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_CACHES == op) {
+        struct devprofile_cache_res *r = buf;
+        com_slab_cache_stats_t       stats;
+        r->num_caches = 0;
+
+        for (size_t i = 0; i < com_mm_slab_get_num_slots() &&
+                           r->num_caches < r->max_caches;
+             i++) {
+            if (!com_mm_slab_get_slot(&stats, i)) {
+                continue;
+            }
+
+            struct devprofile_cache_data *d = &r->data[r->num_caches++];
+            kstrncpy(d->name, stats.name, sizeof(d->name));
+            d->obj_size       = stats.obj_size;
+            d->num_allocs     = stats.num_allocs;
+            d->num_frees      = stats.num_frees;
+            d->num_active     = stats.num_active;
+            d->num_slabs      = stats.num_slabs;
+            d->num_ctor_calls = stats.num_ctor_calls;
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_NUM_CPUS == op) {
+        size_t num_cpus = 0;
+        while (NULL != x86_64_smp_get_cpu(num_cpus)) {
+            num_cpus++;
         }
 
+        *(size_t *)buf = num_cpus;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_SCHED == op) {
+        struct devprofile_sched_res *r = buf;
+        com_sched_stats_t            stats;
+        r->num_cpus = 0;
+
+        for (size_t i = 0; r->num_cpus < r->max_cpus &&
+                           com_sys_sched_get_stats(&stats, i);
+             i++) {
+            struct devprofile_sched_data *d = &r->data[r->num_cpus++];
+            d->cpu                          = i;
+            d->queue_len                    = stats.queue_len;
+            d->max_queue_len                = stats.max_queue_len;
+            d->queue_len_sum                = stats.queue_len_sum;
+            d->num_samples                  = stats.num_samples;
+            d->num_pulled                   = stats.num_pulled;
+            d->num_stolen                   = stats.num_stolen;
+            d->num_wakeups                  = stats.num_wakeups;
+            d->num_wake_affine              = stats.num_wake_affine;
+            d->num_wake_idle                = stats.num_wake_idle;
+            d->num_ipi_sent                 = stats.num_ipi_sent;
+            d->num_ipi_avoided              = stats.num_ipi_avoided;
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_FAULTS == op) {
+        struct devprofile_fault_res *r = buf;
+        com_vmm_fault_stats_t        stats;
+        com_mm_vmm_get_fault_stats(&stats, NULL);
+        r->num_faults        = stats.num_faults;
+        r->num_sequential    = stats.num_sequential;
+        r->num_prefaulted    = stats.num_prefaulted;
+        r->num_prefault_hits = stats.num_prefault_hits;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_GET_CALLOUTS == op) {
+        struct devprofile_callout_res *r = buf;
+        com_callout_stats_t            stats;
+        r->num_cpus = 0;
+
+        for (size_t i = 0; r->num_cpus < r->max_cpus &&
+                           com_sys_callout_get_stats(&stats, i);
+             i++) {
+            struct devprofile_callout_data *d = &r->data[r->num_cpus++];
+            d->cpu                            = i;
+            d->num_pending                    = stats.num_pending;
+            d->num_fired                      = stats.num_fired;
+            d->num_migrated                   = stats.num_migrated;
+        }
+
+        return 0;
+    } else if (DEVPROFILE_IOCTL_BENCH_PID_LOOKUP == op) {
+        struct devprofile_bench_res *r = buf;
+        uintmax_t                    rcu_ns, rwlock_ns;
+        com_sys_proc_bench_lookup(&rcu_ns, &rwlock_ns, r->pid, r->num_iters);
+        r->rcu_ns    = rcu_ns;
+        r->rwlock_ns = rwlock_ns;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_BENCH_CALLOUTS == op) {
+        struct devprofile_callout_bench_res *r = buf;
+        com_callout_bench_t                  bench;
+        com_sys_callout_bench(&bench, r->num_callouts, r->spread_ns);
+        r->arm_ns      = bench.arm_ns;
+        r->cancel_ns   = bench.cancel_ns;
+        r->fire_ns     = bench.fire_ns;
+        r->lateness_ns = bench.lateness_ns;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_BENCH_SPINLOCK == op) {
+        struct devprofile_lock_bench_res *r = buf;
+        com_lockprof_bench_t              bench;
+        com_sys_lockprof_bench_spinlock(&bench, r->num_iters);
+        r->spinlock_type = CONFIG_SPINLOCK_TYPE;
+        r->num_workers   = bench.num_workers;
+        r->num_cpus      = bench.num_cpus;
+        r->num_acquired  = bench.num_acquired;
+        r->wait_ns       = bench.wait_ns;
+        r->max_wait_ns   = bench.max_wait_ns;
+        r->elapsed_ns    = bench.elapsed_ns;
+        return 0;
+    } else if (DEVPROFILE_IOCTL_BENCH_SHOOTDOWN == op) {
+        struct devprofile_shootdown_bench_res *r = buf;
+        com_vmm_shootdown_bench_t              bench;
+        com_mm_vmm_bench_shootdown(&bench, r->num_iters);
+        r->user_ns   = bench.user_ns;
+        r->kernel_ns = bench.kernel_ns;
+        r->async_ns  = bench.async_ns;
         return 0;
     }
 
@@ -74,7 +290,7 @@ static int devprofile_ioctl(void *devdata, uintmax_t op, void *buf) {
 static com_dev_ops_t DevprofileDevops = {.ioctl = devprofile_ioctl};
 
 int com_dev_profile_init(void) {
-#if CONFIG_USE_PROFILER
+#if CONFIG_USE_PROFILER || CONFIG_LOCK_PROFILER
     KLOG("initializing /dev/fb0 fbdev")
     return com_fs_devfs_register(NULL,
                                  NULL,
@@ -0,0 +1,54 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <kernel/com/fs/file.h>
+#include <kernel/com/mm/slab.h>
+#include <lib/spinlock.h>
+#include <lib/util.h>
+
+static com_slab_cache_t *FileCache = NULL;
+
+// Files go back to the cache with their offset lock released, so it is only
+// initialized when the object is first carved out of a slab
+static void file_ctor(void *obj) {
+    com_file_t *file = obj;
+    file->off_lock   = KSPINLOCK_NEW();
+}
+
+void com_fs_file_init(void) {
+    FileCache = com_mm_slab_cache_new("file",
+                                      sizeof(com_file_t),
+                                      _Alignof(com_file_t),
+                                      file_ctor,
+                                      NULL,
+                                      0);
+    KASSERT(NULL != FileCache);
+}
+
+com_file_t *com_fs_file_new(com_vnode_t *vnode, uintmax_t flags) {
+    com_file_t *file = com_mm_slab_cache_alloc(FileCache);
+    file->off        = 0;
+    file->flags      = flags;
+    file->num_ref    = 1;
+    file->vnode      = vnode;
+    return file;
+}
+
+void com_fs_file_free(com_file_t *file) {
+    com_mm_slab_cache_free(FileCache, file);
+}
@@ -105,7 +105,7 @@ end:
     *bytes_read = read_count;
     if (NULL == pipe->read_end && NULL == pipe->write_end) {
         com_mm_slab_free(pipe, sizeof(struct pipefs_node));
-        com_mm_slab_free(node, sizeof(com_vnode_t));
+        com_fs_vfs_free_vnode(node);
     }
     return ret;
 }
@@ -168,7 +168,7 @@ end:
     *bytes_written = write_count;
     if (NULL == pipe->read_end && NULL == pipe->write_end) {
         com_mm_slab_free(pipe, sizeof(struct pipefs_node));
-        com_mm_slab_free(node, sizeof(com_vnode_t));
+        com_fs_vfs_free_vnode(node);
     }
 
     return ret;
@@ -192,7 +192,7 @@ int com_fs_pipefs_close(com_vnode_t *vnode) {
     ksync_release(&pipe->condvar);
     if (!has_notified && NULL == pipe->write_end && NULL == pipe->read_end) {
         com_mm_slab_free(pipe, sizeof(struct pipefs_node));
-        com_mm_slab_free(vnode, sizeof(com_vnode_t));
+        com_fs_vfs_free_vnode(vnode);
     }
 
     return 0;
@@ -207,7 +207,7 @@ void com_fs_pipefs_new(com_vnode_t **read, com_vnode_t **write) {
     pipe->write = 0;
     pipe->buf   = (uint8_t *)ARCH_PHYS_TO_HHDM(com_mm_pmm_alloc());
 
-    com_vnode_t *r  = com_mm_slab_alloc(sizeof(com_vnode_t));
+    com_vnode_t *r  = com_fs_vfs_new_vnode();
     r->extra        = pipe;
     r->mountpointof = NULL;
     r->ops          = &PipefsNodeOps;
@@ -215,7 +215,7 @@ void com_fs_pipefs_new(com_vnode_t **read, com_vnode_t **write) {
     r->num_ref      = 1;
     pipe->read_end  = r;
 
-    com_vnode_t *w  = com_mm_slab_alloc(sizeof(com_vnode_t));
+    com_vnode_t *w  = com_fs_vfs_new_vnode();
     w->extra        = pipe;
     w->mountpointof = NULL;
     w->ops          = &PipefsNodeOps;
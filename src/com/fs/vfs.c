@@ -33,6 +33,8 @@
         path++;                           \
     }
 
+static com_slab_cache_t *VnodeCache = NULL;
+
 // out is the oujtput vnode, and is always set (NULL on errors, valid vnode
 // otherwise) out_dir is the directory containing out, which is set only if out
 // is a symlink, otherwise it's undefined. out_subpath and out_subpathlen are
@@ -546,12 +548,42 @@ int com_fs_vfs_mmap(void             **out,
         out = &dump;
     }
 
-    return node->ops
-        ->mmap(out, node, vmm_context, hint, size, vmm_flags, mmu_flags, off);
+    int ret = node->ops->mmap(out,
+                              node,
+                              vmm_context,
+                              hint,
+                              size,
+                              vmm_flags,
+                              mmu_flags,
+                              off);
+
+    if (0 == ret) {
+        com_mm_vmm_set_backing(vmm_context, *out, size, node, off);
+    }
+
+    return ret;
 }
 
 // UTILITY FUNCTIONS
 
+void com_fs_vfs_init(void) {
+    VnodeCache = com_mm_slab_cache_new("vnode",
+                                       sizeof(com_vnode_t),
+                                       _Alignof(com_vnode_t),
+                                       NULL,
+                                       NULL,
+                                       COM_MM_SLAB_CACHE_FLAGS_ZERO);
+    KASSERT(NULL != VnodeCache);
+}
+
+com_vnode_t *com_fs_vfs_new_vnode(void) {
+    return com_mm_slab_cache_alloc(VnodeCache);
+}
+
+void com_fs_vfs_free_vnode(com_vnode_t *vnode) {
+    com_mm_slab_cache_free(VnodeCache, vnode);
+}
+
 int com_fs_vfs_alloc_vnode(com_vnode_t    **out,
                            com_vfs_t       *vfs,
                            com_vnode_type_t type,
@@ -566,7 +598,7 @@ int com_fs_vfs_alloc_vnode(com_vnode_t    **out,
         ret = ENOSYS;
         goto end;
     } else {
-        new_node = com_mm_slab_alloc(sizeof(com_vnode_t));
+        new_node = com_fs_vfs_new_vnode();
     }
 
     new_node->type    = type;
@@ -92,6 +92,8 @@ void com_init_memory(void) {
 
 void com_init_filesystem(void) {
     com_vfs_t *rootfs = NULL;
+    com_fs_vfs_init();
+    com_fs_file_init();
     com_fs_tmpfs_mount(&rootfs, NULL);
 
     init_tmpfs(rootfs);
@@ -168,8 +170,7 @@ void com_init_pid1(void) {
     }
 
     KASSERT(NULL != MainTtyDev);
-    com_file_t *stdfile       = com_mm_slab_alloc(sizeof(com_file_t));
-    stdfile->vnode            = MainTtyDev;
+    com_file_t *stdfile       = com_fs_file_new(MainTtyDev, 0);
     stdfile->num_ref          = 3;
     proc->num_running_threads = 1;
     proc->next_fd             = 3;
@@ -196,6 +197,7 @@ void com_init_pid1(void) {
     ARCH_CONTEXT_RESTORE_EXTRA(thread->xctx);
 
     com_mm_vmm_init_reaper();
+    com_sys_proc_init_reaper();
     com_mm_pmm_init_threads();
 
     KASSERT(NULL != MainTerm);
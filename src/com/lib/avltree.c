@@ -0,0 +1,202 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <lib/avltree.h>
+#include <lib/util.h>
+#include <stddef.h>
+
+// CREDIT: Adelson-Velsky and Landis
+
+static inline int node_height(kavltree_node_t *node) {
+    return (NULL == node) ? 0 : node->height;
+}
+
+static inline void node_update(kavltree_node_t *node) {
+    node->height = 1 + KMAX(node_height(node->left), node_height(node->right));
+}
+
+// Makes new take the place of old as a child of parent
+static inline void replace_child(kavltree_t      *tree,
+                                 kavltree_node_t *parent,
+                                 kavltree_node_t *old,
+                                 kavltree_node_t *new) {
+    if (NULL == parent) {
+        tree->root = new;
+    } else if (old == parent->left) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+
+    if (NULL != new) {
+        new->parent = parent;
+    }
+}
+
+static kavltree_node_t *rotate_left(kavltree_t *tree, kavltree_node_t *node) {
+    kavltree_node_t *pivot = node->right;
+    node->right            = pivot->left;
+    if (NULL != pivot->left) {
+        pivot->left->parent = node;
+    }
+
+    replace_child(tree, node->parent, node, pivot);
+    pivot->left  = node;
+    node->parent = pivot;
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+static kavltree_node_t *rotate_right(kavltree_t *tree, kavltree_node_t *node) {
+    kavltree_node_t *pivot = node->left;
+    node->left             = pivot->right;
+    if (NULL != pivot->right) {
+        pivot->right->parent = node;
+    }
+
+    replace_child(tree, node->parent, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+// Restores the AVL property on the path from node to the root
+static void rebalance(kavltree_t *tree, kavltree_node_t *node) {
+    while (NULL != node) {
+        node_update(node);
+        int balance = node_height(node->left) - node_height(node->right);
+
+        if (balance > 1) {
+            if (node_height(node->left->left) <
+                node_height(node->left->right)) {
+                rotate_left(tree, node->left);
+            }
+            node = rotate_right(tree, node);
+        } else if (balance < -1) {
+            if (node_height(node->right->right) <
+                node_height(node->right->left)) {
+                rotate_right(tree, node->right);
+            }
+            node = rotate_left(tree, node);
+        }
+
+        node = node->parent;
+    }
+}
+
+static inline kavltree_node_t *leftmost(kavltree_node_t *node) {
+    while (NULL != node && NULL != node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+static inline kavltree_node_t *rightmost(kavltree_node_t *node) {
+    while (NULL != node && NULL != node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
+void kavltree_insert(kavltree_t *tree, kavltree_node_t *node) {
+    kavltree_node_t  *parent = NULL;
+    kavltree_node_t **link   = &tree->root;
+
+    while (NULL != *link) {
+        parent = *link;
+        if (tree->cmp(node, parent) < 0) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    node->parent = parent;
+    node->left   = NULL;
+    node->right  = NULL;
+    node->height = 1;
+    *link        = node;
+    rebalance(tree, parent);
+}
+
+void kavltree_remove(kavltree_t *tree, kavltree_node_t *node) {
+    kavltree_node_t *rebalance_from;
+
+    if (NULL != node->left && NULL != node->right) {
+        // Replace the node with its in-order successor, which has no left child
+        kavltree_node_t *succ = leftmost(node->right);
+
+        if (node == succ->parent) {
+            rebalance_from = succ;
+        } else {
+            rebalance_from = succ->parent;
+            replace_child(tree, succ->parent, succ, succ->right);
+            succ->right         = node->right;
+            succ->right->parent = succ;
+        }
+
+        replace_child(tree, node->parent, node, succ);
+        succ->left         = node->left;
+        succ->left->parent = succ;
+    } else {
+        kavltree_node_t *child = (NULL != node->left) ? node->left
+                                                      : node->right;
+        rebalance_from         = node->parent;
+        replace_child(tree, node->parent, node, child);
+    }
+
+    node->parent = NULL;
+    node->left   = NULL;
+    node->right  = NULL;
+    rebalance(tree, rebalance_from);
+}
+
+kavltree_node_t *kavltree_first(kavltree_t *tree) {
+    return leftmost(tree->root);
+}
+
+kavltree_node_t *kavltree_last(kavltree_t *tree) {
+    return rightmost(tree->root);
+}
+
+kavltree_node_t *kavltree_next(kavltree_node_t *node) {
+    if (NULL != node->right) {
+        return leftmost(node->right);
+    }
+
+    while (NULL != node->parent && node == node->parent->right) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
+
+kavltree_node_t *kavltree_prev(kavltree_node_t *node) {
+    if (NULL != node->left) {
+        return rightmost(node->left);
+    }
+
+    while (NULL != node->parent && node == node->parent->left) {
+        node = node->parent;
+    }
+
+    return node->parent;
+}
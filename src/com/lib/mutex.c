@@ -18,84 +18,164 @@
 
 #include <arch/cpu.h>
 #include <errno.h>
+#include <kernel/com/sys/lockprof.h>
 #include <kernel/com/sys/profiler.h>
 #include <kernel/com/sys/sched.h>
 #include <lib/mutex.h>
 #include <lib/util.h>
 
-static bool try_acquire_internal(kmutex_t *mutex, size_t retries) {
-    for (size_t i = 0; i < retries; i++) {
-        kspinlock_acquire(&mutex->lock);
-        if (!mutex->locked) {
-            return true;
-        }
-        // TODO: check if owner is on this CPU's runqueue. If it is, there's no
-        // point in spinning because it will not be relased until this CPU has a
-        // chance to run that thread
-        if (mutex->owner->last_cpu == ARCH_CPU_GET()) {
-            kspinlock_release(&mutex->lock);
-            return false;
-        }
-        kspinlock_release(&mutex->lock);
-        ARCH_CPU_PAUSE();
+// How many times to check for a new owner before looking at the current one
+#define OWNER_SPINS 64
+
+// Spinning only pays off if the owner is running on another CPU and may release
+// the mutex soon. This is called with the mutex spinlock held, so the owner
+// cannot release the mutex (and go away) in the meantime
+static bool owner_on_cpu(kmutex_t *mutex) {
+    com_thread_t *owner = mutex->owner;
+    if (NULL == owner) {
+        return false;
     }
 
-    return false;
+    arch_cpu_t *owner_cpu = __atomic_load_n(&owner->cpu, __ATOMIC_RELAXED);
+    return NULL != owner_cpu && ARCH_CPU_GET() != owner_cpu;
 }
 
-bool kmutex_try_acquire(kmutex_t *mutex) {
-    if (!try_acquire_internal(mutex, 1)) {
-        return false;
+// Called and returns with the mutex spinlock held. Returns true if the mutex
+// was released while spinning, false if it is not worth spinning anymore
+static bool spin_on_owner(kmutex_t *mutex) {
+    while (mutex->locked) {
+        // Also stop if this CPU has something better to do
+        if (!owner_on_cpu(mutex) || com_sys_sched_resched_pending()) {
+            return false;
+        }
+
+        // Wait for the owner to change without bouncing the spinlock around,
+        // this also lets the owner take it to release the mutex
+        com_thread_t *owner = mutex->owner;
+        kspinlock_release(&mutex->lock);
+        for (size_t i = 0;
+             i < OWNER_SPINS &&
+             owner == __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+             i++) {
+            ARCH_CPU_PAUSE();
+        }
+        kspinlock_acquire(&mutex->lock);
     }
 
-    mutex->locked = true;
-    mutex->owner  = ARCH_CPU_GET_THREAD();
-    kspinlock_release(&mutex->lock);
     return true;
 }
 
-void kmutex_acquire(kmutex_t *mutex) {
-    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
-        E_COM_PROFILE_FUNC_KMUTEX_ACQUIRE);
-    kmutex_acquire_timeout(mutex, 0);
-    com_sys_profiler_end_function(&profiler_data);
+// Called with the mutex spinlock held, right after the mutex has been taken
+static inline void prof_acquired(kmutex_t *mutex,
+                                 void     *ip,
+                                 bool      contended,
+                                 uintmax_t wait_ns) {
+#if CONFIG_LOCK_PROFILER
+    mutex->prof_site  = com_sys_lockprof_get_site(ip, E_COM_LOCKPROF_MUTEX);
+    mutex->prof_start = ARCH_CPU_GET_TIME();
+    com_sys_lockprof_acquired(mutex->prof_site, contended, wait_ns);
+#else
+    (void)mutex;
+    (void)ip;
+    (void)contended;
+    (void)wait_ns;
+#endif
 }
 
-bool kmutex_acquire_timeout(kmutex_t *mutex, uintmax_t timeout) {
+static bool mutex_acquire(kmutex_t *mutex, uintmax_t timeout, void *ip) {
     com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
     KASSERT(NULL == curr_thread || 0 == curr_thread->lock_depth);
 
-    if (try_acquire_internal(mutex, CONFIG_MUTEX_RETRIES)) {
+    kspinlock_acquire(&mutex->lock);
+    if (KLIKELY(!mutex->locked)) {
+        prof_acquired(mutex, ip, false, 0);
         goto take;
     }
 
-    kspinlock_acquire(&mutex->lock);
-    while (mutex->locked) {
+    mutex->stats.num_contended++;
+    uintmax_t wait_start = ARCH_CPU_GET_TIME();
+
+    if (spin_on_owner(mutex)) {
+        mutex->stats.num_spun++;
+        goto contended;
+    }
+
+    // If the mutex is handed off to this thread by kmutex_release, it is
+    // already locked on our behalf when we wake up
+    while (mutex->locked && curr_thread != mutex->owner) {
+        mutex->stats.num_slept++;
         if (ETIMEDOUT == com_sys_sched_wait_spinlock_timeout(&mutex->waiters,
                                                              &mutex->lock,
-                                                             timeout)) {
+                                                             timeout) &&
+            mutex->locked && curr_thread != mutex->owner) {
             KASSERT(0 != timeout);
+            mutex->stats.num_timeouts++;
             kspinlock_release(&mutex->lock);
             return false;
         }
     }
 
+contended:;
+    uintmax_t wait_ns = ARCH_CPU_GET_TIME() - wait_start;
+    mutex->stats.wait_ns += wait_ns;
+    prof_acquired(mutex, ip, true, wait_ns);
 take:
     mutex->locked = true;
     mutex->owner  = curr_thread;
+    mutex->stats.num_acquired++;
     kspinlock_release(&mutex->lock);
     return true;
 }
 
+bool kmutex_try_acquire(kmutex_t *mutex) {
+    kspinlock_acquire(&mutex->lock);
+    if (mutex->locked) {
+        kspinlock_release(&mutex->lock);
+        return false;
+    }
+
+    mutex->locked = true;
+    mutex->owner  = ARCH_CPU_GET_THREAD();
+    mutex->stats.num_acquired++;
+    prof_acquired(mutex, __builtin_return_address(0), false, 0);
+    kspinlock_release(&mutex->lock);
+    return true;
+}
+
+void kmutex_acquire(kmutex_t *mutex) {
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_KMUTEX_ACQUIRE);
+    mutex_acquire(mutex, 0, __builtin_return_address(0));
+    com_sys_profiler_end_function(&profiler_data);
+}
+
+bool kmutex_acquire_timeout(kmutex_t *mutex, uintmax_t timeout) {
+    return mutex_acquire(mutex, timeout, __builtin_return_address(0));
+}
+
 void kmutex_release(kmutex_t *mutex) {
     // com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
     // KASSERT(NULL == curr_thread || 0 == curr_thread->lock_depth);
 
     kspinlock_acquire(&mutex->lock);
     KASSERT(mutex->locked);
-    mutex->locked = false;
-    mutex->owner  = NULL;
-    com_sys_sched_notify(&mutex->waiters);
+#if CONFIG_LOCK_PROFILER
+    com_sys_lockprof_released(mutex->prof_site,
+                              ARCH_CPU_GET_TIME() - mutex->prof_start);
+#endif
+
+    // Pass the mutex directly to the first waiter instead of letting all
+    // sleepers and spinners race for it. The waiter cannot run before we drop
+    // the spinlock, so it is safe to set the owner after waking it up
+    com_thread_t *next = com_sys_sched_notify(&mutex->waiters);
+    if (NULL != next) {
+        mutex->owner = next;
+        mutex->stats.num_handoffs++;
+    } else {
+        mutex->locked = false;
+        mutex->owner  = NULL;
+    }
+
     kspinlock_release(&mutex->lock);
     // com_sys_sched_yield();
 }
@@ -56,13 +56,14 @@ int kradixtree_get_nolock(void **out, kradixtree_t *rxtree, uintmax_t index) {
     size_t             last_layer = rxtree->num_layers - 1;
 
     for (size_t i = 0; i < last_layer; i++) {
-        root = root->branches[indices[i]];
+        root = __atomic_load_n(&root->branches[indices[i]], __ATOMIC_ACQUIRE);
         if (NULL == root) {
             return ENOENT;
         }
     }
 
-    void *data = root->leaves[indices[last_layer]];
+    void *data = __atomic_load_n(&root->leaves[indices[last_layer]],
+                                 __ATOMIC_ACQUIRE);
     if (NULL == data) {
         return ENOENT;
     }
@@ -88,15 +89,19 @@ int kradixtree_put_nolock(kradixtree_t *rxtree, uintmax_t index, void *data) {
         kradixtree_back_t *tmp = root->branches[indices[i]];
 
         if (NULL == tmp) {
-            void *page = (void *)ARCH_PHYS_TO_HHDM(com_mm_pmm_alloc_zero());
-            tmp = root->branches[indices[i]] = page;
+            tmp = (void *)ARCH_PHYS_TO_HHDM(com_mm_pmm_alloc_zero());
+            __atomic_store_n(&root->branches[indices[i]],
+                             tmp,
+                             __ATOMIC_RELEASE);
         }
 
         root = tmp;
     }
 
     KASSERT(NULL == root->leaves[indices[last_layer]]);
-    root->leaves[indices[last_layer]] = data;
+    __atomic_store_n(&root->leaves[indices[last_layer]],
+                     data,
+                     __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -121,6 +126,8 @@ int kradixtree_remove_nolock(kradixtree_t *rxtree, uintmax_t index) {
     }
 
     KASSERT(NULL != root->leaves[indices[last_layer]]);
-    root->leaves[indices[last_layer]] = NULL;
+    __atomic_store_n(&root->leaves[indices[last_layer]],
+                     NULL,
+                     __ATOMIC_RELAXED);
     return 0;
 }
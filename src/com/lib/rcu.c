@@ -0,0 +1,177 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <arch/info.h>
+#include <kernel/com/sys/callout.h>
+#include <kernel/com/sys/sched.h>
+#include <kernel/platform/x86-64/smp.h>
+#include <lib/rcu.h>
+#include <lib/spinlock.h>
+#include <lib/util.h>
+
+// How often pending callbacks are checked for the end of their grace period
+#define GP_POLL_NS ARCH_TIMER_NS
+
+typedef struct rcu_sync {
+    krcu_head_t    head;
+    bool           done;
+    kspinlock_t    lock;
+    com_waitlist_t waiters;
+} rcu_sync_t;
+
+// Grace periods are numbered: GpCurrent is the last one that was started and
+// GpCompleted the last one that ended. CPUs copy GpCurrent into rcu_gp_seen
+// when they go through a quiescent state
+static kspinlock_t   RcuLock       = KSPINLOCK_NEW();
+static uintmax_t     GpCurrent     = 0;
+static uintmax_t     GpCompleted   = 0;
+static krcu_head_t  *CallbacksHead = NULL; // sorted by grace period
+static krcu_head_t **CallbacksTail = &CallbacksHead;
+static bool          Polling       = false;
+
+// Must be called with RcuLock held
+static void gp_start_nolock(void) {
+    if (GpCompleted == GpCurrent) {
+        __atomic_store_n(&GpCurrent, GpCurrent + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Must be called with RcuLock held
+static bool gp_ended_nolock(uintmax_t gp) {
+    arch_cpu_t *cpu;
+
+    for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        if (__atomic_load_n(&cpu->rcu_gp_seen, __ATOMIC_ACQUIRE) >= gp) {
+            continue;
+        }
+
+        // Idle CPUs run no readers, but they may not enter the scheduler for a
+        // long time in tickless mode. The idle thread only has lock_depth = 0
+        // while it is halted, not while it is being switched to or handles an
+        // interrupt (e.g., to run callouts)
+        com_thread_t *idle = cpu->idle_thread;
+        if (idle == __atomic_load_n(&cpu->thread, __ATOMIC_ACQUIRE) &&
+            0 == __atomic_load_n(&idle->lock_depth, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+static void rcu_poll(com_callout_t *callout) {
+    (void)callout;
+
+    // Callouts run in the timer interrupt, so this CPU is not in a read-side
+    // critical section
+    krcu_quiescent();
+
+    kspinlock_acquire(&RcuLock);
+    if (GpCompleted != GpCurrent && gp_ended_nolock(GpCurrent)) {
+        GpCompleted = GpCurrent;
+    }
+
+    krcu_head_t  *ready      = CallbacksHead;
+    krcu_head_t **ready_tail = &ready;
+    while (NULL != *ready_tail && (*ready_tail)->gp <= GpCompleted) {
+        ready_tail = &(*ready_tail)->next;
+    }
+    CallbacksHead = *ready_tail;
+    *ready_tail   = NULL;
+
+    bool again = NULL != CallbacksHead;
+    if (again) {
+        gp_start_nolock();
+    } else {
+        CallbacksTail = &CallbacksHead;
+        Polling       = false;
+    }
+    kspinlock_release(&RcuLock);
+
+    while (NULL != ready) {
+        krcu_head_t *head = ready;
+        ready             = head->next;
+        head->callback(head);
+    }
+
+    if (again) {
+        com_sys_callout_add(rcu_poll, NULL, GP_POLL_NS);
+    }
+}
+
+static void sync_done(krcu_head_t *head) {
+    rcu_sync_t *sync = KRCU_ENTRY(head, rcu_sync_t, head);
+    kspinlock_acquire(&sync->lock);
+    sync->done = true;
+    com_sys_sched_notify(&sync->waiters);
+    kspinlock_release(&sync->lock);
+}
+
+// Readers must not sleep, and must not be preempted since the scheduler counts
+// as a quiescent state
+void krcu_read_lock(void) {
+    kspinlock_fake_acquire();
+}
+
+void krcu_read_unlock(void) {
+    kspinlock_fake_release();
+}
+
+void krcu_call(krcu_head_t *head, krcu_callback_t callback) {
+    head->callback = callback;
+    head->next     = NULL;
+
+    kspinlock_acquire(&RcuLock);
+    // Some CPUs may have gone through the current grace period before the
+    // object was unpublished, so only the next one covers all readers
+    head->gp       = GpCurrent + 1;
+    *CallbacksTail = head;
+    CallbacksTail  = &head->next;
+    gp_start_nolock();
+    bool start_polling = !Polling;
+    Polling            = true;
+    kspinlock_release(&RcuLock);
+
+    if (start_polling) {
+        com_sys_callout_add(rcu_poll, NULL, GP_POLL_NS);
+    }
+}
+
+void krcu_synchronize(void) {
+    rcu_sync_t sync = {.done = false, .lock = KSPINLOCK_NEW()};
+    COM_SYS_THREAD_WAITLIST_INIT(&sync.waiters);
+    krcu_call(&sync.head, sync_done);
+
+    kspinlock_acquire(&sync.lock);
+    while (!sync.done) {
+        com_sys_sched_wait(&sync.waiters, &sync.lock);
+    }
+    kspinlock_release(&sync.lock);
+}
+
+void krcu_quiescent(void) {
+    arch_cpu_t *cpu = ARCH_CPU_GET();
+    uintmax_t   gp  = __atomic_load_n(&GpCurrent, __ATOMIC_ACQUIRE);
+
+    if (gp != cpu->rcu_gp_seen) {
+        __atomic_store_n(&cpu->rcu_gp_seen, gp, __ATOMIC_RELEASE);
+    }
+}
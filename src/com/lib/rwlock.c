@@ -16,17 +16,57 @@
 | along with this program.  If not, see <https://www.gnu.org/licenses/>. |
 *************************************************************************/
 
+#include <arch/cpu.h>
+#include <kernel/com/sys/lockprof.h>
 #include <kernel/com/sys/sched.h>
 #include <lib/rwlock.h>
 
+// Called with the rwlock spinlock held, right after the rwlock has been taken.
+// Readers share the lock, so only the hold time of writers is tracked
+static inline void prof_acquired(krwlock_t          *rwlock,
+                                 void               *ip,
+                                 com_lockprof_type_t type,
+                                 bool                contended,
+                                 uintmax_t           wait_start) {
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_site_t *site = com_sys_lockprof_get_site(ip, type);
+    uintmax_t            now  = ARCH_CPU_GET_TIME();
+    com_sys_lockprof_acquired(site,
+                              contended,
+                              contended ? now - wait_start : 0);
+
+    if (E_COM_LOCKPROF_RWLOCK_WRITE == type) {
+        rwlock->prof_site  = site;
+        rwlock->prof_start = now;
+    }
+#else
+    (void)rwlock;
+    (void)ip;
+    (void)type;
+    (void)contended;
+    (void)wait_start;
+#endif
+}
+
 void krwlock_acquire_read(krwlock_t *rwlock) {
+    bool      contended  = false;
+    uintmax_t wait_start = 0;
     kspinlock_acquire(&rwlock->lock);
 
     while (rwlock->writer_active || rwlock->waiting_writers > 0) {
+        if (!contended) {
+            contended  = true;
+            wait_start = ARCH_CPU_GET_TIME();
+        }
         com_sys_sched_wait(&rwlock->readers_waitlist, &rwlock->lock);
     }
 
     rwlock->active_readers++;
+    prof_acquired(rwlock,
+                  __builtin_return_address(0),
+                  E_COM_LOCKPROF_RWLOCK_READ,
+                  contended,
+                  wait_start);
     kspinlock_release(&rwlock->lock);
 }
 
@@ -42,21 +82,36 @@ void krwlock_release_read(krwlock_t *rwlock) {
 }
 
 void krwlock_acquire_write(krwlock_t *rwlock) {
+    bool      contended  = false;
+    uintmax_t wait_start = 0;
     kspinlock_acquire(&rwlock->lock);
     rwlock->waiting_writers++;
 
     while (rwlock->writer_active || rwlock->active_readers > 0) {
+        if (!contended) {
+            contended  = true;
+            wait_start = ARCH_CPU_GET_TIME();
+        }
         com_sys_sched_wait(&rwlock->writers_waitlist, &rwlock->lock);
     }
 
     KASSERT(!rwlock->writer_active);
     rwlock->waiting_writers--;
     rwlock->writer_active = true;
+    prof_acquired(rwlock,
+                  __builtin_return_address(0),
+                  E_COM_LOCKPROF_RWLOCK_WRITE,
+                  contended,
+                  wait_start);
     kspinlock_release(&rwlock->lock);
 }
 
 void krwlock_release_write(krwlock_t *rwlock) {
     kspinlock_acquire(&rwlock->lock);
+#if CONFIG_LOCK_PROFILER
+    com_sys_lockprof_released(rwlock->prof_site,
+                              ARCH_CPU_GET_TIME() - rwlock->prof_start);
+#endif
     rwlock->writer_active = false;
 
     if (0 == rwlock->waiting_writers) {
@@ -0,0 +1,47 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <lib/seqlock.h>
+
+uintmax_t kseqcount_read_begin(kseqcount_t *seqcount) {
+    uintmax_t seq = __atomic_load_n(&seqcount->seq, __ATOMIC_ACQUIRE);
+
+    while (0 != (seq & 1)) {
+        ARCH_CPU_PAUSE();
+        seq = __atomic_load_n(&seqcount->seq, __ATOMIC_ACQUIRE);
+    }
+
+    return seq;
+}
+
+bool kseqcount_read_retry(kseqcount_t *seqcount, uintmax_t seq) {
+    // Reads of the protected data must not move past the check
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return seq != __atomic_load_n(&seqcount->seq, __ATOMIC_RELAXED);
+}
+
+void kseqcount_write_begin(kseqcount_t *seqcount) {
+    __atomic_store_n(&seqcount->seq, seqcount->seq + 1, __ATOMIC_RELAXED);
+    // Writes to the protected data must not move before the odd sequence
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void kseqcount_write_end(kseqcount_t *seqcount) {
+    __atomic_store_n(&seqcount->seq, seqcount->seq + 1, __ATOMIC_RELEASE);
+}
@@ -18,11 +18,13 @@
 
 #include <arch/cpu.h>
 #include <kernel/com/io/log.h>
+#include <kernel/com/sys/lockprof.h>
 #include <kernel/com/sys/panic.h>
 #include <kernel/com/sys/proc.h>
 #include <kernel/com/sys/profiler.h>
 #include <kernel/com/sys/thread.h>
 #include <lib/spinlock.h>
+#include <lib/util.h>
 
 #define INCREMENT_LOCK_DEPTH(thr) \
     if (NULL != thr)              \
@@ -51,6 +53,189 @@
 
 #endif
 
+#if CONFIG_SPINLOCK_TYPE == CONST_SPINLOCK_TICKET
+
+static inline bool lock_try(kspinlock_word_t *word) {
+    kspinlock_word_t old = {.raw = __atomic_load_n(&word->raw,
+                                                   __ATOMIC_RELAXED)};
+    if (old.ticket.owner != old.ticket.next) {
+        return false;
+    }
+
+    // only take a ticket if it would be served right away
+    kspinlock_word_t new = old;
+    new.ticket.next++;
+    return __atomic_compare_exchange_n(&word->raw,
+                                       &old.raw,
+                                       new.raw,
+                                       false,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+static inline bool lock_is_held(kspinlock_word_t *word) {
+    kspinlock_word_t curr = {.raw = __atomic_load_n(&word->raw,
+                                                    __ATOMIC_RELAXED)};
+    return KSPINLOCK_WORD_IS_HELD(curr);
+}
+
+static inline void lock_wait(kspinlock_word_t *word) {
+    // next is the upper half of the word, so this can never carry into owner
+    kspinlock_word_t old = {
+        .raw = __atomic_fetch_add(&word->raw, 1U << 16, __ATOMIC_ACQUIRE)};
+
+    while (old.ticket.next !=
+           __atomic_load_n(&word->ticket.owner, __ATOMIC_ACQUIRE)) {
+        ARCH_CPU_PAUSE();
+    }
+}
+
+static inline void lock_unlock(kspinlock_word_t *word) {
+    // only the holder ever writes owner, so no RMW is needed
+    uint16_t owner = __atomic_load_n(&word->ticket.owner, __ATOMIC_RELAXED);
+    __atomic_store_n(&word->ticket.owner, owner + 1, __ATOMIC_RELEASE);
+}
+
+#elif CONFIG_SPINLOCK_TYPE == CONST_SPINLOCK_MCS
+
+#define MCS_LOCKED     1U
+#define MCS_LOCKED_MSK 0xFFU
+#define MCS_TAIL_MSK   (~MCS_LOCKED_MSK)
+#define MCS_TAIL_SHIFT 8
+#define MCS_MAX_CPUS   256
+
+// A CPU waits for at most one lock at a time since interrupts are disabled
+// while spinning, so a single queue node per CPU is enough. Nodes are only used
+// while waiting: the holder does not need one, so locks may be released in any
+// order
+typedef struct mcs_node {
+    struct mcs_node *next;
+    bool             wait;
+} KCACHE_FRIENDLY mcs_node_t;
+
+static mcs_node_t McsNodes[MCS_MAX_CPUS];
+
+static inline bool lock_try(kspinlock_word_t *word) {
+    uint32_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    if (0 != (old & MCS_LOCKED_MSK)) {
+        return false;
+    }
+
+    // this may overtake the head of the queue, which simply keeps waiting
+    return __atomic_compare_exchange_n(word,
+                                       &old,
+                                       old | MCS_LOCKED,
+                                       false,
+                                       __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+}
+
+static inline bool lock_is_held(kspinlock_word_t *word) {
+    return KSPINLOCK_WORD_IS_HELD(__atomic_load_n(word, __ATOMIC_RELAXED));
+}
+
+static inline void lock_wait(kspinlock_word_t *word) {
+    uint32_t old = KSPINLOCK_WORD_FREE;
+    if (__atomic_compare_exchange_n(word,
+                                    &old,
+                                    MCS_LOCKED,
+                                    false,
+                                    __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    uintmax_t cpu_id = ARCH_CPU_GET_ID();
+    KASSERT(cpu_id < MCS_MAX_CPUS);
+    mcs_node_t *node = &McsNodes[cpu_id];
+    uint32_t    tail = (uint32_t)(cpu_id + 1) << MCS_TAIL_SHIFT;
+    node->next       = NULL;
+    node->wait       = true;
+
+    // become the new tail, leaving the locked byte as it is
+    old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(word,
+                                        &old,
+                                        (old & MCS_LOCKED_MSK) | tail,
+                                        false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+        ARCH_CPU_PAUSE();
+    }
+
+    // queue behind the previous tail and spin on our own node until it makes
+    // us the head of the queue
+    if (0 != (old & MCS_TAIL_MSK)) {
+        mcs_node_t *prev = &McsNodes[(old >> MCS_TAIL_SHIFT) - 1];
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&node->wait, __ATOMIC_ACQUIRE)) {
+            ARCH_CPU_PAUSE();
+        }
+    }
+
+    // as the head, wait for the holder to leave and take the lock, also
+    // emptying the queue if nobody came after us
+    while (true) {
+        old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        if (0 != (old & MCS_LOCKED_MSK)) {
+            ARCH_CPU_PAUSE();
+            continue;
+        }
+
+        uint32_t new = (tail == (old & MCS_TAIL_MSK)) ? MCS_LOCKED
+                                                      : (old | MCS_LOCKED);
+        if (__atomic_compare_exchange_n(word,
+                                        &old,
+                                        new,
+                                        false,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    // somebody queued behind us: they may not have linked their node yet
+    if (tail != (old & MCS_TAIL_MSK)) {
+        mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        while (NULL == next) {
+            ARCH_CPU_PAUSE();
+            next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        }
+        __atomic_store_n(&next->wait, false, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void lock_unlock(kspinlock_word_t *word) {
+    __atomic_fetch_and(word, MCS_TAIL_MSK, __ATOMIC_RELEASE);
+}
+
+#else
+
+static inline bool lock_try(kspinlock_word_t *word) {
+    return KSPINLOCK_FREE_VALUE ==
+           __atomic_exchange_n(word, KSPINLOCK_HELD_VALUE, __ATOMIC_ACQUIRE);
+}
+
+static inline bool lock_is_held(kspinlock_word_t *word) {
+    return KSPINLOCK_WORD_IS_HELD(__atomic_load_n(word, __ATOMIC_RELAXED));
+}
+
+static inline void lock_wait(kspinlock_word_t *word) {
+    // this is before the spinning since hopefully the lock is uncontended
+    while (!lock_try(word)) {
+        // spin with no ordering constraints
+        while (lock_is_held(word)) {
+            ARCH_CPU_PAUSE();
+        }
+    }
+}
+
+static inline void lock_unlock(kspinlock_word_t *word) {
+    __atomic_store_n(word, KSPINLOCK_FREE_VALUE, __ATOMIC_RELEASE);
+}
+
+#endif
+
 static inline void decrement_lock_depth_tested(void) {
     com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
 
@@ -76,20 +261,24 @@ void kspinlock_acquire(kspinlock_t *lock) {
     ARCH_CPU_DISABLE_INTERRUPTS();
     INCREMENT_CURR_LOCK_DEPTH();
 
-    while (true) {
-        // this is before the spinning since hopefully the lock is uncontended
-        if (KSPINLOCK_FREE_VALUE == __atomic_exchange_n(&LOCK_VALUE(lock),
-                                                        KSPINLOCK_HELD_VALUE,
-                                                        __ATOMIC_ACQUIRE)) {
-            break;
-        }
-        // spin with no ordering constraints
-        while (KSPINLOCK_HELD_VALUE ==
-               __atomic_load_n(&LOCK_VALUE(lock), __ATOMIC_RELAXED)) {
-            ARCH_CPU_PAUSE();
-        }
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_site_t *site = com_sys_lockprof_get_site(
+        __builtin_return_address(0), E_COM_LOCKPROF_SPINLOCK);
+    bool      contended = !lock_try(&LOCK_VALUE(lock));
+    uintmax_t wait_ns   = 0;
+
+    if (contended) {
+        uintmax_t wait_start = ARCH_CPU_GET_TIME();
+        lock_wait(&LOCK_VALUE(lock));
+        wait_ns = ARCH_CPU_GET_TIME() - wait_start;
     }
 
+    com_sys_lockprof_acquired(site, contended, wait_ns);
+    com_sys_lockprof_push_spinlock(lock, site);
+#else
+    lock_wait(&LOCK_VALUE(lock));
+#endif
+
 #if CONFIG_SPINLOCK_DEBUG
     lock->holder_thread   = ARCH_CPU_GET_THREAD();
     lock->last_acquire_ip = (void *)__builtin_return_address(0);
@@ -102,19 +291,14 @@ bool kspinlock_acquire_timeout(kspinlock_t *lock, uintmax_t timeout_ns) {
     ARCH_CPU_DISABLE_INTERRUPTS();
     INCREMENT_CURR_LOCK_DEPTH();
 
-    uintmax_t start_ns = ARCH_CPU_GET_TIME();
-    uintmax_t end_ns   = start_ns + timeout_ns;
+    uintmax_t start_ns  = ARCH_CPU_GET_TIME();
+    uintmax_t end_ns    = start_ns + timeout_ns;
+    bool      contended = false;
 
-    while (true) {
-        // this is before the spinning since hopefully the lock is uncontended
-        if (KSPINLOCK_FREE_VALUE == __atomic_exchange_n(&LOCK_VALUE(lock),
-                                                        KSPINLOCK_HELD_VALUE,
-                                                        __ATOMIC_ACQUIRE)) {
-            break;
-        }
-        // spin with no ordering constraints
-        while (KSPINLOCK_HELD_VALUE ==
-               __atomic_load_n(&LOCK_VALUE(lock), __ATOMIC_RELAXED)) {
+    // never queue here, as a waiter that gave up could not leave the queue
+    while (!lock_try(&LOCK_VALUE(lock))) {
+        contended = true;
+        while (lock_is_held(&LOCK_VALUE(lock))) {
             if (end_ns <= ARCH_CPU_GET_TIME()) {
                 goto fail;
             }
@@ -122,6 +306,17 @@ bool kspinlock_acquire_timeout(kspinlock_t *lock, uintmax_t timeout_ns) {
         }
     }
 
+#if CONFIG_LOCK_PROFILER
+    com_lockprof_site_t *site = com_sys_lockprof_get_site(
+        __builtin_return_address(0), E_COM_LOCKPROF_SPINLOCK);
+    com_sys_lockprof_acquired(site,
+                              contended,
+                              contended ? ARCH_CPU_GET_TIME() - start_ns : 0);
+    com_sys_lockprof_push_spinlock(lock, site);
+#else
+    (void)contended;
+#endif
+
 #if CONFIG_SPINLOCK_DEBUG
     lock->holder_thread   = ARCH_CPU_GET_THREAD();
     lock->last_acquire_ip = (void *)__builtin_return_address(0);
@@ -136,23 +331,44 @@ fail:
 }
 
 void kspinlock_release(kspinlock_t *lock) {
-    if (KUNKLIKELY(KSPINLOCK_FREE_VALUE == LOCK_VALUE(lock))) {
+    if (KUNKLIKELY(!KSPINLOCK_IS_HELD(lock))) {
         LOCK_ERROR("trying to unlock unlocked lock %p", lock);
     }
 
+#if CONFIG_SPINLOCK_TYPE == CONST_SPINLOCK_TAS
     if (KUNKLIKELY(KSPINLOCK_HELD_VALUE != LOCK_VALUE(lock))) {
         LOCK_ERROR("lock at %p has impossible value %d", lock, lock->lock);
     }
+#endif
+
+#if CONFIG_LOCK_PROFILER
+    com_sys_lockprof_pop_spinlock(lock);
+#endif
 
 #if CONFIG_SPINLOCK_DEBUG
     lock->last_release_ip = (void *)__builtin_return_address(0);
     lock->holder_thread   = NULL;
     lock->last_acquire_ip = NULL;
 #endif
-    __atomic_store_n(&LOCK_VALUE(lock), KSPINLOCK_FREE_VALUE, __ATOMIC_RELEASE);
+    lock_unlock(&LOCK_VALUE(lock));
     decrement_lock_depth_tested();
 }
 
+// Only releases the lock, without touching the lock depth or interrupts. This
+// is used by the context switch code, which adjusts the lock depth by itself
+void kspinlock_release_raw(kspinlock_t *lock) {
+#if CONFIG_LOCK_PROFILER
+    com_sys_lockprof_pop_spinlock(lock);
+#endif
+
+#if CONFIG_SPINLOCK_DEBUG
+    lock->last_release_ip = (void *)__builtin_return_address(0);
+    lock->holder_thread   = NULL;
+    lock->last_acquire_ip = NULL;
+#endif
+    lock_unlock(&LOCK_VALUE(lock));
+}
+
 void kspinlock_fake_acquire(void) {
     ARCH_CPU_DISABLE_INTERRUPTS();
     INCREMENT_CURR_LOCK_DEPTH();
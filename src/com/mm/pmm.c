@@ -16,6 +16,7 @@
 | along with this program.  If not, see <https://www.gnu.org/licenses/>. |
 *************************************************************************/
 
+#include <arch/cpu.h>
 #include <arch/info.h>
 #include <errno.h>
 #include <kernel/com/io/log.h>
@@ -26,9 +27,11 @@
 #include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/thread.h>
 #include <kernel/platform/info.h>
+#include <kernel/platform/x86-64/smp.h>
 #include <lib/hashmap.h>
 #include <lib/mem.h>
 #include <lib/searchtree.h>
+#include <lib/seqlock.h>
 #include <lib/sync.h>
 #include <lib/util.h>
 #include <stdint.h>
@@ -40,30 +43,35 @@
     kspinlock_release(&(freelist_head)->lock);
 
 #define PHYS_TO_META_INDEX(page_phys) ((uintptr_t)(page_phys) / ARCH_PAGE_SIZE)
+#define META_INDEX_TO_PHYS(index)     ((void *)((index) * ARCH_PAGE_SIZE))
 #define PAGE_META_ARRAY_LEN(memsize)  ((memsize) / ARCH_PAGE_SIZE)
 #define PAGE_META_ARRAY_SIZE(memsize) \
     (PAGE_META_ARRAY_LEN(memsize) * sizeof(struct page_meta))
 
-#define UPDATE_STATS(field, diff)            \
-    __atomic_add_fetch(&MemoryStats.field,   \
-                       diff *ARCH_PAGE_SIZE, \
-                       __ATOMIC_RELAXED)
+// Largest block managed by the buddy allocator is 2^BUDDY_MAX_ORDER pages
+// (4 GiB with 4 KiB pages)
+#define BUDDY_MAX_ORDER   20
+#define BUDDY_NUM_ORDERS  (BUDDY_MAX_ORDER + 1)
+#define BUDDY_NO_BLOCK    ((size_t)-1)
+#define ORDER_TO_PAGES(o) ((size_t)1 << (o))
+
+// Adds a delta in pages to this CPU's stats, see stats_update
+#define UPDATE_STATS(cpu_stats, diff, field)                    \
+    __atomic_store_n(&(cpu_stats)->delta.field,                 \
+                     (cpu_stats)->delta.field +                 \
+                         (diff).field * ARCH_PAGE_SIZE,         \
+                     __ATOMIC_RELAXED)
 #define READ_STATS(field) __atomic_load_n(&MemoryStats.field, __ATOMIC_RELAXED)
 
-TAILQ_HEAD(freelist_tailq, freelist_entry);
+TAILQ_HEAD(freelist_tailq, page_meta);
 
+// One list of free blocks per order. Block n of order k always starts at a
+// page index that is a multiple of 2^k, so its buddy is at index n ^ 2^k
 struct freelist_head {
-    struct freelist_tailq head;
+    struct freelist_tailq orders[BUDDY_NUM_ORDERS];
     kspinlock_t           lock;
 };
 
-// A block of one or more contigous pages that points to two more such blocks
-// (one before, one after)
-struct freelist_entry {
-    TAILQ_ENTRY(freelist_entry) tqe;
-    size_t pages;
-};
-
 enum page_state {
     // NOTE: this must be zero, since all memory is zeroed on boot, and all page
     // structs in the array are assumed to report a free state
@@ -86,7 +94,16 @@ struct page_meta {
     size_t          num_ref;
 
     enum page_type type;
-    union {};
+    union {
+        // Only meaningful in the first page of a free buddy block. All other
+        // free pages have is_head = false, which is also the value reported by
+        // zeroed (i.e., never used) entries
+        struct {
+            TAILQ_ENTRY(page_meta) tqe;
+            uint8_t order;
+            bool    is_head;
+        } buddy;
+    };
 };
 
 struct page_meta_array {
@@ -100,9 +117,26 @@ struct page_meta_array {
     struct page_meta fake_entry;
 };
 
+// Free pages cached in a per-CPU magazine or in the dirty list are linked
+// through their first word. The link is cleared when the page leaves the stack
+// so that zeroed pages stay zeroed
+struct magazine_page {
+    struct magazine_page *next;
+};
+
+// Pages that were freed but not yet zeroed. The zeroing thread waits on this
+// list, clears the pages in the background and returns them to the buddy
+// allocator, which thus only ever holds zeroed memory
+struct dirty_list {
+    void          *pages;
+    size_t         num_pages;
+    kspinlock_t    lock;
+    com_waitlist_t waiters;
+};
+
 // GLOBAL VARIABLES
 
-// List of currently available blocks. This list is ordered by block size
+// Free lists of the buddy allocator, one per block order
 static struct freelist_head MainFreeList = {0};
 // Array of page metadata. Initialized by the init() function to piont to a the
 // HHDM representation of a memory map entry large enough to hold it
@@ -110,135 +144,128 @@ static struct page_meta_array PageMeta = {0};
 // Consolidated data for fast access. Should be accessed atomically after
 // initialization
 static com_pmm_stats_t MemoryStats = {0};
+// Freed pages waiting to be zeroed
+static struct dirty_list DirtyList = {0};
 
 // UTILITY FUNCTIONS
 
-// Freelists are ordered, so insertion should be too
-static inline void freelist_add_ordered_nolock(struct freelist_head  *freelist,
-                                               struct freelist_entry *entry) {
-    // Fast path for 1-page sized inserts. These will always go to the end
-    if (1 == entry->pages) {
-        struct freelist_entry *curr_last = TAILQ_LAST(&freelist->head,
-                                                      freelist_tailq);
-        // If the freelist is empty, we just add the entry
-        if (NULL == curr_last) {
-            goto fallback;
-        }
-        // If it comes right after the last entry, we merge the two
-        if ((uintptr_t)entry ==
-            (uintptr_t)curr_last + curr_last->pages * ARCH_PAGE_SIZE) {
-            curr_last->pages++;
-            return;
-        }
-        // If it comes right before, we do the same
-        if ((uintptr_t)curr_last == (uintptr_t)entry + ARCH_PAGE_SIZE) {
-            entry->pages += curr_last->pages;
-            TAILQ_REMOVE(&freelist->head, curr_last, tqe);
-        }
-        // If the two entries exist, but are not contiguous, or the new entry is
-        // contiguous but comes before (last if statement), we ad the new entryu
-        // to the end
-        goto fallback;
+static inline size_t pages_to_order(size_t pages) {
+    size_t order = 0;
+    while (ORDER_TO_PAGES(order) < pages) {
+        order++;
     }
+    return order;
+}
 
-    struct freelist_entry *curr, *_;
-    TAILQ_FOREACH_SAFE(curr, &freelist->head, tqe, _) {
-        if (entry->pages >= curr->pages) {
-            TAILQ_INSERT_BEFORE(curr, entry, tqe);
-            return;
-        }
-    }
+static inline void buddy_insert_nolock(struct freelist_head *freelist,
+                                       size_t                index,
+                                       size_t                order) {
+    struct page_meta *head = &PageMeta.buffer[index];
+    head->buddy.order      = order;
+    head->buddy.is_head    = true;
+    // Insert at the head so that recently freed (likely cache-hot) blocks are
+    // handed out first
+    TAILQ_INSERT_HEAD(&freelist->orders[order], head, buddy.tqe);
+}
 
-fallback:
-    // Either the freelist is empty or this entry is the smallest. Either way,
-    // just add it to the end
-    TAILQ_INSERT_TAIL(&freelist->head, entry, tqe);
-}
-
-// Freelists are not just ordered, they're faster if they contain fewer entries.
-// Thus, before adding an entry, we should check if it is just a continuation of
-// a preexisting entry. The reason why we keep the "basic oerdered" function is
-// that this one is slower, so it should be called as rarely as possiblle,
-// whereas the other one might be called by some allocation code.
-// NOTE: This functions does not perform defragmentation
-static inline void freelist_add_merged_nolock(struct freelist_head  *freelist,
-                                              struct freelist_entry *entry) {
-    uintptr_t entry_first_page = (uintptr_t)entry;
-    uintptr_t entry_last_page  = entry_first_page +
-                                (entry->pages - 1) * ARCH_PAGE_SIZE;
-
-    struct freelist_entry *curr, *_;
-    TAILQ_FOREACH_SAFE(curr, &freelist->head, tqe, _) {
-        uintptr_t curr_first_page = (uintptr_t)curr;
-        uintptr_t curr_last_page  = curr_first_page +
-                                   (entry->pages - 1) * ARCH_PAGE_SIZE;
-
-        if (curr_first_page == entry_last_page + ARCH_PAGE_SIZE) {
-            entry->pages += curr->pages;
-            TAILQ_INSERT_BEFORE(curr, entry, tqe);
-            TAILQ_REMOVE(&freelist->head, curr, tqe);
-            curr = entry;
-            return;
+static inline void buddy_remove_nolock(struct freelist_head *freelist,
+                                       struct page_meta     *head) {
+    TAILQ_REMOVE(&freelist->orders[head->buddy.order], head, buddy.tqe);
+    head->buddy.is_head = false;
+}
+
+// Returns a block of 2^order pages starting at index to the free lists, merging
+// it with its buddy as long as the buddy is also free. All pages in the block
+// must already be in the free state
+static void
+buddy_free_nolock(struct freelist_head *freelist, size_t index, size_t order) {
+    for (; order < BUDDY_MAX_ORDER; order++) {
+        size_t buddy_index = index ^ ORDER_TO_PAGES(order);
+        if (buddy_index + ORDER_TO_PAGES(order) > PageMeta.len) {
+            break;
         }
 
-        if (curr_last_page == entry_first_page - ARCH_PAGE_SIZE) {
-            curr->pages += entry->pages;
-            return;
+        struct page_meta *buddy = &PageMeta.buffer[buddy_index];
+        if (!buddy->buddy.is_head || order != buddy->buddy.order) {
+            break;
         }
+
+        buddy_remove_nolock(freelist, buddy);
+        index = KMIN(index, buddy_index);
     }
 
-    // Could not be merged with any existing entry, so we jsut add it as a
-    // separate one
-    freelist_add_ordered_nolock(freelist, entry);
+    buddy_insert_nolock(freelist, index, order);
 }
 
-// Since the freelist is ordered, taking from the rear means taking from the
-// smaller chunks, which is good when allocating single pages
-static inline struct freelist_entry *
-freelist_pop_rear_nolock(struct freelist_head *freelist) {
-    struct freelist_entry *last = TAILQ_LAST(&MainFreeList.head,
-                                             freelist_tailq);
-    KASSERT(NULL != last);
+// Adds an arbitrary (page-aligned) range to the free lists by splitting it into
+// the largest naturally aligned blocks it contains
+static void buddy_add_range_nolock(struct freelist_head *freelist,
+                                   size_t                index,
+                                   size_t                pages) {
+    while (0 != pages) {
+        size_t order = 0;
+        while (order < BUDDY_MAX_ORDER &&
+               0 == KMOD_FAST(index, ORDER_TO_PAGES(order + 1)) &&
+               ORDER_TO_PAGES(order + 1) <= pages) {
+            order++;
+        }
 
-    if (1 == last->pages) {
-        TAILQ_REMOVE(&freelist->head, last, tqe);
-    } else {
-        last->pages--;
-        last = (void *)((uintptr_t)last + ARCH_PAGE_SIZE * last->pages);
+        buddy_free_nolock(freelist, index, order);
+        index += ORDER_TO_PAGES(order);
+        pages -= ORDER_TO_PAGES(order);
     }
-
-    return last;
 }
 
-// When allocating multiple pages, however, we take them from the front, because
-// it is more likelly that we'll find a match immediatelly
-static inline struct freelist_entry *
-freelist_pop_front_nolock(size_t               *out_alloc_size,
-                          struct freelist_head *freelist,
-                          size_t                num_pages) {
-    struct freelist_entry *ret = TAILQ_FIRST(&freelist->head);
-    KASSERT(NULL != ret);
-    size_t alloc_size = KMIN(num_pages, ret->pages);
+// Takes a block of exactly 2^order pages, splitting larger blocks if needed.
+// Returns the index of the first page or BUDDY_NO_BLOCK
+static size_t buddy_alloc_nolock(struct freelist_head *freelist, size_t order) {
+    size_t found = order;
+    while (found < BUDDY_NUM_ORDERS && TAILQ_EMPTY(&freelist->orders[found])) {
+        found++;
+    }
+
+    if (BUDDY_NUM_ORDERS == found) {
+        return BUDDY_NO_BLOCK;
+    }
 
-    struct freelist_entry *entry      = ret;
-    struct freelist_entry *next_entry = TAILQ_NEXT(entry, tqe);
+    struct page_meta *head  = TAILQ_FIRST(&freelist->orders[found]);
+    size_t            index = head - PageMeta.buffer;
+    buddy_remove_nolock(freelist, head);
 
-    if (alloc_size == ret->pages) {
-        TAILQ_REMOVE(&freelist->head, ret, tqe);
-    } else {
-        ret->pages -= alloc_size;
-        ret = (void *)((uintptr_t)ret + ARCH_PAGE_SIZE * ret->pages);
+    // Give back the upper halves until we're down to the requested size
+    while (found > order) {
+        found--;
+        buddy_insert_nolock(freelist, index + ORDER_TO_PAGES(found), found);
     }
 
-    // Since we decrement the number of pages in this entry, it may now longer
-    // be the largest
-    if (NULL != next_entry && next_entry->pages > entry->pages) {
-        TAILQ_REMOVE(&freelist->head, entry, tqe);
-        freelist_add_ordered_nolock(freelist, entry);
+    return index;
+}
+
+// Like buddy_alloc_nolock, but falls back to the largest block available if
+// there is no block of the requested order. The block is then trimmed to
+// at most max_pages and the remainder is returned to the free lists
+static size_t buddy_alloc_max_nolock(size_t               *out_alloc_size,
+                                     struct freelist_head *freelist,
+                                     size_t                max_pages) {
+    size_t order = KMIN(pages_to_order(max_pages), BUDDY_MAX_ORDER);
+    size_t index = buddy_alloc_nolock(freelist, order);
+
+    while (BUDDY_NO_BLOCK == index && order > 0) {
+        order--;
+        index = buddy_alloc_nolock(freelist, order);
+    }
+
+    if (BUDDY_NO_BLOCK == index) {
+        *out_alloc_size = 0;
+        return BUDDY_NO_BLOCK;
     }
 
+    size_t alloc_size = KMIN(max_pages, ORDER_TO_PAGES(order));
+    buddy_add_range_nolock(freelist,
+                           index + alloc_size,
+                           ORDER_TO_PAGES(order) - alloc_size);
     *out_alloc_size = alloc_size;
-    return ret;
+    return index;
 }
 
 static inline struct page_meta *page_meta_get(void *phys_addr) {
@@ -266,92 +293,306 @@ page_meta_set(void *page_phys, struct page_meta *tocopy, size_t num_pages) {
                num_pages);
 }
 
-// INTERFACE FUNCTIONS
+// Applies a group of changes, in pages, to the stats. Negative changes simply
+// wrap around. MemoryStats is only written at boot, afterwards each CPU keeps
+// its own deltas so that allocations and frees never write to shared stats.
+// Interrupts are disabled so that the CPU cannot change under us and that no
+// other update can nest within the group
+static void stats_update(com_pmm_stats_t diff) {
+    kspinlock_fake_acquire();
+    com_pmm_cpu_stats_t *cpu_stats = &ARCH_CPU_GET()->pmm_stats;
+    kseqcount_write_begin(&cpu_stats->seq);
+    UPDATE_STATS(cpu_stats, diff, reserved);
+    UPDATE_STATS(cpu_stats, diff, free);
+    UPDATE_STATS(cpu_stats, diff, used);
+    UPDATE_STATS(cpu_stats, diff, to_zero);
+    UPDATE_STATS(cpu_stats, diff, to_insert);
+    kseqcount_write_end(&cpu_stats->seq);
+    kspinlock_fake_release();
+}
 
-void *com_mm_pmm_alloc(void) {
-    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
-        E_COM_PROFILE_FUNC_PMM_ALLOC);
-    FREELIST_LOCK(&MainFreeList);
-    struct freelist_entry *virt_ret = freelist_pop_rear_nolock(&MainFreeList);
-    FREELIST_UNLOCK(&MainFreeList);
+static inline void *page_take(size_t index, size_t pages) {
+    void            *phys  = META_INDEX_TO_PHYS(index);
+    struct page_meta model = {.num_ref = 1,
+                              .state   = E_PAGE_STATE_TAKEN,
+                              .type    = E_PAGE_TYPE_ANONYMOUS};
+    page_meta_set(phys, &model, pages);
 
-    *virt_ret                   = (struct freelist_entry){0};
-    void             *phys      = (void *)ARCH_HHDM_TO_PHYS(virt_ret);
-    struct page_meta *page_meta = page_meta_get(phys);
+    stats_update((com_pmm_stats_t){.used = pages, .free = -pages});
+    return phys;
+}
 
-    KASSERT(E_PAGE_STATE_FREE == page_meta->state);
-    KASSERT(0 == page_meta->num_ref);
-    page_meta->num_ref = 1;
-    page_meta->state   = E_PAGE_STATE_TAKEN;
-    page_meta->type    = E_PAGE_TYPE_ANONYMOUS;
+// Drops one reference to the page and returns true if this was the last one,
+// in which case the page is marked as free, but not yet inserted anywhere. The
+// contents of the page are left as they are (i.e., the page is dirty)
+static inline bool page_release(void *page) {
+    struct page_meta *page_meta = page_meta_get(page);
 
-    UPDATE_STATS(used, +1);
-    UPDATE_STATS(free, -1);
+    if (E_PAGE_STATE_TAKEN != page_meta->state ||
+        0 != __atomic_add_fetch(&page_meta->num_ref, -1, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
 
-    com_sys_profiler_end_function(&profiler_data);
-    return phys;
+    *page_meta = (struct page_meta){0};
+    return true;
 }
 
-void *com_mm_pmm_alloc_many(size_t pages) {
-    if (1 == pages) {
-        return com_mm_pmm_alloc();
+static inline void *page_stack_pop(void **stack, size_t *len) {
+    struct magazine_page *page = *stack;
+    if (NULL == page) {
+        return NULL;
     }
 
-    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
-        E_COM_PROFILE_FUNC_PMM_ALLOC);
+    *stack = page->next;
+    (*len)--;
+    page->next = NULL;
+    return (void *)ARCH_HHDM_TO_PHYS(page);
+}
+
+static inline void page_stack_push(void **stack, size_t *len, void *page_phys) {
+    struct magazine_page *page = (void *)ARCH_PHYS_TO_HHDM(page_phys);
+    page->next                 = *stack;
+    *stack                     = page;
+    (*len)++;
+}
+
+// Wakes up the zeroing thread if enough dirty pages have piled up. Notifying
+// may take scheduler locks, so this is skipped when the caller holds any lock
+static void dirty_list_notify(void) {
+    com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
+    if (NULL == curr_thread || 0 != curr_thread->lock_depth) {
+        return;
+    }
+
+    size_t threshold = READ_STATS(usable) / ARCH_PAGE_SIZE /
+                       CONFIG_PMM_NOTIFY_ZERO;
+    if (__atomic_load_n(&DirtyList.num_pages, __ATOMIC_RELAXED) >= threshold) {
+        com_sys_sched_notify(&DirtyList.waiters);
+    }
+}
+
+// Zeroes up to max_pages pages from the dirty list and returns them to the
+// buddy allocator. Returns the number of pages that were processed
+static size_t dirty_list_zero(size_t max_pages) {
+    void  *pages     = NULL;
+    size_t num_pages = 0;
+
+    kspinlock_acquire(&DirtyList.lock);
+    while (num_pages < max_pages) {
+        void *page = page_stack_pop(&DirtyList.pages, &DirtyList.num_pages);
+        if (NULL == page) {
+            break;
+        }
+        page_stack_push(&pages, &num_pages, page);
+    }
+    kspinlock_release(&DirtyList.lock);
+
+    if (0 == num_pages) {
+        return 0;
+    }
+
+    stats_update(
+        (com_pmm_stats_t){.to_zero = -num_pages, .to_insert = num_pages});
+
+    // The link word is kept until the page is inserted, so that the local stack
+    // can still be walked. It is cleared by page_stack_pop below
+    for (struct magazine_page *page = pages; NULL != page; page = page->next) {
+        kmemset(page + 1, ARCH_PAGE_SIZE - sizeof(struct magazine_page), 0);
+    }
+
+    size_t count = num_pages;
     FREELIST_LOCK(&MainFreeList);
-    size_t                 alloc_size;
-    struct freelist_entry *virt_ret = freelist_pop_front_nolock(&alloc_size,
-                                                                &MainFreeList,
-                                                                pages);
+    void *page;
+    while (NULL != (page = page_stack_pop(&pages, &count))) {
+        buddy_free_nolock(&MainFreeList, PHYS_TO_META_INDEX(page), 0);
+    }
     FREELIST_UNLOCK(&MainFreeList);
-    KASSERT(alloc_size == pages);
 
-    *virt_ret  = (struct freelist_entry){0};
-    void *phys = (void *)ARCH_HHDM_TO_PHYS(virt_ret);
+    stats_update((com_pmm_stats_t){.to_insert = -num_pages});
+    return num_pages;
+}
 
-    struct page_meta model = {.num_ref = 1,
-                              .state   = E_PAGE_STATE_TAKEN,
-                              .type    = E_PAGE_TYPE_ANONYMOUS};
-    page_meta_set(phys, &model, pages);
+static void magazine_refill_nolock(com_pmm_magazine_t *magazine) {
+    FREELIST_LOCK(&MainFreeList);
+    for (size_t i = 0; i < CONFIG_PMM_MAGAZINE_BATCH; i++) {
+        size_t index = buddy_alloc_nolock(&MainFreeList, 0);
+        if (BUDDY_NO_BLOCK == index) {
+            break;
+        }
+        page_stack_push(&magazine->private.pages,
+                        &magazine->private.num_pages,
+                        META_INDEX_TO_PHYS(index));
+    }
+    FREELIST_UNLOCK(&MainFreeList);
+}
 
-    UPDATE_STATS(used, +pages);
-    UPDATE_STATS(free, -pages);
+static void magazine_drain_nolock(com_pmm_magazine_t *magazine,
+                                  size_t              num_pages) {
+    FREELIST_LOCK(&MainFreeList);
+    for (size_t i = 0; i < num_pages; i++) {
+        void *page = page_stack_pop(&magazine->private.pages,
+                                    &magazine->private.num_pages);
+        if (NULL == page) {
+            break;
+        }
+        buddy_free_nolock(&MainFreeList, PHYS_TO_META_INDEX(page), 0);
+    }
+    FREELIST_UNLOCK(&MainFreeList);
+}
 
-    com_sys_profiler_end_function(&profiler_data);
-    return phys;
+// Dirty pages never go straight back to the buddy allocator, they are handed to
+// the zeroing thread instead
+static void magazine_drain_dirty_nolock(com_pmm_magazine_t *magazine,
+                                        size_t              num_pages) {
+    kspinlock_acquire(&DirtyList.lock);
+    for (size_t i = 0; i < num_pages; i++) {
+        void *page = page_stack_pop(&magazine->private.dirty_pages,
+                                    &magazine->private.num_dirty_pages);
+        if (NULL == page) {
+            break;
+        }
+        page_stack_push(&DirtyList.pages, &DirtyList.num_pages, page);
+    }
+    kspinlock_release(&DirtyList.lock);
 }
 
-void *com_mm_pmm_alloc_zero(void) {
-    return com_mm_pmm_alloc();
+static void magazine_reclaim(arch_cpu_t *cpu) {
+    kspinlock_acquire(&cpu->pmm_magazine.lock);
+    magazine_drain_nolock(&cpu->pmm_magazine,
+                          cpu->pmm_magazine.private.num_pages);
+    magazine_drain_dirty_nolock(&cpu->pmm_magazine,
+                                cpu->pmm_magazine.private.num_dirty_pages);
+    kspinlock_release(&cpu->pmm_magazine.lock);
 }
 
-void *com_mm_pmm_alloc_many_zero(size_t pages) {
-    return com_mm_pmm_alloc_many(pages);
+// Allocates from the buddy allocator. If there is no suitable block, all
+// per-CPU magazines are drained and, as a last resort, the dirty list is zeroed
+// synchronously before trying again. If exact is true, the allocation is
+// exactly pages long, otherwise it may be shorter (see buddy_alloc_max_nolock)
+static size_t
+buddy_alloc_pages(size_t *out_alloc_size, size_t pages, bool exact) {
+    size_t order = pages_to_order(pages);
+    KASSERT(!exact || order <= BUDDY_MAX_ORDER);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (1 == attempt) {
+            com_mm_pmm_reclaim_magazines();
+        } else if (2 == attempt) {
+            while (0 != dirty_list_zero(SIZE_MAX)) {
+            }
+        }
+
+        size_t index;
+        FREELIST_LOCK(&MainFreeList);
+        if (exact) {
+            index = buddy_alloc_nolock(&MainFreeList, order);
+            // Return the unused tail of the block (if pages is not a power of
+            // two)
+            if (BUDDY_NO_BLOCK != index) {
+                buddy_add_range_nolock(&MainFreeList,
+                                       index + pages,
+                                       ORDER_TO_PAGES(order) - pages);
+                *out_alloc_size = pages;
+            }
+        } else {
+            index = buddy_alloc_max_nolock(out_alloc_size,
+                                           &MainFreeList,
+                                           pages);
+        }
+        FREELIST_UNLOCK(&MainFreeList);
+
+        if (KLIKELY(BUDDY_NO_BLOCK != index)) {
+            return index;
+        }
+    }
+
+    return BUDDY_NO_BLOCK;
 }
 
-void *com_mm_pmm_alloc_max(size_t *out_alloc_size, size_t pages) {
-    if (1 == pages) {
-        return com_mm_pmm_alloc();
+static void *alloc_page(bool zero) {
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_PMM_ALLOC);
+
+    // If we get preempted and migrated before taking the lock we'll just be
+    // using another CPU's magazine, which is still correct
+    com_pmm_magazine_t *magazine = &ARCH_CPU_GET()->pmm_magazine;
+    void               *phys     = NULL;
+    bool                dirty    = false;
+    bool                refilled = false;
+    kspinlock_acquire(&magazine->lock);
+    // Callers that do not need zeroed memory get recently freed pages first,
+    // which are likely still in cache and spare the zeroing thread some work
+    if (!zero) {
+        phys  = page_stack_pop(&magazine->private.dirty_pages,
+                              &magazine->private.num_dirty_pages);
+        dirty = NULL != phys;
+    }
+    if (NULL == phys) {
+        if (0 == magazine->private.num_pages) {
+            magazine_refill_nolock(magazine);
+            refilled = true;
+        }
+        phys = page_stack_pop(&magazine->private.pages,
+                              &magazine->private.num_pages);
     }
+    kspinlock_release(&magazine->lock);
 
-    FREELIST_LOCK(&MainFreeList);
-    size_t                 alloc_size;
-    struct freelist_entry *virt_ret = freelist_pop_front_nolock(&alloc_size,
-                                                                &MainFreeList,
-                                                                pages);
-    FREELIST_UNLOCK(&MainFreeList);
+    if (dirty) {
+        stats_update((com_pmm_stats_t){.to_zero = -1});
+    }
 
-    *virt_ret  = (struct freelist_entry){0};
-    void *phys = (void *)ARCH_HHDM_TO_PHYS(virt_ret);
+    // The global allocator ran dry, but other CPUs may still be holding free
+    // pages in their magazines
+    if (KUNKLIKELY(NULL == phys)) {
+        size_t alloc_size;
+        size_t index = buddy_alloc_pages(&alloc_size, 1, true);
+        KASSERT(BUDDY_NO_BLOCK != index);
+        phys = META_INDEX_TO_PHYS(index);
+    }
 
-    struct page_meta model = {.num_ref = 1,
-                              .state   = E_PAGE_STATE_TAKEN,
-                              .type    = E_PAGE_TYPE_ANONYMOUS};
-    page_meta_set(phys, &model, alloc_size);
+    struct page_meta *page_meta = page_meta_get(phys);
+    KASSERT(E_PAGE_STATE_FREE == page_meta->state);
+    KASSERT(0 == page_meta->num_ref);
+    page_take(PHYS_TO_META_INDEX(phys), 1);
+
+    if (refilled) {
+        dirty_list_notify();
+    }
+
+    com_sys_profiler_end_function(&profiler_data);
+    return phys;
+}
+
+// Blocks in the buddy allocator are always zeroed, so zero only matters for
+// single pages, which come from the per-CPU magazines
+static void *alloc_many(size_t pages, bool zero) {
+    if (pages <= 1) {
+        return alloc_page(zero);
+    }
+
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_PMM_ALLOC);
+    size_t alloc_size;
+    size_t index = buddy_alloc_pages(&alloc_size, pages, true);
+    KASSERT(BUDDY_NO_BLOCK != index);
+    void *phys = page_take(index, pages);
+
+    com_sys_profiler_end_function(&profiler_data);
+    return phys;
+}
+
+static void *alloc_max(size_t *out_alloc_size, size_t pages, bool zero) {
+    if (pages <= 1) {
+        if (NULL != out_alloc_size) {
+            *out_alloc_size = 1;
+        }
+        return alloc_page(zero);
+    }
 
-    UPDATE_STATS(used, +alloc_size);
-    UPDATE_STATS(free, -alloc_size);
+    size_t alloc_size;
+    size_t index = buddy_alloc_pages(&alloc_size, pages, false);
+    KASSERT(BUDDY_NO_BLOCK != index);
+    void *phys = page_take(index, alloc_size);
 
     if (NULL != out_alloc_size) {
         *out_alloc_size = alloc_size;
@@ -360,8 +601,45 @@ void *com_mm_pmm_alloc_max(size_t *out_alloc_size, size_t pages) {
     return phys;
 }
 
+static void pmm_zero_thread(void) {
+    for (;;) {
+        kspinlock_acquire(&DirtyList.lock);
+        while (0 == DirtyList.num_pages) {
+            com_sys_sched_wait(&DirtyList.waiters, &DirtyList.lock);
+        }
+        kspinlock_release(&DirtyList.lock);
+
+        // Work in small batches and give up the CPU in between, so that the
+        // thread behaves like a background task
+        dirty_list_zero(CONFIG_PMM_MAGAZINE_BATCH);
+        com_sys_sched_yield();
+    }
+}
+
+// INTERFACE FUNCTIONS
+
+void *com_mm_pmm_alloc(void) {
+    return alloc_page(false);
+}
+
+void *com_mm_pmm_alloc_many(size_t pages) {
+    return alloc_many(pages, false);
+}
+
+void *com_mm_pmm_alloc_zero(void) {
+    return alloc_page(true);
+}
+
+void *com_mm_pmm_alloc_many_zero(size_t pages) {
+    return alloc_many(pages, true);
+}
+
+void *com_mm_pmm_alloc_max(size_t *out_alloc_size, size_t pages) {
+    return alloc_max(out_alloc_size, pages, false);
+}
+
 void *com_mm_pmm_alloc_max_zero(size_t *out_alloc_size, size_t pages) {
-    return com_mm_pmm_alloc_max(out_alloc_size, pages);
+    return alloc_max(out_alloc_size, pages, true);
 }
 
 void com_mm_pmm_hold(void *page) {
@@ -370,6 +648,27 @@ void com_mm_pmm_hold(void *page) {
     __atomic_add_fetch(&page_meta->num_ref, 1, __ATOMIC_RELAXED);
 }
 
+// Drops a reference to page unless it is the last one, which is left to the
+// caller. Returns false in that case, meaning that the caller now owns the page
+bool com_mm_pmm_unhold(void *page) {
+    struct page_meta *page_meta = page_meta_get(page);
+    KASSERT(E_PAGE_STATE_FREE != page_meta->state);
+    size_t num_ref = __atomic_load_n(&page_meta->num_ref, __ATOMIC_ACQUIRE);
+
+    while (num_ref > 1) {
+        if (__atomic_compare_exchange_n(&page_meta->num_ref,
+                                        &num_ref,
+                                        num_ref - 1,
+                                        false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool com_mm_pmm_is_shared(void *page) {
     struct page_meta *page_meta = page_meta_get(page);
     KASSERT(E_PAGE_STATE_FREE != page_meta->state);
@@ -377,44 +676,130 @@ bool com_mm_pmm_is_shared(void *page) {
 }
 
 void com_mm_pmm_free(void *page) {
-    struct page_meta *page_meta = page_meta_get(page);
-
-    if (E_PAGE_STATE_TAKEN != page_meta->state ||
-        0 != __atomic_add_fetch(&page_meta->num_ref, -1, __ATOMIC_ACQ_REL)) {
+    if (!page_release(page)) {
         return;
     }
 
-    // TODO: reimplement free
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_PMM_FREE);
+    com_pmm_magazine_t *magazine = &ARCH_CPU_GET()->pmm_magazine;
+    bool                drained  = false;
+    kspinlock_acquire(&magazine->lock);
+    page_stack_push(&magazine->private.dirty_pages,
+                    &magazine->private.num_dirty_pages,
+                    page);
+    if (magazine->private.num_dirty_pages > CONFIG_PMM_MAGAZINE_SIZE) {
+        magazine_drain_dirty_nolock(magazine, CONFIG_PMM_MAGAZINE_BATCH);
+        drained = true;
+    }
+    kspinlock_release(&magazine->lock);
+
+    stats_update((com_pmm_stats_t){.used = -1, .free = 1, .to_zero = 1});
+
+    if (drained) {
+        dirty_list_notify();
+    }
+
+    com_sys_profiler_end_function(&profiler_data);
 }
 
 void com_mm_pmm_free_many(void *base, size_t pages) {
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_PMM_FREE);
+    size_t num_freed = 0;
+
+    // Pages are reference counted individually, so only those whose last
+    // reference has been dropped are handed to the zeroing thread. All of them
+    // are inserted into the dirty list under a single lock
+    kspinlock_acquire(&DirtyList.lock);
     for (size_t i = 0; i < pages; i++) {
-        com_mm_pmm_free((uint8_t *)base + i * ARCH_PAGE_SIZE);
+        void *page = (uint8_t *)base + i * ARCH_PAGE_SIZE;
+        if (page_release(page)) {
+            page_stack_push(&DirtyList.pages, &DirtyList.num_pages, page);
+            num_freed++;
+        }
     }
+    kspinlock_release(&DirtyList.lock);
+
+    stats_update((com_pmm_stats_t){.used    = -num_freed,
+                                   .free    = num_freed,
+                                   .to_zero = num_freed});
+
+    if (0 != num_freed) {
+        dirty_list_notify();
+    }
+
+    com_sys_profiler_end_function(&profiler_data);
 }
 
 void com_mm_pmm_unreserve_many(void *base, size_t pages) {
-    struct page_meta      *page_meta_base = page_meta_get(base);
-    struct freelist_entry *entry          = (void *)ARCH_PHYS_TO_HHDM(base);
-    kmemset(entry, pages * ARCH_PAGE_SIZE, 0);
+    struct page_meta *page_meta_base = page_meta_get(base);
+    kmemset((void *)ARCH_PHYS_TO_HHDM(base), pages * ARCH_PAGE_SIZE, 0);
     kmemset(page_meta_base, pages * sizeof(struct page_meta), 0);
-    entry->pages = pages;
 
     FREELIST_LOCK(&MainFreeList);
-    freelist_add_ordered_nolock(&MainFreeList, entry);
+    buddy_add_range_nolock(&MainFreeList, PHYS_TO_META_INDEX(base), pages);
     FREELIST_UNLOCK(&MainFreeList);
 
-    UPDATE_STATS(reserved, -pages);
-    UPDATE_STATS(free, +pages);
+    stats_update((com_pmm_stats_t){.reserved = -pages, .free = pages});
+}
+
+// Adds a snapshot of one CPU's deltas to out. Every group of changes is made
+// on a single CPU, so summing consistent per-CPU snapshots never shows half of
+// a group, even though the CPUs are not read at the same instant
+static void stats_add_cpu(com_pmm_stats_t *out, arch_cpu_t *cpu) {
+    com_pmm_cpu_stats_t *cpu_stats = &cpu->pmm_stats;
+    com_pmm_stats_t      delta;
+    uintmax_t            seq;
+
+    do {
+        seq   = kseqcount_read_begin(&cpu_stats->seq);
+        delta = cpu_stats->delta;
+    } while (kseqcount_read_retry(&cpu_stats->seq, seq));
+
+    out->reserved += delta.reserved;
+    out->free += delta.free;
+    out->used += delta.used;
+    out->to_zero += delta.to_zero;
+    out->to_insert += delta.to_insert;
 }
 
 void com_mm_pmm_get_stats(com_pmm_stats_t *out) {
     *out = MemoryStats;
+
+    // Before SMP initialization there is only the bootstrap CPU
+    if (NULL == x86_64_smp_get_cpu(0)) {
+        stats_add_cpu(out, ARCH_CPU_GET());
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        stats_add_cpu(out, cpu);
+    }
+}
+
+void com_mm_pmm_reclaim_magazines(void) {
+    // Before SMP initialization there is only the bootstrap CPU
+    if (NULL == x86_64_smp_get_cpu(0)) {
+        magazine_reclaim(ARCH_CPU_GET());
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        magazine_reclaim(cpu);
+    }
 }
 
 void com_mm_pmm_init_threads(void) {
-    KLOG("TODO: reimplement pmm threads");
-    // TODO reimplement pmm threads
+    KLOG("starting pmm zeroing thread");
+    com_thread_t *zero_thread = com_sys_thread_new_kernel(NULL,
+                                                          pmm_zero_thread);
+    // Zeroing ahead of time only pays off if it does not take CPU time away
+    // from anything else
+    com_sys_sched_set_nice(zero_thread, 19);
+    com_sys_thread_ready(zero_thread);
 }
 
 void com_mm_pmm_init(void) {
@@ -422,7 +807,12 @@ void com_mm_pmm_init(void) {
     arch_memmap_t *memmap               = arch_info_get_memmap();
     uintptr_t      highest_addr         = 0;
     uintptr_t      highest_indexed_addr = 0;
-    TAILQ_INIT(&MainFreeList.head);
+    for (size_t order = 0; order < BUDDY_NUM_ORDERS; order++) {
+        TAILQ_INIT(&MainFreeList.orders[order]);
+    }
+    MainFreeList.lock = KSPINLOCK_NEW();
+    DirtyList.lock    = KSPINLOCK_NEW();
+    COM_SYS_THREAD_WAITLIST_INIT(&DirtyList.waiters);
 
     // Setup the fake entry in the page meta array
     PageMeta.fake_entry.type    = E_PAGE_TYPE_ANONYMOUS;
@@ -472,6 +862,40 @@ void com_mm_pmm_init(void) {
            page_meta_aligned_size);
 
     // Find a segment that fits the array and allocate it there
+    uintmax_t page_meta_segment = memmap->entry_count;
+    for (uintmax_t i = 0; i < memmap->entry_count; i++) {
+        arch_memmap_entry_t *entry = memmap->entries[i];
+
+        if (!ARCH_MEMMAP_IS_USABLE(entry) ||
+            entry->length < page_meta_aligned_size) {
+            continue;
+        }
+
+        PageMeta.buffer         = (void *)ARCH_PHYS_TO_HHDM(entry->base);
+        PageMeta.len            = PAGE_META_ARRAY_LEN(highest_indexed_addr);
+        PageMeta.reserved_start = PHYS_TO_META_INDEX(highest_indexed_addr);
+        PageMeta.extended_len   = PAGE_META_ARRAY_LEN(highest_addr);
+        // Already zeroed before. Remember, 0 == E_PAGE_STATE_FREE
+
+        // We now reserve the pages used for this array
+        struct page_meta model = {.num_ref = 1,
+                                  .state   = E_PAGE_STATE_RESERVED};
+        page_meta_set((void *)entry->base, &model, page_meta_pages);
+        MemoryStats.usable -= page_meta_aligned_size;
+        MemoryStats.reserved += page_meta_aligned_size;
+        page_meta_segment = i;
+
+        KDEBUG("page meta array: base=%p, segment=%zu, length=%zu",
+               PageMeta.buffer,
+               i,
+               PageMeta.len);
+        break;
+    }
+
+    KASSERT(NULL != PageMeta.buffer);
+
+    // The free lists live in the page meta array, so usable memory can only be
+    // handed to the buddy allocator now that the array is in place
     for (uintmax_t i = 0; i < memmap->entry_count; i++) {
         arch_memmap_entry_t *entry = memmap->entries[i];
 
@@ -479,57 +903,29 @@ void com_mm_pmm_init(void) {
             continue;
         }
 
-        if (NULL == PageMeta.buffer &&
-            entry->length >= page_meta_aligned_size) {
-            PageMeta.buffer         = (void *)ARCH_PHYS_TO_HHDM(entry->base);
-            PageMeta.len            = PAGE_META_ARRAY_LEN(highest_indexed_addr);
-            PageMeta.reserved_start = PHYS_TO_META_INDEX(highest_indexed_addr);
-            PageMeta.extended_len   = PAGE_META_ARRAY_LEN(highest_addr);
-            // Already zeroed before. Remember, 0 == E_PAGE_STATE_FREE
+        uintptr_t base   = entry->base;
+        size_t    length = entry->length;
 
-            // We now reserve the pages used for this array
-            struct page_meta model = {.num_ref = 1,
-                                      .state   = E_PAGE_STATE_RESERVED};
-            page_meta_set((void *)entry->base, &model, page_meta_pages);
-            MemoryStats.usable -= page_meta_aligned_size;
-            MemoryStats.reserved += page_meta_aligned_size;
-
-            // We also add this to the freelist. This list entry of couse is
-            // a little special since a part of it has been reserved. The
-            // address is rounded down to the nearest fully free page
-            // boundary to guarantee that allocations will always return
-            // aligned addresses. This is only performed if there is still
-            // at least one page elft
-            if (entry->length >= page_meta_aligned_size + ARCH_PAGE_SIZE) {
-                size_t remaining_length = entry->length -
-                                          page_meta_aligned_size;
-                size_t remaining_pages = remaining_length / ARCH_PAGE_SIZE;
-
-                struct freelist_entry
-                    *list_entry   = (void *)(ARCH_PHYS_TO_HHDM(entry->base) +
-                                           page_meta_aligned_size);
-                list_entry->pages = remaining_pages;
-                freelist_add_ordered_nolock(&MainFreeList, list_entry);
-            }
+        // The segment that holds the array only contributes what comes after
+        // it
+        if (page_meta_segment == i) {
+            base += page_meta_aligned_size;
+            length -= page_meta_aligned_size;
+        }
 
-            KDEBUG("page meta array: base=%p, segment=%zu, length=%zu",
-                   PageMeta.buffer,
-                   i,
-                   PageMeta.len);
+        if (length < ARCH_PAGE_SIZE) {
             continue;
         }
 
-        // If we got here, it means the entire entry is free for us!
-        struct freelist_entry *list_entry = (void *)(ARCH_PHYS_TO_HHDM(
-            entry->base));
-        list_entry->pages                 = entry->length / ARCH_PAGE_SIZE;
-        freelist_add_ordered_nolock(&MainFreeList, list_entry);
+        buddy_add_range_nolock(&MainFreeList,
+                               PHYS_TO_META_INDEX(base),
+                               length / ARCH_PAGE_SIZE);
     }
 
     KDEBUG("reserving remaining unusable pages");
 
-    // We couldn't reserve all unusable regions before because the array
-    // might not have been set yet. But we can not
+    // Unusable regions are reserved last so that their entries are never
+    // mistaken for free blocks
     for (uintmax_t i = 0; i < memmap->entry_count; i++) {
         arch_memmap_entry_t *entry = memmap->entries[i];
 
@@ -546,8 +942,12 @@ void com_mm_pmm_init(void) {
 
     MemoryStats.free = MemoryStats.usable;
 
-    struct freelist_entry *e, *_;
-    TAILQ_FOREACH_SAFE(e, &MainFreeList.head, tqe, _) {
-        KDEBUG("freelist entry %p has %zu pages", e, e->pages);
+    for (size_t order = 0; order < BUDDY_NUM_ORDERS; order++) {
+        size_t            num_blocks = 0;
+        struct page_meta *block;
+        TAILQ_FOREACH(block, &MainFreeList.orders[order], buddy.tqe) {
+            num_blocks++;
+        }
+        KDEBUG("buddy order %zu has %zu free block(s)", order, num_blocks);
     }
 }
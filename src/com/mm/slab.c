@@ -16,54 +16,413 @@
 | along with this program.  If not, see <https://www.gnu.org/licenses/>. |
 *************************************************************************/
 
+#include <arch/cpu.h>
 #include <arch/info.h>
 #include <kernel/com/io/log.h>
 #include <kernel/com/mm/pmm.h>
+#include <kernel/com/mm/slab.h>
+#include <kernel/platform/x86-64/smp.h>
 #include <lib/mem.h>
 #include <lib/spinlock.h>
 #include <lib/util.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <vendor/tailq.h>
 
-#define NUM_SLABS (ARCH_PAGE_SIZE / 16)
+#define NUM_SLABS  (ARCH_PAGE_SIZE / 16)
+#define NUM_CACHES (NUM_SLABS + CONFIG_SLAB_MAX_CACHES)
 
-typedef struct {
-    uintptr_t next;
-} slab_t;
+#define SIZE_TO_CLASS(size)    (((size) + 15) / 16)
+#define ALIGN_UP(value, align) (((value) + (align) - 1) & ~((align) - 1))
+#define SLAB_BYTES(cache)      (ARCH_PAGE_SIZE << (cache)->order)
+#define SLAB_FIRST_OBJ(slab, cache) \
+    ((uintptr_t)(slab) + (cache)->first_off)
+#define OBJ_LINK(cache, obj) \
+    ((void **)((uint8_t *)(obj) + (cache)->link_off))
 
-static slab_t      Slabs[NUM_SLABS] = {0};
-static kspinlock_t Lock             = KSPINLOCK_NEW();
+// Every slab holds at least this many objects. Large objects thus use slabs
+// that span multiple pages
+#define SLAB_MIN_OBJS  8
+#define SLAB_MAX_ORDER 4
+#define SLAB_HDR_SIZE  ALIGN_UP(sizeof(struct slab), 16UL)
 
-static void init(slab_t *s, size_t entry_size) {
-    entry_size          = (entry_size + 15) & ~15UL;
-    void *new_page      = com_mm_pmm_alloc_zero();
-    s->next             = ARCH_PHYS_TO_HHDM(new_page);
-    size_t     max      = ARCH_PAGE_SIZE / entry_size - 1;
-    uintptr_t *list_arr = (uintptr_t *)s->next;
-    size_t     off      = entry_size / sizeof(uintptr_t);
+TAILQ_HEAD(slab_tailq, slab);
 
-    for (size_t i = 0; i < max; i++) {
-        list_arr[i * off] = (uintptr_t)&list_arr[(i + 1) * off];
+// Header placed at the start of every slab. Slabs are naturally aligned blocks
+// of 2^order pages, so the header of an object is found by rounding its
+// address down
+struct slab {
+    TAILQ_ENTRY(slab) entries;
+    void     *free;     // objects that were freed back to this slab
+    uintptr_t bump;     // objects past this point have never been handed out
+    size_t    num_free; // includes objects past bump
+};
+
+// Both the generic size classes and named caches are described by this. The
+// index into the Caches array is also the index into per-CPU magazine arrays
+struct com_slab_cache {
+    kspinlock_t          lock;
+    const char          *name;
+    size_t               id;
+    bool                 used;
+    int                  flags;
+    com_intf_slab_ctor_t ctor;
+    com_intf_slab_ctor_t dtor;
+
+    size_t size;      // size requested by the user
+    size_t stride;    // distance between objects
+    size_t link_off;  // offset of the free list link within the object
+    size_t first_off; // offset of the first object within the slab
+    size_t order;
+    size_t objs_per_slab;
+    size_t magazine_size;
+
+    size_t            num_empty;
+    size_t            num_slabs;
+    size_t            num_taken; // objects outside of slabs
+    size_t            num_ctor_calls;
+    struct slab_tailq partial; // slabs with at least one free object
+};
+
+typedef void (*percpu_fn_t)(com_slab_cpu_t   *cpu_slab,
+                            com_slab_cache_t *cache,
+                            void             *arg);
+
+// Generic size classes come first, followed by named caches
+static com_slab_cache_t Caches[NUM_CACHES] = {0};
+static kspinlock_t      CachesLock         = KSPINLOCK_NEW();
+
+static inline void *obj_stack_pop(com_slab_cache_t *cache,
+                                  void            **stack,
+                                  size_t           *len) {
+    void *obj = *stack;
+    if (NULL == obj) {
+        return NULL;
+    }
+
+    *stack = *OBJ_LINK(cache, obj);
+    (*len)--;
+    return obj;
+}
+
+static inline void obj_stack_push(com_slab_cache_t *cache,
+                                  void            **stack,
+                                  size_t           *len,
+                                  void             *obj) {
+    *OBJ_LINK(cache, obj) = *stack;
+    *stack                = obj;
+    (*len)++;
+}
+
+static inline struct slab *slab_of(com_slab_cache_t *cache, void *obj) {
+    uintptr_t mask = SLAB_BYTES(cache) - 1;
+    return (void *)ARCH_PHYS_TO_HHDM(ARCH_HHDM_TO_PHYS(obj) & ~mask);
+}
+
+static void cache_setup(com_slab_cache_t    *cache,
+                        const char          *name,
+                        size_t               size,
+                        size_t               align,
+                        com_intf_slab_ctor_t ctor,
+                        com_intf_slab_ctor_t dtor,
+                        int                  flags) {
+    align = KMAX(align, sizeof(void *));
+    KASSERT(0 == (align & (align - 1)));
+    KASSERT(align <= ARCH_PAGE_SIZE);
+
+    cache->name  = name;
+    cache->flags = flags;
+    cache->ctor  = ctor;
+    cache->dtor  = dtor;
+    cache->size  = size;
+
+    // Constructed objects must stay intact while they are free, so the free
+    // list link is placed after the object instead of over it
+    if (NULL != ctor) {
+        cache->link_off = ALIGN_UP(size, sizeof(void *));
+        cache->stride   = ALIGN_UP(cache->link_off + sizeof(void *), align);
+    } else {
+        cache->link_off = 0;
+        cache->stride   = ALIGN_UP(KMAX(size, sizeof(void *)), align);
+    }
+
+    cache->first_off = ALIGN_UP(SLAB_HDR_SIZE, align);
+    cache->order     = 0;
+    while (cache->order < SLAB_MAX_ORDER &&
+           (SLAB_BYTES(cache) - cache->first_off) / cache->stride <
+               SLAB_MIN_OBJS) {
+        cache->order++;
+    }
+
+    cache->objs_per_slab = (SLAB_BYTES(cache) - cache->first_off) /
+                           cache->stride;
+    cache->magazine_size = KMIN(CONFIG_SLAB_MAGAZINE_SIZE,
+                                cache->objs_per_slab);
+    KASSERT(cache->objs_per_slab > 0);
+
+    cache->num_empty      = 0;
+    cache->num_slabs      = 0;
+    cache->num_taken      = 0;
+    cache->num_ctor_calls = 0;
+    TAILQ_INIT(&cache->partial);
+}
+
+static struct slab *slab_new(com_slab_cache_t *cache) {
+    // Objects are either zeroed on allocation or constructed, so the pages
+    // need not be zeroed
+    void *phys = com_mm_pmm_alloc_many(1UL << cache->order);
+    // Blocks of 2^n pages from the buddy allocator are aligned to their size
+    KASSERT(0 == (uintptr_t)phys % SLAB_BYTES(cache));
+
+    struct slab *slab = (void *)ARCH_PHYS_TO_HHDM(phys);
+    slab->free        = NULL;
+    slab->bump        = SLAB_FIRST_OBJ(slab, cache);
+    slab->num_free    = cache->objs_per_slab;
+    cache->num_slabs++;
+    return slab;
+}
+
+// Returns a completely free slab to the PMM. Called without locks held
+static void slab_destroy(com_slab_cache_t *cache, struct slab *slab) {
+    if (NULL != cache->dtor) {
+        for (uintptr_t obj = SLAB_FIRST_OBJ(slab, cache); obj < slab->bump;
+             obj += cache->stride) {
+            cache->dtor((void *)obj);
+        }
     }
 
-    list_arr[max * off] = (uintptr_t)NULL;
+    com_mm_pmm_free_many((void *)ARCH_HHDM_TO_PHYS(slab), 1UL << cache->order);
+}
+
+static void *slab_pop(com_slab_cache_t *cache, struct slab *slab) {
+    void *obj = slab->free;
+
+    if (NULL != obj) {
+        slab->free = *OBJ_LINK(cache, obj);
+    } else {
+        obj = (void *)slab->bump;
+        slab->bump += cache->stride;
+
+        // Objects are constructed once, when they are first carved out of the
+        // slab, and are then cached in their constructed state
+        if (NULL != cache->ctor) {
+            cache->ctor(obj);
+            cache->num_ctor_calls++;
+        }
+    }
+
+    slab->num_free--;
+    return obj;
+}
+
+// Moves up to num_objs objects from the cache into the magazine
+static void cache_refill_nolock(com_slab_cache_t    *cache,
+                                com_slab_magazine_t *magazine,
+                                size_t               num_objs) {
+    while (num_objs > 0) {
+        struct slab *slab = TAILQ_FIRST(&cache->partial);
+
+        if (NULL == slab) {
+            slab = slab_new(cache);
+            TAILQ_INSERT_HEAD(&cache->partial, slab, entries);
+            cache->num_empty++;
+        }
+
+        if (cache->objs_per_slab == slab->num_free) {
+            cache->num_empty--;
+        }
+
+        for (; num_objs > 0 && slab->num_free > 0; num_objs--) {
+            obj_stack_push(cache,
+                           &magazine->objs,
+                           &magazine->num_objs,
+                           slab_pop(cache, slab));
+            cache->num_taken++;
+        }
+
+        if (0 == slab->num_free) {
+            TAILQ_REMOVE(&cache->partial, slab, entries);
+        }
+    }
+}
+
+// Moves up to num_objs objects from the magazine back to their slabs. Slabs
+// that become completely free beyond max_empty are unlinked and added to
+// to_free, so that the caller can return them to the PMM once it has dropped
+// its locks
+static void cache_drain_nolock(com_slab_cache_t    *cache,
+                               com_slab_magazine_t *magazine,
+                               size_t               num_objs,
+                               size_t               max_empty,
+                               struct slab_tailq   *to_free) {
+    for (size_t i = 0; i < num_objs; i++) {
+        void *obj = obj_stack_pop(cache, &magazine->objs, &magazine->num_objs);
+        if (NULL == obj) {
+            break;
+        }
+
+        struct slab *slab     = slab_of(cache, obj);
+        *OBJ_LINK(cache, obj) = slab->free;
+        slab->free            = obj;
+        slab->num_free++;
+        cache->num_taken--;
+
+        // The slab was full, so it was not in the partial list
+        if (1 == slab->num_free) {
+            TAILQ_INSERT_TAIL(&cache->partial, slab, entries);
+        }
+
+        if (cache->objs_per_slab == slab->num_free) {
+            if (cache->num_empty < max_empty) {
+                cache->num_empty++;
+            } else {
+                TAILQ_REMOVE(&cache->partial, slab, entries);
+                TAILQ_INSERT_TAIL(to_free, slab, entries);
+                cache->num_slabs--;
+            }
+        }
+    }
+}
+
+static inline com_slab_magazine_t *get_magazine_nolock(com_slab_cpu_t *cpu_slab,
+                                                       size_t cache_id) {
+    if (KUNKLIKELY(NULL == cpu_slab->magazines)) {
+        size_t size         = NUM_CACHES * sizeof(com_slab_magazine_t);
+        cpu_slab->magazines = (void *)ARCH_PHYS_TO_HHDM(
+            COM_MM_PMM_ALLOC_BYTES(size));
+    }
+
+    return &cpu_slab->magazines[cache_id];
+}
+
+static void *cache_alloc(com_slab_cache_t *cache) {
+    // If we get preempted and migrated before taking the lock we'll just be
+    // using another CPU's magazine, which is still correct
+    com_slab_cpu_t *cpu_slab = &ARCH_CPU_GET()->slab;
+    kspinlock_acquire(&cpu_slab->lock);
+    com_slab_magazine_t *magazine = get_magazine_nolock(cpu_slab, cache->id);
+
+    if (0 == magazine->num_objs) {
+        kspinlock_acquire(&cache->lock);
+        cache_refill_nolock(cache,
+                            magazine,
+                            KMAX(cache->magazine_size / 2, 1UL));
+        kspinlock_release(&cache->lock);
+    }
+
+    void *obj = obj_stack_pop(cache, &magazine->objs, &magazine->num_objs);
+    magazine->num_allocs++;
+    kspinlock_release(&cpu_slab->lock);
+    return obj;
+}
+
+static void cache_free(com_slab_cache_t *cache, void *obj) {
+    struct slab_tailq to_free;
+    TAILQ_INIT(&to_free);
+
+    com_slab_cpu_t *cpu_slab = &ARCH_CPU_GET()->slab;
+    kspinlock_acquire(&cpu_slab->lock);
+    com_slab_magazine_t *magazine = get_magazine_nolock(cpu_slab, cache->id);
+    obj_stack_push(cache, &magazine->objs, &magazine->num_objs, obj);
+    magazine->num_frees++;
+
+    if (magazine->num_objs > cache->magazine_size) {
+        kspinlock_acquire(&cache->lock);
+        cache_drain_nolock(cache,
+                           magazine,
+                           KMAX(cache->magazine_size / 2, 1UL),
+                           CONFIG_SLAB_MAX_EMPTY,
+                           &to_free);
+        kspinlock_release(&cache->lock);
+    }
+    kspinlock_release(&cpu_slab->lock);
+
+    struct slab *slab, *_;
+    TAILQ_FOREACH_SAFE(slab, &to_free, entries, _) {
+        slab_destroy(cache, slab);
+    }
+}
+
+// Calls fn on every CPU's slab state. Before SMP initialization there is only
+// the bootstrap CPU
+static void
+for_each_cpu(percpu_fn_t fn, com_slab_cache_t *cache, void *arg) {
+    if (NULL == x86_64_smp_get_cpu(0)) {
+        fn(&ARCH_CPU_GET()->slab, cache, arg);
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        fn(&cpu->slab, cache, arg);
+    }
+}
+
+static void
+cpu_drain_cache(com_slab_cpu_t *cpu_slab, com_slab_cache_t *cache, void *arg) {
+    (void)arg;
+
+    struct slab_tailq to_free;
+    TAILQ_INIT(&to_free);
+
+    kspinlock_acquire(&cpu_slab->lock);
+    if (NULL != cpu_slab->magazines) {
+        com_slab_magazine_t *magazine = &cpu_slab->magazines[cache->id];
+        kspinlock_acquire(&cache->lock);
+        cache_drain_nolock(cache, magazine, magazine->num_objs, 0, &to_free);
+        kspinlock_release(&cache->lock);
+        magazine->num_allocs = 0;
+        magazine->num_frees  = 0;
+    }
+    kspinlock_release(&cpu_slab->lock);
+
+    struct slab *slab, *_;
+    TAILQ_FOREACH_SAFE(slab, &to_free, entries, _) {
+        slab_destroy(cache, slab);
+    }
+}
+
+static void
+cpu_sum_stats(com_slab_cpu_t *cpu_slab, com_slab_cache_t *cache, void *arg) {
+    com_slab_cache_stats_t *out = arg;
+
+    kspinlock_acquire(&cpu_slab->lock);
+    if (NULL != cpu_slab->magazines) {
+        com_slab_magazine_t *magazine = &cpu_slab->magazines[cache->id];
+        out->num_allocs += magazine->num_allocs;
+        out->num_frees += magazine->num_frees;
+        out->num_active -= magazine->num_objs;
+    }
+    kspinlock_release(&cpu_slab->lock);
 }
 
 void *com_mm_slab_alloc(size_t size) {
-    size_t i = (size + 15) / 16;
+    size_t i = SIZE_TO_CLASS(size);
     KASSERT(i < NUM_SLABS);
-    slab_t *s = &Slabs[i];
+    com_slab_cache_t *cache = &Caches[i];
 
-    kspinlock_acquire(&Lock);
-    if (0 == s->next) {
-        init(s, size);
+    if (KUNKLIKELY(!__atomic_load_n(&cache->used, __ATOMIC_ACQUIRE))) {
+        kspinlock_acquire(&cache->lock);
+        if (!cache->used) {
+            cache->id = i;
+            cache_setup(cache,
+                        "generic",
+                        KMAX(i, 1UL) * 16,
+                        16,
+                        NULL,
+                        NULL,
+                        COM_MM_SLAB_CACHE_FLAGS_ZERO);
+            __atomic_store_n(&cache->used, true, __ATOMIC_RELEASE);
+        }
+        kspinlock_release(&cache->lock);
     }
-    uintptr_t *old_next = (uintptr_t *)s->next;
-    s->next             = *old_next;
-    kspinlock_release(&Lock);
 
-    *old_next = 0;
-    return old_next;
+    void *obj = cache_alloc(cache);
+    // Objects are zeroed here rather than on free, so that memory that is
+    // freed and never reused is not touched
+    kmemset(obj, size, 0);
+    return obj;
 }
 
 void com_mm_slab_free(void *ptr, size_t size) {
@@ -71,16 +430,117 @@ void com_mm_slab_free(void *ptr, size_t size) {
         return;
     }
 
-    size_t i = (size + 15) / 16;
+    size_t i = SIZE_TO_CLASS(size);
     KASSERT(i < NUM_SLABS);
-    slab_t *s = &Slabs[i];
+    cache_free(&Caches[i], ptr);
+}
+
+com_slab_cache_t *com_mm_slab_cache_new(const char          *name,
+                                        size_t               size,
+                                        size_t               align,
+                                        com_intf_slab_ctor_t ctor,
+                                        com_intf_slab_ctor_t dtor,
+                                        int                  flags) {
+    com_slab_cache_t *cache = NULL;
+
+    // The cache is set up before it is marked as used, so that statistics
+    // readers never see it half-initialized
+    kspinlock_acquire(&CachesLock);
+    for (size_t i = NUM_SLABS; i < NUM_CACHES; i++) {
+        if (!Caches[i].used) {
+            cache       = &Caches[i];
+            cache->id   = i;
+            cache->lock = KSPINLOCK_NEW();
+            cache_setup(cache, name, size, align, ctor, dtor, flags);
+            __atomic_store_n(&cache->used, true, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    kspinlock_release(&CachesLock);
 
-    uintptr_t *new_head = ptr;
-    kmemset(new_head, size, 0);
-    kspinlock_acquire(&Lock);
-    *new_head = s->next;
-    s->next   = (uintptr_t)new_head;
-    kspinlock_release(&Lock);
+    if (NULL == cache) {
+        KLOG("unable to create slab cache %s: too many caches", name);
+        return NULL;
+    }
+
+    KDEBUG("created slab cache %s with size=%zu stride=%zu objs/slab=%zu",
+           name,
+           size,
+           cache->stride,
+           cache->objs_per_slab);
+    return cache;
+}
+
+void com_mm_slab_cache_destroy(com_slab_cache_t *cache) {
+    // Cached objects go back to their slabs, which are all freed since no
+    // empty slab is kept
+    // This also resets the per-CPU counters for whichever cache reuses the slot
+    for_each_cpu(cpu_drain_cache, cache, NULL);
+
+    kspinlock_acquire(&cache->lock);
+    KASSERT(0 == cache->num_taken);
+    struct slab_tailq to_free;
+    TAILQ_INIT(&to_free);
+    TAILQ_CONCAT(&to_free, &cache->partial, entries);
+    cache->num_slabs = 0;
+    cache->num_empty = 0;
+    kspinlock_release(&cache->lock);
+
+    struct slab *slab, *_;
+    TAILQ_FOREACH_SAFE(slab, &to_free, entries, _) {
+        slab_destroy(cache, slab);
+    }
+
+    kspinlock_acquire(&CachesLock);
+    cache->used = false;
+    kspinlock_release(&CachesLock);
+}
+
+void *com_mm_slab_cache_alloc(com_slab_cache_t *cache) {
+    void *obj = cache_alloc(cache);
+
+    if (COM_MM_SLAB_CACHE_FLAGS_ZERO & cache->flags) {
+        kmemset(obj, cache->size, 0);
+    }
+
+    return obj;
+}
+
+void com_mm_slab_cache_free(com_slab_cache_t *cache, void *obj) {
+    if (NULL == obj) {
+        return;
+    }
+
+    cache_free(cache, obj);
+}
+
+void com_mm_slab_cache_get_stats(com_slab_cache_stats_t *out,
+                                 com_slab_cache_t       *cache) {
+    kspinlock_acquire(&cache->lock);
+    *out = (com_slab_cache_stats_t){.name           = cache->name,
+                                    .obj_size       = cache->size,
+                                    .num_active     = cache->num_taken,
+                                    .num_slabs      = cache->num_slabs,
+                                    .num_ctor_calls = cache->num_ctor_calls};
+    kspinlock_release(&cache->lock);
+
+    for_each_cpu(cpu_sum_stats, cache, out);
+}
+
+size_t com_mm_slab_get_num_slots(void) {
+    return NUM_CACHES;
+}
+
+// Slots cover both the generic size classes and named caches, and are empty
+// until a cache is set up in them
+bool com_mm_slab_get_slot(com_slab_cache_stats_t *out, size_t slot) {
+    KASSERT(slot < NUM_CACHES);
+    com_slab_cache_t *cache = &Caches[slot];
+
+    if (!__atomic_load_n(&cache->used, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
 
-    // TODO: free slab page if needed
+    com_mm_slab_cache_get_stats(out, cache);
+    return true;
 }
@@ -18,6 +18,7 @@
 
 #include <arch/cpu.h>
 #include <arch/info.h>
+#include <kernel/com/fs/vfs.h>
 #include <kernel/com/mm/pmm.h>
 #include <kernel/com/mm/slab.h>
 #include <kernel/com/mm/vmm.h>
@@ -29,11 +30,29 @@
 #include <lib/str.h>
 #include <lib/sync.h>
 #include <stdatomic.h>
+#include <vendor/tailq.h>
 
-#define UNMAP_MAX_ARRAY_ON_STACK 64
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+#define LARGE_PAGE_PAGES (ARCH_MMU_LARGE_PAGE_SIZE / ARCH_PAGE_SIZE)
+#endif
+
+#define VMA_ENTRY(node_ptr) KAVLTREE_ENTRY(node_ptr, com_vmm_vma_t, node)
+#define VMA_NEXT(vma)       VMA_ENTRY(kavltree_next(&(vma)->node))
+#define VMA_PREV(vma)       VMA_ENTRY(kavltree_prev(&(vma)->node))
+
+TAILQ_HEAD(vma_tailq, com_vmm_vma);
 
 static com_vmm_context_t RootContext = {0};
 static void             *ZeroPage    = NULL;
+static com_slab_cache_t *VmaCache    = NULL;
+
+// Pages removed by com_mm_vmm_unmap. Other CPUs may still reach them through
+// stale TLB entries, so they are only freed once the shootdown has completed
+struct unmap_batch {
+    size_t buf_pages;
+    size_t num_pages;
+    void  *pages[];
+};
 
 static inline com_vmm_context_t *vmm_current_context(void) {
     com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
@@ -55,6 +74,492 @@ vmm_ensure_context(com_vmm_context_t *context) {
     return context;
 }
 
+static void unmap_batch_free(void *arg) {
+    struct unmap_batch *batch = arg;
+
+    for (size_t i = 0; i < batch->num_pages; i++) {
+        com_mm_pmm_free(batch->pages[i]);
+    }
+
+    com_mm_pmm_free_many((void *)ARCH_HHDM_TO_PHYS(batch), batch->buf_pages);
+}
+
+static struct unmap_batch *unmap_batch_new(size_t max_pages) {
+    size_t buf_pages = (sizeof(struct unmap_batch) +
+                        max_pages * sizeof(void *) + ARCH_PAGE_SIZE - 1) /
+                       ARCH_PAGE_SIZE;
+    struct unmap_batch *batch = (void *)ARCH_PHYS_TO_HHDM(
+        com_mm_pmm_alloc_many(buf_pages));
+    batch->buf_pages = buf_pages;
+    batch->num_pages = 0;
+    return batch;
+}
+
+// Removes the mapping at virt, which may span up to max_pages pages, and adds
+// the memory it mapped to batch. Returns the number of pages removed
+static size_t unmap_batch_add(struct unmap_batch *batch,
+                              com_vmm_context_t  *context,
+                              void               *virt,
+                              size_t              max_pages) {
+    void **phys = &batch->pages[batch->num_pages];
+
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+    // Large pages that are entirely within the range are removed as a whole,
+    // all others are split by arch_mmu_unmap
+    if (0 == (uintptr_t)virt % ARCH_MMU_LARGE_PAGE_SIZE &&
+        max_pages >= LARGE_PAGE_PAGES &&
+        arch_mmu_unmap_large(&phys[0], context->pagetable, virt)) {
+        for (size_t i = 1; i < LARGE_PAGE_PAGES; i++) {
+            phys[i] = phys[0] + i * ARCH_PAGE_SIZE;
+        }
+        batch->num_pages += LARGE_PAGE_PAGES;
+        return LARGE_PAGE_PAGES;
+    }
+#endif
+
+    if (!arch_mmu_unmap(&phys[0], context->pagetable, virt)) {
+        return 0;
+    }
+
+    batch->num_pages++;
+    return 1;
+}
+
+// Invalidates the range the pages in batch were unmapped from. The pages are
+// freed as soon as all CPUs have acknowledged the shootdown, so there is no
+// need to wait for them here
+static void unmap_batch_commit(struct unmap_batch *batch,
+                               com_vmm_context_t  *context,
+                               void               *virt,
+                               size_t              pages) {
+    if (0 == batch->num_pages) {
+        unmap_batch_free(batch);
+        return;
+    }
+
+    arch_mmu_invalidate_async(context->pagetable,
+                              virt,
+                              pages,
+                              unmap_batch_free,
+                              batch);
+}
+
+// VMA TREE
+
+static int vma_cmp(kavltree_node_t *a, kavltree_node_t *b) {
+    uintptr_t a_start = VMA_ENTRY(a)->start;
+    uintptr_t b_start = VMA_ENTRY(b)->start;
+    return (a_start > b_start) - (a_start < b_start);
+}
+
+static inline bool vma_tracked(com_vmm_context_t *context, uintptr_t virt) {
+    return &RootContext != context && ARCH_MMU_ADDR_IS_USER(virt);
+}
+
+// Returns the lowest VMA that ends after addr, which is also the one that
+// contains addr if there is one
+static com_vmm_vma_t *vma_lower_bound_nolock(com_vmm_context_t *context,
+                                             uintptr_t          addr) {
+    kavltree_node_t *node = context->vmas.root;
+    com_vmm_vma_t   *ret  = NULL;
+
+    while (NULL != node) {
+        com_vmm_vma_t *vma = VMA_ENTRY(node);
+        if (vma->end > addr) {
+            ret  = vma;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return ret;
+}
+
+static com_vmm_vma_t *vma_dup(com_vmm_vma_t *vma) {
+    com_vmm_vma_t *new = com_mm_slab_cache_alloc(VmaCache);
+    *new               = *vma;
+    if (NULL != new->vnode) {
+        COM_FS_VFS_VNODE_HOLD(new->vnode);
+    }
+    return new;
+}
+
+static void vma_remove_nolock(com_vmm_context_t *context,
+                              com_vmm_vma_t     *vma,
+                              struct vma_tailq  *dead) {
+    kavltree_remove(&context->vmas, &vma->node);
+    context->num_vmas--;
+    TAILQ_INSERT_TAIL(dead, vma, dead);
+}
+
+// Releasing a vnode may block, so dead VMAs are only freed after the context
+// lock has been dropped
+static void vma_free_dead(struct vma_tailq *dead) {
+    com_vmm_vma_t *vma, *_;
+    TAILQ_FOREACH_SAFE(vma, dead, dead, _) {
+        COM_FS_VFS_VNODE_RELEASE(vma->vnode);
+        com_mm_slab_cache_free(VmaCache, vma);
+    }
+}
+
+// Makes sure that no VMA crosses addr by splitting the one that contains it
+static void vma_split_nolock(com_vmm_context_t *context, uintptr_t addr) {
+    com_vmm_vma_t *vma = vma_lower_bound_nolock(context, addr);
+
+    if (NULL == vma || vma->start >= addr) {
+        return;
+    }
+
+    com_vmm_vma_t *right = vma_dup(vma);
+    right->off += addr - vma->start;
+    right->start = addr;
+    vma->end     = addr;
+    kavltree_insert(&context->vmas, &right->node);
+    context->num_vmas++;
+}
+
+// Removes [start, end) from the VMA tree, splitting VMAs that partially
+// overlap it
+static void vma_carve_nolock(com_vmm_context_t *context,
+                             uintptr_t          start,
+                             uintptr_t          end,
+                             struct vma_tailq  *dead) {
+    vma_split_nolock(context, start);
+    vma_split_nolock(context, end);
+
+    com_vmm_vma_t *vma = vma_lower_bound_nolock(context, start);
+    while (NULL != vma && vma->start < end) {
+        com_vmm_vma_t *next = VMA_NEXT(vma);
+        vma_remove_nolock(context, vma, dead);
+        vma = next;
+    }
+}
+
+static inline bool vma_can_merge(com_vmm_vma_t *left, com_vmm_vma_t *right) {
+    return left->end == right->start && left->vmm_flags == right->vmm_flags &&
+           left->mmu_flags == right->mmu_flags && left->vnode == right->vnode &&
+           (NULL == left->vnode ||
+            left->off + (left->end - left->start) == right->off);
+}
+
+// Records [start, end) in the VMA tree, replacing whatever was there before.
+// The new range is merged with its neighbours if their attributes match
+static void vma_insert_nolock(com_vmm_context_t *context,
+                              uintptr_t          start,
+                              uintptr_t          end,
+                              int                vmm_flags,
+                              arch_mmu_flags_t   mmu_flags,
+                              struct vma_tailq  *dead) {
+    vma_carve_nolock(context, start, end, dead);
+
+    com_vmm_vma_t *vma = com_mm_slab_cache_alloc(VmaCache);
+    vma->start         = start;
+    vma->end           = end;
+    vma->vmm_flags     = vmm_flags;
+    vma->mmu_flags     = mmu_flags;
+    vma->vnode         = NULL;
+    vma->off           = 0;
+    vma->fault_last    = 0;
+    vma->fault_next    = 0;
+    vma->fault_window  = CONFIG_VMM_PREFAULT_INIT;
+    kavltree_insert(&context->vmas, &vma->node);
+    context->num_vmas++;
+
+    com_vmm_vma_t *prev = VMA_PREV(vma);
+    if (NULL != prev && vma_can_merge(prev, vma)) {
+        prev->end = vma->end;
+        vma_remove_nolock(context, vma, dead);
+        vma = prev;
+    }
+
+    com_vmm_vma_t *next = VMA_NEXT(vma);
+    if (NULL != next && vma_can_merge(vma, next)) {
+        vma->end = next->end;
+        vma_remove_nolock(context, next, dead);
+    }
+}
+
+// First-fit search for a free range of len bytes aligned to align (a power of
+// two) in the anonymous mapping area. Returns 0 if there is none
+static uintptr_t
+vma_find_gap_nolock(com_vmm_context_t *context, size_t len, size_t align) {
+    uintptr_t addr = CONFIG_VMM_ANON_START;
+
+    for (com_vmm_vma_t *vma = vma_lower_bound_nolock(context, addr);
+         NULL != vma && vma->start < addr + len;
+         vma = VMA_NEXT(vma)) {
+        addr = (KMAX(addr, vma->end) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+
+    if (addr + len > (uintptr_t)ARCH_MMU_USERSPACE_END) {
+        return 0;
+    }
+
+    return addr;
+}
+
+// Returns the alignment for a new anonymous range of len_bytes bytes. Ranges
+// that can hold a large page are aligned to its size
+static inline size_t anon_range_align(size_t len_bytes) {
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+    if (len_bytes >= ARCH_MMU_LARGE_PAGE_SIZE) {
+        return ARCH_MMU_LARGE_PAGE_SIZE;
+    }
+#else
+    (void)len_bytes;
+#endif
+    return ARCH_PAGE_SIZE;
+}
+
+// Copies the first VMA that ends after addr into out, provided that it starts
+// before end. Returns false if there is no such VMA
+static bool vma_next_in_range(com_vmm_vma_t     *out,
+                              com_vmm_context_t *context,
+                              uintptr_t          addr,
+                              uintptr_t          end) {
+    kspinlock_acquire(&context->lock);
+    com_vmm_vma_t *vma   = vma_lower_bound_nolock(context, addr);
+    bool           found = NULL != vma && vma->start < end;
+    if (found) {
+        *out = *vma;
+    }
+    kspinlock_release(&context->lock);
+    return found;
+}
+
+// Anonymous memory is backed by the zero page until it is first written to
+static inline bool vma_is_anon(com_vmm_vma_t *vma) {
+    return NULL == vma->vnode && COM_MM_VMM_FLAGS_ALLOCATE & vma->vmm_flags;
+}
+
+// Returns the flags an anonymous page gets once it has its own memory, which
+// are the same that the fault handler derives from the zero page mapping
+static arch_mmu_flags_t anon_page_flags(arch_mmu_flags_t mmu_flags) {
+    mmu_flags &= ~ARCH_MMU_EXTRA_FLAGS_NOCOPY;
+    if (ARCH_MMU_EXTRA_FLAGS_PRIVATE & mmu_flags) {
+        mmu_flags &= ~ARCH_MMU_EXTRA_FLAGS_PRIVATE;
+        mmu_flags |= ARCH_MMU_FLAGS_WRITE;
+    }
+    return mmu_flags;
+}
+
+// Returns the number of consecutive pages from start, up to max_pages, that
+// are still backed by the zero page. Anonymous pages only get or lose their
+// own memory under the context lock, which must be held
+static size_t
+zero_run_nolock(com_vmm_context_t *context, uintptr_t start, size_t max_pages) {
+    size_t run = 0;
+    while (run < max_pages &&
+           ZeroPage == arch_mmu_get_physical(
+                           context->pagetable,
+                           (void *)(start + run * ARCH_PAGE_SIZE))) {
+        run++;
+    }
+    return run;
+}
+
+// Maps the pages of the block at phys that are still backed by the zero page
+// at virt, and frees the others, which a fault has already given memory to
+static void map_over_zero_nolock(com_vmm_context_t *context,
+                                 uintptr_t          virt,
+                                 void              *phys,
+                                 size_t             pages,
+                                 arch_mmu_flags_t   mmu_flags) {
+    for (size_t i = 0; i < pages; i++, virt += ARCH_PAGE_SIZE) {
+        if (ZeroPage != arch_mmu_get_physical(context->pagetable,
+                                              (void *)virt)) {
+            com_mm_pmm_free(phys + i * ARCH_PAGE_SIZE);
+            continue;
+        }
+
+        KASSERT_CALL_SUCCESSFUL(arch_mmu_map(context->pagetable,
+                                             (void *)virt,
+                                             phys + i * ARCH_PAGE_SIZE,
+                                             mmu_flags));
+    }
+}
+
+// Gives their own memory to the pages in the range that are still backed by
+// the zero page. Runs of such pages are allocated as a single block, and whole
+// aligned runs are mapped with large pages. Memory is allocated without the
+// context lock, so runs are checked again before they are mapped
+static void populate_anon(com_vmm_context_t *context,
+                          uintptr_t          start,
+                          uintptr_t          end,
+                          arch_mmu_flags_t   mmu_flags) {
+    uintptr_t curr = start;
+
+    while (curr < end) {
+        size_t max_run = KMIN(CONFIG_VMM_PREFAULT_MAX,
+                              (end - curr) / ARCH_PAGE_SIZE);
+        kspinlock_acquire(&context->lock);
+        size_t run = zero_run_nolock(context, curr, max_run);
+        kspinlock_release(&context->lock);
+
+        if (0 == run) {
+            curr += ARCH_PAGE_SIZE;
+            continue;
+        }
+
+        size_t alloc_size;
+        void  *phys = com_mm_pmm_alloc_max_zero(&alloc_size, run);
+
+        kspinlock_acquire(&context->lock);
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+        if (LARGE_PAGE_PAGES == alloc_size &&
+            0 == curr % ARCH_MMU_LARGE_PAGE_SIZE &&
+            LARGE_PAGE_PAGES ==
+                zero_run_nolock(context, curr, LARGE_PAGE_PAGES)) {
+            KASSERT_CALL_SUCCESSFUL(
+                arch_mmu_map(context->pagetable,
+                             (void *)curr,
+                             phys,
+                             mmu_flags | ARCH_MMU_EXTRA_FLAGS_LARGE));
+            kspinlock_release(&context->lock);
+            curr += ARCH_MMU_LARGE_PAGE_SIZE;
+            continue;
+        }
+#endif
+        map_over_zero_nolock(context, curr, phys, alloc_size, mmu_flags);
+        kspinlock_release(&context->lock);
+        curr += alloc_size * ARCH_PAGE_SIZE;
+    }
+
+    // Other threads may still read the zero page through stale TLB entries
+    arch_mmu_invalidate(context->pagetable,
+                        (void *)start,
+                        (end - start) / ARCH_PAGE_SIZE);
+}
+
+// Returns the memory of all pages in the range to the PMM and backs them with
+// the zero page again, as if they had just been mapped
+static void discard_anon(com_vmm_context_t *context,
+                         uintptr_t          start,
+                         uintptr_t          end,
+                         arch_mmu_flags_t   mmu_flags) {
+    size_t              pages = (end - start) / ARCH_PAGE_SIZE;
+    struct unmap_batch *batch = unmap_batch_new(pages);
+
+    kspinlock_acquire(&context->lock);
+    for (uintptr_t curr = start; curr < end;) {
+        void *phys = arch_mmu_get_physical(context->pagetable, (void *)curr);
+        if (NULL == phys || ZeroPage == phys) {
+            curr += ARCH_PAGE_SIZE;
+            continue;
+        }
+
+        size_t unmapped = unmap_batch_add(batch,
+                                          context,
+                                          (void *)curr,
+                                          (end - curr) / ARCH_PAGE_SIZE);
+        if (0 == unmapped) {
+            curr += ARCH_PAGE_SIZE;
+            continue;
+        }
+
+        for (size_t i = 0; i < unmapped; i++, curr += ARCH_PAGE_SIZE) {
+            com_mm_pmm_hold(ZeroPage);
+            KASSERT_CALL_SUCCESSFUL(arch_mmu_map(context->pagetable,
+                                                 (void *)curr,
+                                                 ZeroPage,
+                                                 mmu_flags));
+        }
+    }
+    kspinlock_release(&context->lock);
+
+    unmap_batch_commit(batch, context, (void *)start, pages);
+}
+
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+// Backs the untouched large page around virt with a single block of zeroed
+// memory if it lies entirely within an anonymous VMA. Returns false if the
+// caller should fall back to 4K pages
+static bool fault_large_anon(com_vmm_context_t *context,
+                             void              *virt,
+                             arch_mmu_flags_t   mmu_flags) {
+    uintptr_t start = (uintptr_t)virt &
+                      ~(uintptr_t)(ARCH_MMU_LARGE_PAGE_SIZE - 1);
+
+    kspinlock_acquire(&context->lock);
+    com_vmm_vma_t *vma      = com_mm_vmm_find_vma_nolock(context,
+                                                         (void *)start);
+    bool           eligible = NULL != vma && NULL == vma->vnode &&
+                    COM_MM_VMM_FLAGS_ALLOCATE & vma->vmm_flags &&
+                    vma->end - start >= ARCH_MMU_LARGE_PAGE_SIZE;
+    kspinlock_release(&context->lock);
+
+    if (!eligible) {
+        return false;
+    }
+
+    // A smaller block means that memory is too fragmented, in which case it is
+    // not worth reclaiming anything just for this
+    size_t alloc_size;
+    void  *phys = com_mm_pmm_alloc_max_zero(&alloc_size, LARGE_PAGE_PAGES);
+    if (LARGE_PAGE_PAGES != alloc_size) {
+        com_mm_pmm_free_many(phys, alloc_size);
+        return false;
+    }
+
+    // Another thread may have touched part of the region in the meantime
+    kspinlock_acquire(&context->lock);
+    bool mapped = LARGE_PAGE_PAGES ==
+                      zero_run_nolock(context, start, LARGE_PAGE_PAGES) &&
+                  arch_mmu_map(context->pagetable,
+                               (void *)start,
+                               phys,
+                               mmu_flags | ARCH_MMU_EXTRA_FLAGS_LARGE);
+    kspinlock_release(&context->lock);
+
+    if (!mapped) {
+        com_mm_pmm_free_many(phys, LARGE_PAGE_PAGES);
+        return false;
+    }
+
+    arch_mmu_invalidate(context->pagetable, (void *)start, LARGE_PAGE_PAGES);
+    return true;
+}
+#endif
+
+// FAULT-AROUND
+
+// Faults that land after the previous one but no further than the end of its
+// window continue a forward scan. The pages in between were either mapped by
+// the previous fault or skipped by the scan
+static bool fault_window_update_nolock(com_vmm_context_t *context,
+                                       com_vmm_vma_t     *vma,
+                                       uintptr_t          page) {
+    bool sequential = 0 != vma->fault_last && page > vma->fault_last &&
+                      page <= vma->fault_next;
+
+    if (sequential) {
+        __atomic_add_fetch(&context->fault_stats.num_sequential,
+                           1,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&context->fault_stats.num_prefault_hits,
+                           (page - vma->fault_last) / ARCH_PAGE_SIZE - 1,
+                           __ATOMIC_RELAXED);
+        vma->fault_window = KMIN(vma->fault_window * 2,
+                                 CONFIG_VMM_PREFAULT_MAX);
+    } else {
+        vma->fault_window = KMAX(vma->fault_window / 2,
+                                 CONFIG_VMM_PREFAULT_MIN);
+    }
+
+    vma->fault_last = page;
+    return sequential;
+}
+
+static inline void fault_account(com_vmm_context_t *context, size_t pages) {
+    __atomic_add_fetch(&context->fault_stats.num_faults, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&context->fault_stats.num_prefaulted,
+                       pages - 1,
+                       __ATOMIC_RELAXED);
+}
+
+// INTERFACE FUNCTIONS
+
 com_vmm_context_t *com_mm_vmm_new_context(arch_mmu_pagetable_t *pagetable) {
     if (NULL == pagetable) {
         pagetable = arch_mmu_new_table();
@@ -62,7 +567,10 @@ com_vmm_context_t *com_mm_vmm_new_context(arch_mmu_pagetable_t *pagetable) {
 
     com_vmm_context_t *context = com_mm_slab_alloc(sizeof(com_vmm_context_t));
     context->pagetable         = pagetable;
+    context->num_vmas          = 0;
     context->lock              = KSPINLOCK_NEW();
+    context->fault_stats       = (com_vmm_fault_stats_t){0};
+    KAVLTREE_INIT(&context->vmas, vma_cmp);
     return context;
 }
 
@@ -74,7 +582,23 @@ void com_mm_vmm_destroy_context(com_vmm_context_t *context) {
     KASSERT(context->pagetable != arch_mmu_get_table());
     KASSERT(NULL != context->pagetable);
 
-    // TODO: reimplement this
+    struct vma_tailq dead;
+    TAILQ_INIT(&dead);
+
+    // Nobody else can reference the context at this point, the lock is only
+    // taken for consistency
+    kspinlock_acquire(&context->lock);
+    kavltree_node_t *node;
+    while (NULL != (node = context->vmas.root)) {
+        vma_remove_nolock(context, VMA_ENTRY(node), &dead);
+    }
+    kspinlock_release(&context->lock);
+    vma_free_dead(&dead);
+
+    // This drops the references held by the page tables on all user pages and
+    // frees the page tables themselves
+    arch_mmu_destroy_table(context->pagetable);
+    com_mm_slab_free(context, sizeof(com_vmm_context_t));
 }
 
 com_vmm_context_t *com_mm_vmm_duplicate_context(com_vmm_context_t *context) {
@@ -82,9 +606,23 @@ com_vmm_context_t *com_mm_vmm_duplicate_context(com_vmm_context_t *context) {
         return com_mm_vmm_new_context(NULL);
     }
 
+    com_profiler_data_t profiler_data = com_sys_profiler_start_function(
+        E_COM_PROFILE_FUNC_VMM_DUPLICATE);
     arch_mmu_pagetable_t *new_pt = arch_mmu_duplicate_table(context->pagetable);
     com_vmm_context_t    *new_vmm_ctx = com_mm_vmm_new_context(new_pt);
-    new_vmm_ctx->anon_pages           = context->anon_pages;
+
+    // The new context is not visible to anyone yet, so its tree can be built
+    // without holding its lock
+    kspinlock_acquire(&context->lock);
+    for (kavltree_node_t *node = kavltree_first(&context->vmas); NULL != node;
+         node = kavltree_next(node)) {
+        com_vmm_vma_t *new_vma = vma_dup(VMA_ENTRY(node));
+        kavltree_insert(&new_vmm_ctx->vmas, &new_vma->node);
+        new_vmm_ctx->num_vmas++;
+    }
+    kspinlock_release(&context->lock);
+
+    com_sys_profiler_end_function(&profiler_data);
     return new_vmm_ctx;
 }
 
@@ -133,15 +671,34 @@ void *com_mm_vmm_map(com_vmm_context_t *context,
 
     context = vmm_ensure_context(context);
 
+    struct vma_tailq dead;
+    TAILQ_INIT(&dead);
+
     if (COM_MM_VMM_FLAGS_NOHINT & vmm_flags) {
         if (COM_MM_VMM_FLAGS_ANONYMOUS & vmm_flags) {
             KASSERT(&RootContext != context);
             KASSERT(RootContext.pagetable != context->pagetable);
+            // The range is reserved in the VMA tree before the lock is dropped
+            // so that concurrent mappings cannot pick it as well
+            size_t len_bytes = size_in_pages * ARCH_PAGE_SIZE;
             kspinlock_acquire(&context->lock);
-            virt = (void *)(context->anon_pages * ARCH_PAGE_SIZE +
-                            CONFIG_VMM_ANON_START);
-            context->anon_pages += size_in_pages;
+            virt = (void *)vma_find_gap_nolock(context,
+                                               len_bytes,
+                                               anon_range_align(len_bytes));
+            if (NULL != virt) {
+                vma_insert_nolock(context,
+                                  (uintptr_t)virt,
+                                  (uintptr_t)virt + len_bytes,
+                                  vmm_flags & ~COM_MM_VMM_FLAGS_NOHINT,
+                                  mmu_flags,
+                                  &dead);
+            }
             kspinlock_release(&context->lock);
+            vma_free_dead(&dead);
+
+            if (NULL == virt) {
+                return NULL;
+            }
         } else if (COM_MM_VMM_FLAGS_PHYSICAL & vmm_flags) {
             virt = (void *)ARCH_PHYS_TO_HHDM(page_paddr);
             mmu_flags |= ARCH_MMU_FLAGS_GLOBAL;
@@ -150,6 +707,18 @@ void *com_mm_vmm_map(com_vmm_context_t *context,
         }
     } else {
         virt = (void *)((uintptr_t)virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
+
+        if (vma_tracked(context, (uintptr_t)virt)) {
+            kspinlock_acquire(&context->lock);
+            vma_insert_nolock(context,
+                              (uintptr_t)virt,
+                              (uintptr_t)virt + size_in_pages * ARCH_PAGE_SIZE,
+                              vmm_flags,
+                              mmu_flags,
+                              &dead);
+            kspinlock_release(&context->lock);
+            vma_free_dead(&dead);
+        }
     }
 
     for (size_t i = 0; i < size_in_pages; i++) {
@@ -162,6 +731,24 @@ void *com_mm_vmm_map(com_vmm_context_t *context,
             com_mm_pmm_hold(ZeroPage);
         }
 
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+        // Physically contiguous ranges (e.g., framebuffers) are mapped with
+        // large pages wherever both addresses are suitably aligned. Anonymous
+        // memory is only promoted to large pages on fault
+        if (!(COM_MM_VMM_FLAGS_ALLOCATE & vmm_flags) &&
+            0 == (uintptr_t)vaddr % ARCH_MMU_LARGE_PAGE_SIZE &&
+            0 == (uintptr_t)paddr % ARCH_MMU_LARGE_PAGE_SIZE &&
+            size_in_pages - i >= LARGE_PAGE_PAGES) {
+            bool success = arch_mmu_map(context->pagetable,
+                                        vaddr,
+                                        paddr,
+                                        mmu_flags | ARCH_MMU_EXTRA_FLAGS_LARGE);
+            KASSERT(success);
+            i += LARGE_PAGE_PAGES - 1;
+            continue;
+        }
+#endif
+
         bool success = arch_mmu_map(context->pagetable,
                                     vaddr,
                                     paddr,
@@ -193,37 +780,68 @@ void com_mm_vmm_unmap(com_vmm_context_t *context, void *virt, size_t len) {
     size_t size_in_pages = (size_p_off + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE;
     virt = (void *)((uintptr_t)virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
 
-    void  *tmp_phys_array[UNMAP_MAX_ARRAY_ON_STACK];
-    void **tmp_phys_buf       = tmp_phys_array;
-    size_t tmp_phys_buf_pages = (size_in_pages * sizeof(void *) +
-                                 ARCH_PAGE_SIZE - 1) /
-                                ARCH_PAGE_SIZE;
-    size_t unmaps_done = 0;
-    if (size_in_pages > UNMAP_MAX_ARRAY_ON_STACK) {
-        tmp_phys_buf = (void *)ARCH_PHYS_TO_HHDM(
-            com_mm_pmm_alloc_many(tmp_phys_buf_pages));
+    if (vma_tracked(context, (uintptr_t)virt)) {
+        struct vma_tailq dead;
+        TAILQ_INIT(&dead);
+        kspinlock_acquire(&context->lock);
+        vma_carve_nolock(context,
+                         (uintptr_t)virt,
+                         (uintptr_t)virt + size_in_pages * ARCH_PAGE_SIZE,
+                         &dead);
+        kspinlock_release(&context->lock);
+        vma_free_dead(&dead);
     }
 
-    for (size_t i = 0; i < size_in_pages; i++) {
-        size_t offset = i * ARCH_PAGE_SIZE;
-        if (!arch_mmu_unmap(&tmp_phys_buf[i],
-                            context->pagetable,
-                            virt + offset)) {
-            tmp_phys_buf[i] = NULL;
+    struct unmap_batch *batch       = unmap_batch_new(size_in_pages);
+    size_t              unmaps_done = 0;
+    while (unmaps_done < size_in_pages) {
+        size_t unmapped = unmap_batch_add(batch,
+                                          context,
+                                          virt + unmaps_done * ARCH_PAGE_SIZE,
+                                          size_in_pages - unmaps_done);
+        if (0 == unmapped) {
             break;
         }
-        unmaps_done++;
+        unmaps_done += unmapped;
     }
 
-    arch_mmu_invalidate(context->pagetable, virt, unmaps_done);
+    unmap_batch_commit(batch, context, virt, unmaps_done);
+}
+
+void com_mm_vmm_populate(com_vmm_context_t *context, void *virt, size_t len) {
+    context         = vmm_ensure_context(context);
+    uintptr_t start = (uintptr_t)virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    uintptr_t end   = ((uintptr_t)virt + len + ARCH_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
 
-    for (size_t i = 0; i < unmaps_done; i++) {
-        com_mm_pmm_free(tmp_phys_buf[i]);
+    com_vmm_vma_t vma;
+    while (start < end && vma_next_in_range(&vma, context, start, end)) {
+        if (vma_is_anon(&vma)) {
+            populate_anon(context,
+                          KMAX(start, vma.start),
+                          KMIN(end, vma.end),
+                          anon_page_flags(vma.mmu_flags));
+        }
+        start = vma.end;
     }
+}
+
+void com_mm_vmm_discard(com_vmm_context_t *context, void *virt, size_t len) {
+    context         = vmm_ensure_context(context);
+    uintptr_t start = (uintptr_t)virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    uintptr_t end   = ((uintptr_t)virt + len + ARCH_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
 
-    if (size_in_pages > UNMAP_MAX_ARRAY_ON_STACK) {
-        com_mm_pmm_free_many((void *)ARCH_HHDM_TO_PHYS(tmp_phys_buf),
-                             tmp_phys_buf_pages);
+    com_vmm_vma_t vma;
+    while (start < end && vma_next_in_range(&vma, context, start, end)) {
+        // Shared memory would be lost for everybody else as well
+        if (vma_is_anon(&vma) && !(COM_MM_VMM_FLAGS_SHARED & vma.vmm_flags)) {
+            discard_anon(context,
+                         KMAX(start, vma.start),
+                         KMIN(end, vma.end),
+                         vma.mmu_flags);
+        }
+        start = vma.end;
     }
 }
 
@@ -234,6 +852,8 @@ void com_mm_vmm_unmap(com_vmm_context_t *context, void *virt, size_t len) {
 // creates major issues for cases where user memory is accessed directly under a
 // spinlock, which is frequent as of now. Thus, this implies deeper kernel
 // restructuring.
+// Faults on pages that were not present no longer wait for other CPUs, but COW
+// faults still do, since they must not return while stale pages are readable.
 void com_mm_vmm_handle_fault(void            *fault_virt,
                              void            *fault_phys,
                              arch_context_t  *fault_ctx,
@@ -257,19 +877,47 @@ void com_mm_vmm_handle_fault(void            *fault_virt,
         goto kernel_thread;
     }
 
-    if (KLIKELY(COM_MM_VMM_FAULT_ATTR_MAP & attr)) {
+    if (COM_MM_VMM_FAULT_ATTR_COW_TABLE & attr) {
         void *fault_virt_page = (void *)((uintptr_t)fault_virt &
                                          ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
-        void *new_phys        = com_mm_pmm_alloc_many_zero(num_pages_hint);
-        for (size_t i = 0; i < num_pages_hint; i++) {
-            arch_mmu_map(curr_proc->vmm_context->pagetable,
-                         fault_virt_page + ARCH_PAGE_SIZE * i,
-                         new_phys + ARCH_PAGE_SIZE * i,
-                         mmu_flags_hint);
-        }
+        KASSERT_CALL_SUCCESSFUL(
+            arch_mmu_unshare_table(curr_proc->vmm_context->pagetable,
+                                   fault_virt_page));
         arch_mmu_invalidate(curr_proc->vmm_context->pagetable,
                             fault_virt_page,
-                            num_pages_hint);
+                            1);
+        goto end;
+    }
+
+    if (KLIKELY(COM_MM_VMM_FAULT_ATTR_MAP & attr)) {
+#ifdef ARCH_MMU_EXTRA_FLAGS_LARGE
+        if (COM_MM_VMM_FAULT_ATTR_LARGE & attr &&
+            fault_large_anon(curr_proc->vmm_context,
+                             fault_virt,
+                             mmu_flags_hint)) {
+            fault_account(curr_proc->vmm_context, LARGE_PAGE_PAGES);
+            goto end;
+        }
+#endif
+        fault_account(curr_proc->vmm_context, num_pages_hint);
+        void *fault_virt_page = (void *)((uintptr_t)fault_virt &
+                                         ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
+        void *new_phys        = com_mm_pmm_alloc_many_zero(num_pages_hint);
+        // Sibling threads may fault on, populate or discard the same pages
+        kspinlock_acquire(&curr_proc->vmm_context->lock);
+        map_over_zero_nolock(curr_proc->vmm_context,
+                             (uintptr_t)fault_virt_page,
+                             new_phys,
+                             num_pages_hint,
+                             mmu_flags_hint);
+        kspinlock_release(&curr_proc->vmm_context->lock);
+        // The pages were not present, so other CPUs can at worst take a
+        // spurious fault on them and there is no reason to wait
+        arch_mmu_invalidate_async(curr_proc->vmm_context->pagetable,
+                                  fault_virt_page,
+                                  num_pages_hint,
+                                  NULL,
+                                  NULL);
         // com_mm_pmm_free(ZeroPage);
         goto end;
     }
@@ -279,27 +927,45 @@ void com_mm_vmm_handle_fault(void            *fault_virt,
                                          ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
         void *fault_phys_page = (void *)((uintptr_t)fault_phys &
                                          ~(uintptr_t)(ARCH_PAGE_SIZE - 1));
+        com_vmm_context_t *context = curr_proc->vmm_context;
+
+        // If the page has been replaced meanwhile (e.g., by a sibling thread
+        // faulting on it or by madvise), the access is simply retried
+        kspinlock_acquire(&context->lock);
+        if (fault_phys_page !=
+            arch_mmu_get_physical(context->pagetable, fault_virt_page)) {
+            kspinlock_release(&context->lock);
+            goto end;
+        }
         if (!com_mm_pmm_is_shared(fault_phys_page)) {
-            arch_mmu_map(curr_proc->vmm_context->pagetable,
+            arch_mmu_map(context->pagetable,
                          fault_virt_page,
                          fault_phys_page,
                          mmu_flags_hint);
-            arch_mmu_invalidate(curr_proc->vmm_context->pagetable,
-                                fault_virt_page,
-                                1);
+            kspinlock_release(&context->lock);
+            arch_mmu_invalidate(context->pagetable, fault_virt_page, 1);
             goto end;
         }
+        kspinlock_release(&context->lock);
+
         void *fault_hhdm = (void *)ARCH_PHYS_TO_HHDM(fault_phys_page);
         void *new_phys   = (void *)com_mm_pmm_alloc();
         void *new_hhdm   = (void *)ARCH_PHYS_TO_HHDM(new_phys);
         kmemcpy(new_hhdm, fault_hhdm, ARCH_PAGE_SIZE);
-        arch_mmu_map(curr_proc->vmm_context->pagetable,
+
+        kspinlock_acquire(&context->lock);
+        if (fault_phys_page !=
+            arch_mmu_get_physical(context->pagetable, fault_virt_page)) {
+            kspinlock_release(&context->lock);
+            com_mm_pmm_free(new_phys);
+            goto end;
+        }
+        arch_mmu_map(context->pagetable,
                      fault_virt_page,
                      new_phys,
                      mmu_flags_hint);
-        arch_mmu_invalidate(curr_proc->vmm_context->pagetable,
-                            fault_virt_page,
-                            1);
+        kspinlock_release(&context->lock);
+        arch_mmu_invalidate(context->pagetable, fault_virt_page, 1);
         com_mm_pmm_free(fault_phys_page);
         goto end;
     }
@@ -328,23 +994,188 @@ void com_mm_vmm_init(void) {
     RootContext.pagetable = arch_mmu_get_table();
     RootContext.lock      = KSPINLOCK_NEW();
     ZeroPage              = com_mm_pmm_alloc_zero();
+
+    VmaCache = com_mm_slab_cache_new("vma",
+                                     sizeof(com_vmm_vma_t),
+                                     _Alignof(com_vmm_vma_t),
+                                     NULL,
+                                     NULL,
+                                     0);
+    KASSERT(NULL != VmaCache);
 }
 
 void *com_mm_vmm_prealloc_range(com_vmm_context_t   *context,
                                 com_vmm_range_type_t rangetype,
                                 size_t               len) {
-    (void)rangetype;
     context = vmm_ensure_context(context);
     KASSERT(&RootContext != context);
     KASSERT(RootContext.pagetable != context->pagetable);
 
+    struct vma_tailq dead;
+    TAILQ_INIT(&dead);
+    size_t len_bytes = (len + ARCH_PAGE_SIZE - 1) & ~(ARCH_PAGE_SIZE - 1);
+
+    // The range is recorded with no permissions. Subsequent mappings replace
+    // the reservation with their own attributes
+    // File ranges are mapped one page at a time, so only anonymous ranges can
+    // make use of large pages
+    size_t align = ARCH_PAGE_SIZE;
+    if (E_COM_VMM_RANGE_TYPE_ANONYMOUS == rangetype) {
+        align = anon_range_align(len_bytes);
+    }
+
     kspinlock_acquire(&context->lock);
-    void *range_base = (void *)(context->anon_pages * ARCH_PAGE_SIZE +
-                                CONFIG_VMM_ANON_START);
-    context->anon_pages += (len + ARCH_PAGE_SIZE - 1) / ARCH_PAGE_SIZE;
+    uintptr_t range_base = vma_find_gap_nolock(context, len_bytes, align);
+    if (0 != range_base) {
+        vma_insert_nolock(context,
+                          range_base,
+                          range_base + len_bytes,
+                          COM_MM_VMM_FLAGS_NONE,
+                          0,
+                          &dead);
+    }
     kspinlock_release(&context->lock);
+    vma_free_dead(&dead);
+
+    return (void *)range_base;
+}
+
+// Returns the range of pages around fault_virt that the fault handler may map
+// in one go. The range never leaves the VMA that contains fault_virt
+void com_mm_vmm_fault_window(uintptr_t *out_start,
+                             uintptr_t *out_end,
+                             void      *fault_virt) {
+    uintptr_t page = (uintptr_t)fault_virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    *out_start     = page;
+    *out_end       = page + ARCH_PAGE_SIZE;
 
-    return range_base;
+    com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
+    if (NULL == curr_thread || NULL == curr_thread->proc) {
+        return;
+    }
+
+    com_vmm_context_t *context = curr_thread->proc->vmm_context;
+    kspinlock_acquire(&context->lock);
+    com_vmm_vma_t *vma = com_mm_vmm_find_vma_nolock(context, (void *)page);
+    if (NULL != vma) {
+        // Scans only need the pages ahead, random accesses are just as likely
+        // to touch the neighbours on either side
+        size_t behind = 0;
+        if (!fault_window_update_nolock(context, vma, page)) {
+            behind = KMIN(vma->fault_window / 2,
+                          (page - vma->start) / ARCH_PAGE_SIZE);
+        }
+
+        uintptr_t start = page - behind * ARCH_PAGE_SIZE;
+        uintptr_t end   = start + vma->fault_window * ARCH_PAGE_SIZE;
+        *out_start      = start;
+        *out_end        = KMIN(end, vma->end);
+        vma->fault_next = *out_end;
+    }
+    kspinlock_release(&context->lock);
+}
+
+void com_mm_vmm_get_fault_stats(com_vmm_fault_stats_t *out,
+                                com_vmm_context_t     *context) {
+    context = vmm_ensure_context(context);
+    com_vmm_fault_stats_t *stats = &context->fault_stats;
+
+    out->num_faults     = __atomic_load_n(&stats->num_faults, __ATOMIC_RELAXED);
+    out->num_sequential = __atomic_load_n(&stats->num_sequential,
+                                          __ATOMIC_RELAXED);
+    out->num_prefaulted = __atomic_load_n(&stats->num_prefaulted,
+                                          __ATOMIC_RELAXED);
+    out->num_prefault_hits = __atomic_load_n(&stats->num_prefault_hits,
+                                             __ATOMIC_RELAXED);
+}
+
+void com_mm_vmm_set_backing(com_vmm_context_t *context,
+                            void              *virt,
+                            size_t             len,
+                            struct com_vnode  *vnode,
+                            uintmax_t          off) {
+    context         = vmm_ensure_context(context);
+    uintptr_t start = (uintptr_t)virt & ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    uintptr_t end   = ((uintptr_t)virt + len + ARCH_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    off -= (uintptr_t)virt - start;
+
+    if (!vma_tracked(context, start)) {
+        return;
+    }
+
+    // The range may have been merged with its neighbours while it was being
+    // mapped, so it is split back out first
+    kspinlock_acquire(&context->lock);
+    vma_split_nolock(context, start);
+    vma_split_nolock(context, end);
+    for (com_vmm_vma_t *vma = vma_lower_bound_nolock(context, start);
+         NULL != vma && vma->start < end;
+         vma = VMA_NEXT(vma)) {
+        if (NULL != vma->vnode) {
+            continue;
+        }
+
+        COM_FS_VFS_VNODE_HOLD(vnode);
+        vma->vnode = vnode;
+        vma->off   = off + (vma->start - start);
+    }
+    kspinlock_release(&context->lock);
+}
+
+com_vmm_vma_t *com_mm_vmm_find_vma_nolock(com_vmm_context_t *context,
+                                          void              *virt) {
+    context            = vmm_ensure_context(context);
+    com_vmm_vma_t *vma = vma_lower_bound_nolock(context, (uintptr_t)virt);
+
+    if (NULL == vma || vma->start > (uintptr_t)virt) {
+        return NULL;
+    }
+
+    return vma;
+}
+
+static void bench_shootdown_done(void *arg) {
+    __atomic_add_fetch((size_t *)arg, 1, __ATOMIC_RELEASE);
+}
+
+void com_mm_vmm_bench_shootdown(com_vmm_shootdown_bench_t *out, size_t n) {
+    *out = (com_vmm_shootdown_bench_t){0};
+
+    // A page of the caller's address space only needs to be dropped by CPUs
+    // running its other threads, while kernel pages are dropped everywhere.
+    // Neither page has to be mapped for the invalidation to be carried out
+    com_vmm_context_t *context = vmm_current_context();
+    void              *user    = (void *)ARCH_PAGE_SIZE;
+    void              *kernel  = (void *)ARCH_PHYS_TO_HHDM(ZeroPage);
+
+    uintmax_t start = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n && &RootContext != context; i++) {
+        arch_mmu_invalidate(context->pagetable, user, 1);
+    }
+    out->user_ns = ARCH_CPU_GET_TIME() - start;
+
+    start = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n; i++) {
+        arch_mmu_invalidate(context->pagetable, kernel, 1);
+    }
+    out->kernel_ns = ARCH_CPU_GET_TIME() - start;
+
+    // Asynchronous shootdowns are all sent before waiting for the first one,
+    // so their acknowledgements can be merged by the targets
+    size_t done = 0;
+    start       = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n; i++) {
+        arch_mmu_invalidate_async(context->pagetable,
+                                  kernel,
+                                  1,
+                                  bench_shootdown_done,
+                                  &done);
+    }
+    while (n != __atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        ARCH_CPU_PAUSE();
+    }
+    out->async_ns = ARCH_CPU_GET_TIME() - start;
 }
 
 void com_mm_vmm_init_reaper(void) {
@@ -21,7 +21,10 @@
 #include <kernel/com/mm/slab.h>
 #include <kernel/com/sys/callout.h>
 #include <kernel/com/sys/sched.h>
+#include <kernel/platform/x86-64/smp.h>
 #include <lib/util.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // CREDIT: vloxei64/ke
 // CREDIT: FreeBSD
@@ -34,41 +37,244 @@
 #error "unknown callout mode"
 #endif
 
+#define WHEEL_MASK (COM_SYS_CALLOUT_WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA \
+    ((1UL << (COM_SYS_CALLOUT_WHEEL_BITS * COM_SYS_CALLOUT_WHEEL_LEVELS)) - 1)
+#define WHEEL_SLOT(queue, level, index) \
+    (&(queue)->wheel[(level) * COM_SYS_CALLOUT_WHEEL_SLOTS + (index)])
+#define WHEEL_INDEX(tick, level) \
+    (((tick) >> ((level) * COM_SYS_CALLOUT_WHEEL_BITS)) & WHEEL_MASK)
+
 static com_callout_queue_t *BspCallout;
 
-static void enqueue_callout(com_callout_queue_t *cpu_callout,
-                            com_callout_t       *callout) {
-    // Add callout to the queue so that it is ordered
-    bool           added = false;
-    com_callout_t *curr  = TAILQ_FIRST(&cpu_callout->queue);
-    while (NULL != curr) {
-        if (callout->ns < curr->ns) {
-            TAILQ_INSERT_BEFORE(curr, callout, queue);
-            added = true;
-            break;
-        }
-        curr = TAILQ_NEXT(curr, queue);
+// The BSP sets up its queue before memory management is available
+static struct com_callout_list
+    BootWheel[COM_SYS_CALLOUT_WHEEL_LEVELS * COM_SYS_CALLOUT_WHEEL_SLOTS];
+static bool BootWheelUsed = false;
+
+static com_slab_cache_t *CalloutCache = NULL;
+
+// State shared by the callouts armed by com_sys_callout_bench
+struct callout_bench {
+    kspinlock_t    lock;
+    size_t         remaining;
+    uintmax_t      lateness_ns;
+    uintmax_t      last_ns;
+    com_waitlist_t waiters;
+};
+
+// Returns the tick at which the callout will run
+static uintmax_t wheel_insert(com_callout_queue_t *cpu_callout,
+                              com_callout_t       *callout) {
+    // Callouts run at the first tick at or after their deadline, and those
+    // whose deadline has already passed run at the next one
+    uintmax_t expires = (callout->ns + ARCH_TIMER_NS - 1) / ARCH_TIMER_NS;
+    expires           = KMAX(expires, cpu_callout->tick);
+    uintmax_t delta   = expires - cpu_callout->tick;
+
+    // Callouts beyond the range of the wheel wait in the last level and are
+    // put back in place when they get cascaded
+    if (delta > WHEEL_MAX_DELTA) {
+        delta   = WHEEL_MAX_DELTA;
+        expires = cpu_callout->tick + delta;
     }
 
-    // If the new callout was not added by the previous block, it means that its
-    // delay is higher than that of any other callout in the queue, so it needs
-    // to be placed at the end
-    if (!added) {
-        TAILQ_INSERT_TAIL(&cpu_callout->queue, callout, queue);
+    size_t level = 0;
+    while (level < COM_SYS_CALLOUT_WHEEL_LEVELS - 1 &&
+           delta >= 1UL << ((level + 1) * COM_SYS_CALLOUT_WHEEL_BITS)) {
+        level++;
     }
 
+    LIST_INSERT_HEAD(WHEEL_SLOT(cpu_callout,
+                                level,
+                                WHEEL_INDEX(expires, level)),
+                     callout,
+                     queue);
     callout->cpu_callout = cpu_callout;
+    return expires;
+}
+
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+#define QUEUE_CPU(queue) \
+    ((arch_cpu_t *)((uintptr_t)(queue) - offsetof(arch_cpu_t, callout)))
+
+// Returns the first tick at which the wheel has work to do, either running or
+// cascading callouts. Callouts in higher levels are only known to be somewhere
+// within their slot, so this may come before the first actual deadline
+static uintmax_t wheel_next_tick(com_callout_queue_t *cpu_callout) {
+    uintmax_t next = UINTMAX_MAX;
+    if (0 == cpu_callout->stats.num_pending) {
+        return next;
+    }
+
+    for (size_t level = 0; level < COM_SYS_CALLOUT_WHEEL_LEVELS; level++) {
+        size_t    shift = level * COM_SYS_CALLOUT_WHEEL_BITS;
+        uintmax_t base  = cpu_callout->tick >> shift;
+
+        // The current slot of a level has already been cascaded, unless the
+        // wheel is right at its start
+        size_t first = (0 == (cpu_callout->tick & ((1UL << shift) - 1))) ? 0
+                                                                         : 1;
+        for (size_t i = first; i < first + COM_SYS_CALLOUT_WHEEL_SLOTS; i++) {
+            if (!LIST_EMPTY(
+                    WHEEL_SLOT(cpu_callout, level, (base + i) & WHEEL_MASK))) {
+                next = KMIN(next, (base + i) << shift);
+                break;
+            }
+        }
+    }
+
+    return next;
+}
+
+// Arms the timer of the local CPU for the next thing it has to do: running
+// callouts or, unless it is idle, preempting the current thread
+static void timer_arm_nolock(com_callout_queue_t *cpu_callout) {
+    uintmax_t next = UINTMAX_MAX;
+
+    uintmax_t next_tick = wheel_next_tick(cpu_callout);
+    if (UINTMAX_MAX != next_tick) {
+        next = next_tick * ARCH_TIMER_NS;
+    }
+
+    if (!cpu_callout->idle) {
+        next = KMIN(next, cpu_callout->next_preempt);
+    }
+
+    cpu_callout->next_event = next;
+    ARCH_CPU_SET_TIMER(next);
+}
+
+// Makes sure that the owner of the queue gets a timer interrupt by deadline.
+// The timer of other CPUs cannot be programmed from here, so they are sent
+// the timer interrupt as an IPI and re-arm their own timer
+static void timer_kick_nolock(com_callout_queue_t *cpu_callout,
+                              uintmax_t            deadline) {
+    if (deadline >= cpu_callout->next_event) {
+        return;
+    }
+
+    cpu_callout->next_event = deadline;
+
+    if (&ARCH_CPU_GET()->callout == cpu_callout) {
+        ARCH_CPU_SET_TIMER(deadline);
+    } else {
+        ARCH_CPU_SEND_IPI(QUEUE_CPU(cpu_callout), ARCH_CPU_IPI_TIMER);
+    }
+}
+#endif
+
+static inline void enqueue_callout(com_callout_queue_t *cpu_callout,
+                                   com_callout_t       *callout) {
+    uintmax_t expires = wheel_insert(cpu_callout, callout);
+    cpu_callout->stats.num_pending++;
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    timer_kick_nolock(cpu_callout, expires * ARCH_TIMER_NS);
+#else
+    (void)expires;
+#endif
+}
+
+// Must be called with both the queue lock and the entry lock held
+static inline void dequeue_callout(com_callout_queue_t *cpu_callout,
+                                   com_callout_t       *callout) {
+    LIST_REMOVE(callout, queue);
+    callout->cpu_callout = NULL;
+    cpu_callout->stats.num_pending--;
+}
+
+// Moves the callouts in the current slot of level to the levels below. Their
+// deadlines are now less than a full turn of level away
+static void cascade_level(com_callout_queue_t *cpu_callout, size_t level) {
+    struct com_callout_list *slot = WHEEL_SLOT(
+        cpu_callout,
+        level,
+        WHEEL_INDEX(cpu_callout->tick, level));
+
+    com_callout_t *callout;
+    while (NULL != (callout = LIST_FIRST(slot))) {
+        LIST_REMOVE(callout, queue);
+        wheel_insert(cpu_callout, callout);
+    }
+}
+
+// Unlinks all callouts in the wheel and puts them in out
+static void wheel_take_all(com_callout_queue_t     *cpu_callout,
+                           struct com_callout_list *out) {
+    for (size_t i = 0;
+         i < COM_SYS_CALLOUT_WHEEL_LEVELS * COM_SYS_CALLOUT_WHEEL_SLOTS;
+         i++) {
+        com_callout_t *callout;
+        while (NULL != (callout = LIST_FIRST(&cpu_callout->wheel[i]))) {
+            LIST_REMOVE(callout, queue);
+            LIST_INSERT_HEAD(out, callout, queue);
+        }
+    }
+}
+
+// Places all callouts again relative to tick. Used when the wheel has fallen
+// too far behind to catch up one tick at a time, which happens if the timer
+// was not running for a while
+static void wheel_rebase(com_callout_queue_t *cpu_callout, uintmax_t tick) {
+    struct com_callout_list pending = LIST_HEAD_INITIALIZER(pending);
+    wheel_take_all(cpu_callout, &pending);
+    cpu_callout->tick = tick;
+
+    com_callout_t *callout;
+    while (NULL != (callout = LIST_FIRST(&pending))) {
+        LIST_REMOVE(callout, queue);
+        wheel_insert(cpu_callout, callout);
+    }
+}
+
+#if CONFIG_CALLOUT_MODE == CONST_CALLOUT_PER_CPU
+// Finds a CPU that is running something, so that an idle CPU can give its
+// callouts away
+static arch_cpu_t *find_busy_cpu(arch_cpu_t *curr_cpu) {
+    arch_cpu_t *cpu;
+
+    for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        com_thread_t *thread = __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED);
+        if (cpu != curr_cpu && cpu->idle_thread != thread) {
+            return cpu;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+// The time of a queue is otherwise only brought forward when its callouts are
+// run, which in tickless mode may have been long ago (e.g., before idling). It
+// never goes backwards, so that callouts are never run before their deadline
+static inline uintmax_t queue_now_nolock(com_callout_queue_t *cpu_callout) {
+    cpu_callout->ns = KMAX(cpu_callout->ns, ARCH_CPU_GET_TIME());
+    return cpu_callout->ns;
+}
+
+// Callouts go back to the cache unlocked and out of any queue, so only the
+// fields below need to be set on allocation
+static void callout_ctor(void *obj) {
+    com_callout_t *callout = obj;
+    callout->entry_lock    = KSPINLOCK_NEW();
+    callout->cpu_callout   = NULL;
+}
+
+static com_callout_t *callout_alloc(com_intf_callout_t handler, void *arg) {
+    com_callout_t *new = com_mm_slab_cache_alloc(CalloutCache);
+    new->handler       = handler;
+    new->arg           = arg;
+    new->reuse         = false;
+    new->permanent     = false;
+    return new;
 }
 
 static void callout_add_at(com_callout_queue_t *cpu_callout,
                            com_intf_callout_t   handler,
                            void                *arg,
                            uintmax_t            ns) {
-    com_callout_t *new = com_mm_slab_alloc(sizeof(com_callout_t));
-    new->handler       = handler;
-    new->arg           = arg;
+    com_callout_t *new = callout_alloc(handler, arg);
     new->ns            = ns;
-    new->reuse         = false;
 
     kspinlock_acquire(&cpu_callout->lock);
     enqueue_callout(cpu_callout, new);
@@ -81,11 +287,8 @@ static void callout_add(com_callout_queue_t *cpu_callout,
                         void                *arg,
                         uintmax_t            delay) {
     kspinlock_acquire(&cpu_callout->lock);
-    com_callout_t *new = com_mm_slab_alloc(sizeof(com_callout_t));
-    new->handler       = handler;
-    new->arg           = arg;
-    new->ns            = cpu_callout->ns + delay;
-    new->reuse         = false;
+    com_callout_t *new = callout_alloc(handler, arg);
+    new->ns            = queue_now_nolock(cpu_callout) + delay;
 
     enqueue_callout(cpu_callout, new);
     kspinlock_release(&cpu_callout->lock);
@@ -94,7 +297,7 @@ static void callout_add(com_callout_queue_t *cpu_callout,
 uintmax_t com_sys_callout_get_time(void) {
     com_callout_queue_t *callout = GET_CALLOUT();
     kspinlock_acquire(&callout->lock);
-    uintmax_t time = callout->ns;
+    uintmax_t time = queue_now_nolock(callout);
     kspinlock_release(&callout->lock);
     return time;
 }
@@ -104,46 +307,90 @@ void com_sys_callout_run(void) {
     com_callout_queue_t *cpu_callout = &curr_cpu->callout;
 
     kspinlock_acquire(&cpu_callout->lock);
-    cpu_callout->ns += ARCH_TIMER_NS;
+    uintmax_t now_tick = queue_now_nolock(cpu_callout) / ARCH_TIMER_NS;
+
+    // There is no point in going through empty slots one by one
+    if (0 == cpu_callout->stats.num_pending) {
+        cpu_callout->tick = now_tick + 1;
+    } else if (now_tick > cpu_callout->tick &&
+               now_tick - cpu_callout->tick >=
+                   COM_SYS_CALLOUT_WHEEL_SLOTS * COM_SYS_CALLOUT_WHEEL_SLOTS) {
+        wheel_rebase(cpu_callout, now_tick);
+    }
 
-    while (true) {
+    while (cpu_callout->tick <= now_tick) {
 #if CONFIG_CALLOUT_MODE == CONST_CALLOUT_ONLY_BSP
         if (cpu_callout != BspCallout) {
+            cpu_callout->tick = now_tick + 1;
             break;
         }
 #endif
 
-        com_callout_t *callout = TAILQ_FIRST(&cpu_callout->queue);
-
-        if (NULL == callout || callout->ns > cpu_callout->ns) {
-            break;
+        // Each level is cascaded when all levels below it wrap around
+        size_t index = WHEEL_INDEX(cpu_callout->tick, 0);
+        for (size_t level = 1;
+             level < COM_SYS_CALLOUT_WHEEL_LEVELS &&
+             0 == WHEEL_INDEX(cpu_callout->tick, level - 1);
+             level++) {
+            cascade_level(cpu_callout, level);
         }
 
-        callout->reuse = false;
-        kspinlock_acquire(&callout->entry_lock);
-        TAILQ_REMOVE_HEAD(&cpu_callout->queue, queue);
-        callout->cpu_callout = NULL;
-        kspinlock_release(&callout->entry_lock);
-
-        kspinlock_release(&cpu_callout->lock);
-        callout->handler(callout);
-        kspinlock_acquire(&cpu_callout->lock);
-
-        if (!callout->reuse && !callout->permanent) {
-            com_mm_slab_free(callout, sizeof(com_callout_t));
+        // Handlers may add callouts that expire at this same tick, so the slot
+        // is checked again after each one
+        struct com_callout_list *slot = WHEEL_SLOT(cpu_callout, 0, index);
+        com_callout_t           *callout;
+        while (NULL != (callout = LIST_FIRST(slot))) {
+            callout->reuse = false;
+            kspinlock_acquire(&callout->entry_lock);
+            dequeue_callout(cpu_callout, callout);
+            kspinlock_release(&callout->entry_lock);
+            cpu_callout->stats.num_fired++;
+
+            kspinlock_release(&cpu_callout->lock);
+            callout->handler(callout);
+            kspinlock_acquire(&cpu_callout->lock);
+
+            if (!callout->reuse && !callout->permanent) {
+                com_mm_slab_cache_free(CalloutCache, callout);
+            }
         }
+
+        cpu_callout->tick++;
     }
 
     bool resched = false;
     if (cpu_callout->ns >= cpu_callout->next_preempt) {
-        resched = true;
-        cpu_callout->next_preempt += ARCH_SCHED_NS;
+        resched                   = true;
+        cpu_callout->next_preempt = cpu_callout->ns + ARCH_SCHED_NS;
+    }
+
+#if CONFIG_CALLOUT_MODE == CONST_CALLOUT_PER_CPU
+    // Idle CPUs hand their callouts over to a busy one, so that they do not
+    // have to wake up just to run them
+    bool migrate = curr_cpu->idle_thread == curr_cpu->thread &&
+                   0 != cpu_callout->stats.num_pending;
+#endif
+
+    kspinlock_release(&cpu_callout->lock);
+
+#if CONFIG_CALLOUT_MODE == CONST_CALLOUT_PER_CPU
+    arch_cpu_t *busy_cpu;
+    if (migrate && NULL != (busy_cpu = find_busy_cpu(curr_cpu))) {
+        com_sys_callout_migrate(cpu_callout, &busy_cpu->callout);
     }
+#endif
 
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    // Idle CPUs stop ticking until they have callouts to run or something else
+    // wakes them up
+    kspinlock_acquire(&cpu_callout->lock);
+    cpu_callout->idle = curr_cpu->idle_thread == curr_cpu->thread;
+    timer_arm_nolock(cpu_callout);
     kspinlock_release(&cpu_callout->lock);
+#endif
 
     if (resched) {
-        com_sys_sched_yield();
+        com_sys_sched_preempt();
     }
 }
 
@@ -168,7 +415,7 @@ void com_sys_callout_reschedule(com_callout_t *callout, uintmax_t delay) {
     com_callout_queue_t *cpu_callout = GET_CALLOUT();
     kspinlock_acquire(&cpu_callout->lock);
     callout->reuse = true;
-    callout->ns    = cpu_callout->ns + delay;
+    callout->ns    = queue_now_nolock(cpu_callout) + delay;
     enqueue_callout(cpu_callout, callout);
     kspinlock_release(&cpu_callout->lock);
 }
@@ -201,18 +448,200 @@ void com_sys_callout_set_bsp_nolock(com_callout_queue_t *bsp_queue) {
     BspCallout = bsp_queue;
 }
 
+void com_sys_callout_init(void) {
+    CalloutCache = com_mm_slab_cache_new("callout",
+                                         sizeof(com_callout_t),
+                                         _Alignof(com_callout_t),
+                                         callout_ctor,
+                                         NULL,
+                                         0);
+    KASSERT(NULL != CalloutCache);
+}
+
+// Pending callouts, if any, are dropped
+void com_sys_callout_init_queue(com_callout_queue_t *queue) {
+    if (!BootWheelUsed) {
+        queue->wheel  = BootWheel;
+        BootWheelUsed = true;
+    } else {
+        queue->wheel = com_mm_slab_alloc(sizeof(BootWheel));
+    }
+
+    for (size_t i = 0;
+         i < COM_SYS_CALLOUT_WHEEL_LEVELS * COM_SYS_CALLOUT_WHEEL_SLOTS;
+         i++) {
+        LIST_INIT(&queue->wheel[i]);
+    }
+
+    queue->tick              = queue->ns / ARCH_TIMER_NS + 1;
+    queue->stats.num_pending = 0;
+    queue->lock              = KSPINLOCK_NEW();
+}
+
+// Moves all pending callouts from src to dst, for example when the CPU that
+// owns src goes idle
+void com_sys_callout_migrate(com_callout_queue_t *src,
+                             com_callout_queue_t *dst) {
+    if (src == dst) {
+        return;
+    }
+
+    // Queue locks are always taken in the same order when two are needed
+    com_callout_queue_t *first  = (src < dst) ? src : dst;
+    com_callout_queue_t *second = (src < dst) ? dst : src;
+    kspinlock_acquire(&first->lock);
+    kspinlock_acquire(&second->lock);
+
+    struct com_callout_list pending = LIST_HEAD_INITIALIZER(pending);
+    wheel_take_all(src, &pending);
+
+    uintmax_t      first_tick = UINTMAX_MAX;
+    com_callout_t *callout;
+    while (NULL != (callout = LIST_FIRST(&pending))) {
+        LIST_REMOVE(callout, queue);
+        kspinlock_acquire(&callout->entry_lock);
+        first_tick = KMIN(first_tick, wheel_insert(dst, callout));
+        kspinlock_release(&callout->entry_lock);
+    }
+
+    dst->stats.num_pending += src->stats.num_pending;
+    dst->stats.num_migrated += src->stats.num_pending;
+    src->stats.num_pending = 0;
+
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    if (UINTMAX_MAX != first_tick) {
+        timer_kick_nolock(dst, first_tick * ARCH_TIMER_NS);
+    }
+#else
+    (void)first_tick;
+#endif
+
+    kspinlock_release(&second->lock);
+    kspinlock_release(&first->lock);
+}
+
+// Called by the scheduler on the local CPU when it switches to or away from the
+// idle thread, so that idle CPUs are not interrupted for preemption
+void com_sys_callout_set_idle(bool idle) {
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    com_callout_queue_t *cpu_callout = &ARCH_CPU_GET()->callout;
+    kspinlock_acquire(&cpu_callout->lock);
+
+    if (idle != cpu_callout->idle) {
+        cpu_callout->idle = idle;
+        if (!idle) {
+            cpu_callout->next_preempt = queue_now_nolock(cpu_callout) +
+                                        ARCH_SCHED_NS;
+        }
+        timer_arm_nolock(cpu_callout);
+    }
+
+    kspinlock_release(&cpu_callout->lock);
+#else
+    (void)idle;
+#endif
+}
+
+bool com_sys_callout_get_stats(com_callout_stats_t *out, size_t cpu_id) {
+    arch_cpu_t *cpu = x86_64_smp_get_cpu(cpu_id);
+    if (NULL == cpu) {
+        return false;
+    }
+
+    kspinlock_acquire(&cpu->callout.lock);
+    *out = cpu->callout.stats;
+    kspinlock_release(&cpu->callout.lock);
+    return true;
+}
+
+static void bench_noop(com_callout_t *callout) {
+    (void)callout;
+}
+
+static void bench_fire(com_callout_t *callout) {
+    struct callout_bench *bench = callout->arg;
+    uintmax_t             now   = ARCH_CPU_GET_TIME();
+
+    kspinlock_acquire(&bench->lock);
+    bench->lateness_ns += now - KMIN(now, callout->ns);
+    bench->last_ns = now;
+    if (0 == --bench->remaining) {
+        com_sys_sched_notify(&bench->waiters);
+    }
+    kspinlock_release(&bench->lock);
+}
+
+// Measures the queue of the calling CPU with n callouts whose deadlines are
+// spread evenly over the next spread_ns. They are first armed and cancelled
+// without running, then armed again and waited for, which gives the time the
+// whole batch takes to fire and how late handlers run on average
+void com_sys_callout_bench(com_callout_bench_t *out,
+                           size_t               n,
+                           uintmax_t            spread_ns) {
+    *out = (com_callout_bench_t){0};
+    if (0 == n) {
+        return;
+    }
+
+    // The callouts are chained through their argument and are permanent, so
+    // that they stay valid even if some of them fire before being cancelled
+    com_callout_t *chain = NULL;
+    uintmax_t      base  = com_sys_callout_get_time();
+    for (size_t i = 0; i < n; i++) {
+        uintmax_t ns     = base + i * spread_ns / n;
+        chain            = com_sys_callout_new(bench_noop, chain, ns);
+        chain->permanent = true;
+    }
+
+    uintmax_t start = ARCH_CPU_GET_TIME();
+    for (com_callout_t *c = chain; NULL != c; c = c->arg) {
+        com_sys_callout_enqueue(c);
+    }
+    out->arm_ns = ARCH_CPU_GET_TIME() - start;
+
+    start = ARCH_CPU_GET_TIME();
+    for (com_callout_t *c = chain; NULL != c; c = c->arg) {
+        com_sys_callout_cancel(c);
+    }
+    out->cancel_ns = ARCH_CPU_GET_TIME() - start;
+
+    while (NULL != chain) {
+        com_callout_t *next = chain->arg;
+        com_sys_callout_destroy(chain);
+        chain = next;
+    }
+
+    struct callout_bench bench = {.lock        = KSPINLOCK_NEW(),
+                                  .remaining   = n,
+                                  .lateness_ns = 0,
+                                  .last_ns     = 0};
+    COM_SYS_THREAD_WAITLIST_INIT(&bench.waiters);
+
+    start = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n; i++) {
+        com_sys_callout_add(bench_fire, &bench, i * spread_ns / n);
+    }
+
+    kspinlock_acquire(&bench.lock);
+    while (0 != bench.remaining) {
+        com_sys_sched_wait(&bench.waiters, &bench.lock);
+    }
+    kspinlock_release(&bench.lock);
+
+    out->fire_ns     = bench.last_ns - KMIN(bench.last_ns, start);
+    out->lateness_ns = bench.lateness_ns;
+}
+
 com_callout_t *
 com_sys_callout_new(com_intf_callout_t handler, void *arg, uintmax_t ns) {
-    com_callout_t *new = com_mm_slab_alloc(sizeof(com_callout_t));
-    new->handler       = handler;
-    new->arg           = arg;
+    com_callout_t *new = callout_alloc(handler, arg);
     new->ns            = ns;
     return new;
 }
 
 void com_sys_callout_destroy(com_callout_t *callout) {
     com_sys_callout_cancel(callout);
-    com_mm_slab_free(callout, sizeof(com_callout_t));
+    com_mm_slab_cache_free(CalloutCache, callout);
 }
 
 void com_sys_callout_enqueue(com_callout_t *callout) {
@@ -230,23 +659,35 @@ void com_sys_callout_set_and_enqueue(com_callout_t     *callout,
     com_callout_queue_t *cpu_callout = GET_CALLOUT();
     callout->handler                 = handler;
     kspinlock_acquire(&cpu_callout->lock);
-    callout->ns = cpu_callout->ns + delay;
+    callout->ns = queue_now_nolock(cpu_callout) + delay;
     enqueue_callout(cpu_callout, callout);
     kspinlock_release(&cpu_callout->lock);
 }
 
+// Safe to call from any CPU. The callout may be run or migrated by its owner
+// between reading cpu_callout and locking the queue (the queue lock comes
+// before the entry lock), in which case this is tried again
 void com_sys_callout_cancel(com_callout_t *callout) {
-    kspinlock_acquire(&callout->entry_lock);
-    if (NULL != callout->cpu_callout) {
+    while (true) {
+        kspinlock_acquire(&callout->entry_lock);
         com_callout_queue_t *cpu_callout = callout->cpu_callout;
-        callout->cpu_callout             = NULL;
-        // avoid lock ordering issues
         kspinlock_release(&callout->entry_lock);
 
+        if (NULL == cpu_callout) {
+            return;
+        }
+
         kspinlock_acquire(&cpu_callout->lock);
-        TAILQ_REMOVE(&cpu_callout->queue, callout, queue);
-        kspinlock_release(&cpu_callout->lock);
-    } else {
+        kspinlock_acquire(&callout->entry_lock);
+        bool queued = cpu_callout == callout->cpu_callout;
+        if (queued) {
+            dequeue_callout(cpu_callout, callout);
+        }
         kspinlock_release(&callout->entry_lock);
+        kspinlock_release(&cpu_callout->lock);
+
+        if (queued) {
+            return;
+        }
     }
 }
@@ -104,7 +104,7 @@ static int load(uintptr_t          vaddr,
         ssize_t misalign    = vaddr % ARCH_PAGE_SIZE;
         ssize_t rem         = ARCH_PAGE_SIZE - misalign;
         ssize_t mapping_len = KMIN(rem, fsz);
-        void   *phys_page   = com_mm_pmm_alloc();
+        void   *phys_page   = com_mm_pmm_alloc_zero();
         com_mm_vmm_map(vmm_context,
                        (void *)(vaddr - misalign),
                        phys_page,
@@ -404,7 +404,7 @@ int com_sys_elf64_prepare_proc(com_vmm_context_t **out_vmm_context,
     uintptr_t stack_end   = 0x60000000;
     size_t    stack_len   = ARCH_PAGE_SIZE * 64;
     uintptr_t stack_start = stack_end - stack_len;
-    void     *stack_phys  = com_mm_pmm_alloc();
+    void     *stack_phys  = com_mm_pmm_alloc_zero();
 
     // allocate first part of the stack
     com_mm_vmm_map(new_vmm_ctx,
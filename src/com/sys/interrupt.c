@@ -23,6 +23,7 @@
 #include <kernel/com/ipc/signal.h>
 #include <kernel/com/sys/interrupt.h>
 #include <kernel/com/sys/panic.h>
+#include <kernel/com/sys/sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -104,6 +105,12 @@ void com_sys_interrupt_isr(uintmax_t vec, arch_context_t *ctx) {
         isr->eoi(isr);
     }
 
+    // Wakeups targeting this CPU do not send an IPI, so the switch to the
+    // woken thread happens here
+    if (NULL != curr_thread && !no_reset && com_sys_sched_resched_pending()) {
+        com_sys_sched_preempt();
+    }
+
     if (ARCH_CONTEXT_ISUSER(ctx)) {
         KASSERT(0 == curr_thread->lock_depth || 1 == curr_thread->lock_depth);
         com_ipc_signal_dispatch(ctx, curr_thread);
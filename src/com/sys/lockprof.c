@@ -0,0 +1,339 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <kernel/com/sys/lockprof.h>
+#include <kernel/com/sys/sched.h>
+#include <kernel/com/sys/thread.h>
+#include <kernel/platform/x86-64/smp.h>
+#include <lib/mem.h>
+#include <lib/spinlock.h>
+#include <lib/util.h>
+
+#if CONFIG_LOCK_PROFILER
+
+#define SITE_MASK (CONFIG_LOCK_PROFILER_MAX - 1)
+
+_Static_assert(0 == (CONFIG_LOCK_PROFILER_MAX & SITE_MASK),
+               "CONFIG_LOCK_PROFILER_MAX must be a power of two");
+
+// Open addressing, sites are claimed with a CAS on ip and never removed. Each
+// site has its own cache line so that unrelated locks do not interfere
+static KCACHE_FRIENDLY com_lockprof_site_t Sites[CONFIG_LOCK_PROFILER_MAX];
+
+static inline void update_max(uintmax_t *max, uintmax_t val) {
+    uintmax_t curr = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > curr && !__atomic_compare_exchange_n(max,
+                                                      &curr,
+                                                      val,
+                                                      true,
+                                                      __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED)) {
+    }
+}
+
+com_lockprof_site_t *com_sys_lockprof_get_site(void               *ip,
+                                               com_lockprof_type_t type) {
+    size_t start = ((uintptr_t)ip >> 4) & SITE_MASK;
+
+    for (size_t i = 0; i < CONFIG_LOCK_PROFILER_MAX; i++) {
+        com_lockprof_site_t *site = &Sites[(start + i) & SITE_MASK];
+        void *site_ip = __atomic_load_n(&site->ip, __ATOMIC_ACQUIRE);
+
+        if (ip == site_ip) {
+            return site;
+        }
+
+        if (NULL == site_ip) {
+            // Only the CPU that claimed the slot may write the type, otherwise
+            // a CPU that lost the race to a different call site could clobber
+            // it. Readers ignore the site until it is marked ready
+            if (__atomic_compare_exchange_n(&site->ip,
+                                            &site_ip,
+                                            ip,
+                                            false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                site->type = type;
+                __atomic_store_n(&site->ready, true, __ATOMIC_RELEASE);
+                return site;
+            }
+
+            if (ip == site_ip) {
+                return site;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void com_sys_lockprof_acquired(com_lockprof_site_t *site,
+                               bool                 contended,
+                               uintmax_t            wait_ns) {
+    if (NULL == site) {
+        return;
+    }
+
+    __atomic_add_fetch(&site->num_acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&site->num_contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&site->wait_ns, wait_ns, __ATOMIC_RELAXED);
+        update_max(&site->max_wait_ns, wait_ns);
+    }
+}
+
+void com_sys_lockprof_released(com_lockprof_site_t *site, uintmax_t hold_ns) {
+    if (NULL != site) {
+        update_max(&site->max_hold_ns, hold_ns);
+    }
+}
+
+// Called with the spinlock just acquired, thus with interrupts disabled
+void com_sys_lockprof_push_spinlock(void *lock, com_lockprof_site_t *site) {
+    com_lockprof_cpu_t *lockprof    = &ARCH_CPU_GET()->lockprof;
+    com_thread_t       *curr_thread = ARCH_CPU_GET_THREAD();
+
+    // Entries may be left behind by locks released on another CPU (e.g., after
+    // a context switch), so forget them whenever this is the only lock held
+    if (NULL != curr_thread && 1 == curr_thread->lock_depth) {
+        lockprof->num_held = 0;
+    }
+
+    if (lockprof->num_held < COM_SYS_LOCKPROF_MAX_HELD) {
+        com_lockprof_held_t *held = &lockprof->held[lockprof->num_held++];
+        held->lock                = lock;
+        held->site                = site;
+        held->start               = ARCH_CPU_GET_TIME();
+    }
+}
+
+// Called with the spinlock still held, thus with interrupts disabled
+void com_sys_lockprof_pop_spinlock(void *lock) {
+    com_lockprof_cpu_t *lockprof = &ARCH_CPU_GET()->lockprof;
+
+    // Locks are usually, but not always, released in reverse order
+    for (size_t i = lockprof->num_held; i > 0; i--) {
+        com_lockprof_held_t *held = &lockprof->held[i - 1];
+        if (lock != held->lock) {
+            continue;
+        }
+
+        com_sys_lockprof_released(held->site,
+                                  ARCH_CPU_GET_TIME() - held->start);
+        kmemmove(held,
+                 held + 1,
+                 (lockprof->num_held - i) * sizeof(com_lockprof_held_t));
+        lockprof->num_held--;
+        return;
+    }
+}
+
+size_t com_sys_lockprof_get_num_slots(void) {
+    return CONFIG_LOCK_PROFILER_MAX;
+}
+
+// The statistics are read one by one, so they may be slightly out of sync
+bool com_sys_lockprof_get_slot(com_lockprof_site_t *out, size_t slot) {
+    KASSERT(slot < CONFIG_LOCK_PROFILER_MAX);
+    com_lockprof_site_t *site = &Sites[slot];
+
+    if (!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    out->ip            = __atomic_load_n(&site->ip, __ATOMIC_RELAXED);
+    out->type          = site->type;
+    out->ready         = true;
+    out->num_acquired  = __atomic_load_n(&site->num_acquired, __ATOMIC_RELAXED);
+    out->num_contended = __atomic_load_n(&site->num_contended,
+                                         __ATOMIC_RELAXED);
+    out->wait_ns       = __atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED);
+    out->max_wait_ns   = __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED);
+    out->max_hold_ns   = __atomic_load_n(&site->max_hold_ns, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Sites stay claimed, only their statistics are cleared
+void com_sys_lockprof_reset(void) {
+    for (size_t i = 0; i < CONFIG_LOCK_PROFILER_MAX; i++) {
+        com_lockprof_site_t *site = &Sites[i];
+        __atomic_store_n(&site->num_acquired, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->num_contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->max_wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->max_hold_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+size_t com_sys_lockprof_get_num_slots(void) {
+    return 0;
+}
+
+bool com_sys_lockprof_get_slot(com_lockprof_site_t *out, size_t slot) {
+    (void)out;
+    (void)slot;
+    return false;
+}
+
+void com_sys_lockprof_reset(void) {
+}
+
+#endif
+
+// SPINLOCK BENCHMARK
+
+// Workers of com_sys_lockprof_bench_spinlock, one per CPU. Kernel threads are
+// never freed, so they are started by the first run and then wait for the
+// next one. Everything but arrived is protected by lock
+static struct {
+    kspinlock_t    lock;
+    bool           started;
+    bool           busy; // a run is in progress
+    size_t         num_workers;
+    uintmax_t      gen; // incremented to start a run
+    size_t         running;
+    size_t         arrived;
+    size_t         num_iters;
+    com_waitlist_t start;
+    com_waitlist_t done;
+
+    uint64_t  cpu_mask;
+    uintmax_t num_acquired;
+    uintmax_t wait_ns;
+    uintmax_t max_wait_ns;
+    uintmax_t first_start;
+    uintmax_t last_end;
+} Bench = {.lock = KSPINLOCK_NEW()};
+
+// The lock all workers fight over, and the data it protects
+static KCACHE_FRIENDLY kspinlock_t BenchSpinlock = KSPINLOCK_NEW();
+static uintmax_t                   BenchCounter  = 0;
+
+static void bench_worker(void) {
+    uintmax_t seen = 0;
+
+    for (;;) {
+        kspinlock_acquire(&Bench.lock);
+        while (Bench.gen == seen) {
+            com_sys_sched_wait(&Bench.start, &Bench.lock);
+        }
+        seen             = Bench.gen;
+        size_t num_iters = Bench.num_iters;
+        size_t workers   = Bench.num_workers;
+        kspinlock_release(&Bench.lock);
+
+        // Wait for the others, so that all workers hammer the lock at once
+        __atomic_add_fetch(&Bench.arrived, 1, __ATOMIC_ACQ_REL);
+        while (__atomic_load_n(&Bench.arrived, __ATOMIC_ACQUIRE) < workers) {
+            com_sys_sched_yield();
+        }
+
+        uintmax_t wait_ns     = 0;
+        uintmax_t max_wait_ns = 0;
+        uintmax_t start       = ARCH_CPU_GET_TIME();
+        for (size_t i = 0; i < num_iters; i++) {
+            uintmax_t before = ARCH_CPU_GET_TIME();
+            kspinlock_acquire(&BenchSpinlock);
+            uintmax_t wait = ARCH_CPU_GET_TIME() - before;
+            BenchCounter++;
+            kspinlock_release(&BenchSpinlock);
+
+            wait_ns += wait;
+            max_wait_ns = KMAX(max_wait_ns, wait);
+        }
+        uintmax_t end = ARCH_CPU_GET_TIME();
+
+        kspinlock_acquire(&Bench.lock);
+        uint64_t cpu_id = ARCH_CPU_GET()->id;
+        if (cpu_id < 64) {
+            Bench.cpu_mask |= 1UL << cpu_id;
+        }
+        Bench.num_acquired += num_iters;
+        Bench.wait_ns += wait_ns;
+        Bench.max_wait_ns = KMAX(Bench.max_wait_ns, max_wait_ns);
+        Bench.first_start = KMIN(Bench.first_start, start);
+        Bench.last_end    = KMAX(Bench.last_end, end);
+        if (0 == --Bench.running) {
+            com_sys_sched_notify_all(&Bench.done);
+        }
+        kspinlock_release(&Bench.lock);
+    }
+}
+
+static void bench_start_nolock(void) {
+    COM_SYS_THREAD_WAITLIST_INIT(&Bench.start);
+    COM_SYS_THREAD_WAITLIST_INIT(&Bench.done);
+
+    while (NULL != x86_64_smp_get_cpu(Bench.num_workers)) {
+        com_thread_t *worker = com_sys_thread_new_kernel(NULL, bench_worker);
+        com_sys_thread_ready(worker);
+        Bench.num_workers++;
+    }
+
+    Bench.started = true;
+}
+
+// Has one worker per CPU acquire and release the same spinlock num_iters times
+// each. Workers are woken up together and are placed like any other thread, so
+// they usually, but not necessarily, end up on different CPUs. The results
+// include the overhead of CONFIG_LOCK_PROFILER if it is enabled
+void com_sys_lockprof_bench_spinlock(com_lockprof_bench_t *out,
+                                     size_t                num_iters) {
+    kspinlock_acquire(&Bench.lock);
+    if (!Bench.started) {
+        bench_start_nolock();
+    }
+    while (Bench.busy) {
+        com_sys_sched_wait(&Bench.done, &Bench.lock);
+    }
+
+    Bench.busy         = true;
+    Bench.num_iters    = num_iters;
+    Bench.running      = Bench.num_workers;
+    Bench.cpu_mask     = 0;
+    Bench.num_acquired = 0;
+    Bench.wait_ns      = 0;
+    Bench.max_wait_ns  = 0;
+    Bench.first_start  = UINTMAX_MAX;
+    Bench.last_end     = 0;
+    __atomic_store_n(&Bench.arrived, 0, __ATOMIC_RELEASE);
+    Bench.gen++;
+    com_sys_sched_notify_all(&Bench.start);
+
+    while (0 != Bench.running) {
+        com_sys_sched_wait(&Bench.done, &Bench.lock);
+    }
+
+    out->num_cpus = 0;
+    for (uint64_t mask = Bench.cpu_mask; 0 != mask; mask &= mask - 1) {
+        out->num_cpus++;
+    }
+    out->num_workers  = Bench.num_workers;
+    out->num_acquired = Bench.num_acquired;
+    out->wait_ns      = Bench.wait_ns;
+    out->max_wait_ns  = Bench.max_wait_ns;
+    out->elapsed_ns   = Bench.last_end - KMIN(Bench.last_end,
+                                            Bench.first_start);
+
+    Bench.busy = false;
+    com_sys_sched_notify_all(&Bench.done);
+    kspinlock_release(&Bench.lock);
+}
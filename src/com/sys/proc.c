@@ -30,6 +30,8 @@
 #include <lib/hashmap.h>
 #include <lib/mem.h>
 #include <lib/radixtree.h>
+#include <lib/rcu.h>
+#include <lib/rwlock.h>
 #include <lib/util.h>
 #include <signal.h>
 #include <stdatomic.h>
@@ -42,6 +44,19 @@ static kradixtree_t Processes;
 static pid_t        NextPid = 1;
 static kradixtree_t ProcGroupMap;
 
+// Only used to compare lockless lookups with ones under a reader lock, see
+// com_sys_proc_bench_lookup
+static krwlock_t LookupBenchLock;
+
+// The last reference to a process may be dropped in a callout (see
+// sched_retire_thread), so tearing down its address space and releasing its
+// vnodes is left to a kernel thread
+static struct {
+    kspinlock_t           lock;
+    struct com_proc_tailq procs;
+    com_waitlist_t        waiters;
+} Reaper = {0};
+
 static void proc_update_fd_hint(com_proc_t *proc) {
     // Best case: there's a file after the hint
     for (; proc->next_fd < CONFIG_OPEN_MAX; proc->next_fd++) {
@@ -59,6 +74,31 @@ end:
     proc->max_fd = KMAX(proc->max_fd, proc->next_fd);
 }
 
+// Only takes a reference if the process still has some: if the count has
+// already dropped to zero, the process is on its way out and must not be
+// brought back
+static bool proc_hold_not_zero(com_proc_t *proc) {
+    size_t num_ref = __atomic_load_n(&proc->num_ref, __ATOMIC_RELAXED);
+
+    do {
+        if (0 == num_ref) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&proc->num_ref,
+                                          &num_ref,
+                                          num_ref + 1,
+                                          false,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    return true;
+}
+
+static void proc_free(krcu_head_t *head) {
+    com_proc_t *proc = KRCU_ENTRY(head, com_proc_t, rcu);
+    com_mm_slab_free(proc, sizeof(com_proc_t));
+}
+
 com_proc_t *com_sys_proc_new(com_vmm_context_t *vmm_context,
                              pid_t              parent_pid,
                              com_vnode_t       *root,
@@ -66,6 +106,7 @@ com_proc_t *com_sys_proc_new(com_vmm_context_t *vmm_context,
     com_proc_t *proc    = com_mm_slab_alloc(sizeof(com_proc_t));
     proc->vmm_context   = vmm_context;
     proc->exited        = false;
+    proc->reaped        = false;
     proc->stop_signal   = COM_IPC_SIGNAL_NONE;
     proc->stop_notified = false;
     proc->exit_status   = 0;
@@ -112,13 +153,34 @@ com_proc_t *com_sys_proc_new(com_vmm_context_t *vmm_context,
     return proc;
 }
 
+static void proc_reaper_thread(void) {
+    for (;;) {
+        kspinlock_acquire(&Reaper.lock);
+        while (TAILQ_EMPTY(&Reaper.procs)) {
+            com_sys_sched_wait(&Reaper.waiters, &Reaper.lock);
+        }
+        com_proc_t *proc = TAILQ_FIRST(&Reaper.procs);
+        TAILQ_REMOVE(&Reaper.procs, proc, reaper);
+        kspinlock_release(&Reaper.lock);
+
+        com_mm_vmm_destroy_context(proc->vmm_context);
+        COM_FS_VFS_VNODE_RELEASE(proc->root);
+        COM_FS_VFS_VNODE_RELEASE(atomic_load(&proc->cwd));
+
+        // com_sys_proc_get_by_pid may still be looking at the process
+        krcu_call(&proc->rcu, proc_free);
+    }
+}
+
+// Only queues the process, since this may run in interrupt context
 void com_sys_proc_destroy(com_proc_t *proc) {
     KASSERT(0 == proc->num_ref);
     KASSERT(proc->exited);
 
-    com_vmm_context_t *proc_vmm_ctx = proc->vmm_context;
-    com_mm_slab_free(proc, sizeof(com_proc_t));
-    com_mm_vmm_destroy_context(proc_vmm_ctx);
+    kspinlock_acquire(&Reaper.lock);
+    TAILQ_INSERT_TAIL(&Reaper.procs, proc, reaper);
+    com_sys_sched_notify(&Reaper.waiters);
+    kspinlock_release(&Reaper.lock);
 }
 
 int com_sys_proc_next_fd(com_proc_t *proc) {
@@ -268,15 +330,55 @@ com_proc_t *com_sys_proc_get_by_pid(pid_t pid) {
     }
 
     com_proc_t *ret = NULL;
-    kspinlock_acquire(&PIDNamespaceLock);
+    krcu_read_lock();
     kradixtree_get_nolock((void *)&ret, &Processes, pid - 1);
-    if (NULL != ret) {
-        COM_SYS_PROC_HOLD(ret);
+    if (NULL != ret && !proc_hold_not_zero(ret)) {
+        ret = NULL;
     }
-    kspinlock_release(&PIDNamespaceLock);
+    krcu_read_unlock();
     return ret;
 }
 
+// Looks pid up n times without locks and n times under a reader lock shared by
+// all callers, and returns the total time taken by each. Both walk the same
+// tree and take the same reference, so the difference is the cost of the lock
+void com_sys_proc_bench_lookup(uintmax_t *out_rcu_ns,
+                               uintmax_t *out_rwlock_ns,
+                               pid_t      pid,
+                               size_t     n) {
+    *out_rcu_ns    = 0;
+    *out_rwlock_ns = 0;
+
+    if (pid > CONFIG_PROC_MAX || pid < 1) {
+        return;
+    }
+
+    uintmax_t start = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n; i++) {
+        com_proc_t *proc = com_sys_proc_get_by_pid(pid);
+        if (NULL != proc) {
+            COM_SYS_PROC_RELEASE(proc);
+        }
+    }
+    *out_rcu_ns = ARCH_CPU_GET_TIME() - start;
+
+    start = ARCH_CPU_GET_TIME();
+    for (size_t i = 0; i < n; i++) {
+        com_proc_t *proc = NULL;
+        krwlock_acquire_read(&LookupBenchLock);
+        kradixtree_get_nolock((void *)&proc, &Processes, pid - 1);
+        if (NULL != proc && !proc_hold_not_zero(proc)) {
+            proc = NULL;
+        }
+        krwlock_release_read(&LookupBenchLock);
+
+        if (NULL != proc) {
+            COM_SYS_PROC_RELEASE(proc);
+        }
+    }
+    *out_rwlock_ns = ARCH_CPU_GET_TIME() - start;
+}
+
 com_proc_t *com_sys_proc_get_arbitrary_child(com_proc_t *proc) {
     kspinlock_acquire(&PIDNamespaceLock);
 
@@ -415,13 +517,12 @@ void com_sys_proc_terminate(int ecode) {
     com_sys_thread_exit(curr_thread);
 }
 
+// Called when the last reference is dropped: the parent has reaped the process
+// and all of its threads have been switched out for the last time. This may
+// run in a callout, see sched_retire_thread, so the actual teardown is done by
+// the reaper thread
 void com_sys_proc_hide(com_proc_t *proc) {
     kspinlock_acquire(&PIDNamespaceLock);
-    // TODO: add it to new reaper thread queue
-    // the new reaper thread will work differently from the previous: since we
-    // have this function now, we can just have other parts drop their refcounts
-    // and we'll always know when it hits 0 and we can dispatch the reaper
-    // thread accordingly without hash tables or scheduler magic
     kradixtree_remove_nolock(&Processes, proc->pid - 1);
     kspinlock_acquire(&proc->pg_lock);
     if (NULL != proc->proc_group) {
@@ -432,6 +533,8 @@ void com_sys_proc_hide(com_proc_t *proc) {
     proc->proc_group = NULL;
     kspinlock_release(&proc->pg_lock);
     kspinlock_release(&PIDNamespaceLock);
+
+    com_sys_proc_destroy(proc);
 }
 
 com_proc_group_t *com_sys_proc_new_group(com_proc_t         *leader,
@@ -525,4 +628,15 @@ void com_sys_proc_init(void) {
     // compatibility and cause lookup overhead
     KRADIXTREE_INIT(&Processes, 2);
     KRADIXTREE_INIT(&ProcGroupMap, 2);
+    KRWLOCK_INIT(&LookupBenchLock);
+
+    Reaper.lock = KSPINLOCK_NEW();
+    TAILQ_INIT(&Reaper.procs);
+    COM_SYS_THREAD_WAITLIST_INIT(&Reaper.waiters);
+}
+
+void com_sys_proc_init_reaper(void) {
+    KLOG("starting process reaper thread");
+    com_thread_t *reaper = com_sys_thread_new_kernel(NULL, proc_reaper_thread);
+    com_sys_thread_ready(reaper);
 }
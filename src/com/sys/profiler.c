@@ -17,11 +17,46 @@
 *************************************************************************/
 
 #include <arch/cpu.h>
+#include <arch/info.h>
+#include <kernel/com/mm/pmm.h>
 #include <kernel/com/sys/profiler.h>
 #include <kernel/com/sys/thread.h>
+#include <kernel/platform/x86-64/smp.h>
+#include <lib/mem.h>
+#include <lib/util.h>
+
+// Counters are kept per CPU so that profiled code running on different CPUs
+// never shares cache lines. They are only added up when someone asks for them
+static bool ProfilerInitialized = false;
+
+static inline void profiler_add(com_profile_func_data_t *data,
+                                uintmax_t                real_elapsed,
+                                uintmax_t                cpu_elapsed) {
+    // Atomics are still needed since interrupts and migrations may happen at
+    // any point, but they are cheap on a line owned by this CPU
+    __atomic_add_fetch(&data->num_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&data->real_time, real_elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&data->cpu_time, cpu_elapsed, __ATOMIC_RELAXED);
+
+    uintmax_t real_ns = ARCH_CPU_TIMESTAMP_TO_NS(real_elapsed);
+    size_t    bucket  = 0;
+    if (0 != real_ns) {
+        bucket = KMIN((size_t)(63 - __builtin_clzll(real_ns)),
+                      COM_SYS_PROFILER_HIST_BUCKETS - 1);
+    }
+    __atomic_add_fetch(&data->hist[bucket], 1, __ATOMIC_RELAXED);
+}
 
-static com_syswide_profile_t SystemProfile       = {0};
-static bool                  ProfilerInitialized = false;
+static inline void profiler_sum(com_profile_func_data_t       *out,
+                                const com_profile_func_data_t *data) {
+    out->num_calls += __atomic_load_n(&data->num_calls, __ATOMIC_RELAXED);
+    out->real_time += __atomic_load_n(&data->real_time, __ATOMIC_RELAXED);
+    out->cpu_time  += __atomic_load_n(&data->cpu_time, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < COM_SYS_PROFILER_HIST_BUCKETS; i++) {
+        out->hist[i] += __atomic_load_n(&data->hist[i], __ATOMIC_RELAXED);
+    }
+}
 
 static inline void profiler_calc_elapsed_time(uintmax_t *out_real_time,
                                               uintmax_t *out_cpu_time,
@@ -41,6 +76,15 @@ static inline void profiler_calc_elapsed_time(uintmax_t *out_real_time,
     }
 }
 
+static arch_cpu_t *profiler_get_cpu(size_t i) {
+    // Before SMP initialization there is only the bootstrap CPU
+    if (NULL == x86_64_smp_get_cpu(0)) {
+        return (0 == i) ? ARCH_CPU_GET() : NULL;
+    }
+
+    return x86_64_smp_get_cpu(i);
+}
+
 static inline com_profiler_data_t profiler_init_data(void) {
     com_profiler_data_t data = {.real_start = ARCH_CPU_GET_TIMESTAMP(), 0};
     com_thread_t       *curr_thread = ARCH_CPU_GET_THREAD();
@@ -51,11 +95,57 @@ static inline com_profiler_data_t profiler_init_data(void) {
 }
 
 void com_sys_profiler_init(void) {
-    ProfilerInitialized = true;
+    // Whole pages so that no two CPUs share a cache line
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = profiler_get_cpu(i)); i++) {
+        cpu->profile = (void *)ARCH_PHYS_TO_HHDM(
+            COM_MM_PMM_ALLOC_BYTES(sizeof(com_syswide_profile_t)));
+    }
+
+    __atomic_store_n(&ProfilerInitialized, true, __ATOMIC_RELEASE);
 }
 
-com_syswide_profile_t *com_sys_profiler_get_syswide(void) {
-    return &SystemProfile;
+void com_sys_profiler_get_function(com_profile_func_data_t *out,
+                                   com_profile_func_t       function_id) {
+    *out = (com_profile_func_data_t){0};
+    KASSERT(function_id < E_COM_PROFILE_FUNC__MAX);
+
+    if (!__atomic_load_n(&ProfilerInitialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = profiler_get_cpu(i)); i++) {
+        profiler_sum(out, &cpu->profile->functions[function_id]);
+    }
+}
+
+void com_sys_profiler_get_syscall(com_profile_func_data_t *out,
+                                  size_t                   syscall_number) {
+    *out = (com_profile_func_data_t){0};
+    KASSERT(syscall_number < CONFIG_SYSCALL_MAX);
+
+    if (!__atomic_load_n(&ProfilerInitialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = profiler_get_cpu(i)); i++) {
+        profiler_sum(out, &cpu->profile->syscalls[syscall_number]);
+    }
+}
+
+// Calls that are in progress while this runs may still be accounted for
+// afterwards
+void com_sys_profiler_reset(void) {
+    if (!__atomic_load_n(&ProfilerInitialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    arch_cpu_t *cpu;
+    for (size_t i = 0; NULL != (cpu = profiler_get_cpu(i)); i++) {
+        kmemset(cpu->profile, sizeof(com_syswide_profile_t), 0);
+    }
 }
 
 // TODO: this is very clunky, we can probably do something with debug syms
@@ -87,6 +177,8 @@ const char *com_sys_profiler_resolve_name(com_profile_func_t function_id) {
             return "com_sys_elf64_load";
         case E_COM_PROFILE_FUNC_VMM_HANDLE_FAULT:
             return "com_mm_vmm_handle_fault";
+        case E_COM_PROFILE_FUNC_VMM_DUPLICATE:
+            return "com_mm_vmm_duplicate_context";
         default:
             break;
     }
@@ -115,13 +207,9 @@ void com_sys_profiler_end_function(com_profiler_data_t *data) {
     uintmax_t cpu_elapsed;
     profiler_calc_elapsed_time(&real_elapsed, &cpu_elapsed, data);
 
-    com_profile_func_data_t
-        *function_data = &SystemProfile.functions[data->syscall_number];
-    __atomic_add_fetch(&function_data->num_calls, 1, __ATOMIC_RELAXED);
-    __atomic_add_fetch(&function_data->real_time,
-                       real_elapsed,
-                       __ATOMIC_RELAXED);
-    __atomic_add_fetch(&function_data->cpu_time, cpu_elapsed, __ATOMIC_RELAXED);
+    profiler_add(&ARCH_CPU_GET()->profile->functions[data->function_id],
+                 real_elapsed,
+                 cpu_elapsed);
 }
 
 com_profiler_data_t com_sys_profiler_start_syscall(size_t syscall_number) {
@@ -142,13 +230,9 @@ void com_sys_profiler_end_syscall(com_profiler_data_t *data) {
     uintmax_t cpu_elapsed;
     profiler_calc_elapsed_time(&real_elapsed, &cpu_elapsed, data);
 
-    com_profile_func_data_t
-        *syscall_data = &SystemProfile.syscalls[data->syscall_number];
-    __atomic_add_fetch(&syscall_data->num_calls, 1, __ATOMIC_RELAXED);
-    __atomic_add_fetch(&syscall_data->real_time,
-                       real_elapsed,
-                       __ATOMIC_RELAXED);
-    __atomic_add_fetch(&syscall_data->cpu_time, cpu_elapsed, __ATOMIC_RELAXED);
+    profiler_add(&ARCH_CPU_GET()->profile->syscalls[data->syscall_number],
+                 real_elapsed,
+                 cpu_elapsed);
 }
 
 #endif
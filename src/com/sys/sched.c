@@ -28,9 +28,12 @@
 #include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/thread.h>
 #include <kernel/platform/mmu.h>
+#include <kernel/platform/x86-64/smp.h>
 #include <lib/hashmap.h>
+#include <lib/rcu.h>
 #include <lib/spinlock.h>
 #include <lib/util.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <vendor/tailq.h>
@@ -71,6 +74,13 @@ static inline void sched_switch_vmm_context(com_thread_t *curr,
     }
 }
 
+// Exited threads hold a reference to their process until they have been
+// switched out for the last time, since the scheduler still uses it until then
+static void sched_retire_thread(krcu_head_t *head) {
+    com_thread_t *thread = KRCU_ENTRY(head, com_thread_t, rcu);
+    COM_SYS_PROC_RELEASE(thread->proc);
+}
+
 static void sched_waitlist_insert(com_waitlist_t *waitlist,
                                   com_thread_t   *thread) {
     // thread->cpu is nulled and curr is removed from runqueue in sched, no need
@@ -92,7 +102,411 @@ static void sched_handle_timeout(com_callout_t *callout) {
     kspinlock_release(&waiting_thread->sched_lock);
 }
 
-void com_sys_sched_yield_nolock(void) {
+// RUNQUEUES
+
+#define FAIR_ENTRY(node_ptr) \
+    KAVLTREE_ENTRY(node_ptr, com_thread_t, fair_node)
+#define QUEUE_LEN(cpu) \
+    __atomic_load_n(&(cpu)->sched_stats.queue_len, __ATOMIC_RELAXED)
+
+// Weight of a nice 0 thread. Each nice level is worth about 10% of CPU time
+// relative to the next one
+#define NICE_0_WEIGHT 1024
+#define NICE_MIN      -20
+#define NICE_MAX      19
+
+// Threads that wake up may run this far behind the slowest thread on the CPU,
+// so that they get to run soon without being able to bank the time they slept
+#define WAKEUP_CREDIT_NS (ARCH_SCHED_NS / 2)
+
+// A fair thread that wakes up only preempts the running one if it is behind it
+// by more than this, otherwise it waits for the next tick
+#define WAKEUP_PREEMPT_NS (ARCH_SCHED_NS / 16)
+
+static const uint32_t NiceWeights[NICE_MAX - NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548,  7620,  6100,  4904,  3906,
+    /*  -5 */ 3121,  2501,  1991,  1586,  1277,
+    /*   0 */ 1024,  820,   655,   526,   423,
+    /*   5 */ 335,   272,   215,   172,   137,
+    /*  10 */ 110,   87,    70,    56,    45,
+    /*  15 */ 36,    29,    23,    18,    15};
+
+static int fair_cmp(kavltree_node_t *a, kavltree_node_t *b) {
+    com_thread_t *thread_a = FAIR_ENTRY(a);
+    com_thread_t *thread_b = FAIR_ENTRY(b);
+
+    if (thread_a->vruntime != thread_b->vruntime) {
+        return (thread_a->vruntime < thread_b->vruntime) ? -1 : 1;
+    }
+
+    // Ties are broken by address so that no two threads compare equal
+    if (thread_a == thread_b) {
+        return 0;
+    }
+    return (thread_a < thread_b) ? -1 : 1;
+}
+
+static inline bool thread_is_rt(com_thread_t *thread) {
+    return SCHED_OTHER != thread->sched_policy;
+}
+
+// Real-time threads are queued by priority, either after or before the others
+// with the same priority
+static void
+rt_queue_insert_nolock(arch_cpu_t *cpu, com_thread_t *thread, bool head) {
+    com_thread_t *pos;
+    TAILQ_FOREACH(pos, &cpu->sched_rt_queue, threads) {
+        if (pos->rt_priority < thread->rt_priority ||
+            (head && pos->rt_priority == thread->rt_priority)) {
+            break;
+        }
+    }
+
+    if (NULL == pos) {
+        TAILQ_INSERT_TAIL(&cpu->sched_rt_queue, thread, threads);
+    } else {
+        TAILQ_INSERT_BEFORE(pos, thread, threads);
+    }
+}
+
+static void runqueue_insert_nolock(arch_cpu_t *cpu, com_thread_t *thread) {
+    if (thread_is_rt(thread)) {
+        rt_queue_insert_nolock(cpu, thread, false);
+    } else {
+        kavltree_insert(&cpu->sched_fair, &thread->fair_node);
+    }
+
+    thread->runqueue = cpu;
+    cpu->sched_stats.queue_len++;
+    cpu->sched_stats.max_queue_len = KMAX(cpu->sched_stats.max_queue_len,
+                                          cpu->sched_stats.queue_len);
+}
+
+static void runqueue_remove_nolock(arch_cpu_t *cpu, com_thread_t *thread) {
+    KASSERT(cpu == thread->runqueue);
+    if (thread_is_rt(thread)) {
+        TAILQ_REMOVE(&cpu->sched_rt_queue, thread, threads);
+    } else {
+        kavltree_remove(&cpu->sched_fair, &thread->fair_node);
+    }
+
+    thread->runqueue = NULL;
+    cpu->sched_stats.queue_len--;
+}
+
+// Real-time threads always go before the others
+static inline com_thread_t *runqueue_peek_nolock(arch_cpu_t *cpu) {
+    com_thread_t *rt = TAILQ_FIRST(&cpu->sched_rt_queue);
+    if (NULL != rt) {
+        return rt;
+    }
+
+    return FAIR_ENTRY(kavltree_first(&cpu->sched_fair));
+}
+
+// Virtual runtimes only make sense relative to the CPU they were accumulated
+// on, so they are carried over as the distance from its minimum
+static void
+rebase_vruntime(com_thread_t *thread, arch_cpu_t *from, arch_cpu_t *to) {
+    uintmax_t from_min = __atomic_load_n(&from->sched_min_vruntime,
+                                         __ATOMIC_RELAXED);
+    uintmax_t to_min   = __atomic_load_n(&to->sched_min_vruntime,
+                                       __ATOMIC_RELAXED);
+    uintmax_t lag      = thread->vruntime - KMIN(thread->vruntime, from_min);
+    thread->vruntime   = to_min + lag;
+}
+
+// Charges curr for the time it ran since it was last accounted for. Higher
+// weights make virtual time pass more slowly
+static void sched_update_curr(arch_cpu_t *cpu, com_thread_t *curr) {
+    uintmax_t now = ARCH_CPU_GET_TIME();
+
+    if (cpu->idle_thread != curr && 0 != curr->exec_start &&
+        !thread_is_rt(curr)) {
+        uintmax_t delta = now - curr->exec_start;
+        curr->vruntime += delta * NICE_0_WEIGHT / curr->weight;
+    }
+    curr->exec_start = now;
+
+    uintmax_t     min      = UINTMAX_MAX;
+    com_thread_t *leftmost = FAIR_ENTRY(kavltree_first(&cpu->sched_fair));
+    if (NULL != leftmost) {
+        min = leftmost->vruntime;
+    }
+    if (cpu->idle_thread != curr && !thread_is_rt(curr) &&
+        E_COM_THREAD_STATE_RUNNING == curr->state) {
+        min = KMIN(min, curr->vruntime);
+    }
+
+    if (UINTMAX_MAX != min && min > cpu->sched_min_vruntime) {
+        __atomic_store_n(&cpu->sched_min_vruntime, min, __ATOMIC_RELAXED);
+    }
+}
+
+// Decides whether next should take the CPU from curr, which could otherwise
+// keep running. Preemption happens on timer ticks and wakeups, while in all
+// other cases curr is giving up the CPU voluntarily. A voluntary yield always
+// lets next run, even if it is a fair thread and curr is real-time: the kernel
+// yields in polling loops that may be waiting for lower priority threads
+static bool
+sched_should_switch(com_thread_t *curr, com_thread_t *next, bool preempt) {
+    if (!preempt) {
+        return true;
+    }
+
+    if (thread_is_rt(curr)) {
+        if (!thread_is_rt(next) || next->rt_priority < curr->rt_priority) {
+            return false;
+        }
+        if (next->rt_priority > curr->rt_priority) {
+            return true;
+        }
+
+        // Threads of equal priority take turns at every tick with SCHED_RR,
+        // but only when the running one yields with SCHED_FIFO
+        return SCHED_RR == curr->sched_policy;
+    }
+
+    return thread_is_rt(next) || next->vruntime < curr->vruntime;
+}
+
+// RUNQUEUE BALANCING
+
+// Threads that ran recently probably still have their working set in the
+// cache of their last CPU, so moving them costs more than it saves
+static inline bool thread_is_cache_hot(com_thread_t *thread, uintmax_t now) {
+    return 0 != thread->last_ran &&
+           ARCH_CPU_TIMESTAMP_TO_NS(now - thread->last_ran) <
+               CONFIG_SCHED_MIGRATE_COST;
+}
+
+// Moves up to max threads from the fair runqueue of src to that of dst,
+// starting from those that are furthest from running on src. Both runqueue
+// locks must be held. Threads whose sched_lock is taken are skipped, since
+// they may still be switching out on their last CPU. Real-time threads are
+// only placed when they wake up
+static size_t runqueue_pull_nolock(arch_cpu_t *dst,
+                                   arch_cpu_t *src,
+                                   size_t      max,
+                                   bool        allow_hot) {
+    uintmax_t     now    = ARCH_CPU_GET_TIMESTAMP();
+    size_t        moved  = 0;
+    com_thread_t *thread = FAIR_ENTRY(kavltree_last(&src->sched_fair));
+
+    while (NULL != thread && moved < max) {
+        com_thread_t *prev = FAIR_ENTRY(kavltree_prev(&thread->fair_node));
+
+        if ((allow_hot || !thread_is_cache_hot(thread, now)) &&
+            kspinlock_acquire_timeout(&thread->sched_lock, 0)) {
+            runqueue_remove_nolock(src, thread);
+            rebase_vruntime(thread, src, dst);
+            runqueue_insert_nolock(dst, thread);
+            kspinlock_release(&thread->sched_lock);
+            moved++;
+        }
+
+        thread = prev;
+    }
+
+    return moved;
+}
+
+static arch_cpu_t *sched_find_busiest(arch_cpu_t *cpu, size_t *out_len) {
+    arch_cpu_t *busiest = NULL;
+    size_t      max_len = 0;
+    arch_cpu_t *other;
+
+    for (size_t i = 0; NULL != (other = x86_64_smp_get_cpu(i)); i++) {
+        size_t len = QUEUE_LEN(other);
+        if (other != cpu && len > max_len) {
+            busiest = other;
+            max_len = len;
+        }
+    }
+
+    *out_len = max_len;
+    return busiest;
+}
+
+// Idle CPUs wait this long for the lock of the runqueue they steal from, which
+// is likely held by the CPU that just told them to come and take some work
+#define STEAL_LOCK_WAIT_NS (10 * 1000UL)
+
+static arch_cpu_t *sched_find_idle(arch_cpu_t *start);
+
+// Called with the local runqueue lock held every time the CPU picks a new
+// thread. A CPU that is about to go idle immediately tries to steal a thread,
+// while busy CPUs only compare their load with the others periodically. The
+// lock of the remote runqueue is never waited for indefinitely, since the
+// owner may be trying to do the same in the opposite direction
+static void sched_balance_nolock(arch_cpu_t *cpu, bool idle) {
+    uintmax_t now_ns   = ARCH_CPU_GET_TIME();
+    size_t    len      = cpu->sched_stats.queue_len;
+    bool      periodic = now_ns >= cpu->sched_balance_next;
+    bool      steal    = idle && 0 == len;
+
+    if (periodic) {
+        cpu->sched_balance_next = now_ns + CONFIG_SCHED_BALANCE_NS;
+        cpu->sched_stats.queue_len_sum += len;
+        cpu->sched_stats.num_samples++;
+
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+        // Idle CPUs do not tick, so they have to be woken up to steal
+        arch_cpu_t *idle_cpu;
+        if (len > 1 && NULL != (idle_cpu = sched_find_idle(cpu))) {
+            __atomic_store_n(&idle_cpu->sched_resched_pending,
+                             true,
+                             __ATOMIC_RELAXED);
+            ARCH_CPU_SEND_IPI(idle_cpu, ARCH_CPU_IPI_RESCHEDULE);
+        }
+#endif
+    } else if (!steal) {
+        return;
+    }
+
+    // Moving a thread between two queues whose lengths differ by one would
+    // just swap them around
+    size_t      busiest_len;
+    arch_cpu_t *busiest = sched_find_busiest(cpu, &busiest_len);
+    if (NULL == busiest || busiest_len < ((steal) ? 1 : len + 2) ||
+        !kspinlock_acquire_timeout(&busiest->runqueue_lock,
+                                   (steal) ? STEAL_LOCK_WAIT_NS : 0)) {
+        return;
+    }
+
+    if (steal) {
+        // Sitting idle is worse than losing the cache, as long as the victim
+        // would not be left with nothing to run next
+        size_t stolen = runqueue_pull_nolock(cpu, busiest, 1, false);
+        if (0 == stolen && busiest->sched_stats.queue_len > 1) {
+            stolen = runqueue_pull_nolock(cpu, busiest, 1, true);
+        }
+        cpu->sched_stats.num_stolen += stolen;
+    } else {
+        cpu->sched_stats.num_pulled += runqueue_pull_nolock(
+            cpu,
+            busiest,
+            (busiest_len - len) / 2,
+            false);
+    }
+
+    kspinlock_release(&busiest->runqueue_lock);
+}
+
+// WAKEUPS
+
+// Lockless hint, the CPU may pick up work right after this returns true
+static inline bool cpu_is_idle(arch_cpu_t *cpu) {
+    return cpu->idle_thread ==
+               __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED) &&
+           0 == QUEUE_LEN(cpu) &&
+           !__atomic_load_n(&cpu->sched_resched_pending, __ATOMIC_RELAXED);
+}
+
+// Looks for an idle CPU starting from the one after start, so that concurrent
+// wakeups do not all pile onto the same CPU
+static arch_cpu_t *sched_find_idle(arch_cpu_t *start) {
+    size_t      first = start->id + 1;
+    arch_cpu_t *cpu;
+
+    for (size_t i = first; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+        if (cpu_is_idle(cpu)) {
+            return cpu;
+        }
+    }
+
+    for (size_t i = 0; i < first && NULL != (cpu = x86_64_smp_get_cpu(i));
+         i++) {
+        if (cpu_is_idle(cpu)) {
+            return cpu;
+        }
+    }
+
+    return NULL;
+}
+
+// Picks the CPU on which thread should run after waking up. The CPU it last
+// ran on is preferred as long as it is idle, since its cache may still be warm.
+// Otherwise, any idle CPU is better than waiting. If all CPUs are busy, the
+// thread is pulled to the CPU that woke it up (wake-affine) if that is less
+// loaded and the thread has nothing left in the cache of its last CPU
+static arch_cpu_t *
+sched_select_cpu(com_thread_t *thread, bool *out_affine, bool *out_idle) {
+    arch_cpu_t *prev  = thread->last_cpu;
+    arch_cpu_t *waker = ARCH_CPU_GET();
+    *out_affine       = false;
+    *out_idle         = true;
+
+    if (NULL != prev && cpu_is_idle(prev)) {
+        return prev;
+    }
+
+    // This also covers wakeups from interrupts that arrived while idle
+    if (cpu_is_idle(waker)) {
+        *out_affine = prev != waker;
+        return waker;
+    }
+
+    arch_cpu_t *idle = sched_find_idle((NULL != prev) ? prev : waker);
+    if (NULL != idle) {
+        return idle;
+    }
+
+    *out_idle = false;
+    if (NULL == prev) {
+        return waker;
+    }
+
+    if (waker != prev && QUEUE_LEN(waker) < QUEUE_LEN(prev) &&
+        !thread_is_cache_hot(thread, ARCH_CPU_GET_TIMESTAMP())) {
+        *out_affine = true;
+        return waker;
+    }
+
+    return prev;
+}
+
+// Same as sched_should_switch with preemption, except that fair threads need
+// to be behind by some margin, so that a flurry of wakeups does not turn into
+// a flurry of context switches
+static bool sched_wakeup_preempts(com_thread_t *curr, com_thread_t *thread) {
+    if (thread_is_rt(curr) || thread_is_rt(thread)) {
+        return sched_should_switch(curr, thread, true);
+    }
+
+    return thread->vruntime + WAKEUP_PREEMPT_NS < curr->vruntime;
+}
+
+// Called with the runqueue lock of cpu held after thread has been inserted.
+// Makes sure that cpu reschedules if thread should run right away. Nothing
+// needs to be done if the CPU is already going to reschedule, or if thread
+// should wait for the running one to yield or be preempted by the timer. When
+// cpu is the local CPU, the switch happens when the current interrupt or
+// syscall returns instead of going through an IPI
+static void sched_kick_nolock(arch_cpu_t *cpu, com_thread_t *thread) {
+    com_thread_t *running = __atomic_load_n(&cpu->thread, __ATOMIC_RELAXED);
+
+    if (cpu->sched_resched_pending ||
+        (NULL != running && cpu->idle_thread != running &&
+         !sched_wakeup_preempts(running, thread))) {
+        cpu->sched_stats.num_ipi_avoided++;
+        return;
+    }
+
+    __atomic_store_n(&cpu->sched_resched_pending, true, __ATOMIC_RELAXED);
+
+    if (ARCH_CPU_GET() == cpu) {
+        cpu->sched_stats.num_ipi_avoided++;
+        return;
+    }
+
+    cpu->sched_stats.num_ipi_sent++;
+    ARCH_CPU_SEND_IPI(cpu, ARCH_CPU_IPI_RESCHEDULE);
+}
+
+static void sched_reschedule_nolock(bool preempt) {
     com_profiler_data_t profiler_data = com_sys_profiler_start_function(
         E_COM_PROFILE_FUNC_SCHED_YIELD);
     arch_cpu_t *cpu = ARCH_CPU_GET();
@@ -100,7 +514,10 @@ void com_sys_sched_yield_nolock(void) {
     com_thread_t *curr = cpu->thread;
     KASSERT(NULL == curr || KSPINLOCK_IS_HELD(&curr->sched_lock));
     KASSERT(NULL == curr || 2 == curr->lock_depth || 3 == curr->lock_depth);
-    com_thread_t *next = TAILQ_FIRST(&cpu->sched_queue);
+    __atomic_store_n(&cpu->sched_resched_pending, false, __ATOMIC_RELAXED);
+    // RCU readers cannot sleep or be preempted, so whatever was running before
+    // entering the scheduler is out of any read-side critical section
+    krcu_quiescent();
 
     if (NULL == curr) {
         kspinlock_release(&cpu->runqueue_lock);
@@ -108,20 +525,35 @@ void com_sys_sched_yield_nolock(void) {
         return;
     }
 
-    if (NULL == next) {
-        if (E_COM_THREAD_STATE_RUNNING == curr->state) {
-            kspinlock_release(&cpu->runqueue_lock);
-            kspinlock_release(&curr->sched_lock);
-            com_sys_profiler_end_function(&profiler_data);
-            return;
-        }
+    bool can_continue = cpu->idle_thread != curr &&
+                        E_COM_THREAD_STATE_RUNNING == curr->state;
+    sched_update_curr(cpu, curr);
+    sched_balance_nolock(cpu, !can_continue);
+
+    // The next thread is picked before curr goes back into the runqueue, so
+    // that giving up the CPU voluntarily always lets someone else run
+    com_thread_t *next = runqueue_peek_nolock(cpu);
+
+    if ((NULL == next && E_COM_THREAD_STATE_RUNNING == curr->state) ||
+        (NULL != next && can_continue &&
+         !sched_should_switch(curr, next, preempt))) {
+        kspinlock_release(&cpu->runqueue_lock);
+        kspinlock_release(&curr->sched_lock);
+        com_sys_profiler_end_function(&profiler_data);
+        return;
+    }
 
+    if (NULL == next) {
         next = cpu->idle_thread;
     } else {
         KASSERT(next != cpu->idle_thread);
-        TAILQ_REMOVE(&cpu->sched_queue, next, threads);
+        runqueue_remove_nolock(cpu, next);
     }
 
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    com_sys_callout_set_idle(cpu->idle_thread == next);
+#endif
+
     if (curr == next) {
         KURGENT("curr = %p, next = %p | curr->tid = %d, next->tid = %d | "
                 "IS_USER(curr) = %d, "
@@ -138,17 +570,24 @@ void com_sys_sched_yield_nolock(void) {
     if (E_COM_THREAD_STATE_RUNNING == curr->state) {
         com_sys_thread_transition_nolock(curr, E_COM_THREAD_STATE_READY);
         if (curr != cpu->idle_thread) {
-            TAILQ_INSERT_TAIL(&cpu->sched_queue, curr, threads);
+            runqueue_insert_nolock(cpu, curr);
         }
     }
     KASSERT(E_COM_THREAD_STATE_RUNNING != curr->state);
 
     curr->cpu      = NULL;
     curr->last_cpu = cpu;
+    curr->last_ran = ARCH_CPU_GET_TIMESTAMP();
     kspinlock_release(&cpu->runqueue_lock);
 
     sched_switch_vmm_context(curr, next);
 
+    // This was the last use of curr->proc, and the address space has already
+    // been switched away from
+    if (E_COM_THREAD_STATE_EXITED == curr->state && NULL != curr->proc) {
+        krcu_call(&curr->rcu, sched_retire_thread);
+    }
+
     ARCH_CONTEXT_SAVE_EXTRA(curr->xctx);
     if (ARCH_CONTEXT_ISUSER(&next->ctx)) {
         ARCH_CONTEXT_RESTORE_EXTRA(next->xctx);
@@ -161,8 +600,9 @@ void com_sys_sched_yield_nolock(void) {
     // probably because not all context switches lead to another instance of
     // this function (for example, newly spawned threads will context switch
     // elsewhere)
-    cpu->thread = next;
-    next->cpu   = cpu;
+    cpu->thread      = next;
+    next->cpu        = cpu;
+    next->exec_start = ARCH_CPU_GET_TIME();
     com_sys_thread_transition_nolock(next, E_COM_THREAD_STATE_RUNNING);
 
     // Restore kernel stack
@@ -191,6 +631,12 @@ void com_sys_sched_yield_nolock(void) {
 #endif
 }
 
+// SCHEDULER INTERFACE
+
+void com_sys_sched_yield_nolock(void) {
+    sched_reschedule_nolock(false);
+}
+
 void com_sys_sched_yield(void) {
     com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
     if (NULL != curr_thread) {
@@ -200,10 +646,21 @@ void com_sys_sched_yield(void) {
     // lock released elsewhere
 }
 
+// Like com_sys_sched_yield, but the current thread keeps the CPU unless a
+// thread that should run before it is waiting
+void com_sys_sched_preempt(void) {
+    com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
+    if (NULL != curr_thread) {
+        kspinlock_acquire(&curr_thread->sched_lock);
+    }
+    sched_reschedule_nolock(true);
+    // lock released elsewhere
+}
+
 void com_sys_sched_isr(com_isr_t *isr, arch_context_t *ctx) {
     (void)isr;
     (void)ctx;
-    com_sys_sched_yield();
+    com_sys_sched_preempt();
 }
 
 void com_sys_sched_wait_nodrop(com_waitlist_t *waitlist) {
@@ -348,7 +805,7 @@ end:
     return ret;
 }
 
-void com_sys_sched_notify(com_waitlist_t *waitlist) {
+com_thread_t *com_sys_sched_notify(com_waitlist_t *waitlist) {
     kspinlock_acquire(&waitlist->lock);
     com_thread_t *next = TAILQ_FIRST(&waitlist->queue);
     if (NULL != next) {
@@ -359,6 +816,8 @@ void com_sys_sched_notify(com_waitlist_t *waitlist) {
     if (NULL != next) {
         com_sys_thread_ready(next);
     }
+
+    return next;
 }
 
 void com_sys_sched_notify_all(com_waitlist_t *waitlist) {
@@ -422,22 +881,169 @@ void com_sys_sched_prioritize(com_thread_t *thread) {
     kspinlock_release(&thread->sched_lock);
 }
 
+// Moves a thread that is waiting in a runqueue to the front of its class
+// without changing its parameters: a real-time thread goes before the others
+// of the same priority, and a fair thread gets the lowest virtual runtime on
+// the CPU. Used to deliver signals to threads that are ready but not running
 void com_sys_sched_prioritize_nolock(com_thread_t *thread) {
-    (void)thread;
-    // TODO: figure out why this doesn't work
+    arch_cpu_t *cpu = __atomic_load_n(&thread->runqueue, __ATOMIC_RELAXED);
+    if (NULL == cpu) {
+        return;
+    }
+
+    kspinlock_acquire(&cpu->runqueue_lock);
+    if (cpu != thread->runqueue) {
+        kspinlock_release(&cpu->runqueue_lock);
+        return;
+    }
+
+    if (thread_is_rt(thread)) {
+        TAILQ_REMOVE(&cpu->sched_rt_queue, thread, threads);
+        rt_queue_insert_nolock(cpu, thread, true);
+    } else {
+        // Ties are broken by address, so the thread must be strictly ahead
+        kavltree_remove(&cpu->sched_fair, &thread->fair_node);
+        com_thread_t *leftmost = FAIR_ENTRY(kavltree_first(&cpu->sched_fair));
+        if (NULL != leftmost && 0 != leftmost->vruntime) {
+            thread->vruntime = KMIN(thread->vruntime, leftmost->vruntime - 1);
+        }
+        kavltree_insert(&cpu->sched_fair, &thread->fair_node);
+    }
 
-    /*arch_cpu_t *cpu = thread->last_cpu;
-    KASSERT(E_COM_THREAD_STATE_READY == thread->state);
-    KASSERT(NULL == thread->cpu);
+    sched_kick_nolock(cpu, thread);
+    kspinlock_release(&cpu->runqueue_lock);
+}
+
+// Sets the parameters of thread and moves it to the right place if it is
+// waiting in a runqueue. A running thread sees the change at the next tick
+static void sched_set_params(com_thread_t *thread,
+                             int           policy,
+                             int           rt_priority,
+                             int           nice) {
+    kspinlock_acquire(&thread->sched_lock);
 
+    // The thread cannot be migrated while its sched_lock is held, but it may
+    // still be picked to run before the runqueue lock is taken
+    arch_cpu_t *cpu = __atomic_load_n(&thread->runqueue, __ATOMIC_RELAXED);
     if (NULL != cpu) {
         kspinlock_acquire(&cpu->runqueue_lock);
-        KASSERT(cpu->thread != thread);
-        TAILQ_REMOVE(&cpu->sched_queue, thread, threads);
-        TAILQ_INSERT_HEAD(&cpu->sched_queue, thread, threads);
+        if (cpu == thread->runqueue) {
+            runqueue_remove_nolock(cpu, thread);
+        } else {
+            kspinlock_release(&cpu->runqueue_lock);
+            cpu = NULL;
+        }
+    }
+
+    // Threads that leave a real-time class must not start with the virtual
+    // runtime they had before entering it
+    arch_cpu_t *vcpu = (NULL != cpu) ? cpu : thread->last_cpu;
+    if (SCHED_OTHER == policy && thread_is_rt(thread) && NULL != vcpu) {
+        thread->vruntime = KMAX(thread->vruntime, vcpu->sched_min_vruntime);
+    }
+
+    thread->sched_policy = policy;
+    thread->rt_priority  = rt_priority;
+    thread->nice         = nice;
+    thread->weight       = NiceWeights[nice - NICE_MIN];
+
+    if (NULL != cpu) {
+        runqueue_insert_nolock(cpu, thread);
         kspinlock_release(&cpu->runqueue_lock);
-        ARCH_CPU_SEND_IPI(cpu, ARCH_CPU_IPI_RESCHEDULE);
-    }*/
+    }
+
+    kspinlock_release(&thread->sched_lock);
+}
+
+void com_sys_sched_init_thread(com_thread_t *thread, com_thread_t *parent) {
+    if (NULL != parent) {
+        thread->sched_policy = parent->sched_policy;
+        thread->rt_priority  = parent->rt_priority;
+        thread->nice         = parent->nice;
+    } else {
+        thread->sched_policy = SCHED_OTHER;
+        thread->rt_priority  = 0;
+        thread->nice         = 0;
+    }
+
+    thread->weight     = NiceWeights[thread->nice - NICE_MIN];
+    thread->vruntime   = 0;
+    thread->exec_start = 0;
+    thread->runqueue   = NULL;
+}
+
+void com_sys_sched_set_nice(com_thread_t *thread, int nice) {
+    nice = KMAX(NICE_MIN, KMIN(NICE_MAX, nice));
+    sched_set_params(thread, thread->sched_policy, thread->rt_priority, nice);
+}
+
+int com_sys_sched_set_policy(com_thread_t *thread,
+                             int           policy,
+                             int           rt_priority) {
+    if (SCHED_OTHER == policy) {
+        if (0 != rt_priority) {
+            return EINVAL;
+        }
+    } else if (SCHED_FIFO == policy || SCHED_RR == policy) {
+        if (rt_priority < COM_SYS_SCHED_RT_PRIO_MIN ||
+            rt_priority > COM_SYS_SCHED_RT_PRIO_MAX) {
+            return EINVAL;
+        }
+    } else {
+        return EINVAL;
+    }
+
+    sched_set_params(thread, policy, rt_priority, thread->nice);
+    return 0;
+}
+
+// Called with the sched_lock of thread held when it becomes runnable
+void com_sys_sched_wake(com_thread_t *thread) {
+    bool        affine, idle;
+    arch_cpu_t *cpu = sched_select_cpu(thread, &affine, &idle);
+    kspinlock_acquire(&cpu->runqueue_lock);
+
+    if (!thread_is_rt(thread)) {
+        if (NULL != thread->last_cpu && cpu != thread->last_cpu) {
+            rebase_vruntime(thread, thread->last_cpu, cpu);
+        }
+
+        uintmax_t min_vruntime = cpu->sched_min_vruntime;
+        thread->vruntime       = KMAX(thread->vruntime,
+                                min_vruntime -
+                                    KMIN(min_vruntime, WAKEUP_CREDIT_NS));
+    }
+
+    runqueue_insert_nolock(cpu, thread);
+    cpu->sched_stats.num_wakeups++;
+    cpu->sched_stats.num_wake_affine += affine;
+    cpu->sched_stats.num_wake_idle += idle;
+    sched_kick_nolock(cpu, thread);
+    kspinlock_release(&cpu->runqueue_lock);
+}
+
+bool com_sys_sched_resched_pending(void) {
+    return __atomic_load_n(&ARCH_CPU_GET()->sched_resched_pending,
+                           __ATOMIC_RELAXED);
+}
+
+bool com_sys_sched_get_stats(com_sched_stats_t *out, size_t cpu_id) {
+    arch_cpu_t *cpu = x86_64_smp_get_cpu(cpu_id);
+    if (NULL == cpu) {
+        return false;
+    }
+
+    kspinlock_acquire(&cpu->runqueue_lock);
+    *out = cpu->sched_stats;
+    kspinlock_release(&cpu->runqueue_lock);
+    return true;
+}
+
+void com_sys_sched_init_runqueue(arch_cpu_t *cpu) {
+    cpu->runqueue_lock      = KSPINLOCK_NEW();
+    cpu->sched_min_vruntime = 0;
+    TAILQ_INIT(&cpu->sched_rt_queue);
+    KAVLTREE_INIT(&cpu->sched_fair, fair_cmp);
 }
 
 void com_sys_sched_init(void) {
@@ -82,12 +82,7 @@ COM_SYS_SYSCALL(com_sys_syscall_accept) {
     com_socket_vnode_t *sockfs_vn = (void *)client_vn;
     sockfs_vn->socket             = new_client;
 
-    curr_proc->fd[new_fd].file = com_mm_slab_alloc(sizeof(com_file_t));
-    com_file_t *new_file       = curr_proc->fd[new_fd].file;
-    new_file->vnode            = client_vn;
-    new_file->flags            = 0;
-    new_file->num_ref          = 1;
-    new_file->off              = 0;
+    curr_proc->fd[new_fd].file = com_fs_file_new(client_vn, 0);
 
     ret = COM_SYS_SYSCALL_OK(new_fd);
 
@@ -22,6 +22,7 @@
 #include <kernel/com/fs/file.h>
 #include <kernel/com/fs/vfs.h>
 #include <kernel/com/ipc/signal.h>
+#include <kernel/com/mm/slab.h>
 #include <kernel/com/mm/vmm.h>
 #include <kernel/com/sys/proc.h>
 #include <kernel/com/sys/sched.h>
@@ -42,13 +43,28 @@ struct futex {
     com_waitlist_t waiters;
 };
 
-static kmutex_t   FutexLock;
-static khashmap_t FutexMap;
+static kmutex_t          FutexLock;
+static khashmap_t        FutexMap;
+static com_slab_cache_t *FutexCache;
+
+// Futexes are only handed out with no waiters, so the waitlist is set up once
+// when the object is carved out of a slab
+static void futex_ctor(void *obj) {
+    struct futex *futex = obj;
+    COM_SYS_THREAD_WAITLIST_INIT(&futex->waiters);
+}
 
 void com_sys_syscall_futex_init(void) {
     KLOG("initializing futex");
     KHASHMAP_INIT(&FutexMap);
     KMUTEX_INIT(&FutexLock);
+    FutexCache = com_mm_slab_cache_new("futex",
+                                       sizeof(struct futex),
+                                       _Alignof(struct futex),
+                                       futex_ctor,
+                                       NULL,
+                                       0);
+    KASSERT(NULL != FutexCache);
 }
 
 // SYSCALL: futex(uint32_t *word_ptr, int op, uint32_t val)
@@ -83,9 +99,8 @@ COM_SYS_SYSCALL(com_sys_syscall_futex) {
                 int get_ret = KHASHMAP_GET(&futex, &FutexMap, &phys);
 
                 if (ENOENT == get_ret) {
-                    struct futex *default_futex = com_mm_slab_alloc(
-                        sizeof(struct futex));
-                    COM_SYS_THREAD_WAITLIST_INIT(&default_futex->waiters);
+                    struct futex *default_futex = com_mm_slab_cache_alloc(
+                        FutexCache);
 
                     KASSERT_CALL(0,
                                  ==,
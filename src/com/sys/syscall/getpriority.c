@@ -0,0 +1,66 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <errno.h>
+#include <kernel/com/sys/proc.h>
+#include <kernel/com/sys/syscall.h>
+#include <lib/util.h>
+#include <sys/resource.h>
+
+// SYSCALL: getpriority(int which, id_t who)
+COM_SYS_SYSCALL(com_sys_syscall_getpriority) {
+    COM_SYS_SYSCALL_UNUSED_CONTEXT();
+    COM_SYS_SYSCALL_UNUSED_START(3);
+
+    int   which = COM_SYS_SYSCALL_ARG(int, 1);
+    pid_t who   = COM_SYS_SYSCALL_ARG(pid_t, 2);
+
+    // Process groups and users are not supported yet
+    if (PRIO_PROCESS != which || who < 0) {
+        return COM_SYS_SYSCALL_ERR(EINVAL);
+    }
+
+    com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
+    com_proc_t   *curr_proc   = curr_thread->proc;
+
+    if (0 == who || curr_proc->pid == who) {
+        return COM_SYS_SYSCALL_OK(curr_thread->nice);
+    }
+
+    com_proc_t *proc = com_sys_proc_get_by_pid(who);
+
+    if (NULL == proc) {
+        return COM_SYS_SYSCALL_ERR(ESRCH);
+    }
+
+    com_syscall_ret_t ret = COM_SYS_SYSCALL_BASE_ERR();
+
+    // All threads share the nice value set by setpriority
+    kspinlock_acquire(&proc->threads_lock);
+    com_thread_t *t = TAILQ_FIRST(&proc->threads);
+    if (NULL != t) {
+        ret.value = t->nice;
+    } else {
+        ret.err = ESRCH;
+    }
+    kspinlock_release(&proc->threads_lock);
+
+    COM_SYS_PROC_RELEASE(proc);
+    return ret;
+}
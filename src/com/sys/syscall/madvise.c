@@ -0,0 +1,63 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <arch/info.h>
+#include <arch/mmu.h>
+#include <errno.h>
+#include <kernel/com/mm/vmm.h>
+#include <kernel/com/sys/proc.h>
+#include <kernel/com/sys/syscall.h>
+#include <lib/util.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// SYSCALL: madvise(void *addr, size_t len, int advice)
+COM_SYS_SYSCALL(com_sys_syscall_madvise) {
+    COM_SYS_SYSCALL_UNUSED_CONTEXT();
+    COM_SYS_SYSCALL_UNUSED_START(4);
+
+    void  *addr   = COM_SYS_SYSCALL_ARG(void *, 1);
+    size_t len    = COM_SYS_SYSCALL_ARG(size_t, 2);
+    int    advice = COM_SYS_SYSCALL_ARG(int, 3);
+
+    if (0 != (uintptr_t)addr % ARCH_PAGE_SIZE ||
+        addr > ARCH_MMU_KERNELSPACE_START || 0 == len ||
+        (uintptr_t)addr + len < (uintptr_t)addr ||
+        addr + len > ARCH_MMU_KERNELSPACE_START) {
+        return COM_SYS_SYSCALL_ERR(EINVAL);
+    }
+
+    com_proc_t *curr_proc = ARCH_CPU_GET_THREAD()->proc;
+
+    switch (advice) {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+            // Access pattern hints are accepted but have no effect yet
+            return COM_SYS_SYSCALL_OK(0);
+        case MADV_WILLNEED:
+            com_mm_vmm_populate(curr_proc->vmm_context, addr, len);
+            return COM_SYS_SYSCALL_OK(0);
+        case MADV_DONTNEED:
+            com_mm_vmm_discard(curr_proc->vmm_context, addr, len);
+            return COM_SYS_SYSCALL_OK(0);
+        default:
+            return COM_SYS_SYSCALL_ERR(EINVAL);
+    }
+}
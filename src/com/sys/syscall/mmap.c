@@ -133,5 +133,14 @@ COM_SYS_SYSCALL(com_sys_syscall_mmap) {
                                 vmm_flags | COM_MM_VMM_FLAGS_ALLOCATE,
                                 mmu_flags);
 
+    if (NULL == virt) {
+        return COM_SYS_SYSCALL_ERR(ENOMEM);
+    }
+
+    // Fault the whole range in now instead of one page at a time
+    if (MAP_POPULATE & flags) {
+        com_mm_vmm_populate(curr_proc->vmm_context, virt, size);
+    }
+
     return COM_SYS_SYSCALL_OK(virt);
 }
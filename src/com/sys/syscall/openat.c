@@ -117,12 +117,8 @@ COM_SYS_SYSCALL(com_sys_syscall_openat) {
         goto end;
     }
 
-    curr_proc->fd[fd].file = com_mm_slab_alloc(sizeof(com_file_t));
-    com_file_t *file       = curr_proc->fd[fd].file;
-    file->vnode            = file_vn;
-    file->flags            = flags;
-    file->num_ref          = 1;
-    file->off              = 0;
+    com_file_t *file       = com_fs_file_new(file_vn, flags);
+    curr_proc->fd[fd].file = file;
     ret.value              = fd;
     KDEBUG("returning fd=%d (file=%p, vn=%p) for %s", fd, file, file_vn, path);
 
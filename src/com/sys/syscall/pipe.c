@@ -47,17 +47,8 @@ COM_SYS_SYSCALL(com_sys_syscall_pipe) {
     com_vnode_t *write;
     com_fs_pipefs_new(&read, &write);
 
-    com_file_t *rf = com_mm_slab_alloc(sizeof(com_file_t));
-    rf->vnode      = read;
-    rf->flags      = 0;
-    rf->num_ref    = 1;
-    rf->off        = 0;
-
-    com_file_t *wf = com_mm_slab_alloc(sizeof(com_file_t));
-    wf->vnode      = write;
-    wf->flags      = 0;
-    wf->num_ref    = 1;
-    wf->off        = 0;
+    com_file_t *rf = com_fs_file_new(read, 0);
+    com_file_t *wf = com_fs_file_new(write, 0);
 
     curr->fd[rfd].file = rf;
     curr->fd[wfd].file = wf;
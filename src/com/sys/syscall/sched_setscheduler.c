@@ -0,0 +1,81 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <errno.h>
+#include <kernel/com/sys/proc.h>
+#include <kernel/com/sys/sched.h>
+#include <kernel/com/sys/syscall.h>
+#include <lib/util.h>
+#include <sched.h>
+
+// SYSCALL: sched_setscheduler(pid_t pid, int policy, int priority)
+COM_SYS_SYSCALL(com_sys_syscall_sched_setscheduler) {
+    COM_SYS_SYSCALL_UNUSED_CONTEXT();
+    COM_SYS_SYSCALL_UNUSED_START(4);
+
+    pid_t pid      = COM_SYS_SYSCALL_ARG(pid_t, 1);
+    int   policy   = COM_SYS_SYSCALL_ARG(int, 2);
+    int   priority = COM_SYS_SYSCALL_ARG(int, 3);
+
+    if (pid < 0) {
+        return COM_SYS_SYSCALL_ERR(EINVAL);
+    }
+
+    com_proc_t *curr_proc = ARCH_CPU_GET_THREAD()->proc;
+    com_proc_t *proc      = curr_proc;
+
+    // Real-time threads can starve everything else, so only init may create
+    // them. The kernel calls com_sys_sched_set_policy directly
+    if (SCHED_OTHER != policy && 1 != curr_proc->pid) {
+        return COM_SYS_SYSCALL_ERR(EPERM);
+    }
+
+    if (0 != pid && curr_proc->pid != pid) {
+        proc = com_sys_proc_get_by_pid(pid);
+
+        if (NULL == proc) {
+            return COM_SYS_SYSCALL_ERR(ESRCH);
+        }
+    }
+
+    int err = 0;
+
+    // Arguments are validated by the first call, so either all threads change
+    // policy or none does
+    kspinlock_acquire(&proc->threads_lock);
+    com_thread_t *t;
+    TAILQ_FOREACH(t, &proc->threads, proc_threads) {
+        err = com_sys_sched_set_policy(t, policy, priority);
+
+        if (0 != err) {
+            break;
+        }
+    }
+    kspinlock_release(&proc->threads_lock);
+
+    if (proc != curr_proc) {
+        COM_SYS_PROC_RELEASE(proc);
+    }
+
+    if (0 != err) {
+        return COM_SYS_SYSCALL_ERR(err);
+    }
+
+    return COM_SYS_SYSCALL_OK(0);
+}
@@ -61,7 +61,11 @@ static void itimer_callout(com_callout_t *callout) {
     uintmax_t                  now       = com_sys_callout_get_time();
     kspinlock_acquire(&thread->real_timer.lock);
 
-    if (arg->cancelled) {
+    // Once the thread has exited, its process may be destroyed. It is only
+    // freed after a grace period, which cannot end while this callout runs
+    if (arg->cancelled ||
+        E_COM_THREAD_STATE_EXITED ==
+            __atomic_load_n(&thread->state, __ATOMIC_ACQUIRE)) {
         kspinlock_release(&thread->real_timer.lock);
         com_mm_slab_free(arg, sizeof(struct itimer_callout_arg));
         return;
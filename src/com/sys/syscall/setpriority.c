@@ -0,0 +1,74 @@
+/*************************************************************************
+| SalernOS Kernel                                                        |
+| Copyright (C) 2021 - 2026 Alessandro Salerno                           |
+|                                                                        |
+| This program is free software: you can redistribute it and/or modify   |
+| it under the terms of the GNU General Public License as published by   |
+| the Free Software Foundation, either version 3 of the License, or      |
+| (at your option) any later version.                                    |
+|                                                                        |
+| This program is distributed in the hope that it will be useful,        |
+| but WITHOUT ANY WARRANTY; without even the implied warranty of         |
+| MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          |
+| GNU General Public License for more details.                           |
+|                                                                        |
+| You should have received a copy of the GNU General Public License      |
+| along with this program.  If not, see <https://www.gnu.org/licenses/>. |
+*************************************************************************/
+
+#include <arch/cpu.h>
+#include <errno.h>
+#include <kernel/com/sys/proc.h>
+#include <kernel/com/sys/sched.h>
+#include <kernel/com/sys/syscall.h>
+#include <lib/util.h>
+#include <sys/resource.h>
+
+// SYSCALL: setpriority(int which, id_t who, int prio)
+COM_SYS_SYSCALL(com_sys_syscall_setpriority) {
+    COM_SYS_SYSCALL_UNUSED_CONTEXT();
+    COM_SYS_SYSCALL_UNUSED_START(4);
+
+    int   which = COM_SYS_SYSCALL_ARG(int, 1);
+    pid_t who   = COM_SYS_SYSCALL_ARG(pid_t, 2);
+    int   prio  = COM_SYS_SYSCALL_ARG(int, 3);
+
+    // Process groups and users are not supported yet
+    if (PRIO_PROCESS != which || who < 0) {
+        return COM_SYS_SYSCALL_ERR(EINVAL);
+    }
+
+    com_thread_t *curr_thread = ARCH_CPU_GET_THREAD();
+    com_proc_t   *curr_proc   = curr_thread->proc;
+    com_proc_t   *proc        = curr_proc;
+    bool          other       = 0 != who && curr_proc->pid != who;
+
+    // Like real-time policies, higher priorities are reserved to init, which
+    // is also the only process that may change the priority of others
+    if (1 != curr_proc->pid && (other || prio < curr_thread->nice)) {
+        return COM_SYS_SYSCALL_ERR(EPERM);
+    }
+
+    if (other) {
+        proc = com_sys_proc_get_by_pid(who);
+
+        if (NULL == proc) {
+            return COM_SYS_SYSCALL_ERR(ESRCH);
+        }
+    }
+
+    // The nice value is a property of the process, so it is applied to all of
+    // its threads
+    kspinlock_acquire(&proc->threads_lock);
+    com_thread_t *t;
+    TAILQ_FOREACH(t, &proc->threads, proc_threads) {
+        com_sys_sched_set_nice(t, prio);
+    }
+    kspinlock_release(&proc->threads_lock);
+
+    if (proc != curr_proc) {
+        COM_SYS_PROC_RELEASE(proc);
+    }
+
+    return COM_SYS_SYSCALL_OK(0);
+}
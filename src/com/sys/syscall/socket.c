@@ -56,12 +56,8 @@ COM_SYS_SYSCALL(com_sys_syscall_socket) {
     com_socket_vnode_t *sockfs_vn = (void *)socket_vn;
     sockfs_vn->socket             = socket;
 
-    curr_proc->fd[fd].file = com_mm_slab_alloc(sizeof(com_file_t));
-    com_file_t *file       = curr_proc->fd[fd].file;
-    file->vnode            = socket_vn;
-    file->flags            = 0;
-    file->num_ref          = 1;
-    file->off              = 0;
+    com_file_t *file       = com_fs_file_new(socket_vn, 0);
+    curr_proc->fd[fd].file = file;
 
     // Convert OSKC_* flags into O_* flags
     if (SOCK_NONBLOCK & type) {
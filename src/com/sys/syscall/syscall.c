@@ -22,6 +22,7 @@
 #include <kernel/com/mm/vmm.h>
 #include <kernel/com/sys/interrupt.h>
 #include <kernel/com/sys/profiler.h>
+#include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/syscall.h>
 #include <kernel/platform/mmu.h>
 #include <kernel/platform/syscall.h>
@@ -171,6 +172,12 @@ com_syscall_ret_t com_sys_syscall_invoke(uintmax_t          number,
         ret = syscall->handler(ctx, arg1, arg2, arg3, arg4, arg5, arg6);
     com_sys_profiler_end_syscall(&profiler_data);
 
+    // Same as in com_sys_interrupt_isr, threads woken by this syscall may need
+    // to run before the caller
+    if (com_sys_sched_resched_pending()) {
+        com_sys_sched_preempt();
+    }
+
 #ifdef DO_SYSCALL_LOG_AFTER
     com_io_log_lock();
     kinitlog("SYSCALL", "\033[33m");
@@ -702,4 +709,46 @@ void com_sys_syscall_init(void) {
                              "addr",
                              COM_SYS_SYSCALL_TYPE_SIZET,
                              "len");
+
+    com_sys_syscall_register(0x38,
+                             "madvise",
+                             com_sys_syscall_madvise,
+                             3,
+                             COM_SYS_SYSCALL_TYPE_PTR,
+                             "addr",
+                             COM_SYS_SYSCALL_TYPE_SIZET,
+                             "len",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "advice");
+
+    com_sys_syscall_register(0x39,
+                             "setpriority",
+                             com_sys_syscall_setpriority,
+                             3,
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "which",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "who",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "prio");
+
+    com_sys_syscall_register(0x3A,
+                             "getpriority",
+                             com_sys_syscall_getpriority,
+                             2,
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "which",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "who");
+
+    com_sys_syscall_register(0x3B,
+                             "sched_setscheduler",
+                             com_sys_syscall_sched_setscheduler,
+                             3,
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "pid",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "policy",
+                             COM_SYS_SYSCALL_TYPE_INT,
+                             "priority");
 }
@@ -45,6 +45,13 @@ static int waitpid_proc(com_proc_t *curr_proc,
         }
 
         if (towait->exited) {
+            // Only one waiter may drop the reference held by the parent
+            if (towait->reaped) {
+                kspinlock_release(&towait->signal_lock);
+                return -ECHILD;
+            }
+
+            towait->reaped = true;
             *status = (towait->exit_status & 0xff) << 8;
             if (COM_IPC_SIGNAL_NONE != towait->stop_signal) {
                 *status |= towait->stop_signal & 0x7f;
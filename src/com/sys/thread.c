@@ -26,16 +26,16 @@
 #include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/thread.h>
 #include <kernel/platform/context.h>
-#include <kernel/platform/x86-64/smp.h>
 #include <lib/spinlock.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <vendor/tailq.h>
 
-static pid_t NextTid = 0;
+static pid_t             NextTid     = 0;
+static com_slab_cache_t *ThreadCache = NULL;
 
 static com_thread_t *new_thread(com_proc_t *proc, arch_context_t ctx) {
-    com_thread_t *thread = (void *)ARCH_PHYS_TO_HHDM(com_mm_pmm_alloc());
+    com_thread_t *thread = com_mm_slab_cache_alloc(ThreadCache);
     thread->proc         = proc;
     thread->ctx          = ctx;
     thread->lock_depth   = 1;
@@ -52,6 +52,10 @@ static com_thread_t *new_thread(com_proc_t *proc, arch_context_t ctx) {
 
     thread->real_timer.lock = KSPINLOCK_NEW();
 
+    // User threads inherit the scheduling parameters of their creator
+    com_sys_sched_init_thread(thread,
+                              (NULL != proc) ? ARCH_CPU_GET_THREAD() : NULL);
+
     COM_IPC_SIGNAL_SIGMASK_INIT(&thread->pending_signals);
     COM_IPC_SIGNAL_SIGMASK_INIT(&thread->masked_signals);
 
@@ -138,27 +142,14 @@ void com_sys_thread_destroy(com_thread_t *thread) {
     com_mm_pmm_free((void *)ARCH_HHDM_TO_PHYS(thread->kernel_stack) -
                     ARCH_PAGE_SIZE);
     com_sys_callout_destroy(thread->timed_wait_callout);
-    com_mm_pmm_free((void *)ARCH_HHDM_TO_PHYS(thread));
+    com_mm_slab_cache_free(ThreadCache, thread);
 }
 
 void com_sys_thread_ready_nolock(com_thread_t *thread) {
-    arch_cpu_t *ready_cpu = thread->last_cpu;
-    thread->waiting_on    = NULL;
+    thread->waiting_on = NULL;
     com_sys_thread_transition_nolock(thread, E_COM_THREAD_STATE_READY);
-
-    if (NULL == ready_cpu) {
-        ready_cpu = x86_64_smp_get_random();
-    }
-
-    kspinlock_acquire(&ready_cpu->runqueue_lock);
-    TAILQ_INSERT_TAIL(&ready_cpu->sched_queue, thread, threads);
-    kspinlock_release(&ready_cpu->runqueue_lock);
-
-    KDEBUG("thread with tid=%zu is now runnable on cpu %zu",
-           thread->tid,
-           curr_cpu->id);
-
-    ARCH_CPU_SEND_IPI(ready_cpu, ARCH_CPU_IPI_RESCHEDULE);
+    com_sys_sched_wake(thread);
+    KDEBUG("thread with tid=%zu is now runnable", thread->tid);
 }
 
 void com_sys_thread_ready(com_thread_t *thread) {
@@ -166,3 +157,13 @@ void com_sys_thread_ready(com_thread_t *thread) {
     com_sys_thread_ready_nolock(thread);
     kspinlock_release(&thread->sched_lock);
 }
+
+void com_sys_thread_init(void) {
+    ThreadCache = com_mm_slab_cache_new("thread",
+                                        sizeof(com_thread_t),
+                                        _Alignof(com_thread_t),
+                                        NULL,
+                                        NULL,
+                                        COM_MM_SLAB_CACHE_FLAGS_ZERO);
+    KASSERT(NULL != ThreadCache);
+}
@@ -80,7 +80,7 @@ static void flanterm_backend_panic(void *termdata) {
 
 static void *flanterm_backend_malloc(size_t bytes) {
     return (void *)ARCH_PHYS_TO_HHDM(
-        com_mm_pmm_alloc_many(bytes / ARCH_PAGE_SIZE + 1));
+        com_mm_pmm_alloc_many_zero(bytes / ARCH_PAGE_SIZE + 1));
 }
 
 static void flanterm_backend_free(void *buf, size_t bytes) {
@@ -16,6 +16,8 @@
 
 section .text
 
+extern kspinlock_release_raw
+
 global x86_64_ctx_switch
 x86_64_ctx_switch:
   mov qword [rsi + 48], rbx
@@ -34,9 +36,10 @@ x86_64_ctx_switch:
   mov r15, qword [rdi + 128]
   mov rsp, qword [rdi + 192]
 
-    mov [rdx], dword 0
-
-  ret
+  ; release the old thread's sched_lock through the spinlock implementation,
+  ; which then returns to the new thread
+  mov rdi, rdx
+  jmp kspinlock_release_raw
 
 global arch_context_trampoline
 arch_context_trampoline:
@@ -23,6 +23,7 @@
 #include <kernel/com/mm/pmm.h>
 #include <kernel/com/sys/sched.h>
 #include <kernel/com/sys/syscall.h>
+#include <kernel/com/sys/thread.h>
 #include <kernel/opt/flanterm.h>
 #include <kernel/opt/nvme.h>
 #include <kernel/opt/uacpi.h>
@@ -62,10 +63,8 @@ void x86_64_entry(void) {
     // BSP CPU initialization
     x86_64_tsc_boot();
     ARCH_CPU_SET(&BspCpu);
-    TAILQ_INIT(&BspCpu.sched_queue);
-    TAILQ_INIT(&BspCpu.callout.queue);
-    BspCpu.runqueue_lock = KSPINLOCK_NEW();
-    BspCpu.callout.lock  = KSPINLOCK_NEW();
+    com_sys_sched_init_runqueue(&BspCpu);
+    com_sys_callout_init_queue(&BspCpu.callout);
     com_sys_callout_set_bsp_nolock(&BspCpu.callout);
 
 #if CONFIG_LOG_USE_SERIAL
@@ -101,6 +100,8 @@ void x86_64_entry(void) {
                                                     x86_64_mmu_invalidate_isr,
                                                     x86_64_lapic_eoi);
     inv_isr->flags     = COM_SYS_INTERRUPT_FLAGS_NO_RESET;
+    com_sys_thread_init();
+    com_sys_callout_init();
     com_sys_syscall_init();
     com_sys_interrupt_register(0x80, x86_64_syscall_isr, NULL);
     x86_64_lapic_bsp_init();
@@ -23,10 +23,13 @@
 #include <kernel/com/sys/interrupt.h>
 #include <kernel/platform/mmu.h>
 #include <kernel/platform/x86-64/arch/mmu.h>
+#include <kernel/platform/x86-64/cpuid.h>
 #include <kernel/platform/x86-64/io.h>
 #include <kernel/platform/x86-64/lapic.h>
 #include <kernel/platform/x86-64/msr.h>
 #include <kernel/platform/x86-64/pit.h>
+#include <lib/util.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <vendor/printf.h>
@@ -35,6 +38,10 @@
 #define LAPIC_ICR_DEST_SELF 0x40000
 #define LAPIC_ICR_ASSERT    0x04000
 
+#define LAPIC_TIMER_PERIODIC     0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+#define CPUID_TSC_DEADLINE       (1 << 24)
+
 #define BSP_APIC_ADDR (void *)0xfee00000
 
 typedef enum {
@@ -49,6 +56,7 @@ typedef enum {
 } lapic_reg_t;
 
 static uint64_t TicksPerSec;
+static bool     TscDeadline;
 
 static void lapic_write(uint32_t offset, uint32_t value) {
     *(volatile uint32_t *)(ARCH_PHYS_TO_HHDM(BSP_APIC_ADDR) + offset) = value;
@@ -73,11 +81,13 @@ static void lapic_calibrate(void) {
     TicksPerSec         = (meas_lapic * X86_64_PIT_FREQUENCY) / meas_pit;
 }
 
+#if CONFIG_TIMER_MODE == CONST_TIMER_PERIODIC
 static void periodic(uint64_t ns, size_t interrupt) {
-    lapic_write(E_LAPIC_REG_LVT_TIMER, interrupt | 0x20000);
+    lapic_write(E_LAPIC_REG_LVT_TIMER, interrupt | LAPIC_TIMER_PERIODIC);
     lapic_write(E_LAPIC_REG_INIT_COUNT,
                 ((ns * TicksPerSec) + 1000000000UL - 1) / 1000000000UL);
 }
+#endif
 
 void x86_64_lapic_bsp_init(void) {
     com_mm_vmm_map(NULL,
@@ -89,13 +99,62 @@ void x86_64_lapic_bsp_init(void) {
                        ARCH_MMU_FLAGS_NOEXEC);
 
     lapic_calibrate();
+
+    // TSC-deadline mode avoids converting deadlines to LAPIC ticks, which run
+    // at a different (and less precisely known) rate
+    x86_64_cpuid_t cpuid;
+    X86_64_CPUID(&cpuid, 1);
+    TscDeadline = CPUID_TSC_DEADLINE & cpuid.ecx;
 }
 
 void x86_64_lapic_init(void) {
     lapic_write(E_LAPIC_REG_SIVR, (1UL << 8) | 0xff);
     lapic_write(E_LAPIC_REG_LVT_TIMER, X86_64_LAPIC_TIMER_INTERRUPT);
     lapic_write(E_LAPIC_REG_DIV_CONF, 0);
+
+#if CONFIG_TIMER_MODE == CONST_TIMER_TICKLESS
+    // The first interrupt fires as soon as interrupts are enabled, and
+    // callouts take it from there. The TSC of APs is not calibrated yet here
+    if (TscDeadline) {
+        lapic_write(E_LAPIC_REG_LVT_TIMER,
+                    X86_64_LAPIC_TIMER_INTERRUPT | LAPIC_TIMER_TSC_DEADLINE);
+        X86_64_MSR_WRITE(X86_64_MSR_TSC_DEADLINE, 1);
+    } else {
+        lapic_write(E_LAPIC_REG_INIT_COUNT, 1);
+    }
+#else
     periodic(ARCH_TIMER_NS, X86_64_LAPIC_TIMER_INTERRUPT);
+#endif
+}
+
+// The LVT timer must already be set to the right mode by x86_64_lapic_init
+void x86_64_lapic_set_deadline(uintmax_t ns) {
+    if (TscDeadline) {
+        // Writing 0 disarms the timer, while values in the past fire at once
+        uint64_t val = 0;
+        if (UINTMAX_MAX != ns) {
+            val = KMAX(1UL,
+                       X86_64_TSC_TIME_TO_VAL(ARCH_CPU_GET()->tsc_reverse_mult,
+                                              ns));
+        }
+        X86_64_MSR_WRITE(X86_64_MSR_TSC_DEADLINE, val);
+        return;
+    }
+
+    if (UINTMAX_MAX == ns) {
+        lapic_write(E_LAPIC_REG_INIT_COUNT, 0);
+        return;
+    }
+
+    // Deadlines too far away for the counter fire early and get re-armed
+    uintmax_t now       = ARCH_CPU_GET_TIME();
+    uintmax_t delta     = (ns > now) ? ns - now : 0;
+    uintmax_t max_delta = UINT32_MAX * 1000000000UL / TicksPerSec;
+    uintmax_t count     = UINT32_MAX;
+    if (delta < max_delta) {
+        count = (delta * TicksPerSec + 1000000000UL - 1) / 1000000000UL;
+    }
+    lapic_write(E_LAPIC_REG_INIT_COUNT, (uint32_t)KMAX(1UL, count));
 }
 
 void x86_64_lapic_selfipi(uint8_t vector) {
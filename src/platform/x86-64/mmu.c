@@ -22,11 +22,16 @@
 #include <kernel/com/io/log.h>
 #include <kernel/com/mm/pmm.h>
 #include <kernel/com/mm/pmmcache.h>
+#include <kernel/com/mm/slab.h>
 #include <kernel/platform/info.h>
 #include <kernel/platform/mmu.h>
+#include <kernel/platform/x86-64/cpuid.h>
+#include <kernel/platform/x86-64/cr.h>
 #include <kernel/platform/x86-64/mmu.h>
 #include <kernel/platform/x86-64/smp.h>
 #include <lib/mem.h>
+#include <lib/spinlock.h>
+#include <lib/util.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <threads.h>
@@ -45,6 +50,53 @@
 #define DEPTH_PD   2
 #define DEPTH_PT   3
 
+// Bit 7 is the page size bit in PD and PDPT entries, and the PAT bit in PT
+// entries. Large pages move the PAT bit to bit 12
+#define PAGE_SIZE_BIT ((uint64_t)1 << 7)
+#define PTE_PAT       ((uint64_t)1 << 7)
+#define LARGE_PAT     ((uint64_t)1 << 12)
+
+// Size and address mask of a page mapped by an entry at the given level, where
+// level 0 is a PT entry, 1 a PD entry and 2 a PDPT entry
+#define LEVEL_PAGE_SIZE(level) ((uint64_t)ARCH_PAGE_SIZE << (9 * (level)))
+#define LEVEL_ADDRMASK(level)  (ADDRMASK & ~(LEVEL_PAGE_SIZE(level) - 1))
+#define LEVEL_DEPTH(level)     ((2 == (level)) ? DEPTH_PD : DEPTH_PT)
+// Only meaningful for entries above level 0
+#define IS_LARGE(entry) \
+    ((ARCH_MMU_FLAGS_PRESENT & (entry)) && (PAGE_SIZE_BIT & (entry)))
+// Ignored by the hardware in entries that point to tables. Set in PD entries
+// whose page table is shared with other address spaces after a fork, which are
+// also made read-only until the table is copied
+#define TABLE_SHARED ((uint64_t)1 << 9)
+#define IS_SHARED(entry) \
+    ((ARCH_MMU_FLAGS_PRESENT & (entry)) && !(PAGE_SIZE_BIT & (entry)) && \
+     (TABLE_SHARED & (entry)))
+
+// Set by the CPU on access, so they differ between otherwise identical entries
+#define PTE_ACCESSED ((uint64_t)1 << 5)
+#define PTE_DIRTY    ((uint64_t)1 << 6)
+#define PTE_FLAGS(entry) \
+    ((entry) & ~(ADDRMASK | PTE_ACCESSED | PTE_DIRTY))
+
+// Page fault error code bits
+#define PF_WRITE ((uint64_t)1 << 1)
+#define PF_USER  ((uint64_t)1 << 2)
+
+#define CR4_PGE   ((uint64_t)1 << 7)
+#define CR4_PCIDE ((uint64_t)1 << 17)
+
+// Loading CR3 with this bit set keeps the TLB entries tagged with the new PCID
+#define CR3_NOFLUSH  ((uint64_t)1 << 63)
+#define CR3_PCIDMASK (uint64_t)0xfff
+
+#define INVPCID_ADDRESS    0
+#define INVPCID_SINGLE     1
+#define INVPCID_ALL_GLOBAL 2
+
+// Number of locks that serialize the unsharing of page tables, see
+// unshare_table
+#define UNSHARE_LOCKS 64
+
 extern uint8_t _TEXT_START[];
 extern uint8_t _TEXT_END[];
 extern uint8_t _RODATA_START[];
@@ -57,6 +109,22 @@ extern uint8_t _USER_DATA_START[];
 extern uint8_t _USER_DATA_END[];
 
 static arch_mmu_pagetable_t *RootTable = NULL;
+// Highest level at which the kernel may install large pages
+static size_t MaxPageLevel = 1;
+static bool   PcidSupported    = false;
+static bool   InvpcidSupported = false;
+// Picked by the address of the PD entry being unshared
+static kspinlock_t UnshareLocks[UNSHARE_LOCKS] = {0};
+
+// A shootdown is acknowledged by dropping references to it: each target CPU
+// holds one until it has drained the range, and the sender holds one until it
+// has queued the range everywhere
+typedef struct x86_64_mmu_shootdown {
+    size_t               pending;
+    arch_intf_mmu_done_t done;
+    void                *arg;
+    bool                 allocated;
+} x86_64_mmu_shootdown_t;
 
 static inline void *internal_alloc_phys(void) {
     arch_cpu_t *curr_cpu = ARCH_CPU_GET();
@@ -76,30 +144,276 @@ static inline uint64_t *next(uint64_t entry) {
     return (uint64_t *)ARCH_PHYS_TO_HHDM(entry & ADDRMASK);
 }
 
-static uint64_t *get_page(arch_mmu_pagetable_t *top, void *vaddr) {
+static inline uint64_t flags_to_large(arch_mmu_flags_t flags) {
+    flags &= ~ARCH_MMU_EXTRA_FLAGS_LARGE;
+    if (PTE_PAT & flags) {
+        flags = (flags & ~PTE_PAT) | LARGE_PAT;
+    }
+    return flags | PAGE_SIZE_BIT;
+}
+
+static inline arch_mmu_flags_t large_to_flags(uint64_t entry, size_t level) {
+    arch_mmu_flags_t flags = entry & ~LEVEL_ADDRMASK(level) & ~PAGE_SIZE_BIT;
+    if (LARGE_PAT & flags) {
+        flags = (flags & ~LARGE_PAT) | PTE_PAT;
+    }
+    return flags;
+}
+
+// Replaces a large page with a table one level below that maps the same memory
+// with the same flags. Stale TLB entries for the large page are harmless since
+// the translation does not change, and invlpg on any address within the large
+// page drops them together with the 4K entry being modified by the caller
+static bool split_large(uint64_t *entry, size_t level) {
+    uint64_t *table = internal_alloc_phys();
+    if (NULL == table) {
+        return false;
+    }
+
+    uint64_t *table_virt = (uint64_t *)ARCH_PHYS_TO_HHDM(table);
+    uint64_t  phys       = *entry & LEVEL_ADDRMASK(level);
+    uint64_t  flags      = large_to_flags(*entry, level);
+    if (level > 1) {
+        flags = flags_to_large(flags);
+    }
+
+    for (size_t i = 0; i < 512; i++) {
+        table_virt[i] = (phys + i * LEVEL_PAGE_SIZE(level - 1)) | flags;
+    }
+
+    *entry = (uint64_t)table | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE |
+             ARCH_MMU_FLAGS_USER;
+    return true;
+}
+
+// Frees the page tables below entry, but not the memory they map
+static void free_tables(uint64_t entry, size_t level) {
+    uint64_t *table = next(entry);
+
+    if (IS_SHARED(entry) && com_mm_pmm_unhold((void *)(entry & ADDRMASK))) {
+        return;
+    }
+
+    for (size_t i = 0; level > 1 && i < 512; i++) {
+        if (ARCH_MMU_FLAGS_PRESENT & table[i] && !IS_LARGE(table[i])) {
+            free_tables(table[i], level - 1);
+        }
+    }
+
+    internal_free_phys((void *)(entry & ADDRMASK));
+}
+
+// Returns the entry that maps vaddr, which may be a large page. The level of
+// the entry (0 for 4K, 1 for 2M, 2 for 1G) is stored in out_level
+static uint64_t *
+get_page(arch_mmu_pagetable_t *top, void *vaddr, size_t *out_level) {
     uint64_t *pml4       = (uint64_t *)ARCH_PHYS_TO_HHDM(top);
     uintptr_t addr       = (uintptr_t)vaddr;
     uintptr_t ptoffset   = (addr & PTMASK) >> 12;
     uintptr_t pdoffset   = (addr & PDMASK) >> 21;
     uintptr_t pdptoffset = (addr & PDPTMASK) >> 30;
     uintptr_t pml4offset = (addr & PML4MASK) >> 39;
+    size_t    level      = 0;
+    uint64_t *entry      = NULL;
 
     uint64_t *pdpt = next(pml4[pml4offset]);
     if (NULL == pdpt) {
         return NULL;
     }
 
-    uint64_t *pd = next(pdpt[pdptoffset]);
+    entry = &pdpt[pdptoffset];
+    if (IS_LARGE(*entry)) {
+        level = 2;
+        goto end;
+    }
+
+    uint64_t *pd = next(*entry);
     if (NULL == pd) {
         return NULL;
     }
 
-    uint64_t *pt = next(pd[pdoffset]);
+    entry = &pd[pdoffset];
+    if (IS_LARGE(*entry)) {
+        level = 1;
+        goto end;
+    }
+
+    uint64_t *pt = next(*entry);
     if (NULL == pt) {
         return NULL;
     }
 
-    return pt + ptoffset;
+    entry = &pt[ptoffset];
+
+end:
+    if (NULL != out_level) {
+        *out_level = level;
+    }
+    return entry;
+}
+
+// Returns the PD entry that covers vaddr, or NULL if there is none
+static uint64_t *get_pde(arch_mmu_pagetable_t *top, void *vaddr) {
+    uint64_t *pml4       = (uint64_t *)ARCH_PHYS_TO_HHDM(top);
+    uintptr_t addr       = (uintptr_t)vaddr;
+    uintptr_t pdoffset   = (addr & PDMASK) >> 21;
+    uintptr_t pdptoffset = (addr & PDPTMASK) >> 30;
+    uintptr_t pml4offset = (addr & PML4MASK) >> 39;
+
+    uint64_t *pdpt = next(pml4[pml4offset]);
+    if (NULL == pdpt || IS_LARGE(pdpt[pdptoffset])) {
+        return NULL;
+    }
+
+    uint64_t *pd = next(pdpt[pdptoffset]);
+    if (NULL == pd) {
+        return NULL;
+    }
+
+    return &pd[pdoffset];
+}
+
+// Takes a reference to the memory mapped by a leaf entry on behalf of a new
+// copy of it. Returns the entry that both copies should hold, which is
+// copy-on-write unless the memory is shared
+static uint64_t share_leaf(uint64_t entry, size_t level) {
+    bool     entry_shared   = ARCH_MMU_EXTRA_FLAGS_SHARED & entry;
+    bool     entry_writable = ARCH_MMU_FLAGS_WRITE & entry;
+    uint64_t phys           = entry & LEVEL_ADDRMASK(level);
+
+    for (size_t i = 0; i < LEVEL_PAGE_SIZE(level) / ARCH_PAGE_SIZE; i++) {
+        com_mm_pmm_hold((void *)(phys + i * ARCH_PAGE_SIZE));
+    }
+
+    return (entry_shared)
+               ? entry
+               : (entry & ~ARCH_MMU_FLAGS_WRITE) | (entry_writable << 9);
+}
+
+void destroy_recursive(uint64_t entry, size_t level);
+
+static bool unshare_table_nolock(uint64_t *pde) {
+    // Another thread of the same address space may have got here first
+    if (!IS_SHARED(*pde)) {
+        return true;
+    }
+
+    uint64_t  entry     = *pde;
+    void     *old_table = (void *)(entry & ADDRMASK);
+    uint64_t  flags     = (entry & ~ADDRMASK & ~TABLE_SHARED) |
+                          ARCH_MMU_FLAGS_WRITE;
+
+    // All other address spaces have already let go of it
+    if (!com_mm_pmm_is_shared(old_table)) {
+        *pde = (uint64_t)old_table | flags;
+        return true;
+    }
+
+    uint64_t *new_table = internal_alloc_phys();
+    if (NULL == new_table) {
+        return false;
+    }
+
+    uint64_t *old_virt = (uint64_t *)ARCH_PHYS_TO_HHDM(old_table);
+    uint64_t *new_virt = (uint64_t *)ARCH_PHYS_TO_HHDM(new_table);
+    for (size_t i = 0; i < 512; i++) {
+        uint64_t pte = old_virt[i];
+        if (ARCH_MMU_FLAGS_PRESENT & pte) {
+            pte         = share_leaf(pte, 0);
+            old_virt[i] = pte;
+        }
+        new_virt[i] = pte;
+    }
+
+    *pde = (uint64_t)new_table | flags;
+
+    // Others may have let go of the table while it was being copied
+    if (!com_mm_pmm_unhold(old_table)) {
+        destroy_recursive(entry, 1);
+    }
+
+    return true;
+}
+
+// Gives the address space its own copy of a page table shared after a fork.
+// The pages it maps become referenced by both copies, so writable private ones
+// are made copy-on-write in both. The caller must invalidate the range.
+// Threads of the same address space may fault under the same entry on several
+// CPUs at once, and only one of them may copy the table and drop the reference
+// to the old one. Other address spaces have their own entry and reference, so
+// it is enough to serialize by entry
+static bool unshare_table(uint64_t *pde) {
+    if (NULL == pde || !IS_SHARED(__atomic_load_n(pde, __ATOMIC_RELAXED))) {
+        return true;
+    }
+
+    kspinlock_t *lock = &UnshareLocks[((uintptr_t)pde / sizeof(uint64_t)) %
+                                      UNSHARE_LOCKS];
+    kspinlock_acquire(lock);
+    bool ret = unshare_table_nolock(pde);
+    kspinlock_release(lock);
+    return ret;
+}
+
+// Same as get_page, but large pages are split first so that the returned entry
+// always maps a single 4K page, and the page table is made private to top if it
+// was shared. Returns NULL if a split or copy fails
+static uint64_t *get_small_page(arch_mmu_pagetable_t *top, void *vaddr) {
+    size_t    level;
+    uint64_t *entry = get_page(top, vaddr, &level);
+
+    while (NULL != entry && 0 != level) {
+        if (!split_large(entry, level)) {
+            return NULL;
+        }
+        entry = get_page(top, vaddr, &level);
+    }
+
+    uint64_t *pde = get_pde(top, vaddr);
+    if (NULL != entry && NULL != pde && IS_SHARED(*pde)) {
+        if (!unshare_table(pde)) {
+            return NULL;
+        }
+        entry = get_page(top, vaddr, NULL);
+    }
+
+    return entry;
+}
+
+// Returns the table pointed to by entry, allocating it if the entry is empty
+// and splitting it if the entry maps a large page
+static uint64_t *next_or_alloc(uint64_t *entry, size_t level) {
+    if (IS_LARGE(*entry) && !split_large(entry, level)) {
+        return NULL;
+    }
+
+    if (!unshare_table(entry)) {
+        return NULL;
+    }
+
+    uint64_t *table = next(*entry);
+    if (NULL != table) {
+        return table;
+    }
+
+    table = internal_alloc_phys();
+    if (NULL == table) {
+        return NULL;
+    }
+    *entry = (uint64_t)table | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE |
+             ARCH_MMU_FLAGS_USER;
+    return (uint64_t *)ARCH_PHYS_TO_HHDM(table);
+}
+
+// Installs a large page entry. If the slot held a table, the table is freed
+// right away: it may still be cached by other CPUs until the caller
+// invalidates the range, but it goes back to the page table cache of this CPU,
+// which does not allocate tables before the invalidation completes
+static inline void set_large(uint64_t *slot, uint64_t entry, size_t level) {
+    if (ARCH_MMU_FLAGS_PRESENT & *slot && !IS_LARGE(*slot)) {
+        free_tables(*slot, level);
+    }
+    *slot = entry;
 }
 
 static bool
@@ -116,59 +430,79 @@ add_page(arch_mmu_pagetable_t *top, void *vaddr, uint64_t entry, int depth) {
         return true;
     }
 
-    uint64_t *pdpt = next(pml4[pml4offset]);
+    uint64_t *pdpt = next_or_alloc(&pml4[pml4offset], 3);
     if (NULL == pdpt) {
-        pdpt = internal_alloc_phys();
-        if (NULL == pdpt) {
-            return false;
-        }
-        pml4[pml4offset] = (uint64_t)pdpt | ARCH_MMU_FLAGS_READ |
-                           ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_USER;
-        pdpt = (uint64_t *)ARCH_PHYS_TO_HHDM(pdpt);
+        return false;
     }
 
     if (DEPTH_PD == depth) {
-        pdpt[pdptoffset] = entry;
+        set_large(&pdpt[pdptoffset], entry, 2);
         return true;
     }
 
-    uint64_t *pd = next(pdpt[pdptoffset]);
+    uint64_t *pd = next_or_alloc(&pdpt[pdptoffset], 2);
     if (NULL == pd) {
-        pd = internal_alloc_phys();
-        if (NULL == pd) {
-            return false;
-        }
-        pdpt[pdptoffset] = (uint64_t)pd | ARCH_MMU_FLAGS_READ |
-                           ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_USER;
-        pd = (uint64_t *)ARCH_PHYS_TO_HHDM(pd);
+        return false;
     }
 
     if (DEPTH_PT == depth) {
-        pd[pdoffset] = entry;
+        set_large(&pd[pdoffset], entry, 1);
         return true;
     }
 
-    uint64_t *pt = next(pd[pdoffset]);
+    uint64_t *pt = next_or_alloc(&pd[pdoffset], 1);
     if (NULL == pt) {
-        pt = internal_alloc_phys();
-        if (NULL == pt) {
-            return false;
-        }
-        pd[pdoffset] = (uint64_t)pt | ARCH_MMU_FLAGS_READ |
-                       ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_USER;
-        pt = (uint64_t *)ARCH_PHYS_TO_HHDM(pt);
+        return false;
     }
 
     pt[ptoffset] = entry;
     return true;
 }
 
+static inline uint64_t read_cr3(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, void *virt) {
+    struct {
+        uint64_t pcid;
+        uint64_t virt;
+    } desc = {.pcid = pcid, .virt = (uint64_t)virt};
+    asm volatile("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+// Flushes every translation on this CPU, global ones included
+static inline void flush_all_global(void) {
+    if (InvpcidSupported) {
+        invpcid(INVPCID_ALL_GLOBAL, 0, NULL);
+        return;
+    }
+
+    // Toggling PGE drops global entries, and with them all other entries too
+    uint64_t cr4 = X86_64_CR_R4();
+    X86_64_CR_W4(cr4 & ~CR4_PGE);
+    X86_64_CR_W4(cr4);
+}
+
 // This must be called with the guarantee that the target of the TLB shootdown
 // is the current CPU. i.e., only if curr_pt == shootdown_pt
 static inline void internal_invalidate(void *virt, size_t pages) {
+    if (NULL != virt && virt >= ARCH_MMU_KERNELSPACE_START && pages > 32) {
+        // Kernel mappings are global, so reloading cr3 would not drop them
+        flush_all_global();
+        return;
+    }
+
     if (NULL == virt || pages > 32) {
+        if (InvpcidSupported) {
+            invpcid(INVPCID_SINGLE, read_cr3() & CR3_PCIDMASK, NULL);
+            return;
+        }
+
         // this puts the current cr3 back into cr3 which causes a full TLB
-        // shootdown
+        // shootdown of the current PCID. The no-flush bit always reads as zero
         asm volatile("mov %%cr3, %%rax; mov %%rax, %%cr3;"
                      :
                      :
@@ -183,22 +517,96 @@ static inline void internal_invalidate(void *virt, size_t pages) {
     }
 }
 
+// Returns the PCID under which pt is tagged on this CPU, together with the CR3
+// no-flush bit if its translations are still valid. Otherwise the least
+// recently used PCID is recycled for pt, and loading CR3 without the no-flush
+// bit discards what was left of its previous owner
+static uint64_t pcid_get(arch_cpu_t *cpu, arch_mmu_pagetable_t *pt) {
+    uint64_t gen    = ++cpu->mmu_pcid_gen;
+    size_t   victim = 0;
+    uint64_t oldest = UINT64_MAX;
+
+    for (size_t i = 0; i < X86_64_MMU_NUM_PCIDS; i++) {
+        x86_64_mmu_pcid_t    *slot  = &cpu->mmu_pcids[i];
+        arch_mmu_pagetable_t *table = __atomic_load_n(&slot->table,
+                                                      __ATOMIC_SEQ_CST);
+        if (pt == table) {
+            slot->last_use = gen;
+            return (i + 1) | CR3_NOFLUSH;
+        }
+
+        uint64_t last_use = (NULL == table) ? 0 : slot->last_use;
+        if (last_use < oldest) {
+            oldest = last_use;
+            victim = i;
+        }
+    }
+
+    __atomic_store_n(&cpu->mmu_pcids[victim].table, pt, __ATOMIC_SEQ_CST);
+    cpu->mmu_pcids[victim].last_use = gen;
+    return victim + 1;
+}
+
+// Drops the PCID that tags pt on the given CPU, if any. The CPU flushes it the
+// next time it switches to pt, so this is how CPUs that are not running pt get
+// rid of its stale translations without an IPI
+static void pcid_forget(arch_cpu_t *cpu, arch_mmu_pagetable_t *pt) {
+    for (size_t i = 0; i < X86_64_MMU_NUM_PCIDS; i++) {
+        arch_mmu_pagetable_t *expected = pt;
+        __atomic_compare_exchange_n(&cpu->mmu_pcids[i].table,
+                                    &expected,
+                                    NULL,
+                                    false,
+                                    __ATOMIC_SEQ_CST,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+// Invalidates a range of pt on the current CPU, which is not running it. If pt
+// is tagged with a PCID here, INVPCID can target its entries directly
+static void pcid_invalidate_inactive(arch_cpu_t           *cpu,
+                                     arch_mmu_pagetable_t *pt,
+                                     void                 *virt,
+                                     size_t                pages) {
+    if (!InvpcidSupported || NULL == virt || pages > 32) {
+        pcid_forget(cpu, pt);
+        return;
+    }
+
+    for (size_t i = 0; i < X86_64_MMU_NUM_PCIDS; i++) {
+        if (pt != __atomic_load_n(&cpu->mmu_pcids[i].table, __ATOMIC_SEQ_CST)) {
+            continue;
+        }
+
+        for (size_t j = 0; j < pages; j++) {
+            invpcid(INVPCID_ADDRESS,
+                    i + 1,
+                    (uint8_t *)virt + j * ARCH_PAGE_SIZE);
+        }
+    }
+}
+
 // CREDIT: vloxei64/ke
 static uint64_t duplicate_recursive(uint64_t entry, size_t level, size_t addr) {
-    uint64_t *virt           = (uint64_t *)ARCH_PHYS_TO_HHDM(entry & ADDRMASK);
-    bool      entry_shared   = ARCH_MMU_EXTRA_FLAGS_SHARED & entry;
-    bool      entry_writable = ARCH_MMU_FLAGS_WRITE & entry;
+    uint64_t *virt = (uint64_t *)ARCH_PHYS_TO_HHDM(entry & ADDRMASK);
 
     if (!(ARCH_MMU_FLAGS_PRESENT & entry)) {
         return 0;
     }
 
-    if (0 == level) {
+    if (0 == level || IS_LARGE(entry)) {
+        return share_leaf(entry, level);
+    }
+
+#if CONFIG_VMM_LAZY_FORK
+    // Page tables are not copied, both address spaces use the same one until
+    // either of them writes to it. The PD entry is made read-only so that
+    // writes fault and get a chance to copy the table first
+    if (1 == level) {
         com_mm_pmm_hold((void *)(entry & ADDRMASK));
-        return (entry_shared)
-                   ? entry
-                   : (entry & ~ARCH_MMU_FLAGS_WRITE) | (entry_writable << 9);
+        return (entry & ~ARCH_MMU_FLAGS_WRITE) | TABLE_SHARED;
     }
+#endif
 
     uint64_t new    = (uint64_t)internal_alloc_phys();
     uint64_t *nvirt = (uint64_t *)ARCH_PHYS_TO_HHDM(new);
@@ -209,7 +617,7 @@ static uint64_t duplicate_recursive(uint64_t entry, size_t level, size_t addr) {
                                            level - 1,
                                            addr |
                                                ((i << (12 + (level - 1) * 9))));
-            if (1 == level) {
+            if (1 == level || IS_LARGE(virt[i]) || IS_SHARED(nvirt[i])) {
                 virt[i] = nvirt[i];
             }
         }
@@ -222,7 +630,12 @@ void destroy_recursive(uint64_t entry, size_t level) {
     uint64_t *directory = (void *)ARCH_PHYS_TO_HHDM(entry & ADDRMASK);
     void     *phys      = (void *)(entry & ADDRMASK);
 
-    if (0 != level) {
+    // Only the last address space that uses a shared table destroys it
+    if (IS_SHARED(entry) && com_mm_pmm_unhold(phys)) {
+        return;
+    }
+
+    if (0 != level && !IS_LARGE(entry)) {
         for (size_t i = 0; i < 512; i++) {
             if (ARCH_MMU_FLAGS_PRESENT & directory[i]) {
                 destroy_recursive(directory[i], level - 1);
@@ -231,9 +644,14 @@ void destroy_recursive(uint64_t entry, size_t level) {
 
         internal_free_phys(phys);
     } else {
-        // If we're at level 0, then this page is not part of the PT and needs
-        // to be returned to pmm
-        com_mm_pmm_free(phys);
+        // If we're at level 0 or at a large page, then this memory is not part
+        // of the PT and needs to be returned to pmm
+        if (0 == level) {
+            com_mm_pmm_free(phys);
+        } else {
+            com_mm_pmm_free_many((void *)(entry & LEVEL_ADDRMASK(level)),
+                                 LEVEL_PAGE_SIZE(level) / ARCH_PAGE_SIZE);
+        }
     }
 }
 
@@ -253,6 +671,16 @@ arch_mmu_pagetable_t *arch_mmu_new_table(void) {
 void arch_mmu_destroy_table(arch_mmu_pagetable_t *pt) {
     arch_mmu_pagetable_t *pt_virt = (void *)ARCH_PHYS_TO_HHDM(pt);
 
+    // The table may be reallocated as soon as it is freed, so no CPU may still
+    // consider its PCID valid by then
+    if (PcidSupported) {
+        arch_cpu_t *cpu;
+        pcid_forget(ARCH_CPU_GET(), pt);
+        for (size_t i = 0; NULL != (cpu = x86_64_smp_get_cpu(i)); i++) {
+            pcid_forget(cpu, pt);
+        }
+    }
+
     for (size_t i = 0; i < 256; i++) {
         if (ARCH_MMU_FLAGS_PRESENT & pt_virt[i]) {
             destroy_recursive(pt_virt[i], 3);
@@ -287,22 +715,50 @@ bool arch_mmu_map(arch_mmu_pagetable_t *pt,
                   void                 *virt,
                   void                 *phys,
                   arch_mmu_flags_t      flags) {
+    // Kernel mappings are shared by all address spaces. Making them global
+    // keeps them out of PCID flushes and lets invlpg drop them under any PCID
+    if (!ARCH_MMU_ADDR_IS_USER(virt)) {
+        flags |= ARCH_MMU_FLAGS_GLOBAL;
+    }
+
+    if (ARCH_MMU_EXTRA_FLAGS_LARGE & flags) {
+        KASSERT(0 == (uintptr_t)virt % ARCH_MMU_LARGE_PAGE_SIZE);
+        KASSERT(0 == (uintptr_t)phys % ARCH_MMU_LARGE_PAGE_SIZE);
+        return add_page(pt,
+                        virt,
+                        ((uint64_t)phys & LEVEL_ADDRMASK(1)) |
+                            flags_to_large(flags),
+                        DEPTH_PT);
+    }
+
     return add_page(pt, virt, ((uint64_t)phys & ADDRMASK) | flags, 0);
 }
 
 bool arch_mmu_chflags(arch_mmu_pagetable_t *pt,
                       void                 *virt,
                       arch_mmu_flags_t      new_flags) {
-    uint64_t *entry = get_page(pt, virt);
+    size_t    level;
+    uint64_t *entry = get_page(pt, virt, &level);
+    if (NULL == entry) {
+        return false;
+    }
+
+    // Changing the flags of a whole 2M page does not require a split
+    if (ARCH_MMU_EXTRA_FLAGS_LARGE & new_flags && 1 == level) {
+        *entry = (*entry & LEVEL_ADDRMASK(1)) | flags_to_large(new_flags);
+        return true;
+    }
+
+    entry = get_small_page(pt, virt);
     if (NULL == entry) {
         return false;
     }
-    *entry = (*entry & ADDRMASK) | new_flags;
+    *entry = (*entry & ADDRMASK) | (new_flags & ~ARCH_MMU_EXTRA_FLAGS_LARGE);
     return true;
 }
 
 bool arch_mmu_unmap(void **out_old_phys, arch_mmu_pagetable_t *pt, void *virt) {
-    uint64_t *entry = get_page(pt, virt);
+    uint64_t *entry = get_small_page(pt, virt);
     if (NULL == entry) {
         return false;
     }
@@ -311,10 +767,164 @@ bool arch_mmu_unmap(void **out_old_phys, arch_mmu_pagetable_t *pt, void *virt) {
     return true;
 }
 
+bool arch_mmu_unmap_large(void                **out_old_phys,
+                          arch_mmu_pagetable_t *pt,
+                          void                 *virt) {
+    size_t    level;
+    uint64_t *entry = get_page(pt, virt, &level);
+    if (NULL == entry || 1 != level ||
+        0 != (uintptr_t)virt % ARCH_MMU_LARGE_PAGE_SIZE) {
+        return false;
+    }
+    *out_old_phys = (void *)((*entry) & LEVEL_ADDRMASK(1));
+    *entry        = 0;
+    return true;
+}
+
+bool arch_mmu_unshare_table(arch_mmu_pagetable_t *pt, void *virt) {
+    return unshare_table(get_pde(pt, virt));
+}
+
+static void shootdown_put(x86_64_mmu_shootdown_t *sd) {
+    // Synchronous shootdowns live on the stack of the sender, which may return
+    // as soon as the count hits zero
+    arch_intf_mmu_done_t done      = sd->done;
+    void                *arg       = sd->arg;
+    bool                 allocated = sd->allocated;
+
+    if (0 != __atomic_sub_fetch(&sd->pending, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    if (NULL != done) {
+        done(arg);
+    }
+
+    if (allocated) {
+        com_mm_slab_free(sd, sizeof(x86_64_mmu_shootdown_t));
+    }
+}
+
+// Performs and acknowledges all invalidations queued on the current CPU
+static void shootdown_drain(void) {
+    x86_64_mmu_shootdown_range_t ranges[X86_64_MMU_SHOOTDOWN_RANGES];
+    x86_64_mmu_shootdown_t      *acks[X86_64_MMU_SHOOTDOWN_ACKS];
+
+    kspinlock_fake_acquire();
+    x86_64_mmu_shootdown_queue_t *queue = &ARCH_CPU_GET()->mmu_shootdown;
+    kspinlock_acquire(&queue->lock);
+    bool   flush_all  = queue->flush_all;
+    size_t num_ranges = queue->num_ranges;
+    size_t num_acks   = queue->num_acks;
+    kmemcpy(ranges, queue->ranges, num_ranges * sizeof(ranges[0]));
+    kmemcpy(acks, queue->acks, num_acks * sizeof(acks[0]));
+    queue->flush_all  = false;
+    queue->num_ranges = 0;
+    queue->num_acks   = 0;
+    kspinlock_release(&queue->lock);
+
+    if (flush_all) {
+        flush_all_global();
+    }
+
+    arch_mmu_pagetable_t *curr_pt = arch_mmu_get_table();
+    for (size_t i = 0; !flush_all && i < num_ranges; i++) {
+        x86_64_mmu_shootdown_range_t *range = &ranges[i];
+
+        // If this CPU has switched away from the table since the range was
+        // queued, the switch has already dropped its translations
+        if (range->start < (uintptr_t)ARCH_MMU_KERNELSPACE_START &&
+            range->table != curr_pt) {
+            continue;
+        }
+
+        if (UINTPTR_MAX == range->end) {
+            internal_invalidate(NULL, 0);
+            continue;
+        }
+
+        internal_invalidate((void *)range->start,
+                            (range->end - range->start) / ARCH_PAGE_SIZE);
+    }
+
+    for (size_t i = 0; i < num_acks; i++) {
+        shootdown_put(acks[i]);
+    }
+
+    kspinlock_fake_release();
+}
+
+// Drains the queue of the current CPU if other CPUs are waiting on it. This is
+// called while spinning, so that two CPUs that wait on each other with
+// interrupts disabled still make progress
+static inline void shootdown_poll(void) {
+    if (0 != __atomic_load_n(&ARCH_CPU_GET()->mmu_shootdown.num_acks,
+                             __ATOMIC_RELAXED)) {
+        shootdown_drain();
+    }
+}
+
+static void shootdown_merge_nolock(x86_64_mmu_shootdown_queue_t *queue,
+                                   arch_mmu_pagetable_t         *pt,
+                                   uintptr_t                     start,
+                                   uintptr_t                     end) {
+    for (size_t i = 0; i < queue->num_ranges; i++) {
+        x86_64_mmu_shootdown_range_t *range = &queue->ranges[i];
+        if (pt == range->table && start <= range->end && end >= range->start) {
+            range->start = KMIN(range->start, start);
+            range->end   = KMAX(range->end, end);
+            return;
+        }
+    }
+
+    if (X86_64_MMU_SHOOTDOWN_RANGES == queue->num_ranges) {
+        queue->flush_all  = true;
+        queue->num_ranges = 0;
+        return;
+    }
+
+    queue->ranges[queue->num_ranges++] = (x86_64_mmu_shootdown_range_t){
+        .table = pt, .start = start, .end = end};
+}
+
+// Queues a range on another CPU and takes a reference to the shootdown on its
+// behalf. Returns false if the CPU cannot hold any more acknowledgements
+static bool shootdown_enqueue(arch_cpu_t             *cpu,
+                              arch_mmu_pagetable_t   *pt,
+                              uintptr_t               start,
+                              uintptr_t               end,
+                              x86_64_mmu_shootdown_t *sd) {
+    x86_64_mmu_shootdown_queue_t *queue = &cpu->mmu_shootdown;
+    kspinlock_acquire(&queue->lock);
+
+    if (X86_64_MMU_SHOOTDOWN_ACKS == queue->num_acks) {
+        kspinlock_release(&queue->lock);
+        return false;
+    }
+
+    // Every request comes with an acknowledgement, so if there are others the
+    // CPU already has an IPI on the way and will pick this one up as well
+    bool send_ipi = 0 == queue->num_acks;
+    __atomic_add_fetch(&sd->pending, 1, __ATOMIC_RELAXED);
+    queue->acks[queue->num_acks++] = sd;
+    if (!queue->flush_all) {
+        shootdown_merge_nolock(queue, pt, start, end);
+    }
+    kspinlock_release(&queue->lock);
+
+    if (send_ipi) {
+        ARCH_CPU_SEND_IPI(cpu, X86_64_MMU_IPI_INVALIDATE);
+    }
+
+    return true;
+}
+
 // CREDIT: Mathewnd/Astral
-void arch_mmu_invalidate(arch_mmu_pagetable_t *pt, void *virt, size_t pages) {
+static void shootdown(arch_mmu_pagetable_t   *pt,
+                      void                   *virt,
+                      size_t                  pages,
+                      x86_64_mmu_shootdown_t *sd) {
     com_thread_t         *curr_thread = ARCH_CPU_GET_THREAD();
-    arch_cpu_t           *curr_cpu    = ARCH_CPU_GET();
     arch_mmu_pagetable_t *curr_pt     = arch_mmu_get_table();
 
     // as of kernel 0.2.4, NULL is still almost always a legal userspace
@@ -322,67 +932,124 @@ void arch_mmu_invalidate(arch_mmu_pagetable_t *pt, void *virt, size_t pages) {
     // is redundant, but we'll keep it just in case.
     bool is_user = virt > ARCH_MMU_USERSPACE_START &&
                    (virt + pages * ARCH_PAGE_SIZE) < ARCH_MMU_KERNELSPACE_START;
+    bool is_kernel    = virt >= ARCH_MMU_KERNELSPACE_START;
     bool do_shootdown = NULL != curr_thread &&
-                        (virt >= ARCH_MMU_KERNELSPACE_START ||
+                        (is_kernel ||
                          ((NULL == virt || is_user) &&
-                          NULL != curr_thread->proc &&
-                          __atomic_load_n(
-                              &curr_thread->proc->num_running_threads,
-                              __ATOMIC_ACQUIRE) > 1));
-    // numer of other CPUs that have completed the shootdown
-    size_t shootdown_counter = 0;
-    // expected number of CPUs to compelte the shootdown
-    size_t num_other_cpus = 0;
+                          (pt != curr_pt || NULL == curr_thread->proc ||
+                           __atomic_load_n(
+                               &curr_thread->proc->num_running_threads,
+                               __ATOMIC_ACQUIRE) > 1)));
 
+    // With PCIDs, CPUs that ran pt in the past may still hold its
+    // translations even if they are not running it now
+    bool forget_pcid = PcidSupported && !is_kernel;
+
+    uintptr_t start = (uintptr_t)virt;
+    uintptr_t end   = (NULL == virt) ? UINTPTR_MAX
+                                     : start + pages * ARCH_PAGE_SIZE;
+
+    // The current CPU is handled below, so it does not matter if this thread
+    // migrates in the meantime and ends up targetting itself
+    arch_cpu_t *curr_cpu = ARCH_CPU_GET();
     arch_cpu_t *next_cpu;
-    for (size_t i = 0;
-         do_shootdown && NULL != (next_cpu = x86_64_smp_get_cpu(i));
+    for (size_t i = 0; (do_shootdown || forget_pcid) &&
+                       NULL != (next_cpu = x86_64_smp_get_cpu(i));
          i++) {
         // Skipp current CPU, we'll do that later
         if (next_cpu->id == curr_cpu->id) {
             continue;
         }
-        // Skip CPUs that are not running any process or are running a different
-        // process then the one we're targetting
-        kspinlock_acquire(&next_cpu->runqueue_lock);
-        com_thread_t *next_cpu_thread = next_cpu->thread;
-        if (NULL == next_cpu_thread || NULL == next_cpu_thread->proc ||
-            pt != next_cpu_thread->proc->vmm_context->pagetable) {
-            kspinlock_release(&next_cpu->runqueue_lock);
-            continue;
+
+        // The PCID is dropped before the active table is checked, while
+        // arch_mmu_switch publishes the active table before looking up the
+        // PCID. So the other CPU either flushes on its own or gets the IPI
+        if (forget_pcid) {
+            pcid_forget(next_cpu, pt);
         }
-        kspinlock_release(&next_cpu->runqueue_lock);
 
-        // Now here we know we have ourselves a CPU we can target. At the very
-        // worst it will context switch and receivea spurious IPI and we loose a
-        // little bit of performance
-        kspinlock_acquire(&next_cpu->mmu_shootdown_lock);
-        next_cpu->mmu_shootdown_counter = &shootdown_counter;
-        next_cpu->mmu_shootdown_virt    = virt;
-        next_cpu->mmu_shootdown_pages   = pages;
-        num_other_cpus++;
-        ARCH_CPU_SEND_IPI(next_cpu, X86_64_MMU_IPI_INVALIDATE);
+        // Kernel mappings are shared by all tables, otherwise CPUs that are
+        // running a different table have nothing to drop (lazy TLB)
+        if (!do_shootdown ||
+            (!is_kernel && pt != __atomic_load_n(&next_cpu->mmu_active_table,
+                                                 __ATOMIC_SEQ_CST))) {
+            continue;
+        }
 
-        // lock released by ISR
-        kspinlock_fake_release();
+        // At the very worst the CPU will context switch before it gets the IPI
+        // and it will flush a table it is not running anymore
+        while (!shootdown_enqueue(next_cpu, pt, start, end, sd)) {
+            shootdown_poll();
+            ARCH_CPU_PAUSE();
+        }
     }
 
-    // If we also have to perform a shootdown
-    if (pt == curr_pt) {
+    kspinlock_fake_acquire();
+    curr_pt = arch_mmu_get_table();
+    if (is_kernel || pt == curr_pt) {
         internal_invalidate(virt, pages);
+    } else if (forget_pcid) {
+        pcid_invalidate_inactive(ARCH_CPU_GET(), pt, virt, pages);
     }
+    kspinlock_fake_release();
+}
+
+void arch_mmu_invalidate(arch_mmu_pagetable_t *pt, void *virt, size_t pages) {
+    x86_64_mmu_shootdown_t sd = {.pending = 1};
+    shootdown(pt, virt, pages, &sd);
+    shootdown_put(&sd);
 
     // And finally, we wait for all others to complete
-    while (do_shootdown &&
-           __atomic_load_n(&shootdown_counter, __ATOMIC_ACQUIRE) !=
-               num_other_cpus) {
+    while (0 != __atomic_load_n(&sd.pending, __ATOMIC_ACQUIRE)) {
+        shootdown_poll();
         ARCH_CPU_PAUSE();
     }
 }
 
+// Unlike arch_mmu_invalidate, this returns as soon as the range has been queued
+// on the other CPUs. Resources that they may still reach through their TLBs,
+// like the pages that were just unmapped, are to be released by done
+void arch_mmu_invalidate_async(arch_mmu_pagetable_t *pt,
+                               void                 *virt,
+                               size_t                pages,
+                               arch_intf_mmu_done_t  done,
+                               void                 *arg) {
+    x86_64_mmu_shootdown_t *sd = com_mm_slab_alloc(
+        sizeof(x86_64_mmu_shootdown_t));
+
+    if (KUNKLIKELY(NULL == sd)) {
+        arch_mmu_invalidate(pt, virt, pages);
+        if (NULL != done) {
+            done(arg);
+        }
+        return;
+    }
+
+    sd->pending   = 1;
+    sd->done      = done;
+    sd->arg       = arg;
+    sd->allocated = true;
+    shootdown(pt, virt, pages, sd);
+    shootdown_put(sd);
+}
+
 void arch_mmu_switch(arch_mmu_pagetable_t *pt) {
     // KDEBUG("switching to page table at address %p", pt);
-    asm volatile("mov %%rax, %%cr3" : : "a"(pt));
+    uint64_t cr3 = (uint64_t)pt;
+
+    // The PCID slots are per-CPU, so this must not migrate halfway through
+    kspinlock_fake_acquire();
+    arch_cpu_t *cpu = ARCH_CPU_GET();
+    __atomic_store_n(&cpu->mmu_active_table, pt, __ATOMIC_SEQ_CST);
+
+    // The root table only holds global mappings, so it uses PCID 0 and is
+    // always flushed, which costs nothing
+    if (PcidSupported && (uintptr_t)pt != ARCH_HHDM_TO_PHYS(RootTable)) {
+        cr3 |= pcid_get(cpu, pt);
+    }
+
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    kspinlock_fake_release();
 }
 
 void arch_mmu_switch_default(void) {
@@ -390,19 +1057,20 @@ void arch_mmu_switch_default(void) {
 }
 
 void *arch_mmu_get_physical(arch_mmu_pagetable_t *pagetable, void *virt_addr) {
-    uint64_t *entry = get_page(pagetable, virt_addr);
+    size_t    level;
+    uint64_t *entry = get_page(pagetable, virt_addr, &level);
     if (NULL == entry) {
         return NULL;
     }
-    if (0 == (*entry & ADDRMASK)) {
+    if (0 == (*entry & LEVEL_ADDRMASK(level))) {
         return NULL;
     }
-    return (void *)((*entry & ADDRMASK) +
-                    ((uintptr_t)virt_addr & (ARCH_PAGE_SIZE - 1)));
+    return (void *)((*entry & LEVEL_ADDRMASK(level)) +
+                    ((uintptr_t)virt_addr & (LEVEL_PAGE_SIZE(level) - 1)));
 }
 
 bool arch_mmu_is_cow(arch_mmu_pagetable_t *pagetable, void *virt_addr) {
-    uint64_t *entry = get_page(pagetable, virt_addr);
+    uint64_t *entry = get_page(pagetable, virt_addr, NULL);
     if (NULL == entry) {
         return false;
     }
@@ -410,7 +1078,7 @@ bool arch_mmu_is_cow(arch_mmu_pagetable_t *pagetable, void *virt_addr) {
 }
 
 bool arch_mmu_is_executable(arch_mmu_pagetable_t *pagetable, void *virt_addr) {
-    uint64_t *entry = get_page(pagetable, virt_addr);
+    uint64_t *entry = get_page(pagetable, virt_addr, NULL);
     if (NULL == entry) {
         return false;
     }
@@ -418,15 +1086,80 @@ bool arch_mmu_is_executable(arch_mmu_pagetable_t *pagetable, void *virt_addr) {
 }
 
 arch_mmu_pagetable_t *arch_mmu_get_table(void) {
-    void *pt;
-    asm volatile("mov %%cr3, %0" : "=r"(pt));
-    return pt;
+    return (void *)(read_cr3() & ADDRMASK);
+}
+
+// Maps a physically contiguous range into the root table, using the largest
+// pages allowed by the alignment of both addresses and by the remaining length
+static void
+map_kernel_range(uintptr_t virt, uintptr_t phys, size_t len, uint64_t flags) {
+    arch_mmu_pagetable_t *top = (void *)ARCH_HHDM_TO_PHYS(RootTable);
+
+    for (size_t off = 0; off < len;) {
+        uintptr_t vaddr = virt + off;
+        uintptr_t paddr = phys + off;
+        size_t    level = MaxPageLevel;
+
+        while (0 != level && (0 != vaddr % LEVEL_PAGE_SIZE(level) ||
+                              0 != paddr % LEVEL_PAGE_SIZE(level) ||
+                              len - off < LEVEL_PAGE_SIZE(level))) {
+            level--;
+        }
+
+        if (0 == level) {
+            KASSERT_CALL_SUCCESSFUL(
+                add_page(top, (void *)vaddr, (paddr & ADDRMASK) | flags, 0));
+        } else {
+            KASSERT_CALL_SUCCESSFUL(
+                add_page(top,
+                         (void *)vaddr,
+                         (paddr & LEVEL_ADDRMASK(level)) |
+                             flags_to_large(flags),
+                         LEVEL_DEPTH(level)));
+        }
+
+        off += LEVEL_PAGE_SIZE(level);
+    }
+}
+
+static void map_kernel_section(uint8_t  *start,
+                               uint8_t  *end,
+                               uint64_t  delta,
+                               uint64_t  flags) {
+    uintptr_t vstart = ARCH_PAGE_ROUND(start);
+    uintptr_t vend   = ARCH_PAGE_ROUND((uintptr_t)end + ARCH_PAGE_SIZE - 1);
+    map_kernel_range(vstart, vstart - delta, vend - vstart, flags);
+}
+
+static void probe_features(void) {
+    x86_64_cpuid_t cpuid;
+    X86_64_CPUID(&cpuid, 1);
+    PcidSupported = X86_64_CPUID_LEAF_1_ECX_PCID & cpuid.ecx;
+    if (PcidSupported && X86_64_CPUID_BASE_MAX_LEAF() >= 7) {
+        X86_64_CPUID(&cpuid, 7);
+        InvpcidSupported = X86_64_CPUID_LEAF_7_EBX_INVPCID & cpuid.ebx;
+    }
+
+    if (X86_64_CPUID_EXT_MAX_LEAF() >= X86_64_CPUID_LEAF_EXT_1) {
+        X86_64_CPUID(&cpuid, X86_64_CPUID_LEAF_EXT_1);
+        if (X86_64_CPUID_LEAF_EXT_1_EDX_PDPE1GB & cpuid.edx) {
+            MaxPageLevel = 2;
+        }
+    }
+
+    KDEBUG("pcid support: %s, invpcid support: %s",
+           PcidSupported ? "yes" : "no",
+           InvpcidSupported ? "yes" : "no");
+    KDEBUG("using pages of up to %zu KiB for the kernel",
+           LEVEL_PAGE_SIZE(MaxPageLevel) / 1024);
 }
 
 void arch_mmu_init(void) {
-    // Allocate the kernel (root) page table
     KLOG("initializing mmu");
+    probe_features();
     x86_64_mmu_init_cpu();
+
+    // Allocate the kernel (root) page table
     RootTable = internal_alloc_phys();
     KASSERT(NULL != RootTable);
     RootTable = (arch_mmu_pagetable_t *)ARCH_PHYS_TO_HHDM(RootTable);
@@ -455,16 +1188,13 @@ void arch_mmu_init(void) {
                 other_flags |= ARCH_MMU_FLAGS_WC;
             }
 
-            for (uintmax_t i = 0; i < entry->length; i += ARCH_PAGE_SIZE) {
-                uint64_t pt_entry = ((entry->base + i) & ADDRMASK) |
-                                    ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE |
-                                    ARCH_MMU_FLAGS_NOEXEC | other_flags;
-                KASSERT_CALL_SUCCESSFUL(add_page(
-                    (arch_mmu_pagetable_t *)ARCH_HHDM_TO_PHYS(RootTable),
-                    (uint64_t *)ARCH_PHYS_TO_HHDM(entry->base + i),
-                    pt_entry,
-                    0));
-            }
+            map_kernel_range(ARCH_PHYS_TO_HHDM(entry->base),
+                             entry->base,
+                             ARCH_PAGE_ROUND(entry->length + ARCH_PAGE_SIZE -
+                                             1),
+                             ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE |
+                                 ARCH_MMU_FLAGS_NOEXEC | ARCH_MMU_FLAGS_GLOBAL |
+                                 other_flags);
         }
     }
 
@@ -480,43 +1210,29 @@ void arch_mmu_init(void) {
     KDEBUG("mapping kernel text section (virtual: %p -> %p)",
            _TEXT_START,
            _TEXT_END);
-    for (uintptr_t i = (uintptr_t)_TEXT_START; i < (uintptr_t)_TEXT_END;
-         i += ARCH_PAGE_SIZE) {
-        KASSERT_CALL_SUCCESSFUL(
-            add_page((arch_mmu_pagetable_t *)ARCH_HHDM_TO_PHYS(RootTable),
-                     (uint64_t *)i,
-                     ((i - vp_delta) & ADDRMASK) | ARCH_MMU_FLAGS_READ |
-                         ARCH_MMU_FLAGS_GLOBAL,
-                     0));
-    }
+    map_kernel_section(_TEXT_START,
+                       _TEXT_END,
+                       vp_delta,
+                       ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_GLOBAL);
 
     KDEBUG("mapping kernel rodata section (virtual: %p -> %p)",
            _RODATA_START,
            _RODATA_END);
-    for (uintptr_t i = (uintptr_t)_RODATA_START; i < (uintptr_t)_RODATA_END;
-         i += ARCH_PAGE_SIZE) {
-        KASSERT_CALL_SUCCESSFUL(
-            add_page((arch_mmu_pagetable_t *)ARCH_HHDM_TO_PHYS(RootTable),
-                     (uint64_t *)i,
-                     ((i - vp_delta) & ADDRMASK) | ARCH_MMU_FLAGS_READ |
-                         ARCH_MMU_FLAGS_NOEXEC | ARCH_MMU_FLAGS_GLOBAL,
-                     0));
-    }
+    map_kernel_section(_RODATA_START,
+                       _RODATA_END,
+                       vp_delta,
+                       ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_NOEXEC |
+                           ARCH_MMU_FLAGS_GLOBAL);
 
     KDEBUG(
         "mapping kernel data/bss/limine_requests sections (virtual: %p -> %p)",
         _DATA_START,
         _DATA_END);
-    for (uintptr_t i = (uintptr_t)_DATA_START; i < (uintptr_t)_DATA_END;
-         i += ARCH_PAGE_SIZE) {
-        KASSERT_CALL_SUCCESSFUL(
-            add_page((arch_mmu_pagetable_t *)ARCH_HHDM_TO_PHYS(RootTable),
-                     (uint64_t *)i,
-                     ((i - vp_delta) & ADDRMASK) | ARCH_MMU_FLAGS_READ |
-                         ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC |
-                         ARCH_MMU_FLAGS_GLOBAL,
-                     0));
-    }
+    map_kernel_section(_DATA_START,
+                       _DATA_END,
+                       vp_delta,
+                       ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE |
+                           ARCH_MMU_FLAGS_NOEXEC | ARCH_MMU_FLAGS_GLOBAL);
 
     arch_mmu_switch((arch_mmu_pagetable_t *)ARCH_HHDM_TO_PHYS(RootTable));
     ARCH_CPU_GET()->root_page_table = (void *)ARCH_HHDM_TO_PHYS(RootTable);
@@ -534,20 +1250,89 @@ void x86_64_mmu_init_cpu(void) {
                           PT_CACHE_MAX_POOL_SIZE,
                           COM_MM_PMM_CACHE_FLAGS_AUTOALLOC |
                               COM_MM_PMM_CACHE_FLAGS_AUTOLOCK);
+
+    // CR3 holds no PCID yet at this point, which is required to set PCIDE
+    uint64_t cr4 = X86_64_CR_R4() | CR4_PGE;
+    if (PcidSupported) {
+        cr4 |= CR4_PCIDE;
+    }
+    X86_64_CR_W4(cr4);
+}
+
+// Large pages are only write-protected when they are shared after a fork, in
+// which case they are split so that copy on write works on 4K pages
+static uint64_t *get_fault_page(arch_mmu_pagetable_t *top, void *vaddr) {
+    size_t    level;
+    uint64_t *entry = get_page(top, vaddr, &level);
+
+    if (NULL != entry && 0 != level && ARCH_MMU_EXTRA_FLAGS_PRIVATE & *entry) {
+        return get_small_page(top, vaddr);
+    }
+
+    return entry;
+}
+
+// Returns true if all entries in the PT that holds entry are equal to it
+static bool pt_is_uniform(uint64_t *entry, void *vaddr) {
+    uint64_t *pt = entry - (((uintptr_t)vaddr & PTMASK) >> 12);
+
+    for (size_t i = 0; i < 512; i++) {
+        if (pt[i] != *entry) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Returns true if a write fault was caused by a stale TLB entry, which happens
+// if another CPU has already given write access to the page
+static bool fault_is_spurious(arch_mmu_pagetable_t *top,
+                              void                 *vaddr,
+                              uint64_t              error) {
+    uint64_t *entry = get_page(top, vaddr, NULL);
+    uint64_t *pde   = get_pde(top, vaddr);
+
+    if (!(PF_WRITE & error) || NULL == entry) {
+        return false;
+    }
+
+    uint64_t required = ARCH_MMU_FLAGS_PRESENT | ARCH_MMU_FLAGS_WRITE |
+                        ((PF_USER & error) ? ARCH_MMU_FLAGS_USER : 0);
+    return required == (*entry & required) &&
+           (NULL == pde || !IS_SHARED(*pde));
 }
 
 void x86_64_mmu_fault_isr(com_isr_t *isr, arch_context_t *ctx) {
     (void)isr;
 
-    arch_mmu_pagetable_t *curr_pt        = arch_mmu_get_table();
-    void                 *fault_virt     = (void *)ctx->cr2;
-    uint64_t             *entry_ptr      = get_page(curr_pt, fault_virt);
-    uint64_t              entry          = *entry_ptr;
-    uint64_t              start_entry    = entry;
-    void                 *start_virt     = fault_virt;
-    arch_mmu_flags_t      mmu_flags      = entry & ~ADDRMASK;
-    arch_mmu_flags_t      mmu_flags_hint = mmu_flags;
-    size_t                num_pages      = 1;
+    arch_mmu_pagetable_t *curr_pt    = arch_mmu_get_table();
+    void                 *fault_virt = (void *)ctx->cr2;
+    uint64_t             *pde        = get_pde(curr_pt, fault_virt);
+
+    // Writes to a page table shared after a fork copy the table first. The
+    // access is then retried, and faults again if the page is copy-on-write
+    if (PF_WRITE & ctx->error && NULL != pde && IS_SHARED(*pde)) {
+        com_mm_vmm_handle_fault(fault_virt,
+                                NULL,
+                                ctx,
+                                0,
+                                COM_MM_VMM_FAULT_ATTR_COW_TABLE,
+                                1);
+        return;
+    }
+
+    if (fault_is_spurious(curr_pt, fault_virt, ctx->error)) {
+        internal_invalidate(fault_virt, 1);
+        return;
+    }
+
+    uint64_t        *entry_ptr      = get_fault_page(curr_pt, fault_virt);
+    uint64_t         entry          = *entry_ptr;
+    uint64_t         start_entry    = entry;
+    void            *start_virt     = fault_virt;
+    arch_mmu_flags_t mmu_flags_hint = entry & ~ADDRMASK;
+    size_t           num_pages      = 1;
 
     int vmm_attr = 0;
     if (ARCH_MMU_EXTRA_FLAGS_PRIVATE & entry) {
@@ -562,37 +1347,39 @@ void x86_64_mmu_fault_isr(com_isr_t *isr, arch_context_t *ctx) {
         mmu_flags_hint &= ~ARCH_MMU_EXTRA_FLAGS_NOCOPY;
         vmm_attr &= ~COM_MM_VMM_FAULT_ATTR_COW;
         vmm_attr |= COM_MM_VMM_FAULT_ATTR_MAP;
+
+        // If no page in the surrounding 2M region has been touched yet, the
+        // vmm may back the whole region with a single large page
+        if (pt_is_uniform(entry_ptr, fault_virt)) {
+            vmm_attr |= COM_MM_VMM_FAULT_ATTR_LARGE;
+        }
     }
 
     if (!(COM_MM_VMM_PREFAULT_SUPPORTED_ATTR & vmm_attr)) {
         goto call_vmm;
     }
 
-    for (; num_pages < CONFIG_VMM_PREFAULT_MAX / 2; num_pages++) {
-        uint64_t *prev_entry_tr = get_page(curr_pt,
-                                           (char *)fault_virt -
-                                               ARCH_PAGE_SIZE * num_pages);
-        if (NULL == prev_entry_tr) {
-            break;
-        }
-        uint64_t         prev_entry     = *prev_entry_tr;
-        arch_mmu_flags_t prev_mmu_flags = prev_entry & ~ADDRMASK;
-        if (mmu_flags != prev_mmu_flags) {
+    // The vmm sizes the window after the access pattern of the VMA, which is
+    // then cut short at the first neighbour that is mapped differently
+    uintptr_t window_start, window_end;
+    com_mm_vmm_fault_window(&window_start, &window_end, fault_virt);
+
+    uintptr_t fault_page = (uintptr_t)fault_virt &
+                           ~(uintptr_t)(ARCH_PAGE_SIZE - 1);
+    for (uintptr_t prev = fault_page; prev > window_start; num_pages++) {
+        prev -= ARCH_PAGE_SIZE;
+        uint64_t *prev_entry = get_page(curr_pt, (void *)prev, NULL);
+        if (NULL == prev_entry || PTE_FLAGS(entry) != PTE_FLAGS(*prev_entry)) {
             break;
         }
-        start_entry = prev_entry;
-        start_virt  = (void *)((uintptr_t)start_virt - ARCH_PAGE_SIZE);
+        start_entry = *prev_entry;
+        start_virt  = (void *)prev;
     }
 
-    for (; num_pages < CONFIG_VMM_PREFAULT_MAX; num_pages++) {
-        uint64_t *next_entry = get_page(curr_pt,
-                                        (char *)fault_virt +
-                                            ARCH_PAGE_SIZE * num_pages);
-        if (NULL == next_entry) {
-            break;
-        }
-        arch_mmu_flags_t next_mmu_flags = *next_entry & ~ADDRMASK;
-        if (mmu_flags != next_mmu_flags) {
+    for (uintptr_t next = fault_page + ARCH_PAGE_SIZE; next < window_end;
+         next += ARCH_PAGE_SIZE, num_pages++) {
+        uint64_t *next_entry = get_page(curr_pt, (void *)next, NULL);
+        if (NULL == next_entry || PTE_FLAGS(entry) != PTE_FLAGS(*next_entry)) {
             break;
         }
     }
@@ -609,12 +1396,5 @@ call_vmm:
 void x86_64_mmu_invalidate_isr(com_isr_t *isr, arch_context_t *ctx) {
     (void)isr;
     (void)ctx;
-
-    arch_cpu_t *curr_cpu = ARCH_CPU_GET();
-    kspinlock_fake_acquire(); // acquired by sender
-    internal_invalidate(curr_cpu->mmu_shootdown_virt,
-                        curr_cpu->mmu_shootdown_pages);
-    KASSERT(KSPINLOCK_IS_HELD(&curr_cpu->mmu_shootdown_lock));
-    __atomic_add_fetch(curr_cpu->mmu_shootdown_counter, 1, __ATOMIC_RELAXED);
-    kspinlock_release(&curr_cpu->mmu_shootdown_lock); // realeased by us
+    shootdown_drain();
 }
@@ -39,7 +39,8 @@
 #include <vendor/tailq.h>
 
 #define EFER_SYSCALLENABLE 1
-#define MAX_CPUS           (ARCH_PAGE_SIZE * 2) / sizeof(arch_cpu_t)
+#define CPUS_PAGES         8
+#define MAX_CPUS           (ARCH_PAGE_SIZE * CPUS_PAGES) / sizeof(arch_cpu_t)
 
 __attribute__((
     used,
@@ -55,8 +56,8 @@ static size_t      NumCpus;
 
 static void common_cpu_init(struct limine_smp_info *cpu_info) {
     ARCH_CPU_DISABLE_INTERRUPTS();
-    arch_cpu_t *cpu    = (void *)cpu_info->extra_argument;
-    cpu->runqueue_lock = KSPINLOCK_NEW();
+    arch_cpu_t *cpu = (void *)cpu_info->extra_argument;
+    com_sys_sched_init_runqueue(cpu);
     ARCH_CPU_SET(cpu);
     KDEBUG("initializing cpu %zu", cpu->id);
 
@@ -87,11 +88,10 @@ static void common_cpu_init(struct limine_smp_info *cpu_info) {
     X86_64_CR_W4(X86_64_CR_R4() | (3 << 9));
 
     com_sys_sched_init();
-    TAILQ_INIT(&cpu->sched_queue);
 
     com_mm_vmm_switch(NULL);
 
-    TAILQ_INIT(&cpu->callout.queue);
+    com_sys_callout_init_queue(&cpu->callout);
     x86_64_lapic_init();
 }
 
@@ -124,7 +124,8 @@ void x86_64_smp_init(void) {
         return;
     }
 
-    arch_cpu_t *cpus = (void *)ARCH_PHYS_TO_HHDM(com_mm_pmm_alloc_many_zero(2));
+    arch_cpu_t *cpus = (void *)ARCH_PHYS_TO_HHDM(
+        com_mm_pmm_alloc_many_zero(CPUS_PAGES));
     size_t      avail_cpus = KMIN(MAX_CPUS, smp->cpu_count);
     Cpus                   = cpus;
     NumCpus                = avail_cpus;